@@ -1,23 +1,68 @@
 #include <arch/amd64/mm/mmu.h>
-#include <drivers/bus/pci.h>
-#include <drivers/gfx/vbe.h>
-#include <drivers/ioapic.h>
-#include <drivers/lapic.h>
+#include <fs/multiboot2.h>
 #include <kernel/common.h>
+#include <kernel/cpu.h>
 #include <kernel/kassert.h>
 #include <kernel/kprint.h>
+#include <kernel/percpu.h>
 #include <kernel/util.h>
 #include <mm/mmu.h>
+#include <mm/ksm.h>
 #include <mm/page.h>
+#include <mm/swap.h>
+#include <mm/tlb.h>
+#include <sched/sched.h>
 #include <sched/task.h>
+#include <stdbool.h>
 #include <sys/types.h>
+#include <errno.h>
 
-static uint64_t __pml4[512]   __attribute__((aligned(PAGE_SIZE)));
-static uint64_t __pdpt[512]   __attribute__((aligned(PAGE_SIZE)));
-static uint64_t __pd[512 * 2] __attribute__((aligned(PAGE_SIZE)));
+static uint64_t __pml4[512]      __attribute__((aligned(PAGE_SIZE)));
+static uint64_t __pdpt[512]      __attribute__((aligned(PAGE_SIZE)));
+static uint64_t __pd[512 * 2]    __attribute__((aligned(PAGE_SIZE)));
+static uint64_t __pdpt_id[512]   __attribute__((aligned(PAGE_SIZE)));
+static uint64_t __pd_id[512 * 2] __attribute__((aligned(PAGE_SIZE)));
+
+/* If the CPU doesn't support 1GB pages, the direct map is built using 2MB pages
+ * and the page directories are allocated statically for the first PHYS_MAP_2MB_MAX GB */
+#define PHYS_MAP_2MB_MAX 64
+
+static uint64_t __pdpt_pm[512]                  __attribute__((aligned(PAGE_SIZE)));
+static uint64_t __pd_pm[512 * PHYS_MAP_2MB_MAX] __attribute__((aligned(PAGE_SIZE)));
 
 static uint64_t __pml4_;
 static spinlock_t lock = 0;
+static unsigned long phys_end = 0;
+
+/* Pages that are being moved by mmu_native_migrate_range()
+ * or swapped out by mmu_native_reclaim()
+ *
+ * Only the first entry of a page table holds a reference to the table
+ * and the others point to it. "migrating" is protected by lock
+ * and the array is owned by whoever set "migrating" */
+#define MIGRATE_MAX 512
+
+enum {
+    MIGRATE_DONE,     /* the migration entry was replaced with "next" */
+    MIGRATE_RESTORED, /* the migration entry was replaced with "entry" */
+    MIGRATE_LOST,     /* the migration entry was removed by the address space */
+};
+
+static struct {
+    task_t *task;
+    uint64_t *pte;
+    unsigned long table;   /* page table that contains "pte" */
+    size_t owner;          /* the entry that holds the reference to "table" */
+    bool live;             /* "table" is still used by its address space */
+    uint64_t entry;        /* the entry before it was replaced with a migration entry */
+    uint64_t next;         /* the entry that replaces the migration entry, 0 restores "entry" */
+    unsigned long copy;    /* new location of the page */
+    size_t req;            /* index of the request of the page, if any */
+    int state;
+} migrations[MIGRATE_MAX];
+
+static size_t nmigrations = 0;
+static bool   migrating   = false;
 
 #define PML4_ATOEI(addr) (((addr) >> 39) & 0x1FF)
 #define PDPT_ATOEI(addr) (((addr) >> 30) & 0x1FF)
@@ -25,77 +70,383 @@ static spinlock_t lock = 0;
 #define PT_ATOEI(addr)   (((addr) >> 12) & 0x1FF)
 
 #define V_TO_P(addr)     ((uint64_t)addr - KVSTART + KPSTART)
+#define PTE_ADDR(entry)  ((entry) & 0x000ffffffffff000)
+#define PTE_DIRTY        (1 << 6)
+#define PTE_MIGRATE      (1 << 10) /* not present, the page is being moved by compaction */
+#define PTE_SWAP         (1 << 11) /* not present, the address bits hold a swap slot */
+#define PTE_SLOT(entry)  (PTE_ADDR(entry) >> PAGE_SHIFT)
+
+#define GB(n)            ((unsigned long)(n) << 30)
+
+/* Level of a page table, ie. the level of the table an entry points to */
+enum {
+    LVL_PT   = 1,
+    LVL_PD   = 2,
+    LVL_PDPT = 3,
+};
+
+static void __find_phys_end(unsigned type, unsigned long address, size_t len)
+{
+    if (type != MULTIBOOT_MEMORY_AVAILABLE &&
+        type != MULTIBOOT_MEMORY_ACPI_RECLAIMABLE)
+        return;
 
-int mmu_native_init(void)
+    phys_end = MAX(phys_end, address + len);
+}
+
+static bool __has_1gb_pages(void)
 {
-    kmemset(__pml4, 0, sizeof(__pml4));
-    kmemset(__pdpt, 0, sizeof(__pdpt));
-    kmemset(__pd,   0, sizeof(__pd));
+    uint32_t eax, ebx, ecx, edx;
 
-    /* map also the lower part of the address space so our boot stack still works
-     * It only has to work until we switch to init task */
-    __pml4[PML4_ATOEI(KVSTART)] = __pml4[0] = V_TO_P(&__pdpt) | MM_PRESENT | MM_READWRITE;
+    cpuid(0x80000000, 0, &eax, &ebx, &ecx, &edx);
+
+    if (eax < 0x80000001)
+        return false;
+
+    cpuid(0x80000001, 0, &eax, &ebx, &ecx, &edx);
+
+    return !!(edx & (1 << 26));
+}
+
+/* Map all physical memory listed in the memory map to PHYS_MAP_START
+ *
+ * The mapping is built using 1GB pages if the CPU supports them and
+ * 2MB pages otherwise. Firmware tables live below 4GB so at least
+ * that much is always mapped */
+static void __map_phys_mem(void *arg)
+{
+    bool gb_pages = __has_1gb_pages();
+    size_t max_gb = gb_pages ? 512 : PHYS_MAP_2MB_MAX;
+
+    multiboot2_map_memory(arg, __find_phys_end);
+
+    phys_end = ROUND_UP(MAX(phys_end, GB(4)), GB(1));
+
+    if (phys_end > MIN(GB(max_gb), MM_PHYS_MAX)) {
+        kprint("mmu: only %uGB of %uGB of memory can be mapped\n",
+                MIN(max_gb, MM_PHYS_MAX >> 30), phys_end >> 30);
+        phys_end = MIN(GB(max_gb), MM_PHYS_MAX);
+    }
+
+    for (size_t gb = 0; gb < (phys_end >> 30); ++gb) {
+        if (gb_pages) {
+            __pdpt_pm[gb] = GB(gb) | MM_PRESENT | MM_READWRITE | MM_2MB | MM_GLOBAL;
+            continue;
+        }
+
+        for (size_t i = 0; i < 512; ++i) {
+            __pd_pm[gb * 512 + i] = (GB(gb) + i * (1 << 21)) |
+                                    MM_PRESENT | MM_READWRITE | MM_2MB | MM_GLOBAL;
+        }
+
+        __pdpt_pm[gb] = V_TO_P(&__pd_pm[gb * 512]) | MM_PRESENT | MM_READWRITE;
+    }
 
-    /* map the first 2GB of address space */
+    __pml4[PML4_ATOEI(PHYS_MAP_START)] = V_TO_P(&__pdpt_pm) | MM_PRESENT | MM_READWRITE;
+}
+
+int mmu_native_init(void *arg)
+{
+    kmemset(__pml4,    0, sizeof(__pml4));
+    kmemset(__pdpt,    0, sizeof(__pdpt));
+    kmemset(__pd,      0, sizeof(__pd));
+    kmemset(__pdpt_id, 0, sizeof(__pdpt_id));
+    kmemset(__pd_id,   0, sizeof(__pd_id));
+    kmemset(__pdpt_pm, 0, sizeof(__pdpt_pm));
+
+    /* map also the lower part of the address space so our boot stack still works
+     * It only has to work until we switch to init task
+     *
+     * The lower part uses its own tables because the kernel mappings are global
+     * and global entries of user addresses would survive the switch to init task */
+    __pml4[PML4_ATOEI(KVSTART)] = V_TO_P(&__pdpt)    | MM_PRESENT | MM_READWRITE;
+    __pml4[0]                   = V_TO_P(&__pdpt_id) | MM_PRESENT | MM_READWRITE;
+
+    /* map the first 2GB of address space right below the kernel
+     * This is where the kernel image itself lives */
     for (size_t i = 0; i < 512 * 2; ++i) {
-        __pd[i] = (i * (1 << 21)) | MM_PRESENT | MM_READWRITE | MM_2MB;
+        __pd[i]    = (i * (1 << 21)) | MM_PRESENT | MM_READWRITE | MM_2MB | MM_GLOBAL;
+        __pd_id[i] = (i * (1 << 21)) | MM_PRESENT | MM_READWRITE | MM_2MB;
     }
 
     for (size_t i = 0; i < 2; ++i) {
-        __pdpt[PDPT_ATOEI(KVSTART) + i] = __pdpt[i] = V_TO_P(&__pd[i * 512]) | MM_PRESENT | MM_READWRITE;
+        __pdpt[PDPT_ATOEI(KVSTART) + i] = V_TO_P(&__pd[i * 512])    | MM_PRESENT | MM_READWRITE;
+        __pdpt_id[i]                    = V_TO_P(&__pd_id[i * 512]) | MM_PRESENT | MM_READWRITE;
     }
 
+    __map_phys_mem(arg);
+
     amd64_set_cr3(V_TO_P(__pml4));
 
+    /* enable global pages and PCIDs on BSP */
+    mmu_tlb_init_cpu();
+
     return 0;
 }
 
 static uint64_t __alloc_entry(void)
 {
-    uint64_t addr = mmu_page_alloc(MM_ZONE_DMA | MM_ZONE_NORMAL, MM_HIGH_PRIO);
-    kmemset((void *)amd64_p_to_v(addr), 0, PAGE_SIZE);
+    uint64_t addr = mmu_page_alloc(MM_ZONE_HIGH, MM_HIGH_PRIO | MM_ZERO);
 
     return addr | MM_PRESENT | MM_READWRITE;
 }
 
-/* TODO: should this do some error checking */
-static void __map_page(uint64_t *pml4, uint64_t paddr, uint64_t vaddr, int flags)
+/* Mark entry "entry" as shared by one more page table
+ *
+ * Entries that point to tables are made read-only and tagged with MM_COW
+ * so the first write through them copies the table (see __unshare()).
+ * Writable user pages become copy-on-write pages. Kernel mappings,
+ * such as the MMIO mappings of the lower half, and pages that were not
+ * allocated by the page allocator, such as the initrd pages mapped by mmap(),
+ * are not reference counted
+ *
+ * lock must be held by the caller */
+static void __share_entry(uint64_t *entry, bool leaf)
+{
+    if (leaf) {
+        if (!(*entry & MM_USER) || !mmu_page_refcount(PTE_ADDR(*entry)))
+            return;
+
+        if (*entry & MM_READWRITE)
+            *entry = (*entry & ~MM_READWRITE) | MM_COW;
+    } else {
+        *entry = (*entry & ~MM_READWRITE) | MM_COW;
+    }
+
+    mmu_page_ref(PTE_ADDR(*entry));
+}
+
+/* Drop the reference of a user page mapped by "entry"
+ *
+ * If this is the last reference and "batch" is given, the page is released
+ * only after the TLBs have been flushed because other CPUs may still access it.
+ * If "entry" is a swap entry, the reference of the swap slot is dropped
+ *
+ * lock must be held by the caller */
+static void __put_page(uint64_t entry, mm_tlb_batch_t *batch)
+{
+    page_t *page = NULL;
+
+    if (entry & PTE_SWAP) {
+        mmu_swap_free(PTE_SLOT(entry));
+        return;
+    }
+
+    if ((entry & (MM_PRESENT | MM_USER)) != (MM_PRESENT | MM_USER))
+        return;
+
+    if (!(page = mmu_page_get(PTE_ADDR(entry))) || !mmu_page_refcount(PTE_ADDR(entry)))
+        return;
+
+    /* the batch reuses the list entry of the page */
+    if (batch && mmu_page_refcount(PTE_ADDR(entry)) == 1) {
+        if (page->usage == MM_PU_USER)
+            mmu_lru_del(page);
+
+        mmu_tlb_batch_add_page(batch, page);
+    } else
+        (void)mmu_page_unref(PTE_ADDR(entry));
+}
+
+/* Make the table of level "level" that "entry" points to private to this address space
+ *
+ * If this is the last reference to the table, the table is just made writable.
+ * Otherwise the table is copied and all the entries of the table
+ * are shared by the old and the new table. Because the entry now points
+ * to a different table, the whole address space is added to "batch"
+ *
+ * lock must be held by the caller */
+static void __unshare(uint64_t *entry, int level, mm_tlb_batch_t *batch)
+{
+    unsigned long table = PTE_ADDR(*entry);
+
+    if (mmu_page_refcount(table) > 1) {
+        unsigned long copy = mmu_page_alloc(MM_ZONE_HIGH, MM_HIGH_PRIO);
+        uint64_t *src      = amd64_p_to_v(table);
+        uint64_t *dst      = amd64_p_to_v(copy);
+
+        for (size_t i = 0; i < 512; ++i) {
+            if (src[i] & MM_PRESENT)
+                __share_entry(&src[i], level == LVL_PT || (src[i] & MM_2MB));
+            else if (level == LVL_PT && (src[i] & PTE_SWAP))
+                mmu_swap_dup(PTE_SLOT(src[i]));
+
+            dst[i] = src[i];
+        }
+
+        /* this can't be the last reference */
+        (void)mmu_page_unref(table);
+        *entry = copy | (*entry & (PAGE_SIZE - 1));
+
+        if (batch)
+            mmu_tlb_batch_add_all(batch);
+    }
+
+    *entry = (*entry | MM_READWRITE) & ~MM_COW;
+}
+
+/* Return pointer to the table of level "level" that "entry" points to
+ *
+ * Shared tables are unshared so the returned table can be modified.
+ * If the table doesn't exist and "alloc" is true, it's allocated
+ *
+ * lock must be held by the caller
+ *
+ * Return NULL if the table doesn't exist and "alloc" is false */
+static uint64_t *__get_table(uint64_t *entry, int level, bool alloc, mm_tlb_batch_t *batch)
+{
+    if (!(*entry & MM_PRESENT)) {
+        if (!alloc)
+            return NULL;
+
+        *entry = __alloc_entry();
+    } else if (*entry & MM_COW) {
+        __unshare(entry, level, batch);
+    }
+
+    return amd64_p_to_v(PTE_ADDR(*entry));
+}
+
+/* Replace the 2MB mapping of "entry" with a page table that maps the same memory
+ *
+ * Kernel mappings are not reference counted so the new page table just maps
+ * the 4KB pages of the 2MB block. A user block can only be released as a whole,
+ * so its contents are copied to private 4KB pages and the block loses
+ * the reference of this mapping. Copying also resolves copy-on-write
+ *
+ * lock must be held by the caller */
+static void __split_huge(uint64_t *entry, unsigned long vaddr, mm_tlb_batch_t *batch)
+{
+    unsigned long block = PTE_ADDR(*entry);
+    uint64_t flags      = *entry & (PAGE_SIZE - 1) & ~MM_2MB;
+    uint64_t table      = __alloc_entry();
+    uint64_t *pt        = amd64_p_to_v(PTE_ADDR(table));
+    bool copy           = (*entry & MM_USER) && mmu_page_get(block);
+
+    if (copy && (flags & MM_COW))
+        flags = (flags & ~MM_COW) | MM_READWRITE;
+
+    for (size_t i = 0; i < 512; ++i) {
+        unsigned long page = block + i * PAGE_SIZE;
+
+        if (copy) {
+            page = mmu_page_alloc(MM_ZONE_HIGH, 0);
+            kmemcpy(amd64_p_to_v(page), amd64_p_to_v(block + i * PAGE_SIZE), PAGE_SIZE);
+        }
+
+        pt[i] = page | flags;
+    }
+
+    if (copy)
+        __put_page(*entry, batch);
+
+    *entry = table | (*entry & MM_USER);
+
+    /* invlpg drops the translation of the whole 2MB page */
+    if (batch)
+        mmu_tlb_batch_add(batch, vaddr, 1);
+}
+
+/* Return pointer to the page directory entry of "vaddr" for modification
+ *
+ * Missing tables are allocated if "alloc" is true and "flags" (MM_USER)
+ * is set for all the entries on the path
+ *
+ * lock must be held by the caller
+ *
+ * Return NULL if a table is missing and "alloc" is false
+ * or if "vaddr" is mapped using a 1GB page */
+static uint64_t *__walk_pd(uint64_t *pml4, unsigned long vaddr, bool alloc, int flags, mm_tlb_batch_t *batch)
+{
+    uint64_t *entry = &pml4[PML4_ATOEI(vaddr)];
+    uint64_t *table = NULL;
+
+    if (!(table = __get_table(entry, LVL_PDPT, alloc, batch)))
+        return NULL;
+    *entry |= flags & MM_USER;
+    entry   = &table[PDPT_ATOEI(vaddr)];
+
+    /* 1GB pages are only used for the direct map */
+    if ((*entry & MM_PRESENT) && (*entry & MM_2MB))
+        return NULL;
+
+    if (!(table = __get_table(entry, LVL_PD, alloc, batch)))
+        return NULL;
+    *entry |= flags & MM_USER;
+
+    return &table[PD_ATOEI(vaddr)];
+}
+
+/* Return pointer to the page table entry of "vaddr" for modification
+ *
+ * See __walk_pd(). If "alloc" is true and "vaddr" is mapped
+ * using a 2MB page, the page is split into 4KB pages
+ *
+ * lock must be held by the caller
+ *
+ * Return NULL if a table is missing and "alloc" is false
+ * or if "vaddr" is mapped using a 2MB page and "alloc" is false */
+static uint64_t *__walk(uint64_t *pml4, unsigned long vaddr, bool alloc, int flags, mm_tlb_batch_t *batch)
+{
+    uint64_t *entry = __walk_pd(pml4, vaddr, alloc, flags, batch);
+    uint64_t *table = NULL;
+
+    if (!entry)
+        return NULL;
+
+    if ((*entry & MM_PRESENT) && (*entry & MM_2MB)) {
+        if (!alloc)
+            return NULL;
+
+        __split_huge(entry, vaddr, batch);
+    }
+
+    if (!(table = __get_table(entry, LVL_PT, alloc, batch)))
+        return NULL;
+    *entry |= flags & MM_USER;
+
+    return &table[PT_ATOEI(vaddr)];
+}
+
+/* Map "paddr" to "vaddr" in "pml4"
+ *
+ * If "vaddr" was already mapped, the old mapping is added to "batch".
+ * "batch" may be NULL if "pml4" is not in use yet
+ *
+ * TODO: should this do some error checking */
+static void __map_page(uint64_t *pml4, uint64_t paddr, uint64_t vaddr, int flags, mm_tlb_batch_t *batch)
 {
     spin_acquire(&lock);
 
     kassert(PAGE_ALIGNED(paddr));
     kassert(PAGE_ALIGNED(vaddr));
 
-    unsigned long pml4i = (vaddr >> 39) & 0x1ff;
-    unsigned long pdpti = (vaddr >> 30) & 0x1ff;
-    unsigned long pdi   = (vaddr >> 21) & 0x1ff;
-    unsigned long pti   = (vaddr >> 12) & 0x1ff;
+    uint64_t *pte = __walk(pml4, vaddr, true, flags, batch);
 
-    if (!(pml4[pml4i] & MM_PRESENT))
-        pml4[pml4i] = __alloc_entry();
-    pml4[pml4i] |= flags;
+    kassert(pte != NULL);
 
-    uint64_t *pdpt = amd64_p_to_v(pml4[pml4i] & ~0xfff);
+    /* kernel mappings are the same in every address space */
+    if (vaddr >= KERNEL_SPACE_START)
+        flags |= MM_GLOBAL;
 
-    if (!(pdpt[pdpti] & MM_PRESENT))
-        pdpt[pdpti] = __alloc_entry();
-    pdpt[pdpti] |= flags;
+    /* a user page that is replaced loses the reference of this mapping */
+    if (*pte & MM_PRESENT) {
+        __put_page(*pte, batch);
 
-    uint64_t *pd = amd64_p_to_v(pdpt[pdpti] & ~0xfff);
-
-    if (!(pd[pdi] & MM_PRESENT))
-        pd[pdi] = __alloc_entry();
-    pd[pdi] |= flags;
+        if (batch)
+            mmu_tlb_batch_add(batch, vaddr, 1);
+    } else if (*pte & PTE_SWAP) {
+        __put_page(*pte, NULL);
+    }
 
-    uint64_t *pt = amd64_p_to_v(pd[pdi] & ~0xfff);
-    pt[pti]      = paddr | flags | MM_PRESENT;
+    *pte = paddr | flags | MM_PRESENT;
     spin_release(&lock);
 }
 
 static void __map_range(uint64_t *pml4, unsigned long pstart, unsigned long vstart, size_t n, int flags)
 {
     for (size_t i = 0; i < n; ++i) {
-        __map_page(pml4, pstart, vstart, flags);
+        __map_page(pml4, pstart, vstart, flags, NULL);
 
         pstart += PAGE_SIZE;
         vstart += PAGE_SIZE;
@@ -105,25 +456,255 @@ static void __map_range(uint64_t *pml4, unsigned long pstart, unsigned long vsta
 int mmu_native_map_page(unsigned long paddr, unsigned long vaddr, int flags)
 {
     uint64_t *pml4 = amd64_p_to_v(amd64_get_cr3());
+    mm_tlb_batch_t batch;
 
-    __map_page(pml4, paddr, vaddr, flags);
+    mmu_tlb_batch_init(&batch);
+    __map_page(pml4, paddr, vaddr, flags, &batch);
 
-    /* TODO: use amd64_invld_page() instead! */
-    amd64_flush_tlb();
+    /* not-present entries are never cached so only
+     * a replaced mapping has to be invalidated */
+    mmu_tlb_batch_flush(&batch);
 
     return 0;
 }
 
+int mmu_native_try_map_page(unsigned long paddr, unsigned long vaddr, int flags)
+{
+    uint64_t *pml4 = amd64_p_to_v(amd64_get_cr3());
+    uint64_t *pde  = NULL;
+    uint64_t *pte  = NULL;
+    int ret        = 0;
+    mm_tlb_batch_t batch;
+
+    kassert(PAGE_ALIGNED(paddr));
+    kassert(PAGE_ALIGNED(vaddr));
+
+    mmu_tlb_batch_init(&batch);
+    spin_acquire(&lock);
+
+    pde = __walk_pd(pml4, vaddr, true, flags, &batch);
+
+    kassert(pde != NULL);
+
+    /* a large page is never split here, it maps "vaddr" already */
+    if ((*pde & MM_PRESENT) && (*pde & MM_2MB)) {
+        ret = -EEXIST;
+        goto end;
+    }
+
+    pte = __walk(pml4, vaddr, true, flags, &batch);
+
+    kassert(pte != NULL);
+
+    /* a swapped out page is still mapped, the fault that swaps it in owns it */
+    if (*pte & (MM_PRESENT | PTE_SWAP)) {
+        ret = -EEXIST;
+        goto end;
+    }
+
+    if (vaddr >= KERNEL_SPACE_START)
+        flags |= MM_GLOBAL;
+
+    *pte = paddr | flags | MM_PRESENT;
+
+end:
+    spin_release(&lock);
+
+    /* only unsharing the tables on the path may require a flush */
+    mmu_tlb_batch_flush(&batch);
+
+    return ret;
+}
+
+int mmu_native_map_huge_page(unsigned long paddr, unsigned long vaddr, int flags)
+{
+    uint64_t *pml4 = amd64_p_to_v(amd64_get_cr3());
+    uint64_t *pde  = NULL;
+    int ret        = 0;
+    mm_tlb_batch_t batch;
+
+    if ((paddr & (HUGE_PAGE_SIZE - 1)) || (vaddr & (HUGE_PAGE_SIZE - 1)))
+        return -EINVAL;
+
+    mmu_tlb_batch_init(&batch);
+    spin_acquire(&lock);
+
+    pde = __walk_pd(pml4, vaddr, true, flags, &batch);
+
+    kassert(pde != NULL);
+
+    if (*pde & MM_PRESENT) {
+        ret = -EEXIST;
+        goto end;
+    }
+
+    if (vaddr >= KERNEL_SPACE_START)
+        flags |= MM_GLOBAL;
+
+    *pde = paddr | flags | MM_2MB | MM_PRESENT;
+
+end:
+    spin_release(&lock);
+
+    /* only unsharing the tables on the path may require a flush */
+    mmu_tlb_batch_flush(&batch);
+
+    return ret;
+}
+
+/* Return pointer to the page directory entry of "vaddr" or NULL if
+ * one of the tables on the path is not present or "vaddr" is mapped using a 1GB page */
+static uint64_t *__get_pde(uint64_t *pml4, unsigned long vaddr)
+{
+    if (!(pml4[PML4_ATOEI(vaddr)] & MM_PRESENT))
+        return NULL;
+
+    uint64_t *pdpt = amd64_p_to_v(pml4[PML4_ATOEI(vaddr)] & ~(PAGE_SIZE - 1));
+
+    if (!(pdpt[PDPT_ATOEI(vaddr)] & MM_PRESENT) || (pdpt[PDPT_ATOEI(vaddr)] & MM_2MB))
+        return NULL;
+
+    uint64_t *pd = amd64_p_to_v(pdpt[PDPT_ATOEI(vaddr)] & ~(PAGE_SIZE - 1));
+
+    return &pd[PD_ATOEI(vaddr)];
+}
+
+/* Return pointer to the page table entry of "vaddr" or NULL if
+ * one of the tables on the path is not present or "vaddr" is mapped using a 2MB page */
+static uint64_t *__get_pte(uint64_t *pml4, unsigned long vaddr)
+{
+    uint64_t *pde = __get_pde(pml4, vaddr);
+
+    if (!pde || !(*pde & MM_PRESENT) || (*pde & MM_2MB))
+        return NULL;
+
+    uint64_t *pt = amd64_p_to_v(*pde & ~(PAGE_SIZE - 1));
+
+    return &pt[PT_ATOEI(vaddr)];
+}
+
 int mmu_native_unmap_page(unsigned long vaddr)
 {
-    unsigned long pml4i = (vaddr >> 39) & 0x1ff;
-    unsigned long pdpti = (vaddr >> 30) & 0x1ff;
-    unsigned long pdi   = (vaddr >> 21) & 0x1ff;
-    unsigned long pti   = (vaddr >> 12) & 0x1ff;
+    uint64_t *pml4 = amd64_p_to_v(amd64_get_cr3());
+    uint64_t *pde  = NULL;
+    uint64_t *pte  = NULL;
+    mm_tlb_batch_t batch;
+
+    mmu_tlb_batch_init(&batch);
+    spin_acquire(&lock);
+
+    /* the rest of a 2MB page stays mapped */
+    if ((pde = __walk_pd(pml4, vaddr, false, 0, &batch)) && (*pde & MM_PRESENT) && (*pde & MM_2MB))
+        __split_huge(pde, vaddr, &batch);
+
+    if (!(pte = __walk(pml4, vaddr, false, 0, &batch)) || !(*pte & (MM_PRESENT | PTE_MIGRATE | PTE_SWAP))) {
+        spin_release(&lock);
+        mmu_tlb_batch_flush(&batch);
+        return -EINVAL;
+    }
+
+    __put_page(*pte, &batch);
+    mmu_tlb_batch_add(&batch, vaddr, 1);
+
+    *pte = 0;
+    spin_release(&lock);
+
+    mmu_tlb_batch_flush(&batch);
+
+    return 0;
+}
+
+int mmu_native_unmap_range(unsigned long vaddr, size_t n)
+{
+    uint64_t *pml4    = amd64_p_to_v(amd64_get_cr3());
+    uint64_t *pde     = NULL;
+    uint64_t *pte     = NULL;
+    unsigned long end = vaddr + n * PAGE_SIZE;
+    size_t step       = PAGE_SIZE;
+    mm_tlb_batch_t batch;
+
+    mmu_tlb_batch_init(&batch);
+    spin_acquire(&lock);
+
+    for (; vaddr < end; vaddr += step) {
+        step = PAGE_SIZE;
+
+        /* skip the rest of a 2MB region that has no page table */
+        if (!(pde = __walk_pd(pml4, vaddr, false, 0, &batch)) || !(*pde & MM_PRESENT)) {
+            step = HUGE_PAGE_SIZE - (vaddr & (HUGE_PAGE_SIZE - 1));
+            continue;
+        }
+
+        if (*pde & MM_2MB) {
+            if (!(vaddr & (HUGE_PAGE_SIZE - 1)) && end - vaddr >= HUGE_PAGE_SIZE) {
+                __put_page(*pde, &batch);
+                mmu_tlb_batch_add(&batch, vaddr, 1);
+
+                *pde = 0;
+                step = HUGE_PAGE_SIZE;
+                continue;
+            }
+
+            __split_huge(pde, vaddr, &batch);
+        }
+
+        /* the page of a migration entry is released by the compactor */
+        if (!(pte = __walk(pml4, vaddr, false, 0, &batch)) || !(*pte & (MM_PRESENT | PTE_MIGRATE | PTE_SWAP)))
+            continue;
+
+        __put_page(*pte, &batch);
+        mmu_tlb_batch_add(&batch, vaddr, 1);
+
+        *pte = 0;
+    }
+
+    spin_release(&lock);
+
+    /* all pages are invalidated at once */
+    mmu_tlb_batch_flush(&batch);
 
     return 0;
 }
 
+unsigned long mmu_native_translate(unsigned long vaddr)
+{
+    uint64_t *pml4 = amd64_p_to_v(amd64_get_cr3());
+    uint64_t *pde  = __get_pde(pml4, vaddr);
+    uint64_t *pte  = NULL;
+
+    if (pde && (*pde & MM_PRESENT) && (*pde & MM_2MB))
+        return PTE_ADDR(*pde) | (vaddr & (HUGE_PAGE_SIZE - 1));
+
+    if (!(pte = __get_pte(pml4, vaddr)) || !(*pte & MM_PRESENT))
+        return INVALID_ADDRESS;
+
+    return (*pte & ~(PAGE_SIZE - 1)) | (vaddr & (PAGE_SIZE - 1));
+}
+
+/* Non-temporal stores write the zeroes directly to memory
+ * so zeroing a page doesn't evict the working set from the caches */
+void mmu_native_zero_page(unsigned long paddr)
+{
+    uint64_t *page = amd64_p_to_v(paddr);
+
+    for (size_t i = 0; i < PAGE_SIZE / sizeof(uint64_t); i += 4) {
+        asm volatile ("movnti %1,   (%0) \n"
+                      "movnti %1,  8(%0) \n"
+                      "movnti %1, 16(%0) \n"
+                      "movnti %1, 24(%0)"
+                      :: "r" (&page[i]), "r" (0UL) : "memory");
+    }
+
+    /* non-temporal stores are weakly ordered,
+     * make them visible before the page is handed out */
+    asm volatile ("sfence" ::: "memory");
+}
+
+unsigned long mmu_native_phys_limit(void)
+{
+    return phys_end;
+}
+
 unsigned long mmu_native_v_to_p(void *vaddr)
 {
     return amd64_v_to_p(vaddr);
@@ -134,45 +715,33 @@ void *mmu_native_p_to_v(unsigned long paddr)
     return amd64_p_to_v(paddr);
 }
 
-void *mmu_native_build_dir(void)
+/* Allocate new PML4 that has only the kernel mappings */
+static uint64_t *__alloc_dir(void)
 {
     uint64_t pml4_p;
     uint64_t *pml4_v;
 
-    if ((pml4_p = mmu_page_alloc(MM_ZONE_NORMAL, 0)) == INVALID_ADDRESS)
+    if ((pml4_p = mmu_page_alloc(MM_ZONE_HIGH, 0)) == INVALID_ADDRESS)
         return NULL;
 
     pml4_v = amd64_p_to_v(pml4_p);
 
-    for (size_t i = 0; i < 511; ++i) {
-        pml4_v[i] = 0;
+    /* the higher half is shared by all address spaces */
+    for (size_t i = 0; i < 512; ++i) {
+        pml4_v[i] = (i >= PML4_ATOEI(KERNEL_SPACE_START)) ? __pml4[i] : 0;
     }
 
-    pml4_v[PML4_ATOEI(KVSTART)] = __pml4[PML4_ATOEI(KVSTART)];
-
-    /* TODO: create some kind of iomem device mapper, this is disgusting! */
-    unsigned long lapic  = lapic_get_base();
-    unsigned long ioapic = ioapic_get_base();
-
-    kassert(lapic  != INVALID_ADDRESS);
-    kassert(ioapic != INVALID_ADDRESS);
-
-    __map_page(pml4_v, lapic,  lapic,  MM_PRESENT | MM_READWRITE);
-    __map_page(pml4_v, ioapic, ioapic, MM_PRESENT | MM_READWRITE);
-
-    pci_dev_t *dev = pci_get_dev(VBE_VENDOR_ID, VBE_DEVICE_ID);
+    return pml4_v;
+}
 
-    if (dev) {
-        void *vga_mem = (uint8_t *)((unsigned long)dev->bar0 - 8);
+void *mmu_native_build_dir(void)
+{
+    uint64_t *pml4_v;
 
-        __map_range(
-            pml4_v,
-            (unsigned long)vga_mem,
-            (unsigned long)vga_mem,
-            4096,
-            MM_PRESENT | MM_READWRITE
-        );
-    }
+    /* The Local APIC, I/O APIC and frame buffer are accessed using the direct map
+     * so the lower half of the new directory has nothing but user mappings */
+    if ((pml4_v = __alloc_dir()) == NULL)
+        return NULL;
 
     return pml4_v;
 }
@@ -225,129 +794,888 @@ void mmu_native_walk_addr(void *vaddr)
     kprint("----------------------\n");
 }
 
+/* Fork doesn't copy any tables. The PDPTs of the parent are shared with
+ * the child and they're copied level by level only when either one writes
+ * to them, so the cost of fork is proportional to the pages touched after it */
 void *mmu_native_duplicate_dir(void)
 {
-    uint64_t *pml4_cv = mmu_native_build_dir();          /* copy,     virtual */
+    uint64_t *pml4_cv = __alloc_dir();                 /* copy,     virtual */
     uint64_t *pml4_ov = amd64_p_to_v(amd64_get_cr3()); /* original, virtual */
-    uint64_t *pdpt_ov = NULL, *pdpt_cv = NULL;
-    uint64_t *pd_ov   = NULL, *pd_cv   = NULL;
-    uint64_t *pt_ov   = NULL, *pt_cv   = NULL;
 
-    /* TODO: this code looks pretty ugly, use recursion maybe? */
+    if (!pml4_cv)
+        return NULL;
 
-    /* level 3 */
-    for (size_t pml4i = 0; pml4i < 511; ++pml4i) {
-        if (pml4_ov[pml4i] & MM_PRESENT) {
+    mm_tlb_batch_t batch;
 
-            /* create new PML4 entry and set up pdpt pointers */
-            pml4_cv[pml4i] = __alloc_entry() | MM_PRESENT | MM_USER;
-            pdpt_ov        = amd64_p_to_v(pml4_ov[pml4i] & ~(PAGE_SIZE - 1));
-            pdpt_cv        = amd64_p_to_v(pml4_cv[pml4i] & ~(PAGE_SIZE - 1));
-
-            /* level 2 */
-            for (size_t pdpti = 0; pdpti < 512; ++pdpti)  {
-                if (pdpt_ov[pdpti] & MM_PRESENT) {
-
-                    /* create new pdpt entry and set up pd pointers */
-                    pdpt_cv[pdpti] = __alloc_entry() | MM_PRESENT | MM_USER;
-                    pd_ov          = amd64_p_to_v(pdpt_ov[pdpti] & ~(PAGE_SIZE - 1));
-                    pd_cv          = amd64_p_to_v(pdpt_cv[pdpti] & ~(PAGE_SIZE - 1));
-
-                    /* level 1 */
-                    for (size_t pdi = 0; pdi < 512; ++pdi)  {
-                        if (pd_ov[pdi] & MM_PRESENT) {
-
-                            /* 2MB pages should not be mapped like 4KB pages */
-                            if ((pd_ov[pdi] & MM_2MB)) {
-                                pd_ov[pdi] &= ~(PAGE_SIZE - 1); /* reset flags */
-                                pd_ov[pdi] |= (MM_COW | MM_READONLY | MM_PRESENT | MM_USER | MM_2MB);
-                                pd_cv[pdi]  = pd_ov[pdi];
-                            }
-
-                            /* create new pd entry and set up pt pointers */
-                            pd_cv[pdi] = __alloc_entry() | MM_PRESENT | MM_USER;
-                            pt_ov      = amd64_p_to_v(pd_ov[pdi] & ~(PAGE_SIZE - 1));
-                            pt_cv      = amd64_p_to_v(pd_cv[pdi] & ~(PAGE_SIZE - 1));
-
-                            for (size_t pti = 0; pti < 512; ++pti) {
-                                if (pt_ov[pti] & MM_PRESENT) {
-                                    pt_ov[pti] &= ~(PAGE_SIZE - 1); /* reset flags */
-                                    pt_ov[pti] |= (MM_COW | MM_READONLY | MM_PRESENT | MM_USER);
-                                    pt_cv[pti]  = pt_ov[pti];
-                                }
-                            }
-                        }
-                    }
-                }
-            }
+    mmu_tlb_batch_init(&batch);
+    spin_acquire(&lock);
+
+    /* A copy of a table would get a copy of its migration entries
+     * and the compactor only knows about the original ones. The compactor may
+     * be flushing the TLB of this CPU so the requests are handled while waiting */
+    while (migrating) {
+        spin_release(&lock);
+        mmu_tlb_poll();
+        cpu_relax();
+        spin_acquire(&lock);
+    }
+
+    for (size_t pml4i = 0; pml4i < PML4_ATOEI(KERNEL_SPACE_START); ++pml4i) {
+        if (pml4_ov[pml4i] & MM_PRESENT) {
+            __share_entry(&pml4_ov[pml4i], false);
+            pml4_cv[pml4i] = pml4_ov[pml4i];
         }
     }
 
-    /* TODO: use amd64_invld_page() instead! */
-    amd64_flush_tlb();
+    spin_release(&lock);
+
+    /* the mappings of the parent are now read-only */
+    mmu_tlb_batch_add_all(&batch);
+    mmu_tlb_batch_flush(&batch);
 
     return pml4_cv;
 }
 
+/* Drop the reference to the table of level "level" that "entry" points to
+ * If this was the last reference, drop the references of all entries of the table too
+ *
+ * lock must be held by the caller */
+static void __release_table(uint64_t entry, int level)
+{
+    unsigned long table = PTE_ADDR(entry);
+    uint64_t *tbl       = amd64_p_to_v(table);
+
+    if (mmu_page_refcount(table) == 1) {
+        for (size_t i = 0; i < 512; ++i) {
+            if (level == LVL_PT && (tbl[i] & PTE_SWAP))
+                __put_page(tbl[i], NULL);
+
+            if (!(tbl[i] & MM_PRESENT))
+                continue;
+
+            if (level == LVL_PT || (tbl[i] & MM_2MB))
+                __put_page(tbl[i], NULL);
+            else
+                __release_table(tbl[i], level - 1);
+        }
+    }
+
+    (void)mmu_page_unref(table);
+}
+
 void mmu_native_destroy_dir(void *dir)
 {
     if (!dir)
         return;
 
     uint64_t *pml4 = dir;
-    uint64_t *pdpt = NULL;
-    uint64_t *pd   = NULL;
-    uint64_t *pt   = NULL;
-    uint64_t page  = 0;
-    unsigned flags = 0;
 
-    /* level 3 */
-    for (size_t pml4i = 0; pml4i < 511; ++pml4i) {
-        if (!(pml4[pml4i] & MM_PRESENT))
-            continue;
+    spin_acquire(&lock);
 
-        pdpt = amd64_p_to_v(pml4[pml4i] & ~(PAGE_SIZE - 1));
+    for (size_t pml4i = 0; pml4i < PML4_ATOEI(KERNEL_SPACE_START); ++pml4i) {
+        if (pml4[pml4i] & MM_PRESENT)
+            __release_table(pml4[pml4i], LVL_PDPT);
+    }
 
-        /* level 2 */
-        for (size_t pdpti = 0; pdpti < 512; ++pdpti)  {
-            if (!(pdpt[pdpti] & MM_PRESENT))
-                continue;
+    spin_release(&lock);
 
-            pd = amd64_p_to_v(pdpt[pdpti] & ~(PAGE_SIZE - 1));
+    mmu_page_free(amd64_v_to_p(dir));
+}
 
-            /* level 1 */
-            for (size_t pdi = 0; pdi < 512; ++pdi)  {
-                if (!(pd[pdi] & MM_PRESENT))
-                    continue;
+/* Resolve a write fault at "vaddr" of mapping "entry"
+ *
+ * If the mapping is a 2MB page that is shared and there's no free 2MB block
+ * for the copy, the page is split into private 4KB pages instead
+ *
+ * lock must be held by the caller
+ *
+ * Return 0 if the fault was handled
+ * Return -EFAULT if the mapping is not a copy-on-write mapping */
+static int __cow_entry(uint64_t *entry, unsigned long vaddr, bool huge, mm_tlb_batch_t *batch)
+{
+    /* stale TLB entry, the page is already writable */
+    if (*entry & MM_READWRITE) {
+        amd64_invld_page(vaddr);
+        return 0;
+    }
 
-                flags = MM_PRESENT | MM_USER;
-                pt    = amd64_p_to_v(pd[pdi] & ~(PAGE_SIZE - 1));
+    if (!(*entry & MM_COW))
+        return -EFAULT;
 
-                for (size_t pti = 0; pti < 512; ++pti) {
-                    if ((pt[pti] & flags) == flags && !(pt[pti] & MM_COW)) {
-                        page = pt[pti] & ~(PAGE_SIZE - 1);
-                        /* kdebug("free 4kb page 0x%x", page); */
-                        kmemset(amd64_p_to_v(page), 0, PAGE_SIZE);
-                        mmu_page_free(page);
-                    }
-                }
+    unsigned long page  = PTE_ADDR(*entry);
+    unsigned long flags = (*entry & (PAGE_SIZE - 1) & ~MM_COW) | MM_READWRITE;
+    unsigned order      = huge ? HUGE_PAGE_ORDER : 0;
 
-                page = pd[pdi] & ~(PAGE_SIZE - 1);
-                kmemset(amd64_p_to_v(page), 0, PAGE_SIZE);
-                mmu_page_free(page);
-            }
+    /* sole owner of the page doesn't have to copy it. Pages that
+     * are not reference counted are never owned by the task */
+    if (mmu_page_refcount(page) != 1) {
+        unsigned long copy = mmu_block_alloc(MM_ZONE_HIGH, order, huge ? MM_TRY : MM_NO_FLAGS);
 
-            page = pdpt[pdpti] & ~(PAGE_SIZE - 1);
-            kmemset(amd64_p_to_v(page), 0, PAGE_SIZE);
-            mmu_page_free(page);
+        if (copy == INVALID_ADDRESS) {
+            __split_huge(entry, vaddr, batch);
+            return 0;
         }
 
-        page = pml4[pml4i] & ~(PAGE_SIZE - 1);
-        kmemset(amd64_p_to_v(page), 0, PAGE_SIZE);
-        mmu_page_free(page);
+        kmemcpy(amd64_p_to_v(copy), amd64_p_to_v(page), PAGE_SIZE << order);
+
+        if (!huge)
+            mmu_lru_add(copy, sched_get_active(), vaddr);
+
+        if (mmu_page_refcount(page))
+            (void)mmu_page_unref(page);
+
+        page = copy;
+    } else if (!huge && mmu_page_get(page)->usage == MM_PU_USER) {
+        /* the page was mapped by the other address space of a fork until now */
+        mmu_lru_add(page, sched_get_active(), vaddr);
     }
 
-    mmu_page_free(amd64_v_to_p(dir));
+    *entry = page | flags;
+
+    /* other threads of this task may have the old page in their TLBs */
+    mmu_tlb_batch_add(batch, vaddr, 1);
+
+    return 0;
+}
+
+int mmu_native_cow_fault(unsigned long vaddr)
+{
+    uint64_t *pml4 = amd64_p_to_v(amd64_get_cr3());
+    uint64_t *pde  = NULL;
+    uint64_t *pte  = NULL;
+    int ret        = -EFAULT;
+    mm_tlb_batch_t batch;
+
+    mmu_tlb_batch_init(&batch);
+    spin_acquire(&lock);
+
+    /* walking the tables unshares all shared tables on the path */
+    if (!(pde = __walk_pd(pml4, vaddr, false, 0, &batch)) || !(*pde & MM_PRESENT))
+        goto end;
+
+    if (*pde & MM_2MB)
+        ret = __cow_entry(pde, vaddr, true, &batch);
+    else if ((pte = __walk(pml4, vaddr, false, 0, &batch)) && (*pte & MM_PRESENT))
+        ret = __cow_entry(pte, vaddr, false, &batch);
+
+end:
+    spin_release(&lock);
+    mmu_tlb_batch_flush(&batch);
+
+    return ret;
+}
+
+/* Return true if page table entry "entry" can be part of a 2MB page with flags "flags"
+ *
+ * The entry must map a private user page and the flags, ignoring
+ * the accessed and dirty bits, must be the same for all entries */
+static bool __can_promote(uint64_t entry, uint64_t flags)
+{
+    if ((entry & (PAGE_SIZE - 1) & ~(MM_ACCESSED | PTE_DIRTY)) != flags)
+        return false;
+
+    if (!mmu_page_get(PTE_ADDR(entry)))
+        return false;
+
+    return mmu_page_refcount(PTE_ADDR(entry)) == 1;
+}
+
+int mmu_native_promote_huge_page(unsigned long vaddr)
+{
+    uint64_t *pml4 = amd64_p_to_v(amd64_get_cr3());
+    uint64_t *pde  = NULL;
+    uint64_t *pt   = NULL;
+    uint64_t flags = 0;
+    int ret        = -EAGAIN;
+    unsigned long block;
+    size_t start;
+    mm_tlb_batch_t batch;
+
+    mmu_tlb_batch_init(&batch);
+    spin_acquire(&lock);
+
+    vaddr = ROUND_DOWN(vaddr, HUGE_PAGE_SIZE);
+    start = PT_ATOEI(vaddr);
+
+    if (!(pde = __walk_pd(pml4, vaddr, false, 0, &batch)))
+        goto end;
+
+    if ((*pde & (MM_PRESENT | MM_2MB | MM_COW)) != MM_PRESENT)
+        goto end;
+
+    pt    = amd64_p_to_v(PTE_ADDR(*pde));
+    flags = pt[start] & (PAGE_SIZE - 1) & ~(MM_ACCESSED | PTE_DIRTY);
+
+    if ((flags & (MM_PRESENT | MM_USER | MM_2MB | MM_COW)) != (MM_PRESENT | MM_USER))
+        goto end;
+
+    /* The region is usually populated in address order, so start from the
+     * faulting entry so that a partially populated table is rejected quickly */
+    for (size_t i = 0; i < 512; ++i) {
+        if (!__can_promote(pt[(start + i) % 512], flags))
+            goto end;
+    }
+
+    if ((block = mmu_block_alloc(MM_ZONE_HIGH, HUGE_PAGE_ORDER, MM_TRY)) == INVALID_ADDRESS) {
+        ret = -ENOMEM;
+        goto end;
+    }
+
+    /* The address space is run by one CPU at a time and that CPU is here,
+     * so nothing can write to the pages while they're copied. Other CPUs may
+     * still have the pages in their TLBs so they're released after the flush */
+    for (size_t i = 0; i < 512; ++i) {
+        kmemcpy(amd64_p_to_v(block + i * PAGE_SIZE), amd64_p_to_v(PTE_ADDR(pt[i])), PAGE_SIZE);
+        __put_page(pt[i], &batch);
+    }
+
+    mmu_tlb_batch_add_page(&batch, mmu_page_get(PTE_ADDR(*pde)));
+    mmu_tlb_batch_add(&batch, vaddr, 512);
+
+    *pde = block | flags | MM_2MB;
+    ret  = 0;
+
+end:
+    spin_release(&lock);
+    mmu_tlb_batch_flush(&batch);
+
+    return ret;
+}
+
+/* Return true if "entry" points to a table that is used only by this address space */
+static bool __is_private_table(uint64_t entry)
+{
+    return (entry & (MM_PRESENT | MM_2MB | MM_COW)) == MM_PRESENT;
+}
+
+/* Record that "entry" at "pte" of page table "table" of "task" has been
+ * replaced with a migration entry. "next" is the entry that replaces
+ * the migration entry if it's already known, see "migrations"
+ *
+ * The first migration of a table takes a reference to it so the table
+ * stays around even if the task releases it
+ *
+ * lock must be held by the caller */
+static void __add_migration(task_t *task, uint64_t *pte, unsigned long table,
+                            uint64_t entry, uint64_t next, size_t req)
+{
+    size_t owner = nmigrations;
+
+    /* the pages of a table are usually collected one after another */
+    for (size_t i = nmigrations; i > 0; --i) {
+        if (migrations[i - 1].table == table) {
+            owner = migrations[i - 1].owner;
+            break;
+        }
+    }
+
+    if (owner == nmigrations)
+        mmu_page_ref(table);
+
+    migrations[nmigrations].task      = task;
+    migrations[nmigrations].pte       = pte;
+    migrations[nmigrations].table     = table;
+    migrations[nmigrations].owner     = owner;
+    migrations[nmigrations].entry     = entry;
+    migrations[nmigrations].next      = next;
+    migrations[nmigrations].copy      = INVALID_ADDRESS;
+    migrations[nmigrations].req       = req;
+    nmigrations++;
+}
+
+/* Replace the entries of page table "pde" of "task" that map a movable page
+ * in the physical range [range[0], range[1]) with migration entries
+ *
+ * lock must be held by the caller */
+static void __collect_table(task_t *task, uint64_t pde, unsigned long *range)
+{
+    unsigned long table = PTE_ADDR(pde);
+    uint64_t *pt        = amd64_p_to_v(table);
+
+    for (size_t i = 0; i < 512 && nmigrations < MIGRATE_MAX; ++i) {
+        uint64_t entry     = pt[i];
+        unsigned long page = PTE_ADDR(entry);
+        page_t *p          = NULL;
+
+        if ((entry & (MM_PRESENT | MM_USER | MM_COW)) != (MM_PRESENT | MM_USER))
+            continue;
+
+        if (page < range[0] || page >= range[1])
+            continue;
+
+        if (!(p = mmu_page_get(page)) || p->usage != MM_PU_USER || mmu_page_refcount(page) != 1)
+            continue;
+
+        /* the CPU may set the accessed and dirty bits at any time */
+        if (!__sync_bool_compare_and_swap(&pt[i], entry, (entry & ~MM_PRESENT) | PTE_MIGRATE))
+            continue;
+
+        __add_migration(task, &pt[i], table, entry, 0, 0);
+    }
+}
+
+/* Collect the movable pages of "task", see __collect_table() */
+static void __collect_task(task_t *task, void *arg)
+{
+    uint64_t *pml4 = task->dir;
+
+    spin_acquire(&lock);
+
+    /* Shared tables are copied when either one of the address spaces writes to
+     * them so their entries are not touched. Only 4KB pages are moved */
+    for (size_t pml4i = 0; pml4i < PML4_ATOEI(KERNEL_SPACE_START); ++pml4i) {
+        if (!__is_private_table(pml4[pml4i]))
+            continue;
+
+        uint64_t *pdpt = amd64_p_to_v(PTE_ADDR(pml4[pml4i]));
+
+        for (size_t pdpti = 0; pdpti < 512; ++pdpti) {
+            if (!__is_private_table(pdpt[pdpti]))
+                continue;
+
+            uint64_t *pd = amd64_p_to_v(PTE_ADDR(pdpt[pdpti]));
+
+            for (size_t pdi = 0; pdi < 512 && nmigrations < MIGRATE_MAX; ++pdi) {
+                if (__is_private_table(pd[pdi]))
+                    __collect_table(task, pd[pdi], arg);
+            }
+        }
+    }
+
+    spin_release(&lock);
+}
+
+/* Replace the migration entries with their next entries
+ *
+ * An entry that was changed while the page was copied, eg. because the memory
+ * was unmapped, or whose table was released by its address space is left alone
+ * and it's marked lost. The page of a lost entry still has the reference
+ * of the mapping because migration entries are not released by the address space
+ *
+ * lock must be held by the caller */
+static void __finish_migration(void)
+{
+    for (size_t i = 0; i < nmigrations; ++i) {
+        if (migrations[i].owner == i)
+            migrations[i].live = mmu_page_refcount(migrations[i].table) > 1;
+    }
+
+    for (size_t i = 0; i < nmigrations; ++i) {
+        uint64_t entry = migrations[i].entry;
+        uint64_t *pte  = migrations[i].pte;
+
+        if (!migrations[migrations[i].owner].live || *pte != ((entry & ~MM_PRESENT) | PTE_MIGRATE)) {
+            migrations[i].state = MIGRATE_LOST;
+        } else if (migrations[i].next == 0) {
+            *pte = entry;
+            migrations[i].state = MIGRATE_RESTORED;
+        } else {
+            *pte = migrations[i].next;
+            migrations[i].state = MIGRATE_DONE;
+        }
+    }
+
+    /* A table that was released by its address space while its entries were
+     * being migrated still has the references of its other pages */
+    for (size_t i = 0; i < nmigrations; ++i) {
+        if (migrations[i].owner != i)
+            continue;
+
+        if (mmu_page_refcount(migrations[i].table) == 1)
+            __release_table(migrations[i].table | MM_PRESENT, LVL_PT);
+        else
+            (void)mmu_page_unref(migrations[i].table);
+    }
+}
+
+/* Take ownership of the migration array, see "migrating"
+ *
+ * If "wait" is true, wait until the current owner is done. The owner may be
+ * flushing the TLB of this CPU so the requests are handled while waiting.
+ * Otherwise the lock is not waited for either because the caller
+ * may be an allocation made while holding it
+ *
+ * Return 0 on success
+ * Return -EBUSY if the array or the lock is in use and "wait" is false */
+static int __start_migration(bool wait)
+{
+    if (!wait && !spin_try_acquire(&lock))
+        return -EBUSY;
+    else if (wait)
+        spin_acquire(&lock);
+
+    while (migrating) {
+        spin_release(&lock);
+
+        if (!wait)
+            return -EBUSY;
+
+        mmu_tlb_poll();
+        cpu_relax();
+        spin_acquire(&lock);
+    }
+
+    migrating   = true;
+    nmigrations = 0;
+    spin_release(&lock);
+
+    return 0;
+}
+
+/* No CPU can access the pages of the collected entries after this */
+static void __flush_migration(void)
+{
+    for (size_t i = 0; i < nmigrations; ++i) {
+        if (i == 0 || migrations[i].task != migrations[i - 1].task)
+            mmu_tlb_flush_task(migrations[i].task);
+    }
+}
+
+/* Migration of a page is done in three steps:
+ *  - the entries that map the page are replaced with non-present migration entries
+ *  - the TLBs of the address spaces are flushed and the pages are copied
+ *  - the migration entries are replaced with entries that map the copies
+ *
+ * Threads that access the page while it's copied fault and wait until the copy
+ * is done (see mmu_native_migration_pending()). Interrupts are kept disabled
+ * so the compactor can't be preempted while others wait for it */
+int mmu_native_migrate_range(unsigned long start, unsigned long end)
+{
+    unsigned long range[2] = { start, end };
+    uint64_t flags         = 0;
+    int nmoved             = 0;
+
+    if (start >= end || (end - start) > MIGRATE_MAX * PAGE_SIZE)
+        return -EINVAL;
+
+    flags = irq_save();
+
+    if (__start_migration(false) < 0) {
+        irq_restore(flags);
+        return -EBUSY;
+    }
+
+    sched_task_for_each(__collect_task, range);
+    __flush_migration();
+
+    for (size_t i = 0; i < nmigrations; ++i) {
+        uint64_t entry     = migrations[i].entry;
+        unsigned long copy = mmu_page_alloc(MM_ZONE_HIGH, MM_TRY);
+
+        if (copy == INVALID_ADDRESS)
+            continue;
+
+        kmemcpy(amd64_p_to_v(copy), amd64_p_to_v(PTE_ADDR(entry)), PAGE_SIZE);
+        migrations[i].copy = copy;
+        migrations[i].next = copy | (entry & ~PTE_ADDR(entry));
+    }
+
+    spin_acquire(&lock);
+    __finish_migration();
+
+    /* The old pages of all entries except the ones that are restored are now
+     * owned by the compactor and they're released when the block is put back */
+    for (size_t i = 0; i < nmigrations; ++i) {
+        page_t *page = mmu_page_get(PTE_ADDR(migrations[i].entry));
+
+        if (migrations[i].state == MIGRATE_RESTORED)
+            continue;
+
+        if (migrations[i].state == MIGRATE_DONE) {
+            mmu_lru_add(migrations[i].copy, page->task, page->vaddr);
+            nmoved++;
+        } else if (migrations[i].copy != INVALID_ADDRESS) {
+            mmu_page_free(migrations[i].copy);
+        }
+
+        mmu_lru_del(page);
+        page->usage = MM_PU_ISOLATED;
+    }
+
+    migrating = false;
+    spin_release(&lock);
+    irq_restore(flags);
+
+    return nmoved;
+}
+
+typedef struct reclaim_arg {
+    mm_reclaim_req_t *reqs;
+    size_t n;
+} reclaim_arg_t;
+
+/* Return pointer to the page table entry of "vaddr" in "pml4" and store
+ * the physical address of the page table to "table"
+ *
+ * Return NULL if one of the tables on the path is not present or
+ * "vaddr" is mapped using a large page. If one of the tables is shared,
+ * return NULL and set "shared" */
+static uint64_t *__get_private_pte(uint64_t *pml4, unsigned long vaddr, unsigned long *table, bool *shared)
+{
+    uint64_t *entry = &pml4[PML4_ATOEI(vaddr)];
+
+    for (int shift = 30; shift >= 12; shift -= 9) {
+        if (!(*entry & MM_PRESENT) || (*entry & MM_2MB))
+            return NULL;
+
+        if (*entry & MM_COW) {
+            *shared = true;
+            return NULL;
+        }
+
+        *table = PTE_ADDR(*entry);
+        entry  = (uint64_t *)amd64_p_to_v(*table) + ((vaddr >> shift) & 0x1FF);
+    }
+
+    return entry;
+}
+
+/* Find the entries of the reclaim requests of "task", see mmu_native_reclaim()
+ *
+ * Referenced pages have their accessed bit cleared and the entries of idle pages
+ * that are evicted are replaced with migration entries */
+static void __reclaim_task(task_t *task, void *arg)
+{
+    reclaim_arg_t *ra      = arg;
+    mm_reclaim_req_t *reqs = ra->reqs;
+    uint64_t *pml4         = task->dir;
+
+    spin_acquire(&lock);
+
+    for (size_t i = 0; i < ra->n && nmigrations < MIGRATE_MAX; ++i) {
+        uint64_t *pte       = NULL;
+        uint64_t entry      = 0;
+        unsigned long table = 0;
+        bool shared         = false;
+        unsigned long slot;
+
+        if (reqs[i].task != task)
+            continue;
+
+        /* Entries of shared tables can't be changed without unsharing the tables
+         * first. That is done by the next write to them so the page is tried later */
+        if (!(pte = __get_private_pte(pml4, reqs[i].vaddr, &table, &shared))) {
+            reqs[i].status = shared ? MM_RECLAIM_BUSY : MM_RECLAIM_GONE;
+            continue;
+        }
+
+        reqs[i].status = MM_RECLAIM_GONE;
+        entry          = *pte;
+
+        if ((entry & (MM_PRESENT | MM_USER)) != (MM_PRESENT | MM_USER) || PTE_ADDR(entry) != reqs[i].page)
+            continue;
+
+        /* the page is mapped by someone else too, or it's used by the kernel */
+        if (mmu_page_refcount(reqs[i].page) != 2) {
+            reqs[i].status = MM_RECLAIM_BUSY;
+            continue;
+        }
+
+        /* the CPU may set the accessed and dirty bits at any time */
+        if (entry & MM_ACCESSED) {
+            if (__sync_bool_compare_and_swap(pte, entry, entry & ~MM_ACCESSED))
+                reqs[i].status = MM_RECLAIM_REFERENCED;
+            else
+                reqs[i].status = MM_RECLAIM_BUSY;
+            continue;
+        }
+
+        reqs[i].status = MM_RECLAIM_IDLE;
+
+        if (!reqs[i].evict || mmu_swap_alloc(&slot) < 0)
+            continue;
+
+        if (!__sync_bool_compare_and_swap(pte, entry, (entry & ~MM_PRESENT) | PTE_MIGRATE)) {
+            mmu_swap_free(slot);
+            reqs[i].status = MM_RECLAIM_BUSY;
+            continue;
+        }
+
+        __add_migration(task, pte, table, entry, (slot << PAGE_SHIFT) | PTE_SWAP |
+                        (entry & ~PTE_ADDR(entry) & ~(MM_PRESENT | MM_ACCESSED | PTE_DIRTY)), i);
+    }
+
+    spin_release(&lock);
+}
+
+/* Pages are swapped out the same way they're migrated except that
+ * the contents of the page are written to a swap slot instead of a copy
+ * and the migration entry is replaced with a swap entry. Pages are found
+ * using the address space and address stored by the LRU */
+int mmu_native_reclaim(mm_reclaim_req_t *reqs, size_t n, int flags)
+{
+    reclaim_arg_t arg = { reqs, n };
+    uint64_t irq      = 0;
+    int nevicted      = 0;
+
+    if (!reqs || n > MIGRATE_MAX)
+        return -EINVAL;
+
+    irq = irq_save();
+
+    if (__start_migration(!(flags & MM_TRY)) < 0) {
+        irq_restore(irq);
+        return -EBUSY;
+    }
+
+    sched_task_for_each(__reclaim_task, &arg);
+    __flush_migration();
+
+    /* the page is restored if it can't be written */
+    for (size_t i = 0; i < nmigrations; ++i) {
+        if (mmu_swap_write(PTE_SLOT(migrations[i].next), PTE_ADDR(migrations[i].entry)) < 0)
+            migrations[i].next = 0;
+    }
+
+    spin_acquire(&lock);
+    __finish_migration();
+
+    /* The page loses the reference of the mapping unless it's restored.
+     * The caller still holds a reference so the page is not released here */
+    for (size_t i = 0; i < nmigrations; ++i) {
+        unsigned long slot = PTE_SLOT(migrations[i].next);
+
+        switch (migrations[i].state) {
+            case MIGRATE_DONE:
+                (void)mmu_page_unref(PTE_ADDR(migrations[i].entry));
+                reqs[migrations[i].req].status = MM_RECLAIM_EVICTED;
+                nevicted++;
+                break;
+
+            case MIGRATE_LOST:
+                (void)mmu_page_unref(PTE_ADDR(migrations[i].entry));
+                reqs[migrations[i].req].status = MM_RECLAIM_GONE;
+                mmu_swap_free(slot);
+                break;
+
+            case MIGRATE_RESTORED:
+                reqs[migrations[i].req].status = MM_RECLAIM_BUSY;
+                break;
+        }
+    }
+
+    migrating = false;
+    spin_release(&lock);
+    irq_restore(irq);
+
+    return nevicted;
+}
+
+unsigned long mmu_native_task_page(task_t *task, unsigned long vaddr)
+{
+    unsigned long address = INVALID_ADDRESS;
+    unsigned long table   = 0;
+    bool shared           = false;
+    uint64_t *pte         = NULL;
+    page_t *page          = NULL;
+
+    spin_acquire(&lock);
+
+    if (!(pte = __get_private_pte(task->dir, vaddr, &table, &shared)))
+        goto end;
+
+    if ((*pte & (MM_PRESENT | MM_USER | MM_COW)) != (MM_PRESENT | MM_USER))
+        goto end;
+
+    if (!(page = mmu_page_get(PTE_ADDR(*pte))) || page->usage != MM_PU_USER)
+        goto end;
+
+    if (mmu_page_refcount(PTE_ADDR(*pte)) == 1)
+        address = PTE_ADDR(*pte);
+
+end:
+    spin_release(&lock);
+
+    return address;
+}
+
+typedef struct merge_arg {
+    mm_merge_req_t *reqs;
+    size_t n;
+} merge_arg_t;
+
+/* Replace the entries of the merge requests of "task" with migration entries
+ * The checks are the same as in mmu_native_task_page() */
+static void __merge_task(task_t *task, void *arg)
+{
+    merge_arg_t *ma      = arg;
+    mm_merge_req_t *reqs = ma->reqs;
+    uint64_t *pml4       = task->dir;
+
+    spin_acquire(&lock);
+
+    for (size_t i = 0; i < ma->n && nmigrations < MIGRATE_MAX; ++i) {
+        uint64_t *pte       = NULL;
+        uint64_t entry      = 0;
+        unsigned long table = 0;
+        bool shared         = false;
+        page_t *page        = NULL;
+
+        if (reqs[i].task != task)
+            continue;
+
+        if (!(pte = __get_private_pte(pml4, reqs[i].vaddr, &table, &shared)))
+            continue;
+
+        entry = *pte;
+
+        if ((entry & (MM_PRESENT | MM_USER | MM_COW)) != (MM_PRESENT | MM_USER))
+            continue;
+
+        if (PTE_ADDR(entry) != reqs[i].page || mmu_page_refcount(reqs[i].page) != 1)
+            continue;
+
+        if (!(page = mmu_page_get(reqs[i].page)) || page->usage != MM_PU_USER)
+            continue;
+
+        if (!__sync_bool_compare_and_swap(pte, entry, (entry & ~MM_PRESENT) | PTE_MIGRATE))
+            continue;
+
+        __add_migration(task, pte, table, entry, 0, i);
+    }
+
+    spin_release(&lock);
+}
+
+/* Pages are merged the same way they're migrated except that the copy
+ * already exists. The page can't be written once its TLB entries have
+ * been flushed so its contents are compared to the shared page only then.
+ * The shared page is mapped read-only and it's copied on the next write
+ * if the mapping was writable */
+int mmu_native_merge(mm_merge_req_t *reqs, size_t n)
+{
+    merge_arg_t arg = { reqs, n };
+    uint64_t irq    = 0;
+    int nmerged     = 0;
+
+    if (!reqs || n > MIGRATE_MAX)
+        return -EINVAL;
+
+    for (size_t i = 0; i < n; ++i)
+        reqs[i].merged = false;
+
+    irq = irq_save();
+    (void)__start_migration(true);
+
+    sched_task_for_each(__merge_task, &arg);
+    __flush_migration();
+
+    for (size_t i = 0; i < nmigrations; ++i) {
+        uint64_t entry      = migrations[i].entry;
+        unsigned long kpage = reqs[migrations[i].req].kpage;
+
+        if (kmemcmp(amd64_p_to_v(PTE_ADDR(entry)), amd64_p_to_v(kpage), PAGE_SIZE))
+            continue;
+
+        migrations[i].next = kpage | (entry & ~PTE_ADDR(entry) & ~(MM_READWRITE | MM_ACCESSED | PTE_DIRTY));
+
+        if (entry & MM_READWRITE)
+            migrations[i].next |= MM_COW;
+    }
+
+    spin_acquire(&lock);
+    __finish_migration();
+
+    /* The page loses the reference of the mapping unless it's restored.
+     * The TLBs have been flushed so the page can be released right away */
+    for (size_t i = 0; i < nmigrations; ++i) {
+        mm_merge_req_t *req = &reqs[migrations[i].req];
+
+        if (migrations[i].state == MIGRATE_RESTORED)
+            continue;
+
+        if (migrations[i].state == MIGRATE_DONE) {
+            mmu_page_ref(req->kpage);
+            req->merged = true;
+            nmerged++;
+        }
+
+        (void)mmu_page_unref(PTE_ADDR(migrations[i].entry));
+    }
+
+    migrating = false;
+    spin_release(&lock);
+    irq_restore(irq);
+
+    return nmerged;
+}
+
+int mmu_native_swap_fault(unsigned long vaddr)
+{
+    uint64_t *pml4     = amd64_p_to_v(amd64_get_cr3());
+    uint64_t *pte      = NULL;
+    uint64_t entry     = 0;
+    unsigned long page = INVALID_ADDRESS;
+    mm_tlb_batch_t batch;
+
+    mmu_tlb_batch_init(&batch);
+    spin_acquire(&lock);
+
+    if (!(pte = __walk(pml4, vaddr, false, 0, &batch)) || !(*pte & PTE_SWAP)) {
+        spin_release(&lock);
+        mmu_tlb_batch_flush(&batch);
+        return -ENOENT;
+    }
+
+    entry = *pte;
+    spin_release(&lock);
+
+    /* The lock is not held while the page is read so other pages can be
+     * swapped out to make room for it. Another thread of the task
+     * may fault on the same entry and whoever comes second frees its copy */
+    if ((page = mmu_page_alloc(MM_ZONE_HIGH, MM_TRY)) == INVALID_ADDRESS &&
+        mmu_swap_reclaim(1, MM_TRY) > 0)
+        page = mmu_page_alloc(MM_ZONE_HIGH, MM_TRY);
+
+    if (page == INVALID_ADDRESS) {
+        mmu_tlb_batch_flush(&batch);
+        return -ENOMEM;
+    }
+
+    if (mmu_swap_read(PTE_SLOT(entry), page) < 0) {
+        mmu_page_free(page);
+        mmu_tlb_batch_flush(&batch);
+        return -EIO;
+    }
+
+    spin_acquire(&lock);
+
+    /* the tables may have been shared again by fork() */
+    if ((pte = __walk(pml4, vaddr, false, 0, &batch)) && *pte == entry) {
+        *pte = page | (entry & ~PTE_ADDR(entry) & ~PTE_SWAP) | MM_PRESENT;
+        mmu_lru_add(page, sched_get_active(), vaddr);
+        __put_page(entry, NULL);
+        page = INVALID_ADDRESS;
+    }
+
+    spin_release(&lock);
+
+    if (page != INVALID_ADDRESS)
+        mmu_page_free(page);
+
+    mmu_tlb_batch_flush(&batch);
+
+    return 0;
+}
+
+bool mmu_native_migration_pending(unsigned long vaddr)
+{
+    uint64_t *pte = NULL;
+    bool ret      = false;
+
+    spin_acquire(&lock);
+
+    if ((pte = __get_pte(amd64_p_to_v(amd64_get_cr3()), vaddr)))
+        ret = !!(*pte & PTE_MIGRATE);
+
+    spin_release(&lock);
+
+    return ret;
+}
+
+unsigned long mmu_native_get_ctx(task_t *task)
+{
+    return mmu_tlb_prepare_ctx(task);
 }
 
 void mmu_native_switch_ctx(task_t *task)
@@ -355,5 +1683,5 @@ void mmu_native_switch_ctx(task_t *task)
     if (!task)
         return;
 
-    amd64_set_cr3(task->cr3);
+    amd64_set_cr3(mmu_tlb_prepare_ctx(task));
 }
@@ -7,7 +7,10 @@
 #include <kernel/util.h>
 #include <mm/mmu.h>
 #include <mm/page.h>
+#include <mm/tlb.h>
+#include <mm/vma.h>
 #include <sched/sched.h>
+#include <errno.h>
 
 static void __walk_dir(uint64_t cr3, uint16_t pml4i, uint16_t pdpti, uint16_t pdi, uint16_t pti)
 {
@@ -56,6 +59,7 @@ uint32_t mmu_pf_handler(void *ctx)
     uint64_t cr3   = 0;
     uint32_t error = cpu_state->err_num;
     task_t *task   = sched_get_active();
+    int ret        = 0;
 
     asm volatile ("mov %%cr3, %0" : "=r"(cr3));
     asm volatile ("mov %%cr2, %0" : "=r"(cr2));
@@ -65,42 +69,37 @@ uint32_t mmu_pf_handler(void *ctx)
     unsigned long pdi   = (cr2 >> 21) & 0x1ff;
     unsigned long pti   = (cr2 >> 12) & 0x1ff;
 
-    uint64_t *pml4 = mmu_p_to_v(cr3);
-
-    if (!(pml4[pml4i] & MM_PRESENT))
-        goto error;
-
-    uint64_t *pdpt = mmu_p_to_v(pml4[pml4i] & ~(PAGE_SIZE - 1));
-
-    if (!(pdpt[pdpti] & MM_PRESENT))
-        goto error;
-
-    uint64_t *pd = mmu_p_to_v(pdpt[pdpti] & ~(PAGE_SIZE - 1));
-
-    if (!(pd[pdi] & MM_PRESENT))
-        goto error;
-
-    uint64_t *pt = mmu_p_to_v(pd[pdi] & ~(PAGE_SIZE - 1));
+    /* the page is being moved by compaction, retry once it's done */
+    if (!(error & 0x1) && cr2 < USER_SPACE_END && mmu_native_migration_pending(cr2)) {
+        mmu_tlb_poll();
+        return IRQ_HANDLED;
+    }
 
-    if (!(pt[pti] & MM_PRESENT))
-        goto error;
+    /* the page was swapped out, read it back */
+    if (!(error & 0x1) && cr2 < USER_SPACE_END && (ret = mmu_native_swap_fault(cr2)) != -ENOENT) {
+        if (ret == 0)
+            return IRQ_HANDLED;
 
-    if ((pt[pti] & MM_COW) && !(pt[pti] & MM_READWRITE)) {
-        static spinlock_t lock = 0;
-        spin_acquire(&lock);
+        kprint("Failed to swap in the page: %s\n", kstrerror(-ret));
+    }
 
-        unsigned long copy = mmu_page_alloc(MM_ZONE_NORMAL, 0);
-        uint8_t *copy_v    = mmu_native_p_to_v(copy);
-        int flags          = MM_PRESENT | MM_USER | MM_READWRITE; /* TODO: preserve flags */
+    /* not present user page, let the virtual memory areas of the task decide
+     * whether the access is valid and if so, allocate a zeroed page for it */
+    if (!(error & 0x1) && cr2 < USER_SPACE_END && task) {
+        if ((ret = mmu_vma_fault(task, cr2, !!(error & 0x2))) == 0)
+            return IRQ_HANDLED;
 
-        kmemcpy(copy_v, (void *)ROUND_DOWN(cr2, PAGE_SIZE), PAGE_SIZE);
+        if (ret == -ENOMEM)
+            kprint("Failed to allocate the page: %s\n", kstrerror(-ret));
+    }
 
-        pt[pti] = (unsigned long)copy | flags;
-        spin_release(&lock);
-        return IRQ_HANDLED;
+    /* write to a present page, the page or one of the tables
+     * on the path may be shared with another address space */
+    if ((error & 0x3) == 0x3 && cr2 < USER_SPACE_END) {
+        if (mmu_native_cow_fault(cr2) == 0)
+            return IRQ_HANDLED;
     }
 
-error:
     __print_error(error);
     kprint("\nFaulting address: 0x%08x %10u\n", cr2, cr2);
     kprint("PML4 index:       0x%08x %10u\n"
@@ -0,0 +1,482 @@
+#include <arch/amd64/mm/mmu.h>
+#include <drivers/lapic.h>
+#include <kernel/common.h>
+#include <kernel/compiler.h>
+#include <kernel/cpu.h>
+#include <kernel/idt.h>
+#include <kernel/irq.h>
+#include <kernel/kassert.h>
+#include <kernel/kprint.h>
+#include <kernel/percpu.h>
+#include <kernel/util.h>
+#include <mm/page.h>
+#include <mm/tlb.h>
+#include <mm/vma.h>
+#include <sched/sched.h>
+#include <sched/task.h>
+#include <sync/spinlock.h>
+
+#define TLB_MAILBOX_SIZE 8
+#define PCID_COUNT       4096 /* PCID 0 is never assigned to a task */
+#define PCID_SHIFT       12
+
+#define CPUID_PCID       (1 << 17) /* CPUID.01H:ECX */
+#define CPUID_PGE        (1 << 13) /* CPUID.01H:EDX */
+
+/* defined in arch/amd64/interrupts.S */
+extern void irq_tlb();
+
+/* Pending invalidation requests sent to a CPU by other CPUs
+ *
+ * The sender increments "req_seq" when it adds a request and the receiver
+ * stores the value of "req_seq" it saw to "done_seq" once it has flushed
+ * all requests so the sender knows when its requests have been handled */
+typedef struct mm_tlb_mailbox {
+    spinlock_t lock;
+    bool flush_all;   /* mailbox overflowed, flush everything */
+    size_t nreqs;
+
+    struct {
+        unsigned long cr3;   /* address space of the range, 0 for kernel mappings */
+        task_t *task;        /* owner of the address space */
+        unsigned long start;
+        size_t npages;
+    } reqs[TLB_MAILBOX_SIZE];
+
+    uint64_t req_seq;
+    uint64_t done_seq;
+} mm_tlb_mailbox_t;
+
+typedef struct mm_tlb_stats {
+    size_t ninvlpg;  /* number of pages invalidated using INVLPG */
+    size_t nfull;    /* number of full TLB flushes */
+    size_t nsent;    /* number of shootdown IPIs sent */
+    size_t nrecv;    /* number of shootdown IPIs received */
+    size_t nrollover; /* number of PCID generation changes seen */
+} mm_tlb_stats_t;
+
+static __percpu mm_tlb_mailbox_t mailbox;
+static __percpu mm_tlb_stats_t   stats;
+
+/* PCIDs are handed out from a global counter. When they run out,
+ * a new generation is started and all PCIDs become free again.
+ * A task's PCID is valid only if it's from the current generation
+ * and a CPU must flush its whole TLB before using PCIDs of a new generation */
+static bool       pcid_enabled = false;
+static spinlock_t pcid_lock    = 0;
+static uint64_t   pcid_gen     = 1;
+static uint64_t   pcid_next    = 1;
+
+static __percpu uint64_t cpu_gen; /* generation this CPU has flushed its TLB for */
+
+static void __flush_range(unsigned long start, size_t npages)
+{
+    mm_tlb_stats_t *st = get_thiscpu_ptr(stats);
+
+    if (npages > TLB_FLUSH_THRESHOLD) {
+        amd64_flush_tlb();
+        st->nfull++;
+    } else {
+        for (size_t i = 0; i < npages; ++i)
+            amd64_invld_page(start + i * PAGE_SIZE);
+        st->ninvlpg += npages;
+    }
+
+    put_thiscpu_ptr(st);
+}
+
+/* Flush all entries of current address space or if "global"
+ * is true, every entry of every address space including kernel mappings */
+static void __flush_all(bool global)
+{
+    mm_tlb_stats_t *st = get_thiscpu_ptr(stats);
+
+    if (global)
+        amd64_flush_tlb_all();
+    else
+        amd64_flush_tlb();
+    st->nfull++;
+
+    put_thiscpu_ptr(st);
+}
+
+/* Handle all requests in the mailbox of this CPU
+ *
+ * Requests for an address space this CPU is not running are not flushed.
+ * Instead, the PCID of the task is invalidated so the task gets a new PCID,
+ * which has no TLB entries, when it's run the next time. Without PCIDs,
+ * loading CR3 on context switch flushes the entries anyway.
+ * The CPU is also removed from the CPU mask of that address space
+ * so it won't receive more IPIs for it until it runs the address space again
+ *
+ * Interrupts must be disabled */
+static void __process_mailbox(void)
+{
+    mm_tlb_mailbox_t *mb = get_thiscpu_ptr(mailbox);
+    unsigned long cr3    = amd64_get_cr3();
+    unsigned long cpu    = get_thiscpu_id();
+    uint64_t seq         = 0;
+
+    spin_acquire(&mb->lock);
+
+    seq = mb->req_seq;
+
+    if (mb->flush_all) {
+        __flush_all(true);
+    } else {
+        for (size_t i = 0; i < mb->nreqs; ++i) {
+            task_t *task = mb->reqs[i].task;
+
+            if (mb->reqs[i].cr3 == 0 || mb->reqs[i].cr3 == cr3) {
+                __flush_range(mb->reqs[i].start, mb->reqs[i].npages);
+            } else {
+                WRITE_ONCE(task->asid, 0);
+                __sync_fetch_and_and(&task->cpu_mask, ~(1UL << cpu));
+            }
+        }
+    }
+
+    mb->nreqs     = 0;
+    mb->flush_all = false;
+
+    spin_release(&mb->lock);
+
+    __sync_synchronize();
+    WRITE_ONCE(mb->done_seq, seq);
+
+    put_thiscpu_ptr(mb);
+}
+
+static uint32_t __shootdown_handler(void *ctx)
+{
+    (void)ctx;
+
+    mm_tlb_stats_t *st = get_thiscpu_ptr(stats);
+    st->nrecv++;
+    put_thiscpu_ptr(st);
+
+    __process_mailbox();
+    lapic_ack_interrupt();
+
+    return IRQ_HANDLED;
+}
+
+/* Add the ranges of "batch" to the mailbox of "cpu"
+ *
+ * Return true if an IPI must be sent to "cpu", ie. the mailbox was empty */
+static bool __post(mm_tlb_batch_t *batch, unsigned cpu, unsigned long cr3, task_t *task)
+{
+    mm_tlb_mailbox_t *mb = get_percpu_ptr(mailbox, cpu);
+    bool send            = false;
+
+    spin_acquire(&mb->lock);
+
+    send = (mb->nreqs == 0 && !mb->flush_all);
+
+    if (batch->flush_all || mb->nreqs + batch->nranges > TLB_MAILBOX_SIZE) {
+        mb->flush_all = true;
+    } else {
+        for (size_t i = 0; i < batch->nranges; ++i) {
+            mb->reqs[mb->nreqs].cr3    = cr3;
+            mb->reqs[mb->nreqs].task   = task;
+            mb->reqs[mb->nreqs].start  = batch->ranges[i].start;
+            mb->reqs[mb->nreqs].npages = batch->ranges[i].npages;
+            mb->nreqs++;
+        }
+    }
+
+    mb->req_seq++;
+    spin_release(&mb->lock);
+
+    put_percpu_ptr(mb, cpu);
+    return send;
+}
+
+/* Send the ranges of "batch" to all other CPUs that may have them in their TLBs
+ *
+ * User mappings belong to the address space "cr3" of "task"
+ *
+ * Interrupts must be disabled */
+static void __shootdown(mm_tlb_batch_t *batch, task_t *task, unsigned long cr3)
+{
+    unsigned long self    = get_thiscpu_id();
+    unsigned long online  = 0;
+    unsigned long targets = 0;
+    unsigned ncpus        = lapic_get_init_cpu_count();
+
+    online = (ncpus >= MAX_CPU) ? ~0UL : ((1UL << ncpus) - 1);
+
+    if (batch->kernel) {
+        task    = NULL;
+        cr3     = 0;
+        targets = online;
+    } else {
+        if (task == NULL)
+            return;
+
+        targets = READ_ONCE(task->cpu_mask) & online;
+    }
+
+    if ((targets &= ~(1UL << self)) == 0)
+        return;
+
+    mm_tlb_stats_t *st = get_thiscpu_ptr(stats);
+
+    for (unsigned cpu = 0; cpu < ncpus; ++cpu) {
+        if (!(targets & (1UL << cpu)))
+            continue;
+
+        /* if the mailbox already had requests, an IPI is on its way */
+        if (__post(batch, cpu, cr3, task)) {
+            lapic_send_fixed_ipi(cpu, VECNUM_TLB_SHOOTDOWN);
+            st->nsent++;
+        }
+    }
+
+    put_thiscpu_ptr(st);
+
+    /* Wait until all targets have handled the requests.
+     * Handle the requests sent to this CPU while waiting so that
+     * two CPUs shooting down each other's TLB cannot deadlock */
+    for (unsigned cpu = 0; cpu < ncpus; ++cpu) {
+        if (!(targets & (1UL << cpu)))
+            continue;
+
+        mm_tlb_mailbox_t *mb = get_percpu_ptr(mailbox, cpu);
+
+        while (READ_ONCE(mb->done_seq) < READ_ONCE(mb->req_seq)) {
+            __process_mailbox();
+            cpu_relax();
+        }
+
+        put_percpu_ptr(mb, cpu);
+    }
+}
+
+void mmu_tlb_init(void)
+{
+    idt_set_gate((unsigned long)irq_tlb, 0x08, 0x8e, &IDT[VECNUM_TLB_SHOOTDOWN]);
+    irq_install_handler(VECNUM_TLB_SHOOTDOWN, __shootdown_handler, NULL);
+}
+
+void mmu_tlb_init_cpu(void)
+{
+    uint32_t eax, ebx, ecx, edx;
+    uint64_t cr4 = amd64_get_cr4();
+
+    cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+
+    if (edx & CPUID_PGE)
+        cr4 |= CR4_PGE;
+
+    /* PCIDs are used only with global pages because otherwise
+     * there's no way to flush the entries of all PCIDs at once.
+     * All CPUs must support PCIDs or none of them use them */
+    if ((ecx & CPUID_PCID) && (cr4 & CR4_PGE)) {
+        if (lapic_get_init_cpu_count() <= 1)
+            pcid_enabled = true;
+
+        if (pcid_enabled)
+            cr4 |= CR4_PCIDE;
+    } else {
+        pcid_enabled = false;
+    }
+
+    /* CR3 must not have a PCID when PCIDE is enabled */
+    amd64_set_cr3(amd64_get_cr3());
+    amd64_set_cr4(cr4);
+}
+
+/* Return the PCID of "task" in the current generation
+ * and allocate a new one if the task doesn't have one */
+static uint64_t __get_asid(task_t *task)
+{
+    uint64_t asid = READ_ONCE(task->asid);
+
+    if ((asid >> PCID_SHIFT) == READ_ONCE(pcid_gen))
+        return asid;
+
+    spin_acquire(&pcid_lock);
+
+    if ((task->asid >> PCID_SHIFT) != pcid_gen) {
+        if (pcid_next == PCID_COUNT) {
+            pcid_gen++;
+            pcid_next = 1;
+        }
+
+        task->asid = (pcid_gen << PCID_SHIFT) | pcid_next++;
+    }
+
+    asid = task->asid;
+    spin_release(&pcid_lock);
+
+    return asid;
+}
+
+unsigned long mmu_tlb_prepare_ctx(task_t *task)
+{
+    /* the CPU must be in the mask before it can cache any entries of the address space */
+    __sync_fetch_and_or(&task->cpu_mask, 1UL << get_thiscpu_id());
+
+    if (!pcid_enabled)
+        return task->cr3;
+
+    uint64_t asid = __get_asid(task);
+    uint64_t *gen = get_thiscpu_ptr(cpu_gen);
+
+    /* PCIDs of the new generation may have entries of older tasks in the TLB */
+    if (*gen != (asid >> PCID_SHIFT)) {
+        mm_tlb_stats_t *st = get_thiscpu_ptr(stats);
+
+        amd64_flush_tlb_all();
+        *gen = asid >> PCID_SHIFT;
+
+        st->nfull++;
+        st->nrollover++;
+        put_thiscpu_ptr(st);
+    }
+
+    put_thiscpu_ptr(gen);
+
+    return task->cr3 | (asid & CR3_PCID) | CR3_NOFLUSH;
+}
+
+void mmu_tlb_batch_init(mm_tlb_batch_t *batch)
+{
+    batch->nranges   = 0;
+    batch->npages    = 0;
+    batch->flush_all = false;
+    batch->kernel    = false;
+
+    list_init(&batch->pages);
+}
+
+void mmu_tlb_batch_add(mm_tlb_batch_t *batch, unsigned long vaddr, size_t npages)
+{
+    kassert(batch != NULL);
+
+    batch->npages += npages;
+
+    if (vaddr >= USER_SPACE_END)
+        batch->kernel = true;
+
+    if (batch->flush_all)
+        return;
+
+    if (batch->nranges > 0) {
+        size_t last = batch->nranges - 1;
+
+        if (batch->ranges[last].start + batch->ranges[last].npages * PAGE_SIZE == vaddr) {
+            batch->ranges[last].npages += npages;
+            goto end;
+        }
+    }
+
+    if (batch->nranges == TLB_BATCH_MAX) {
+        batch->flush_all = true;
+        return;
+    }
+
+    batch->ranges[batch->nranges].start  = vaddr;
+    batch->ranges[batch->nranges].npages = npages;
+    batch->nranges++;
+
+end:
+    if (batch->npages > TLB_FLUSH_THRESHOLD)
+        batch->flush_all = true;
+}
+
+void mmu_tlb_batch_add_all(mm_tlb_batch_t *batch)
+{
+    kassert(batch != NULL);
+
+    batch->flush_all = true;
+    batch->npages++;
+}
+
+void mmu_tlb_batch_add_page(mm_tlb_batch_t *batch, page_t *page)
+{
+    kassert(batch != NULL && page != NULL);
+
+    list_append(&batch->pages, &page->list);
+}
+
+void mmu_tlb_batch_flush(mm_tlb_batch_t *batch)
+{
+    kassert(batch != NULL);
+
+    if (batch->npages > 0) {
+        uint64_t flags = irq_save();
+
+        if (batch->flush_all) {
+            __flush_all(batch->kernel);
+        } else {
+            for (size_t i = 0; i < batch->nranges; ++i)
+                __flush_range(batch->ranges[i].start, batch->ranges[i].npages);
+        }
+
+        __shootdown(batch, sched_get_active(), amd64_get_cr3());
+        irq_restore(flags);
+    }
+
+    /* no CPU can access the pages anymore */
+    while (!LIST_EMPTY(batch->pages)) {
+        page_t *page = container_of(batch->pages.next, page_t, list);
+
+        list_remove(&page->list);
+        (void)mmu_page_unref(mmu_page_addr(page));
+    }
+
+    mmu_tlb_batch_init(batch);
+}
+
+void mmu_tlb_flush_page(unsigned long vaddr)
+{
+    mm_tlb_batch_t batch;
+
+    mmu_tlb_batch_init(&batch);
+    mmu_tlb_batch_add(&batch, vaddr, 1);
+    mmu_tlb_batch_flush(&batch);
+}
+
+void mmu_tlb_flush_task(task_t *task)
+{
+    kassert(task != NULL);
+
+    mm_tlb_batch_t batch;
+    uint64_t flags = 0;
+
+    mmu_tlb_batch_init(&batch);
+    mmu_tlb_batch_add_all(&batch);
+
+    /* this CPU may have entries of "task" tagged with its PCID
+     * even if it's running some other address space right now */
+    flags = irq_save();
+    __flush_all(true);
+    __shootdown(&batch, task, task->cr3);
+    irq_restore(flags);
+}
+
+void mmu_tlb_poll(void)
+{
+    uint64_t flags = irq_save();
+
+    __process_mailbox();
+    irq_restore(flags);
+}
+
+void mmu_tlb_print_stats(void)
+{
+    kprint("TLB flushes (PCIDs %s, generation %u):\n",
+            pcid_enabled ? "enabled" : "disabled", pcid_gen);
+    kprint("\t  cpu   invlpg     full     sent     recv rollover\n");
+
+    for (size_t i = 0; i < lapic_get_cpu_count(); ++i) {
+        mm_tlb_stats_t *st = get_percpu_ptr(stats, i);
+
+        kprint("\t%5u %8u %8u %8u %8u %8u\n", i,
+                st->ninvlpg, st->nfull, st->nsent, st->nrecv, st->nrollover);
+
+        put_percpu_ptr(st, i);
+    }
+}
@@ -10,6 +10,8 @@
 #include <mm/mmu.h>
 #include <mm/page.h>
 #include <mm/heap.h>
+#include <sync/spinlock.h>
+#include <errno.h>
 
 typedef struct ahci_port_regs {
     uint32_t p_clb;
@@ -95,6 +97,14 @@ typedef struct ahci_cmd_tbl_entry {
     struct ahci_prdt_entry prdt[];
 } __packed ahci_cmd_tbl_entry_t;
 
+/* The first SATA disk found is the only disk that can be accessed
+ * Commands are issued using the first command slot and polled for completion */
+static struct {
+    ahci_port_regs_t *port;
+    uint64_t nsect;
+    spinlock_t lock;
+} disk;
+
 static uint32_t __irq_handler(void *ctx)
 {
     (void)ctx;
@@ -109,7 +119,14 @@ static int __destroy(void *arg)
     return 0;
 }
 
-static void __sata_access(int write, struct ahci_port_regs *port, void *buf, uint32_t nsect, uint64_t lba)
+/* Issue ATA command "cmd" on "port" and wait until it's completed
+ *
+ * "buf" must be physically contiguous and it's written to the disk if "write"
+ * is true and read from the disk otherwise
+ *
+ * Return 0 on success
+ * Return -EIO if the device reported an error */
+static int __sata_cmd(struct ahci_port_regs *port, uint8_t cmd, int write, void *buf, uint32_t nsect, uint64_t lba)
 {
     port->p_is = -1;
 
@@ -124,7 +141,7 @@ static void __sata_access(int write, struct ahci_port_regs *port, void *buf, uin
     size_t bytes_left = byte_cnt;
     size_t prd_cnt    = (byte_cnt + 8191) / 8192;
 
-    cmd_hdr->attr  = sizeof(ahci_fis_reg_h2d_t) / sizeof(uint32_t);
+    cmd_hdr->attr  = sizeof(ahci_fis_reg_h2d_t) / sizeof(uint32_t) | (write ? (1 << 6) : 0);
     cmd_hdr->prdtl = prd_cnt;
     cmd_hdr->prdbc = 0;
 
@@ -137,7 +154,7 @@ static void __sata_access(int write, struct ahci_port_regs *port, void *buf, uin
 
         cmd_tbl->prdt[i].dba  = prd_buf & 0xffffffff;
         cmd_tbl->prdt[i].dbau = prd_buf >> 32;
-        cmd_tbl->prdt[i].dbc  = ((prd_size - 1) << 1) | 1;
+        cmd_tbl->prdt[i].dbc  = prd_size - 1;
 
         if (i == prd_cnt - 1)
             cmd_tbl->prdt[i].dbc |= 1 << 31;
@@ -146,10 +163,10 @@ static void __sata_access(int write, struct ahci_port_regs *port, void *buf, uin
     }
 
     ahci_fis_reg_h2d_t *fis_reg_h2d = &cmd_tbl->fis_reg_h2d;
-    kmemset(fis_reg_h2d, 0, sizeof(fis_reg_h2d));
+    kmemset(fis_reg_h2d, 0, sizeof(*fis_reg_h2d));
 
     fis_reg_h2d->type     = FIS_TYPE_H2D;
-    fis_reg_h2d->cmd      = write ? ATA_CMD_DMA_WRITE_EXT : ATA_CMD_DMA_READ_EXT;
+    fis_reg_h2d->cmd      = cmd;
     fis_reg_h2d->cmd_port = 1 << 7;
     fis_reg_h2d->lba0     = lba & 0xff;
     fis_reg_h2d->lba1     = (lba >> 8) & 0xff;
@@ -166,20 +183,55 @@ static void __sata_access(int write, struct ahci_port_regs *port, void *buf, uin
 
     port->p_ci |= 0x1;
 
-    for (;;) {
-        if (!(port->p_ci & 0x1))
-            break;
+    while (port->p_ci & 0x1) {
+        if (port->p_is & AHCI_PORT_TFES)
+            return -EIO;
     }
+
+    if ((port->p_is & AHCI_PORT_TFES) || (port->p_tfd & (ATA_SR_ERR | ATA_SR_DF)))
+        return -EIO;
+
+    return 0;
 }
 
-static void __sata_write(struct ahci_port_regs *port, void *buf, uint32_t nsect, uint64_t lba)
+/* Return the number of sectors of the disk behind "port" using IDENTIFY DEVICE
+ * Return 0 if the disk can't be identified */
+static uint64_t __sata_identify(struct ahci_port_regs *port)
 {
-    return __sata_access(1, port, buf, nsect, lba);
+    unsigned long page = mmu_page_alloc(MM_ZONE_NORMAL, 0);
+    uint8_t *ident     = mmu_p_to_v(page);
+    uint64_t nsect     = 0;
+
+    if (__sata_cmd(port, ATA_CMD_IDENTIFY, 0, ident, 1, 0) == 0)
+        nsect = *(uint64_t *)(ident + ATA_IDENT_MAX_LBAEXT) & 0xffffffffffff;
+
+    mmu_page_free(page);
+    return nsect;
 }
 
-static void __sata_read(struct ahci_port_regs *port, void *buf, uint32_t nsect, uint64_t lba)
+/* Read or write "nsect" sectors of the disk starting at "lba" */
+static int __disk_access(int write, uint64_t lba, void *buf, uint32_t nsect)
 {
-    return __sata_access(0, port, buf, nsect, lba);
+    uint64_t flags = 0;
+    int ret        = 0;
+
+    if (!disk.port)
+        return -ENODEV;
+
+    if (nsect == 0 || nsect > AHCI_MAX_SECTORS || lba + nsect > disk.nsect)
+        return -EINVAL;
+
+    /* commands are polled so they must not be preempted while holding the port */
+    flags = irq_save();
+    spin_acquire(&disk.lock);
+
+    ret = __sata_cmd(disk.port, write ? ATA_CMD_DMA_WRITE_EXT : ATA_CMD_DMA_READ_EXT,
+                     write, buf, nsect, lba);
+
+    spin_release(&disk.lock);
+    irq_restore(flags);
+
+    return ret;
 }
 
 static inline void __sata_port_stop(struct ahci_port_regs *port)
@@ -198,8 +250,10 @@ static inline void __sata_port_start(struct ahci_port_regs *port)
     port->p_cmd |= AHCI_PORT_CMD_FRE | AHCI_PORT_CMD_ST;
 }
 
-static int *__init_sata_port(device_t *dev, struct ahci_port_regs *port)
+static void __init_sata_port(device_t *dev, struct ahci_port_regs *port)
 {
+    (void)dev;
+
     kprint("ahci - initialize sata port\n");
 
     /* the ahci device must be stopped before modifying lb/fb */
@@ -210,8 +264,8 @@ static int *__init_sata_port(device_t *dev, struct ahci_port_regs *port)
     port->p_clb  = page & 0xffffffff;
     port->p_clbu = page >> 32;
 
-    port->p_fb = (page + 0x400) & 0xffffffff;
-    port->p_fb = (page + 0x400) >> 32;
+    port->p_fb  = (page + 0x400) & 0xffffffff;
+    port->p_fbu = (page + 0x400) >> 32;
 
     unsigned long block = mmu_block_alloc(1, MM_ZONE_NORMAL, 0);
     kmemset(mmu_p_to_v(block), 0, PAGE_SIZE * 2);
@@ -227,9 +281,17 @@ static int *__init_sata_port(device_t *dev, struct ahci_port_regs *port)
 
     /* TODO: create entry to devfs */
 
-    /* start the device and enable interrupts */
+    /* Start the device. Commands are polled so the port doesn't interrupt */
     __sata_port_start(port);
-    port->p_ie |= (1 << 0);
+    port->p_ie = 0;
+
+    if (disk.port)
+        return;
+
+    if ((disk.nsect = __sata_identify(port)) != 0) {
+        disk.port = port;
+        kprint("ahci - disk has %u sectors\n", disk.nsect);
+    }
 }
 
 static int __init(void *arg)
@@ -239,9 +301,9 @@ static int __init(void *arg)
     device_t *dev   = arg;
     pci_dev_t *pdev = dev->ctx;
 
-    mmu_map_page(pdev->bar5, (unsigned long)pdev->bar5, MM_PRESENT | MM_READWRITE);
-
-    ahci_registers_t *regs = (ahci_registers_t *)(intptr_t)pdev->bar5;
+    /* The registers are accessed through the direct map so that the disk
+     * can be used in any address space, eg. by the swap code */
+    ahci_registers_t *regs = mmu_p_to_v(pdev->bar5);
     int ports              = regs->pi;
 
     for (int i = 0; i < AHCI_MAX_PORTS; ++i, ports >>= 1) {
@@ -265,6 +327,21 @@ static int __init(void *arg)
     return 0;
 }
 
+uint64_t ahci_disk_size(void)
+{
+    return disk.port ? disk.nsect : 0;
+}
+
+int ahci_disk_read(uint64_t lba, void *buf, uint32_t nsect)
+{
+    return __disk_access(0, lba, buf, nsect);
+}
+
+int ahci_disk_write(uint64_t lba, void *buf, uint32_t nsect)
+{
+    return __disk_access(1, lba, buf, nsect);
+}
+
 int ahci_init(void)
 {
     kprint("ahci - initializing ahci subsystem\n");
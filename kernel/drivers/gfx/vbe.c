@@ -5,6 +5,7 @@
 #include <mm/mmu.h>
 #include <mm/page.h>
 #include <mm/types.h>
+#include <mm/vmalloc.h>
 #include <kernel/io.h>
 #include <kernel/kprint.h>
 #include <kernel/util.h>
@@ -131,8 +132,8 @@ static void vbe_get_font(void)
 
 void vbe_init(void)
 {
-    line_buffer[0] = mmu_p_to_v(mmu_block_alloc(MM_ZONE_NORMAL, 2, 0));
-    line_buffer[1] = mmu_p_to_v(mmu_block_alloc(MM_ZONE_NORMAL, 2, 0));
+    line_buffer[0] = vmalloc(4 * PAGE_SIZE);
+    line_buffer[1] = vmalloc(4 * PAGE_SIZE);
 
     vbe_get_font();
 
@@ -150,14 +151,9 @@ void vbe_init(void)
     pci_dev_t *dev = pci_get_dev(VBE_VENDOR_ID, VBE_DEVICE_ID);
 
     if (dev) {
+        /* the frame buffer is below 4GB so it's covered by the direct map */
         lfb     = true;
-        vga_mem = (uint8_t *)((unsigned long)dev->bar0 - 8);
-        mmu_map_range(
-            (unsigned long)vga_mem,
-            (unsigned long)vga_mem,
-            4096, /* 4096 * 4096 == 16 MB */
-            MM_PRESENT | MM_READWRITE
-        );
+        vga_mem = mmu_p_to_v((unsigned long)dev->bar0 - 8);
     }
 
     /* set all video memory to 0xff (black color) */
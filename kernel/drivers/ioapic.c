@@ -63,7 +63,6 @@ void ioapic_initialize_all(void)
         kprint("ioapic - initializing I/O APIC %d\n", io_apic.apics[i].id);
 
         uint8_t *ioapic_v = (uint8_t *)io_apic.apics[i].base;
-        mmu_map_page((unsigned long)ioapic_v, (unsigned long)ioapic_v, MM_PRESENT | MM_READWRITE);
 
         uint32_t id  = __read_reg(ioapic_v, IOAPIC_REG_ID);
         uint32_t ver = __read_reg(ioapic_v, IOAPIC_REG_VER);
@@ -85,7 +84,7 @@ void ioapic_register_dev(uint8_t ioapic_id, uint32_t ioapic_addr, uint32_t intr_
     kassert(ioapic_id < MAX_IOAPIC);
 
     io_apic.apics[ioapic_id].id        = ioapic_id;
-    io_apic.apics[ioapic_id].base      = (uint8_t *)(unsigned long)ioapic_addr;
+    io_apic.apics[ioapic_id].base      = mmu_p_to_v(ioapic_addr);
     io_apic.apics[ioapic_id].intr_base = intr_base;
 
     io_apic.num_apics++;
@@ -95,7 +94,6 @@ void ioapic_enable_irq(unsigned cpu, unsigned irq)
 {
     unsigned offset   = IOAPIC_REG_TABLE + 2 * (irq - VECNUM_IRQ_START);
     uint8_t *ioapic_v = (uint8_t *)io_apic.apics[cpu].base;
-    mmu_map_page((unsigned long)ioapic_v, (unsigned long)ioapic_v, MM_PRESENT | MM_READWRITE);
 
     __write_reg(ioapic_v, offset + 0, irq);
     __write_reg(ioapic_v, offset + 1, cpu << 24);
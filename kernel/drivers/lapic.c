@@ -1,13 +1,16 @@
 #include <drivers/lapic.h>
 #include <drivers/pit.h>
 #include <kernel/acpi/acpi.h>
+#include <kernel/clock.h>
 #include <kernel/common.h>
+#include <kernel/cpu.h>
 #include <kernel/idt.h>
 #include <kernel/io.h>
 #include <kernel/irq.h>
 #include <kernel/kassert.h>
 #include <kernel/tick.h>
 #include <mm/mmu.h>
+#include <mm/numa.h>
 #include <mm/types.h>
 #include <sched/sched.h>
 #include <errno.h>
@@ -85,6 +88,7 @@
 static struct {
     unsigned cpu_id;
     unsigned lapic_id;
+    unsigned node;     /* home NUMA node of the CPU */
 } lapics[MAX_CPU];
 
 static uint8_t *lapic_base     = NULL;
@@ -95,6 +99,7 @@ static void __configure_timer(void)
 {
     uint16_t ticks;
     uint32_t end;
+    uint64_t tsc_start, tsc_end;
 
     write_32(lapic_base + LAPIC_REG_CFG, 0x0b);
     write_32(lapic_base + LAPIC_REG_ICR, 0xffffffff);
@@ -109,21 +114,27 @@ static void __configure_timer(void)
         outb(PIT_CMD, 0xe8);
     } while ((inb(PIT_DATA_2) & 0x80) == 0x80);
 
-    /* sleep 50ms */
+    /* sleep 50ms, the time stamp counter is calibrated using the same window */
+    tsc_start = rdtsc();
+
     do {
         outb(PIT_CMD, 0x80);
         ticks  =  inb(PIT_DATA_2);
         ticks |= (inb(PIT_DATA_2) << 8);
     } while (ticks > (2 * 65535 - 119318 + 10));
 
-    end = read_32(lapic_base + LAPIC_REG_CCR);
+    end     = read_32(lapic_base + LAPIC_REG_CCR);
+    tsc_end = rdtsc();
     outb(PIT_CHNL_2, inb(PIT_CHNL_2) & ~0x01);
 
-    write_32(lapic_base + LAPIC_REG_TIMER, LAPIC_TMR_PERIODIC | VECNUM_TIMER);
+    /* The timer is armed for each event separately so that
+     * the tick can be stopped when the CPU has nothing to switch to */
+    write_32(lapic_base + LAPIC_REG_TIMER, LAPIC_TMR_ONESHOT | VECNUM_TIMER);
     write_32(lapic_base + LAPIC_REG_CFG, 0x0b);
     write_32(lapic_base + LAPIC_REG_ICR, ((0xffffffff - end) * 20) / 1000);
 
     tick_init((0xffffffff - end) * 20, 1000);
+    clock_init((tsc_end - tsc_start) * 20);
 }
 
 static uint32_t __svr_handler(void *ctx)
@@ -138,7 +149,7 @@ static uint32_t __svr_handler(void *ctx)
 static uint32_t __tmr_handler(void *ctx)
 {
     lapic_ack_interrupt();
-    tick_inc();
+    tick_update();
 
     /* Update the running time of currently running process.
      *
@@ -160,9 +171,10 @@ void lapic_initialize(void)
         set_msr(IA32_APIC_BASE, msr);
     }
 
-    /* Because the Local APIC is above 2GB, we must explicitly map it to address space  */
-    lapic_base = (uint8_t *)lapic_addr;
-    mmu_map_page(lapic_addr, (unsigned long)lapic_base, MM_PRESENT | MM_READWRITE);
+    /* The registers are accessed through the direct map which is shared
+     * by all address spaces. A mapping in the lower half would go through
+     * the tables that are shared copy-on-write after a fork */
+    lapic_base = mmu_p_to_v(lapic_addr);
 
     write_32(lapic_base + LAPIC_REG_DFR, 0xffffffff);
     write_32(lapic_base + LAPIC_REG_TPR, 0);
@@ -192,6 +204,7 @@ void lapic_register_dev(int cpu_id, int lapic_id)
 
     lapics[cpu_id].cpu_id    = cpu_id;
     lapics[cpu_id].lapic_id = lapic_id;
+    lapics[cpu_id].node     = mmu_numa_lapic_node(lapic_id);
 
     cpu_count++;
 }
@@ -214,8 +227,20 @@ int lapic_get_lapic_id(unsigned cpu)
     return lapics[cpu].lapic_id;
 }
 
+int lapic_get_node(unsigned cpu)
+{
+    if (cpu >= cpu_count)
+        return -ENXIO;
+
+    return lapics[cpu].node;
+}
+
 void lapic_send_ipi(uint32_t high, uint32_t low)
 {
+    /* wait until the previous IPI has been delivered */
+    while (read_32(lapic_base + LAPIC_REG_ICR_LO) & LAPIC_DS_PEND)
+        ;
+
     write_32(lapic_base + LAPIC_REG_ICR_HI, high);
     write_32(lapic_base + LAPIC_REG_ICR_LO, low);
 }
@@ -236,11 +261,32 @@ void lapic_send_sipi(unsigned cpu, unsigned vec)
     lapic_send_ipi(high, low);
 }
 
+void lapic_send_fixed_ipi(unsigned cpu, unsigned vec)
+{
+    uint32_t high = (lapics[cpu].lapic_id << 24) & 0xff000000;
+    uint32_t low  = (vec & 0xff) | LAPIC_DM_FIXED | LAPIC_TM_EDGE | LAPIC_LVL_ASSERT;
+
+    lapic_send_ipi(high, low);
+}
+
 void lapic_ack_interrupt(void)
 {
     write_32(lapic_base + LAPIC_REG_EOI, 0);
 }
 
+void lapic_timer_arm(uint32_t count)
+{
+    write_32(lapic_base + LAPIC_REG_ICR, count);
+}
+
+uint32_t lapic_timer_elapsed(void)
+{
+    if (!lapic_base)
+        return 0;
+
+    return read_32(lapic_base + LAPIC_REG_ICR) - read_32(lapic_base + LAPIC_REG_CCR);
+}
+
 unsigned long lapic_get_base(void)
 {
     if (!lapic_base)
@@ -5,8 +5,12 @@
 #include <kernel/util.h>
 #include <mm/mmu.h>
 #include <mm/page.h>
+#include <mm/swap.h>
+#include <mm/vma.h>
+#include <mm/vmalloc.h>
 #include <sched/sched.h>
 #include <stdbool.h>
+#include <errno.h>
 
 #ifdef __amd64__
 #define USER_STACK_START 0xc0000000
@@ -35,7 +39,97 @@ static bool __check_common_elf_header(Elf32_Ehdr *header)
     return true;
 }
 
-static bool __loader_32(void *addr, int argc, char **argv)
+/* Create a virtual memory area for a loadable segment and copy the file-backed
+ * part of it to memory. Pages that contain only bss are left unmapped and they're
+ * allocated and zeroed on demand by the page fault handler
+ *
+ * Return true on success and false on error */
+static bool __load_segment(void *file, unsigned long vaddr, size_t memsz,
+                           size_t filesz, unsigned long offset, uint32_t p_flags)
+{
+    unsigned long v_start = ROUND_DOWN(vaddr, PAGE_SIZE);
+    unsigned long v_end   = ROUND_UP(vaddr + memsz, PAGE_SIZE);
+    unsigned long f_end   = vaddr + filesz;
+    unsigned vm_flags     = 0;
+    int mm_flags          = MM_PRESENT | MM_USER;
+    bool huge             = true;
+
+    if (memsz == 0)
+        return true;
+
+    if (filesz > memsz) {
+        kdebug("Segment file size is larger than its memory size!");
+        return false;
+    }
+
+    if (p_flags & PF_R) vm_flags |= VM_READ;
+    if (p_flags & PF_W) vm_flags |= VM_WRITE;
+    if (p_flags & PF_X) vm_flags |= VM_EXEC;
+
+    if (p_flags & PF_W)
+        mm_flags |= MM_READWRITE;
+
+    if (!mmu_vma_create(sched_get_active(), v_start, v_end, vm_flags)) {
+        kdebug("Failed to create area for segment: %s", kstrerror(errno));
+        return false;
+    }
+
+    /* copy the data through the direct map so read-only segments can be written
+     * Aligned 2MB parts of large segments are mapped using 2MB pages if possible */
+    for (unsigned long v = v_start, size = PAGE_SIZE; v < f_end; v += size) {
+        unsigned long page = INVALID_ADDRESS;
+        uint8_t *page_v    = NULL;
+
+        size = PAGE_SIZE;
+
+        if (huge && !(v & (HUGE_PAGE_SIZE - 1)) && v + HUGE_PAGE_SIZE <= ROUND_UP(f_end, PAGE_SIZE))
+            page = mmu_block_alloc(MM_ZONE_HIGH, HUGE_PAGE_ORDER, MM_TRY);
+
+        if (page != INVALID_ADDRESS)
+            size = HUGE_PAGE_SIZE;
+        else if ((page = mmu_page_alloc(MM_ZONE_HIGH, 0)) == INVALID_ADDRESS)
+            return false;
+
+        page_v = mmu_p_to_v(page);
+        kmemset(page_v, 0, size);
+
+        unsigned long copy_start = MAX(v, vaddr);
+        unsigned long copy_end   = MIN(v + size, f_end);
+
+        kmemcpy(page_v + (copy_start - v),
+                (uint8_t *)file + offset + (copy_start - vaddr),
+                copy_end - copy_start);
+
+        if (size == PAGE_SIZE) {
+            mmu_map_page(page, v, mm_flags);
+            mmu_lru_add(page, sched_get_active(), v);
+            huge = true;
+        } else if (mmu_map_huge_page(page, v, mm_flags) != 0) {
+            /* the first page is shared with the previous segment, retry using 4KB pages */
+            mmu_block_free(page, HUGE_PAGE_ORDER);
+            huge = false;
+            size = 0;
+        }
+    }
+
+    return true;
+}
+
+/* Create the stack area for current task. Only the topmost page
+ * is reserved here and the stack grows down on demand */
+static bool __create_stack(void)
+{
+    unsigned flags = VM_READ | VM_WRITE | VM_GROWSDOWN;
+
+    if (!mmu_vma_create(sched_get_active(), USER_STACK_START - PAGE_SIZE, USER_STACK_START, flags)) {
+        kdebug("Failed to create stack area: %s", kstrerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+static bool __loader_32(void *addr, unsigned long *entry)
 {
     Elf32_Ehdr *ehdr = (Elf32_Ehdr *)addr;
     Elf32_Phdr *phdr = (Elf32_Phdr *)((uint8_t *)ehdr + ehdr->e_phoff);
@@ -50,44 +144,25 @@ static bool __loader_32(void *addr, int argc, char **argv)
         return false;
     }
 
-    if (phdr->p_type == PT_LOAD) {
-        int mm_flags = MM_PRESENT | MM_USER;
-
-        if ((phdr->p_flags & PF_W) == 0)
-            mm_flags |= MM_READONLY;
+    /* release the areas and the pages of the old image before creating new ones */
+    mmu_vma_unmap_all(sched_get_active());
 
-        unsigned long v_start = ROUND_DOWN(phdr->p_vaddr, PAGE_SIZE);
-        size_t nleft          = phdr->p_filesz;
-        void *fptr            = (uint8_t *)phdr + phdr->p_offset + ehdr->e_phentsize;
-        size_t nwritten       = 0;
+    for (size_t i = 0; i < ehdr->e_phnum; ++i) {
+        phdr = (Elf32_Phdr *)((uint8_t *)ehdr + ehdr->e_phoff + i * ehdr->e_phentsize);
 
-        while (nwritten < nleft) {
-            unsigned long page = mmu_page_alloc(MM_ZONE_NORMAL, 0);
-            mmu_map_page(page, v_start, mm_flags);
+        if (phdr->p_type != PT_LOAD)
+            continue;
 
-            size_t read_size = MIN(PAGE_SIZE, nleft);
-            kmemcpy((void *)(unsigned long)ehdr->e_entry, fptr, read_size);
-
-            nwritten += read_size;
-            v_start   = v_start + read_size;
-        }
+        if (!__load_segment(addr, phdr->p_vaddr, phdr->p_memsz,
+                            phdr->p_filesz, phdr->p_offset, phdr->p_flags))
+            return false;
     }
 
-    /* allocate user stack and copy argc + argv there */
-    uint32_t mm_flags = MM_PRESENT | MM_READWRITE | MM_USER;
-    mmu_map_page(mmu_page_alloc(MM_ZONE_NORMAL, 0), USER_STACK_START - PAGE_SIZE, mm_flags);
-
-    /* TODO: where is argv mapped? */
-    /* TODO: add argc + argv to stack */
-    (void)argc, (void)argv;
-
-    sched_enter_userland(
-        (void *)(unsigned long)ehdr->e_entry,
-        (void *)(unsigned long)USER_STACK_START - 4
-    );
+    *entry = ehdr->e_entry;
+    return __create_stack();
 }
 
-static bool __loader_64(void *addr, int argc, char **argv)
+static bool __loader_64(void *addr, unsigned long *entry)
 {
     Elf64_Ehdr *ehdr = (Elf64_Ehdr *)addr;
     Elf64_Phdr *phdr = (Elf64_Phdr *)((uint8_t *)ehdr + ehdr->e_phoff);
@@ -102,67 +177,64 @@ static bool __loader_64(void *addr, int argc, char **argv)
         return false;
     }
 
-    if (phdr->p_type == PT_LOAD) {
-        int mm_flags = MM_PRESENT | MM_USER;
+    /* release the areas and the pages of the old image before creating new ones */
+    mmu_vma_unmap_all(sched_get_active());
 
-        if ((phdr->p_flags & PF_W) == 0)
-            mm_flags |= MM_READONLY;
+    for (size_t i = 0; i < ehdr->e_phnum; ++i) {
+        phdr = (Elf64_Phdr *)((uint8_t *)ehdr + ehdr->e_phoff + i * ehdr->e_phentsize);
 
-        unsigned long v_start = ROUND_DOWN(phdr->p_vaddr, PAGE_SIZE);
-        size_t nleft          = phdr->p_filesz;
-        void *fptr            = (uint8_t *)phdr + phdr->p_offset + ehdr->e_phentsize;
-        size_t nwritten       = 0;
+        if (phdr->p_type != PT_LOAD)
+            continue;
 
-        while (nwritten < nleft) {
-            unsigned long page = mmu_page_alloc(MM_ZONE_NORMAL, 0);
-            mmu_map_page(page, v_start, mm_flags);
-
-            size_t read_size = MIN(PAGE_SIZE, nleft);
-            kmemcpy((void *)(unsigned long)ehdr->e_entry, fptr, read_size);
-
-            nwritten += read_size;
-            v_start   = v_start + read_size;
-        }
+        if (!__load_segment(addr, phdr->p_vaddr, phdr->p_memsz,
+                            phdr->p_filesz, phdr->p_offset, phdr->p_flags))
+            return false;
     }
 
-    /* allocate user stack and copy argc + argv there */
-    uint32_t mm_flags = MM_PRESENT | MM_READWRITE | MM_USER;
-    mmu_map_page(mmu_page_alloc(MM_ZONE_NORMAL, 0), USER_STACK_START - PAGE_SIZE, mm_flags);
-
-    /* TODO: where is argv mapped? */
-    /* TODO: add argc + argv to stack */
-    (void)argc, (void)argv;
-
-    sched_enter_userland(
-        (void *)(unsigned long)ehdr->e_entry,
-        (void *)(unsigned long)USER_STACK_START - 8
-    );
+    *entry = ehdr->e_entry;
+    return __create_stack();
 }
 
 /* This is the ELF loader stub, it will just check whether the the
  * file in question is 32 or 64-bit and call the appropriate handler */
 bool binfmt_elf_loader(file_t *file, int argc, char **argv)
 {
-    (void)argc, (void)argv;
-
-    /* kdebug("in binfmt_elf_loader..."); */
-
-    unsigned long mem = (unsigned long)mmu_p_to_v(mmu_page_alloc(MM_ZONE_NORMAL, 0));
-    size_t fsize      = file->f_dentry->d_inode->i_size;
-    size_t pages      = (fsize / PAGE_SIZE) + 1;
-    void *addr        = (void *)mem;
+    size_t fsize        = file->f_dentry->d_inode->i_size;
+    unsigned long entry = 0;
+    unsigned long sp    = 0;
+    bool ret            = false;
+    void *addr          = NULL;
+
+    if ((addr = vmalloc(fsize)) == NULL) {
+        kdebug("Failed to allocate memory for the file!");
+        return false;
+    }
 
     if (file_read(file, 0, fsize, addr) < 0) {
         kdebug("Failed to read data from file!");
+        vfree(addr);
         return false;
     }
 
     Elf32_Ehdr *ehdr = (Elf32_Ehdr *)addr;
 
-    if (ehdr->e_ident[EI_CLASS] == ELFCLASS32)
-        return __loader_32(addr, argc, argv);
-    else if (ehdr->e_ident[EI_CLASS] == ELFCLASS64)
-        return __loader_64(addr, argc, argv);
+    if (ehdr->e_ident[EI_CLASS] == ELFCLASS32) {
+        ret = __loader_32(addr, &entry);
+        sp  = USER_STACK_START - 4;
+    } else if (ehdr->e_ident[EI_CLASS] == ELFCLASS64) {
+        ret = __loader_64(addr, &entry);
+        sp  = USER_STACK_START - 8;
+    }
+
+    vfree(addr);
 
-    return false;
+    if (!ret)
+        return false;
+
+    /* TODO: where is argv mapped? */
+    /* TODO: add argc + argv to stack */
+    (void)argc, (void)argv;
+
+    sched_enter_userland((void *)entry, (void *)sp);
+    return true;
 }
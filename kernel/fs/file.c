@@ -1,7 +1,15 @@
+#include <fs/dentry.h>
 #include <fs/file.h>
 #include <fs/fs.h>
+#include <fs/inode.h>
 #include <kernel/kpanic.h>
+#include <kernel/util.h>
+#include <mm/heap.h>
+#include <mm/mmu.h>
+#include <mm/page.h>
 #include <mm/slab.h>
+#include <sched/sched.h>
+#include <sched/task.h>
 #include <errno.h>
 
 static mm_cache_t *file_cache     = NULL;
@@ -102,6 +110,40 @@ void file_close(file_t *file)
     file->f_ops->close(file);
 }
 
+file_t *file_fget(int fd)
+{
+    task_t *current = sched_get_active();
+    file_t *file    = NULL;
+
+    if (!current || !current->file_ctx || !current->file_ctx->fd) {
+        errno = EBADF;
+        return NULL;
+    }
+
+    spin_acquire(&current->file_ctx->lock);
+
+    if (fd >= 0 && fd < current->file_ctx->numfd && (file = current->file_ctx->fd[fd]))
+        __sync_add_and_fetch(&file->f_count, 1);
+
+    spin_release(&current->file_ctx->lock);
+
+    if (!file)
+        errno = EBADF;
+
+    return file;
+}
+
+int file_fput(file_t *file)
+{
+    if (!file)
+        return -EINVAL;
+
+    if (__sync_sub_and_fetch(&file->f_count, 1) == 0)
+        file_close(file);
+
+    return 0;
+}
+
 int file_seek(file_t *file, off_t off)
 {
     if (!file)
@@ -134,3 +176,144 @@ ssize_t file_write(file_t *file, off_t offset, size_t size, void *buffer)
 
     return file->f_ops->write(file, offset, size, buffer);
 }
+
+ssize_t file_pread(file_t *file, off_t offset, size_t size, void *buffer)
+{
+    if (!file)
+        return -EINVAL;
+
+    off_t pos    = file->f_pos;
+    file->f_pos  = 0;
+    ssize_t ret  = file_read(file, offset, size, buffer);
+    file->f_pos  = pos;
+
+    return ret;
+}
+
+ssize_t file_pwrite(file_t *file, off_t offset, size_t size, void *buffer)
+{
+    if (!file)
+        return -EINVAL;
+
+    off_t pos    = file->f_pos;
+    file->f_pos  = 0;
+    ssize_t ret  = file_write(file, offset, size, buffer);
+    file->f_pos  = pos;
+
+    return ret;
+}
+
+/* Return pointer to the page cache slot of page "index" of "ino"
+ * The slot array is allocated on first use and grown if the file has grown
+ *
+ * ino->i_lock must be held by the caller
+ *
+ * Return NULL if allocating the slots failed */
+static unsigned long *__page_cache_slot(inode_t *ino, size_t index)
+{
+    if (index >= ino->i_npages) {
+        size_t npages        = MAX(index + 1, ROUND_UP((size_t)ino->i_size, PAGE_SIZE) / PAGE_SIZE);
+        unsigned long *pages = kzalloc(npages * sizeof(unsigned long));
+
+        if (!pages)
+            return NULL;
+
+        if (ino->i_pages)
+            kmemcpy(pages, ino->i_pages, ino->i_npages * sizeof(unsigned long));
+
+        kfree(ino->i_pages);
+        ino->i_pages  = pages;
+        ino->i_npages = npages;
+    }
+
+    return &ino->i_pages[index];
+}
+
+unsigned long file_generic_get_page(file_t *file, off_t offset)
+{
+    inode_t *ino        = file->f_dentry->d_inode;
+    unsigned long *slot = NULL;
+    unsigned long page  = 0;
+    size_t index        = offset / PAGE_SIZE;
+
+    spin_acquire(&ino->i_lock);
+
+    if ((slot = __page_cache_slot(ino, index)) != NULL)
+        page = *slot;
+
+    spin_release(&ino->i_lock);
+
+    if (slot == NULL) {
+        errno = ENOMEM;
+        return INVALID_ADDRESS;
+    }
+
+    if (page != 0)
+        return page;
+
+    /* The data is read without holding the lock. If someone else filled
+     * the slot while we were reading, their page is used and ours is released */
+    size_t len = MIN((size_t)PAGE_SIZE, (size_t)(ino->i_size - offset));
+
+    if ((page = mmu_page_alloc(MM_ZONE_HIGH, MM_ZERO | MM_TRY)) == INVALID_ADDRESS) {
+        errno = ENOMEM;
+        return INVALID_ADDRESS;
+    }
+
+    if (file_pread(file, offset, len, mmu_p_to_v(page)) < 0) {
+        (void)mmu_page_free(page);
+        errno = EIO;
+        return INVALID_ADDRESS;
+    }
+
+    spin_acquire(&ino->i_lock);
+
+    unsigned long ret = INVALID_ADDRESS;
+
+    if ((slot = __page_cache_slot(ino, index)) != NULL) {
+        if (*slot == 0) {
+            *slot = page;
+            page  = 0;
+        }
+
+        ret = *slot;
+    }
+
+    spin_release(&ino->i_lock);
+
+    if (page != 0)
+        (void)mmu_page_free(page);
+
+    if (ret == INVALID_ADDRESS)
+        errno = ENOMEM;
+
+    return ret;
+}
+
+unsigned long file_get_page(file_t *file, off_t offset)
+{
+    if (!file || !file->f_dentry || !file->f_dentry->d_inode) {
+        errno = EINVAL;
+        return INVALID_ADDRESS;
+    }
+
+    if (offset < 0 || !PAGE_ALIGNED(offset)) {
+        errno = EINVAL;
+        return INVALID_ADDRESS;
+    }
+
+    if (offset >= file->f_dentry->d_inode->i_size) {
+        errno = ENXIO;
+        return INVALID_ADDRESS;
+    }
+
+    if (file->f_ops->get_page)
+        return file->f_ops->get_page(file, offset);
+
+    if (!file->f_ops->read) {
+        errno = ENODEV;
+        return INVALID_ADDRESS;
+    }
+
+    return file_generic_get_page(file, offset);
+}
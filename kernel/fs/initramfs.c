@@ -127,6 +127,23 @@ static ssize_t initramfs_file_read(file_t *file, off_t offset, size_t count, voi
     return count;
 }
 
+/* Full pages of page-aligned file data are mapped directly from the initrd.
+ * The initrd is part of the kernel image so its pages are not reference
+ * counted and they're copied on first write to a private mapping.
+ *
+ * The last partial page is read to the page cache instead so that
+ * the data following the file isn't exposed to user space */
+static unsigned long initramfs_file_get_page(file_t *file, off_t offset)
+{
+    uint8_t *data = (uint8_t *)GET_FILE_PRIVATE(file)->pstart + sizeof(file_header_t);
+
+    if (PAGE_ALIGNED((unsigned long)data) &&
+        offset + PAGE_SIZE <= file->f_dentry->d_inode->i_size)
+        return mmu_v_to_p(data + offset);
+
+    return file_generic_get_page(file, offset);
+}
+
 static file_t *initramfs_file_open(dentry_t *dntr, int mode)
 {
     if (!dntr || !dntr->d_inode) {
@@ -295,6 +312,7 @@ static inode_t *initramfs_inode_alloc(superblock_t *sb)
     ino->i_fops->open   = initramfs_file_open;
     ino->i_fops->close  = initramfs_file_close;
     ino->i_fops->seek   = initramfs_file_seek;
+    ino->i_fops->get_page = initramfs_file_get_page;
 
     ino->i_iops->create   = NULL; ino->i_iops->link     = NULL; ino->i_iops->unlink      = NULL;
     ino->i_iops->symlink  = NULL; ino->i_iops->mkdir    = NULL; ino->i_iops->rmdir       = NULL;
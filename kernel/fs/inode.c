@@ -2,6 +2,8 @@
 #include <fs/file.h>
 #include <fs/inode.h>
 #include <kernel/kpanic.h>
+#include <mm/heap.h>
+#include <mm/page.h>
 #include <mm/slab.h>
 #include <errno.h>
 
@@ -62,6 +64,14 @@ int inode_generic_dealloc(inode_t *ino)
     if (ino->i_count > 1)
         return -EBUSY;
 
+    /* pages that are still mapped to user space keep their own references */
+    for (size_t i = 0; i < ino->i_npages; ++i) {
+        if (ino->i_pages[i])
+            (void)mmu_page_unref(ino->i_pages[i]);
+    }
+
+    kfree(ino->i_pages);
+
     (void)mmu_cache_free_entry(inode_ops_cache, ino->i_iops, 0);
     (void)mmu_cache_free_entry(file_ops_cache,  ino->i_fops, 0);
     (void)mmu_cache_free_entry(inode_cache,     ino,         0);
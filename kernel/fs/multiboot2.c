@@ -21,8 +21,8 @@ size_t multiboot2_map_memory(unsigned long *address, void (*callback)(unsigned,
                 mmap = ((multiboot_tag_mmap_t *)tag)->entries;
 
                 do {
-                    unsigned long addr = (mmap->addr >> 32) | (mmap->addr & 0xffffffff);
-                    unsigned long len  = (mmap->len  >> 32) | (mmap->len  & 0xffffffff);
+                    unsigned long addr = mmap->addr;
+                    unsigned long len  = mmap->len;
 
                     switch (mmap->type) {
                         case MULTIBOOT_MEMORY_AVAILABLE:
@@ -5,6 +5,7 @@
 #include <kernel/util.h>
 #include <mm/heap.h>
 #include <mm/slab.h>
+#include <mm/vmalloc.h>
 #include <sched/sched.h>
 #include <sync/spinlock.h>
 #include <sync/wait.h>
@@ -173,7 +174,7 @@ pipe_t *pipe_create(size_t size)
     pipe->file->f_private           = pipe;
     pipe->file->f_dentry->d_private = pipe;
 
-    pipe->mem  = kmalloc(size, 0);
+    pipe->mem  = (size > PAGE_SIZE) ? vmalloc(size) : kmalloc(size, 0);
     pipe->size = size;
     pipe->lock = 0;
     pipe->ptr  = 0;
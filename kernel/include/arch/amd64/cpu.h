@@ -28,6 +28,24 @@ static inline void enable_irq(void)
     asm volatile ("sti" ::: "memory");
 }
 
+/* Disable interrupts and return the previous value of RFLAGS */
+static inline uint64_t irq_save(void)
+{
+    uint64_t flags;
+    asm volatile ("pushfq \n"
+                  "popq %0 \n"
+                  "cli" : "=r"(flags) :: "memory");
+
+    return flags;
+}
+
+/* Enable interrupts if they were enabled when irq_save() was called */
+static inline void irq_restore(uint64_t flags)
+{
+    if (flags & (1 << 9))
+        enable_irq();
+}
+
 static inline uint64_t get_sp(void)
 {
     uint64_t sp;
@@ -53,11 +71,36 @@ static inline void set_msr(uint32_t msr, uint64_t reg)
     );
 }
 
+static inline void cpuid(uint32_t leaf, uint32_t subleaf,
+                         uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx)
+{
+    asm volatile ("cpuid"
+                  : "=a" (*eax), "=b" (*ebx), "=c" (*ecx), "=d" (*edx)
+                  : "a" (leaf), "c" (subleaf));
+}
+
 static inline void cpu_relax(void)
 {
     asm volatile ("pause");
 }
 
+/* Return the time stamp counter of this CPU
+ * The fence keeps the read from being executed before the preceding instructions */
+static inline uint64_t rdtsc(void)
+{
+    uint32_t lo, hi;
+    asm volatile ("lfence \n"
+                  "rdtsc" : "=a" (lo), "=d" (hi) :: "memory");
+
+    return ((uint64_t)hi) << 32 | lo;
+}
+
+/* Stop executing until the next interrupt */
+static inline void cpu_halt(void)
+{
+    asm volatile ("hlt" ::: "memory");
+}
+
 void native_dump_registers(isr_regs_t *cpu_state);
 void native_context_load(unsigned long cr3, void *exec_state);
 void native_context_prepare(task_t *task, void *ip, void *sp);
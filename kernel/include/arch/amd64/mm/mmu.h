@@ -2,12 +2,24 @@
 #define __AMD64_MMU_H__
 #ifdef __amd64__
 
+#include <mm/ksm.h>
+#include <mm/swap.h>
 #include <mm/types.h>
 
 #define KPSTART 0x0000000000100000
 #define KVSTART 0xffffffff80100000
 #define KPML4I  511
 
+#define KERNEL_SPACE_START 0xffff800000000000 /* start of the higher half */
+#define PHYS_MAP_START     0xffff880000000000 /* all physical memory is mapped here */
+
+#define CR3_NOFLUSH (1UL << 63) /* don't flush the TLB entries of the loaded PCID */
+#define CR3_PCID    0xfff       /* PCID of the address space */
+
+#define CR4_PGE     (1 << 7)    /* global pages */
+#define CR4_PCIDE   (1 << 17)   /* process-context identifiers */
+
+/* Return the physical address of the PML4 without the PCID */
 static inline uint64_t amd64_get_cr3(void)
 {
     uint64_t address;
@@ -15,7 +27,7 @@ static inline uint64_t amd64_get_cr3(void)
     asm volatile ("mov %%cr3, %%rax \n"
                   "mov %%rax, %0" : "=r" (address));
 
-    return address;
+    return address & ~CR3_PCID;
 }
 
 static inline void amd64_set_cr3(uint64_t address)
@@ -24,38 +36,95 @@ static inline void amd64_set_cr3(uint64_t address)
                   "mov %%rax, %%cr3" :: "r" (address));
 }
 
-static inline uint64_t *amd64_p_to_v(uint64_t paddr)
+static inline uint64_t amd64_get_cr4(void)
+{
+    uint64_t value;
+
+    asm volatile ("mov %%cr4, %0" : "=r" (value));
+
+    return value;
+}
+
+static inline void amd64_set_cr4(uint64_t value)
 {
-    /* TODO: check is this really a physical address
-     * ie. that the the addition doesn't overflow */
+    asm volatile ("mov %0, %%cr4" :: "r" (value) : "memory");
+}
 
-    return (uint64_t *)(paddr + (KVSTART - KPSTART));
+static inline uint64_t *amd64_p_to_v(uint64_t paddr)
+{
+    return (uint64_t *)(paddr + PHYS_MAP_START);
 }
 
+/* The kernel image and the first 2GB of memory are also mapped right below KVSTART,
+ * so pointers to static data are translated using that mapping */
 static inline uint64_t amd64_v_to_p(void *vaddr)
 {
-    /* TODO: check if this highmen ie not idetity mapped */
-    return ((uint64_t)vaddr - (KVSTART - KPSTART));
+    if ((uint64_t)vaddr >= KVSTART - KPSTART)
+        return ((uint64_t)vaddr - (KVSTART - KPSTART));
+
+    return ((uint64_t)vaddr - PHYS_MAP_START);
 }
 
+/* Flush the non-global TLB entries of current PCID */
 static inline void amd64_flush_tlb(void)
 {
     asm volatile ("mov %cr3, %rcx \n \
                    mov %rcx, %cr3");
 }
 
+/* Flush all TLB entries of all PCIDs, including global entries
+ * Toggling CR4.PGE does that, if global pages are not enabled, reload CR3 */
+static inline void amd64_flush_tlb_all(void)
+{
+    uint64_t cr4 = amd64_get_cr4();
+
+    if (cr4 & CR4_PGE) {
+        amd64_set_cr4(cr4 & ~CR4_PGE);
+        amd64_set_cr4(cr4);
+    } else {
+        amd64_flush_tlb();
+    }
+}
+
 static inline void amd64_invld_page(uint64_t address)
 {
-    (void)address;
-    /* TODO:  */
+    asm volatile ("invlpg (%0)" :: "r" (address) : "memory");
 }
 
 typedef struct task task_t;
 
-int mmu_native_init(void);
+int mmu_native_init(void *arg);
+unsigned long mmu_native_phys_limit(void);
 
 int mmu_native_map_page(unsigned long paddr, unsigned long vaddr, int flags);
+int mmu_native_try_map_page(unsigned long paddr, unsigned long vaddr, int flags);
 int mmu_native_unmap_page(unsigned long vaddr);
+int mmu_native_unmap_range(unsigned long vaddr, size_t n);
+
+int mmu_native_map_huge_page(unsigned long paddr, unsigned long vaddr, int flags);
+int mmu_native_promote_huge_page(unsigned long vaddr);
+
+int mmu_native_migrate_range(unsigned long start, unsigned long end);
+bool mmu_native_migration_pending(unsigned long vaddr);
+
+int mmu_native_reclaim(mm_reclaim_req_t *reqs, size_t n, int flags);
+
+unsigned long mmu_native_task_page(task_t *task, unsigned long vaddr);
+int mmu_native_merge(mm_merge_req_t *reqs, size_t n);
+
+/* Handle a fault at "vaddr" of current address space caused by a swapped out page
+ *
+ * The page is read from the swap area and mapped back with its old flags
+ *
+ * Return 0 if the fault was handled
+ * Return -ENOENT if "vaddr" is not mapped by a swap entry
+ * Return -ENOMEM if there's no memory for the page
+ * Return -EIO if the page couldn't be read */
+int mmu_native_swap_fault(unsigned long vaddr);
+
+unsigned long mmu_native_translate(unsigned long vaddr);
+
+void mmu_native_zero_page(unsigned long paddr);
 
 unsigned long mmu_native_v_to_p(void *vaddr);
 void *mmu_native_p_to_v(unsigned long paddr);
@@ -66,7 +135,18 @@ void  mmu_native_destroy_dir(void *dir);
 
 void mmu_native_walk_addr(void *addr);
 
+/* Handle a write fault at "vaddr" of current address space
+ *
+ * Shared page tables on the path are copied and if the page is
+ * a copy-on-write page, it's either copied or, if this address
+ * space is the only user of the page, made writable
+ *
+ * Return 0 if the fault was handled
+ * Return -EFAULT if the fault was not caused by copy-on-write */
+int mmu_native_cow_fault(unsigned long vaddr);
+
 void mmu_native_switch_ctx(task_t *task);
+unsigned long mmu_native_get_ctx(task_t *task);
 
 #endif /* __amd64__ */
 #endif /* __AMD64_MMU_H__ */
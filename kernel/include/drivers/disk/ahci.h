@@ -1,6 +1,8 @@
 #ifndef __AHCI_H__
 #define __AHCI_H__
 
+#include <stdint.h>
+
 enum {
     FIS_TYPE_H2D       = 0x27,
     FIS_TYPE_D2H       = 0x34,
@@ -24,6 +26,7 @@ enum {
 #define AHCI_MAX_PORTS      32
 
 #define AHCI_NUM_PRDT_ENTRIES 16
+#define AHCI_MAX_SECTORS      128 /* 8 PRDT entries of 8KB per command */
 
 #define PORT_SIG_SATA   0x00000101
 #define PORT_SIG_SATAPI 0xeb140101
@@ -82,4 +85,21 @@ enum {
 
 int ahci_init(void);
 
+/* Return the number of 512-byte sectors of the disk or 0 if there is no disk */
+uint64_t ahci_disk_size(void);
+
+/* Read "nsect" sectors starting at "lba" from the disk to "buf"
+ *
+ * "buf" must be physically contiguous, eg. memory returned by mmu_p_to_v()
+ *
+ * Return 0 on success
+ * Return -ENODEV if there is no disk
+ * Return -EINVAL if "nsect" is 0 or larger than AHCI_MAX_SECTORS or the range is past the end of the disk
+ * Return -EIO if the disk reported an error */
+int ahci_disk_read(uint64_t lba, void *buf, uint32_t nsect);
+
+/* Write "nsect" sectors starting at "lba" from "buf" to the disk
+ * See ahci_disk_read() for the requirements and return values */
+int ahci_disk_write(uint64_t lba, void *buf, uint32_t nsect);
+
 #endif /* __AHCI_H__ */
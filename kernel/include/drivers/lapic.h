@@ -13,9 +13,19 @@ void lapic_send_sipi(unsigned cpu, unsigned vec);
 void lapic_send_ipi(uint32_t high, uint32_t low);
 void lapic_send_init(unsigned cpu);
 
+/* Send interrupt "vec" to "cpu" */
+void lapic_send_fixed_ipi(unsigned cpu, unsigned vec);
+
 /* Acknowledge the pending interrupt */
 void lapic_ack_interrupt(void);
 
+/* Arm the one-shot timer of this CPU to fire after "count" timer counts
+ * Arming the timer again cancels the previous expiry, 0 stops the timer */
+void lapic_timer_arm(uint32_t count);
+
+/* Return the number of timer counts since the timer of this CPU was armed */
+uint32_t lapic_timer_elapsed(void);
+
 /* Return the number of detected CPUs */
 unsigned lapic_get_cpu_count(void);
 
@@ -26,6 +36,10 @@ unsigned lapic_get_init_cpu_count(void);
  * Return -ENXIO if "cpu" doesn't not exist */
 int lapic_get_lapic_id(unsigned cpu);
 
+/* Return the home NUMA node of "cpu"
+ * Return -ENXIO if "cpu" doesn't exist */
+int lapic_get_node(unsigned cpu);
+
 /* Return the Local APIC base address
  * Return INVALID_ADDRESS if an error occurred */
 unsigned long lapic_get_base(void);
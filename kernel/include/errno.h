@@ -17,8 +17,12 @@ int errno;
 #define ENXIO   12      /* No such device or address */
 #define EAGAIN  13      /* Try again */
 #define EFAULT  14      /* Bad address */
+#define EBADF   15      /* Bad file descriptor */
+#define EACCES  16      /* Permission denied */
+#define ENODEV  17      /* No such device */
+#define EIO     18      /* I/O error */
 #define EINPROGRESS 115 /* Operation now in progress */
 
-#define EMAX    13 /* Used by the kstrerror() */
+#define EMAX    19 /* Used by the kstrerror() */
 
 #endif /* __ERRNO_H__ */
@@ -17,6 +17,10 @@ struct file_ops {
     file_t  *(*open)(dentry_t *, int);
     int      (*close)(file_t *);
     int      (*seek)(file_t *, off_t);
+
+    /* return the physical address of the page holding the data at
+     * page-aligned offset or INVALID_ADDRESS, used by mmap() */
+    unsigned long (*get_page)(file_t *, off_t);
 };
 
 struct file {
@@ -57,10 +61,18 @@ int file_generic_dealloc(file_t *file);
  * return -ESPIPE if the seek is illegal (off bounds) */
 int file_generic_seek(file_t *file, off_t off);
 
-/* TODO: comment */
+/* Return the file of descriptor "fd" of current task and take a reference to it
+ * The reference must be released with file_fput()
+ *
+ * Return pointer to the file on success
+ * Return NULL on error and set errno to EBADF if "fd" is not an open descriptor */
 file_t *file_fget(int fd);
 
-/* TODO: comment */
+/* Release a reference taken with file_fget(), the file is closed
+ * when the last reference is released
+ *
+ * Return 0 on success
+ * Return -EINVAL if "file" is NULL */
 int file_fput(file_t *file);
 
 /* TODO: comment */
@@ -81,4 +93,40 @@ ssize_t file_read(file_t  *file, off_t offset, size_t size, void *buffer);
 /* TODO: comment */
 ssize_t file_write(file_t *file, off_t offset, size_t size, void *buffer);
 
+/* Read "size" bytes from absolute offset "offset" of "file" to "buffer"
+ * The file position is not changed
+ *
+ * Return the number of bytes read on success
+ * Return negative error code on error (see file_read()) */
+ssize_t file_pread(file_t *file, off_t offset, size_t size, void *buffer);
+
+/* Write "size" bytes from "buffer" to absolute offset "offset" of "file"
+ * The file position is not changed
+ *
+ * Return the number of bytes written on success
+ * Return negative error code on error (see file_write()) */
+ssize_t file_pwrite(file_t *file, off_t offset, size_t size, void *buffer);
+
+/* Return the physical address of the page that holds the data of "file"
+ * at page-aligned offset "offset". The page is owned by the file and whoever
+ * maps the page must take a reference to it if it's reference counted
+ *
+ * The filesystem may provide the page itself (see file_ops->get_page),
+ * otherwise the page cache of the inode is used
+ *
+ * Return INVALID_ADDRESS on error and set errno to:
+ *   EINVAL if "offset" is not page-aligned
+ *   ENXIO  if "offset" is beyond the end of the file
+ *   ENODEV if the file can't be mapped
+ *   ENOMEM if allocating the page failed
+ *   EIO    if reading the data failed */
+unsigned long file_get_page(file_t *file, off_t offset);
+
+/* Page cache implementation of file_get_page()
+ *
+ * The page is read using file_ops->read when it's first requested and
+ * it stays in the page cache of the inode until the inode is destroyed.
+ * The part of the last page after the end of the file is zeroed */
+unsigned long file_generic_get_page(file_t *file, off_t offset);
+
 #endif /* __FILE_H__ */
@@ -2,6 +2,7 @@
 #define __INODE_H__
 
 #include <lib/list.h>
+#include <sync/spinlock.h>
 #include <sys/types.h>
 #include <stdint.h>
 
@@ -52,6 +53,13 @@ struct inode {
 
     list_head_t i_list;  /* list of all inodes */
     list_head_t i_dirty; /* list of dirty inodes */
+
+    /* Page cache of the file data, used for mapping the file to user space.
+     * Each slot holds the physical address of one page of the data or 0 if
+     * the page hasn't been read yet. The cache holds a reference to each page */
+    unsigned long *i_pages;
+    size_t i_npages;
+    spinlock_t i_lock;   /* protects the page cache */
 };
 
 int inode_init(void);
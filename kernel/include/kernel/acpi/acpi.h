@@ -9,6 +9,15 @@
  * Return -EINVAL if the ACPI-related info is invalid */
 int acpi_init(void);
 
+/* Record the memory and CPU affinity from SRAT and the node distances from SLIT
+ *
+ * This is called before the page allocator is initialized so it must not allocate memory
+ *
+ * Return 0 on success
+ * Return -ENXIO  if ACPI tables or SRAT were not found
+ * Return -EINVAL if the ACPI-related info is invalid */
+int acpi_numa_init(void);
+
 /* Find PCI IRQ routing information
  *
  * Return 0 on success
@@ -0,0 +1,71 @@
+#ifndef __CLOCK_H__
+#define __CLOCK_H__
+
+#include <kernel/tick.h>
+#include <sync/spinlock.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct task task_t;
+
+/* Sleep of a task that can be cut short by other CPUs, see clock_wait()
+ * The waiter must be zeroed before it's used for the first time */
+typedef struct clock_waiter {
+    task_t *task;      /* task that is sleeping */
+    hrtimer_t timeout; /* ends the sleep when the time is up */
+    hrtimer_t wakeup;  /* ends the sleep early, installed by clock_wakeup() */
+    spinlock_t lock;   /* protects "sleeping" against the timer callbacks */
+    bool sleeping;     /* the task is blocked and waits for a timer */
+    bool woken;        /* clock_wakeup() was called and clock_wait() has not noticed it */
+} clock_waiter_t;
+
+/* Initialize the monotonic clock
+ *
+ * "tsc_hz" is the frequency of the time stamp counter measured against the PIT.
+ * Only the first call (made by the BSP) has an effect, the clock starts from 0 */
+void clock_init(uint64_t tsc_hz);
+
+/* Return the number of nanoseconds since clock_init() was called
+ *
+ * The clock is read from the time stamp counter of the calling CPU,
+ * corrected by the offset measured by clock_sync_ap() so the clocks
+ * of all CPUs agree within the accuracy of the synchronization
+ *
+ * Return 0 if the clock has not been initialized */
+uint64_t clock_monotonic_ns(void);
+
+/* Measure the offset of the time stamp counter of this AP to that of the BSP
+ * The BSP must call clock_sync_serve() while the AP is synchronizing */
+void clock_sync_ap(void);
+
+/* Answer a pending synchronization request of an AP, called by the BSP */
+void clock_sync_serve(void);
+
+/* Put the calling task to sleep for "ns" nanoseconds
+ *
+ * The task is woken up by a high-resolution timer of the calling CPU
+ * so the sleep is not rounded to the scheduler tick. A sleep that would
+ * end after the clock wraps around never ends
+ *
+ * Return 0 on success
+ * Return -ENXIO if the timers of this CPU have not been initialized */
+int clock_sleep(uint64_t ns);
+
+/* Put the calling task to sleep for "ns" nanoseconds or until clock_wakeup()
+ * is called for "waiter", whichever happens first
+ *
+ * If clock_wakeup() was called since the previous clock_wait() returned,
+ * this returns immediately. The task may occasionally be woken up early
+ * so the caller must check itself whether there is something to do
+ *
+ * Return 0 on success
+ * Return -ENXIO if the timers of this CPU have not been initialized */
+int clock_wait(clock_waiter_t *waiter, uint64_t ns);
+
+/* Wake up the task sleeping in clock_wait() on "waiter"
+ *
+ * The task is woken up from the timer interrupt of this CPU, not directly,
+ * so this can be called while holding locks, eg. by the page allocator */
+void clock_wakeup(clock_waiter_t *waiter);
+
+#endif /* __CLOCK_H__ */
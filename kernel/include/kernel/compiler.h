@@ -6,6 +6,7 @@
 #define __noreturn __attribute__((noreturn))
 #define __percpu   __attribute__((section(".percpu")))
 
-#define READ_ONCE(var) (*((volatile typeof(var) *)&(var)))
+#define READ_ONCE(var)       (*((volatile typeof(var) *)&(var)))
+#define WRITE_ONCE(var, val) (*((volatile typeof(var) *)&(var)) = (val))
 
 #endif /* end of include guard: __COMPILER_H__ */
@@ -10,6 +10,7 @@
 #define VECNUM_SYSCALL    0x80
 #define VECNUM_PAGE_FAULT 0x0e
 #define VECNUM_GPF        0x0d
+#define VECNUM_TLB_SHOOTDOWN 0xf0
 
 enum {
     IRQ_HANDLED   =  0,
@@ -2,21 +2,68 @@
 #define __TICK_H__
 
 #include <lib/list.h>
+#include <stdbool.h>
+#include <stdint.h>
 
+/* The timer must be zeroed before it's installed for the first time
+ * and it may be installed again once it has expired or been cancelled */
 typedef struct timer {
-    unsigned long wait;       /* how long to wait, caller fills */
+    unsigned long wait;       /* how long to wait in milliseconds, caller fills */
     unsigned long expr;       /* when the timer expires, tick fils */
     void (*callback)(void *); /* function to call when the timer expires */
     void *ctx;                /* context that is given to the callback */
     list_head_t list;
+    unsigned cpu;             /* CPU whose timer wheel holds the timer, tick fills */
+    unsigned slot;            /* slot of the wheel that holds the timer, tick fills */
+    bool pending;             /* the callback has not been called yet, tick fills */
 } timer_t;
 
+/* High-resolution timer, expires at an absolute time of the monotonic clock
+ *
+ * The timer must be zeroed before it's installed for the first time
+ * and it may be installed again once it has expired or been cancelled */
+typedef struct hrtimer {
+    uint64_t expires;         /* when the timer expires in nanoseconds, caller fills */
+    void (*callback)(void *); /* function to call when the timer expires */
+    void *ctx;                /* context that is given to the callback */
+    list_head_t list;
+    unsigned cpu;             /* CPU whose timer list holds the timer, tick fills */
+    bool pending;             /* the callback has not been called yet, tick fills */
+} hrtimer_t;
+
 /* Initialize the tick counter
  * "ticks" tells how many ticks "ms" milliseconds took */
 void tick_init(unsigned long ticks, unsigned long ms);
 
-/* Increase the tick counter */
-void tick_inc(void);
+/* Advance the timer wheel of this CPU and call the callbacks of the expired timers
+ * This is called by the timer interrupt handler */
+void tick_update(void);
+
+/* Return the tick counter of this CPU
+ *
+ * The counter runs even when the tick is stopped because it's
+ * derived from the monotonic clock, it doesn't count timer interrupts.
+ * Before the clock has been started, it's read from the timer */
+unsigned long tick_get(void);
+
+/* Arm the timer of this CPU for its next event
+ *
+ * If "periodic" is true, the next event is the next scheduler tick.
+ * Otherwise the tick is stopped and the timer only fires when
+ * the first timer of this CPU expires (or when the hardware counter
+ * runs out) */
+void tick_program(bool periodic);
+
+/* Mark the tick of this CPU stopped before tick_program() is called
+ *
+ * From this point on tick_kick() interrupts this CPU so whatever
+ * is looked at to decide whether the tick is needed can be changed
+ * by other CPUs without the change going unnoticed */
+void tick_stop(void);
+
+/* Interrupt "cpu" if its tick is stopped so that it re-evaluates
+ * whether it needs the tick, eg. after a task was queued to it */
+void tick_kick(unsigned cpu);
 
 /* Busy wait */
 void tick_wait(unsigned long ticks);
@@ -26,9 +73,51 @@ unsigned long tick_ms_to_ticks(unsigned long ms);
 unsigned long tick_us_to_ticks(unsigned long us);
 unsigned long tick_ns_to_ticks(unsigned long ns);
 
+/* Initialize the timer wheel of this CPU */
 void tick_init_timer(void);
 
-/* Install timer whose callback is called when the timer expires */
-void tick_install_timer(timer_t *tmr);
+/* Install timer whose callback is called on this CPU when the timer expires
+ *
+ * Return 0 on success
+ * Return -EBUSY if the timer is already pending
+ * Return -ENXIO if the timer wheel of this CPU has not been initialized */
+int tick_install_timer(timer_t *tmr);
+
+/* Install timer whose callback is called on "cpu" when the timer expires
+ *
+ * The timer is added to the wheel of "cpu" by "cpu" itself on its next
+ * tick so the waiting starts from that moment. The timer stays on the wheel
+ * of "cpu" even if the task that installed it is moved to another CPU
+ *
+ * Return 0 on success
+ * Return -EBUSY if the timer is already pending
+ * Return -ENXIO if "cpu" is invalid or its timer wheel has not been initialized */
+int tick_install_timer_on(timer_t *tmr, unsigned cpu);
+
+/* Cancel a pending timer so that its callback is not called
+ * The timer can be cancelled from any CPU
+ *
+ * Return 0 on success
+ * Return -ENOENT if the timer is not pending, ie. it has not been installed
+ *        or its callback has been called or is being called */
+int tick_cancel_timer(timer_t *tmr);
+
+/* Install high-resolution timer whose callback is called on this CPU
+ * when the monotonic clock reaches "expires" of the timer
+ *
+ * The timer of this CPU is armed for the exact expiry of the timer
+ * so the callback is not delayed until the next scheduler tick
+ *
+ * Return 0 on success
+ * Return -EBUSY if the timer is already pending
+ * Return -ENXIO if the timer wheel of this CPU has not been initialized */
+int tick_install_hrtimer(hrtimer_t *tmr);
+
+/* Cancel a pending high-resolution timer so that its callback is not called
+ * The timer can be cancelled from any CPU
+ *
+ * Return 0 on success
+ * Return -ENOENT if the timer is not pending */
+int tick_cancel_hrtimer(hrtimer_t *tmr);
 
 #endif /* __TICK_H__ */
@@ -0,0 +1,38 @@
+#ifndef __COMPACT_H__
+#define __COMPACT_H__
+
+/* Compaction moves user pages out of partially used blocks so that
+ * the free pages around them merge into blocks of higher order
+ *
+ * A block is compacted by isolating its free parts (see mmu_block_isolate()),
+ * moving its user pages elsewhere (see mmu_migrate_range()) and releasing
+ * the block as a whole (see mmu_block_putback()) */
+
+/* Compact zone "memzone" of NUMA node "node" until a free block of "order" is created
+ *
+ * If the zone has no movable blocks, lower zones down to the normal zone are tried.
+ * At most COMPACT_SCAN_MAX blocks are scanned per zone so the call is bounded
+ *
+ * Return 0 if a free block of "order" was created
+ * Return -EINVAL if "order" is 0 or larger than HUGE_PAGE_ORDER
+ * Return -EBUSY if the zones are being compacted by someone else
+ * Return -EAGAIN if no block of "order" could be freed */
+int mmu_compact_node(unsigned node, unsigned memzone, unsigned order);
+
+/* Ask the compaction thread to create free blocks of "order"
+ *
+ * This can be called while holding locks because it doesn't compact anything */
+void mmu_compact_kick(unsigned order);
+
+/* Start the compaction thread
+ *
+ * The thread compacts the zones of all nodes when an allocation couldn't
+ * compact them itself (see mmu_compact_kick()) or when too much of the free
+ * memory is fragmented. This must be called after the scheduler has been initialized */
+void mmu_compact_init(void);
+
+/* Print the number of moved pages, pages that couldn't be moved
+ * and blocks that were and were not freed by compaction */
+void mmu_compact_print_stats(void);
+
+#endif /* __COMPACT_H__ */
@@ -10,21 +10,12 @@ void *kcalloc(size_t nmemb, size_t size);
 void *krealloc(void *ptr, size_t size);
 void  kfree(void *ptr);
 
-/* Initialize heap using boot memory allocator
- * This is only a temporary initialization and once
- * the page frame allocator is up and runningj,
- * the heap can be reinitialized, this time permanently
+/* Initialize the kernel heap by creating the slab caches
+ * for the size classes of kmalloc() (16 bytes - 4KB)
  *
- * Return 0 on success
- * Return -EINVAL if the physical->virtual conversion failed
- * Return -ENOMEM if no memory was allocated for heap */
-int mmu_heap_preinit(void);
-
-/* Reinitialize the kernel heap using page frame allocator
+ * Allocations larger than 4KB are served by the page allocator
  *
- * Return 0 on success
- * Return -EINVAL if the physical->virtual conversion failed
- * Return -ENOMEM if no memory was allocated for heap */
+ * Return 0 on success */
 int mmu_heap_init(void);
 
 /* TODO: deprecated, remove */
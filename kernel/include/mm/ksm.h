@@ -0,0 +1,32 @@
+#ifndef __KSM_H__
+#define __KSM_H__
+
+#include <stdbool.h>
+
+/* Same-page merging finds anonymous user pages with identical contents
+ * and maps one read-only copy of them in their place. A write to a merged
+ * page copies it again, see mmu_cow_fault()
+ *
+ * The merging thread visits the private anonymous pages of all tasks a few
+ * at a time and hashes their contents. Pages with equal hashes are compared
+ * and merged into a shared page that is owned by the thread. A shared page
+ * is released once it's no longer mapped by anyone */
+
+/* One page given to mmu_merge() */
+typedef struct mm_merge_req {
+    struct task *task;   /* address space that maps the page */
+    unsigned long vaddr; /* address of the mapping */
+    unsigned long page;  /* physical address of the page */
+    unsigned long kpage; /* shared page that replaces "page" */
+    bool merged;         /* the mapping now points to "kpage" */
+} mm_merge_req_t;
+
+/* Start the merging thread
+ * This must be called after the scheduler has been initialized */
+void mmu_ksm_init(void);
+
+/* Print the number of shared pages, the number of mappings
+ * that point to them and the memory that was saved */
+void mmu_ksm_print_stats(void);
+
+#endif /* __KSM_H__ */
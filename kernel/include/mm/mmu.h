@@ -1,6 +1,8 @@
 #ifndef __MMU_H__
 #define __MMU_H__
 
+#include <mm/ksm.h>
+#include <mm/swap.h>
 #include <mm/types.h>
 #include <sys/types.h>
 
@@ -8,10 +10,10 @@ typedef struct task task_t;
 
 /* Initialize the Memory Management Unit:
  *  - native MMU
- *  - boot memory allocator
- *  - preinitialize heap and slab for booting
  *  - initialize page frame allocator (PFA)
- *  - reinitialize heap and slab using PFA
+ *  - initialize slab and heap using PFA
+ *  - initialize vmalloc region
+ *  - initialize virtual memory areas
  *  
  * Return 0 on success 
  *
@@ -24,15 +26,115 @@ int mmu_init(void *arg);
 /* TODO:  */
 int mmu_map_page(unsigned long paddr, unsigned long vaddr, int flags);
 
+/* Map "paddr" to "vaddr" of current address space unless "vaddr" is already mapped
+ *
+ * Unlike mmu_map_page(), an existing mapping is never replaced, so of two
+ * threads that fault the same page only one gets its page mapped
+ *
+ * Return 0 on success
+ * Return -EEXIST if "vaddr" is mapped or its page has been swapped out */
+int mmu_try_map_page(unsigned long paddr, unsigned long vaddr, int flags);
+
 /* TODO:  */
 int mmu_unmap_page(unsigned long vaddr);
 
 /* TODO:  */
 int mmu_map_range(unsigned long pstart, unsigned long vstart, size_t n, int flags);
 
-/* TODO:  */
+/* Unmap "n" pages starting at "start" from current address space
+ *
+ * Pages that are not mapped are skipped and the TLBs
+ * are flushed only once for the whole range
+ *
+ * Return 0 on success */
 int mmu_unmap_range(unsigned long start, size_t n);
 
+/* Map the 2MB block at "paddr" to "vaddr" using one large page
+ *
+ * Both addresses must be aligned to HUGE_PAGE_SIZE. If the mapping is a user
+ * mapping, the block must be allocated using order HUGE_PAGE_ORDER because
+ * the mapping owns a reference to the whole block
+ *
+ * Return 0 on success
+ * Return -EINVAL if either of the addresses is not aligned
+ * Return -EEXIST if some part of the region is already mapped */
+int mmu_map_huge_page(unsigned long paddr, unsigned long vaddr, int flags);
+
+/* Replace the page table that maps the 2MB region of "vaddr" with one large page
+ *
+ * All 512 pages of the region must be mapped with the same flags and
+ * current address space must be their only user. The pages are copied
+ * to a newly allocated 2MB block and released
+ *
+ * Return 0 on success
+ * Return -EAGAIN if the region cannot be mapped using a large page
+ * Return -ENOMEM if there is no free 2MB block */
+int mmu_promote_huge_page(unsigned long vaddr);
+
+/* Move the user pages in the physical range [start, end) to other pages
+ *
+ * The page tables of all tasks are searched for private 4KB pages that are
+ * marked MM_PU_USER. Old pages of the moved mappings are left marked
+ * MM_PU_ISOLATED and the caller must release them, see mmu_block_putback().
+ * At most 512 pages can be moved at once
+ *
+ * Return the number of moved pages on success
+ * Return -EINVAL if the range is empty or too large
+ * Return -EBUSY if another migration is in progress */
+int mmu_migrate_range(unsigned long start, unsigned long end);
+
+/* Age or swap out the user pages of "reqs"
+ *
+ * Each request names a page that the LRU thinks is mapped at "vaddr" of "task"
+ * and the caller must hold a reference to the page. Pages with the accessed bit
+ * set have the bit cleared. If "evict" is set, the other pages are written
+ * to the swap area and their mappings are replaced with swap entries.
+ * The outcome is stored to the "status" field of the request (see mm/swap.h)
+ *
+ * Only pages of private page tables that are mapped once can be swapped out.
+ * If "flags" has MM_TRY, the call fails instead of waiting for a migration
+ *
+ * Return the number of pages that were swapped out on success
+ * Return -EINVAL if "reqs" is NULL or "n" is too large
+ * Return -EBUSY if "flags" has MM_TRY and another migration is in progress
+ *   or the page tables are locked */
+int mmu_reclaim(mm_reclaim_req_t *reqs, size_t n, int flags);
+
+/* Return the physical address of the page mapped at "vaddr" of "task"
+ * if it's a private anonymous page that can be merged
+ *
+ * "task" must not be destroyed during the call, so this
+ * is meant to be called from sched_task_for_each()
+ *
+ * Return INVALID_ADDRESS if there is no such page */
+unsigned long mmu_task_page(task_t *task, unsigned long vaddr);
+
+/* Replace the mappings of the pages of "reqs" with read-only mappings of their shared pages
+ *
+ * A page is merged only if it's still mapped at "vaddr" of "task", it has
+ * no other users and its contents are equal to the shared page. The shared
+ * page gets a reference for each new mapping and the old pages are released
+ *
+ * Return the number of merged pages on success
+ * Return -EINVAL if "reqs" is NULL or "n" is too large */
+int mmu_merge(mm_merge_req_t *reqs, size_t n);
+
+/* Translate virtual address "vaddr" to physical address by walking the page tables
+ * Unlike mmu_v_to_p(), this works for any address mapped in current address space
+ *
+ * Return the physical address on success
+ * Return INVALID_ADDRESS if "vaddr" is not mapped */
+unsigned long mmu_translate(unsigned long vaddr);
+
+/* Return the end of physical memory that is mapped to the kernel address space
+ * Memory above this cannot be accessed using mmu_p_to_v() and is not managed */
+unsigned long mmu_phys_limit(void);
+
+/* Zero the page at physical address "paddr" without polluting the caches
+ *
+ * Use this only for pages that are not going to be accessed soon */
+void mmu_zero_page(unsigned long paddr);
+
 /* TODO:  */
 unsigned long mmu_v_to_p(void *vaddr);
 
@@ -50,6 +152,10 @@ void *mmu_duplicate_dir(void);
 
 void mmu_switch_ctx(task_t *task);
 
+/* Return the value of page table base register for switching
+ * to the address space of "task" on this CPU, see mmu_tlb_prepare_ctx() */
+unsigned long mmu_get_ctx(task_t *task);
+
 void mmu_walk_addr(void *addr);
 
 #endif /* __MMU_H__ */
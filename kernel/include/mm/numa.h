@@ -0,0 +1,57 @@
+#ifndef __NUMA_H__
+#define __NUMA_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MAX_NUMNODES         8
+#define NUMA_LOCAL_DISTANCE  10 /* SLIT distance of a node to itself */
+#define NUMA_REMOTE_DISTANCE 20 /* distance between nodes if SLIT is not present */
+
+/* Record that physical memory [start, start + len) belongs to proximity domain "pxm"
+ *
+ * Proximity domains are mapped to node numbers in the order they're first seen
+ *
+ * Return 0 on success
+ * Return -ENOSPC if there are too many nodes or memory ranges */
+int mmu_numa_add_memory(uint32_t pxm, unsigned long start, size_t len);
+
+/* Record that the CPU with Local APIC ID "lapic_id" belongs to proximity domain "pxm"
+ *
+ * Return 0 on success
+ * Return -ENOSPC if there are too many nodes or CPUs */
+int mmu_numa_add_cpu(uint32_t lapic_id, uint32_t pxm);
+
+/* Set the relative distance from proximity domain "from" to "to"
+ * Distances of proximity domains that have no memory or CPUs are ignored */
+void mmu_numa_set_distance(uint32_t from, uint32_t to, uint8_t distance);
+
+/* Build the fallback lists of the nodes from the recorded topology
+ *
+ * If no topology was recorded, all memory and CPUs belong to node 0 */
+void mmu_numa_init(void);
+
+/* Return the number of nodes */
+unsigned mmu_numa_node_count(void);
+
+/* Return the node of physical address "paddr"
+ * Memory not described by the firmware belongs to node 0 */
+unsigned mmu_numa_addr_node(unsigned long paddr);
+
+/* Return the first address after "paddr" that may belong to a different node */
+unsigned long mmu_numa_range_end(unsigned long paddr);
+
+/* Return the node of the CPU with Local APIC ID "lapic_id" or 0 if it's not known */
+unsigned mmu_numa_lapic_node(uint32_t lapic_id);
+
+/* Return the home node of the calling CPU */
+unsigned mmu_numa_this_node(void);
+
+/* Return the distance from node "from" to node "to" */
+unsigned mmu_numa_distance(unsigned from, unsigned to);
+
+/* Return the nodes ordered by their distance from "node", "node" itself first
+ * The list has mmu_numa_node_count() entries */
+const uint8_t *mmu_numa_fallback(unsigned node);
+
+#endif /* __NUMA_H__ */
@@ -2,6 +2,7 @@
 #define __PAGE_H__
 
 #include <mm/types.h>
+#include <stdbool.h>
 
 /* Initialize the memory zones according to memory map pointed to by "arg" */
 void mmu_zones_init(void *arg);
@@ -9,10 +10,22 @@ void mmu_zones_init(void *arg);
 /* Allocate one page of memory from requested memory zone
  * The size of returned chunk is [(1 << order) * PAGE_SIZE] bytes
  *
+ * Running out of memory is fatal unless "flags" contains MM_TRY
+ *
  * Return pointer to allocated page structure on success
  * Return INVALID_ADDRESS on error and set errno */
 unsigned long mmu_block_alloc(unsigned memzone, unsigned order, int flags);
 
+/* Allocate block of memory from requested memory zone of NUMA node "node"
+ *
+ * If the zone of "node" is exhausted, the block is allocated from
+ * the nearest node that has memory. mmu_block_alloc() is the same as
+ * calling this function with the home node of the calling CPU
+ *
+ * Return address of the block on success
+ * Return INVALID_ADDRESS on error and set errno */
+unsigned long mmu_block_alloc_node(unsigned node, unsigned memzone, unsigned order, int flags);
+
 /* Allocate one page of memory from requested memory zone
  * This is the same as calling: mmu_block_alloc(zone, 0);
  *
@@ -24,7 +37,8 @@ unsigned long mmu_page_alloc(unsigned memzone, int flags);
  * Try to coalesce with buddy if possible
  *
  * Return 0 on success
- * Return -EINVAL if address is not page-aligned
+ * Return -EINVAL if address is not page-aligned or the block
+ *        is not an allocated block of order "order"
  * Return -ENXIO if the address doesn't point to a valid zone */
 int mmu_block_free(unsigned long address, unsigned order);
 
@@ -38,6 +52,34 @@ int mmu_block_free(unsigned long address, unsigned order);
  * Return -ENXIO if the address doesn't point to a valid zone */
 int mmu_page_free(unsigned long address);
 
+/* Return the page array entry of the page containing physical address "address"
+ *
+ * The owner of an allocated block may use the "usage" field and
+ * the fields of the union of the entry to record what the block is used for
+ *
+ * Return NULL if "address" is not covered by the page array */
+page_t *mmu_page_get(unsigned long address);
+
+/* Return the physical address of the page described by page array entry "page" */
+unsigned long mmu_page_addr(page_t *page);
+
+/* Take a reference to the allocated block starting at "address"
+ *
+ * A block has one reference when it's allocated. Blocks that are shared,
+ * such as copy-on-write pages and page tables shared by several address
+ * spaces, have one reference for each page table entry pointing to them */
+void mmu_page_ref(unsigned long address);
+
+/* Drop a reference to the allocated block starting at "address"
+ * The block is released when the last reference is dropped
+ *
+ * Return the number of references left */
+unsigned mmu_page_unref(unsigned long address);
+
+/* Return the number of references to the block starting at "address"
+ * Return 0 if "address" doesn't point to an allocated block */
+unsigned mmu_page_refcount(unsigned long address);
+
 /* Compute correct zone for the page and mark that page as free
  * Try to coalesce adjancent blocks if possible
  *
@@ -48,4 +90,66 @@ void mmu_claim_page(unsigned long address);
  * Try to coalesce adjancent blocks if possible */
 void mmu_claim_range(unsigned long address, size_t len);
 
+/* Return the fragmentation index of "order" in zone "memzone", ie. how many
+ * percent of the zone's free memory is unusable for an allocation of "order"
+ *
+ * Return -EINVAL if "memzone" or "order" is invalid */
+int mmu_zone_frag_index(unsigned memzone, unsigned order);
+
+/* Return the number of pages that the normal and high zones of all nodes
+ * are short of twice their low watermark, ie. how much should be reclaimed */
+size_t mmu_zones_shortage(void);
+
+/* Store the physical address range of memory claimed for zone "memzone"
+ * of NUMA node "node" to "start" and "end"
+ *
+ * The range may contain holes that are not covered by the page array
+ *
+ * Return 0 on success
+ * Return -EINVAL if "node" or "memzone" is invalid
+ * Return -ENXIO if the zone has no memory */
+int mmu_zone_span(unsigned node, unsigned memzone, unsigned long *start, unsigned long *end);
+
+/* Take the free parts of the naturally aligned block of "order" at "address"
+ * out of the free lists so that the block can be compacted
+ *
+ * The block must consist only of free blocks and single user pages
+ * (pages marked MM_PU_USER). The free parts are marked MM_PU_ISOLATED
+ *
+ * Return the number of user pages in the block on success
+ * Return -EINVAL if "address" is not aligned or not covered by a zone
+ * Return -EBUSY if the block contains pages that cannot be moved */
+int mmu_block_isolate(unsigned long address, unsigned order);
+
+/* Release a block isolated using mmu_block_isolate()
+ *
+ * If all pages of the block are marked MM_PU_ISOLATED, the block
+ * is freed as a whole. Otherwise its isolated parts are freed one by one
+ *
+ * Return 0 if the whole block was freed
+ * Return -EAGAIN if some page of the block is still in use */
+int mmu_block_putback(unsigned long address, unsigned order);
+
+/* Enable the per-CPU page caches and the zero pool
+ *
+ * Before this is called, all allocations go directly to the zones.
+ * This must be called after the percpu areas have been initialized */
+void mmu_pcp_init(void);
+
+/* Zero one free page of the normal zone of this CPU's node and add it to the node's zero pool
+ *
+ * Single-page MM_ZERO allocations are served from the pool if it's not empty.
+ * This is called by idle CPUs and the pages are zeroed using non-temporal
+ * stores so that zeroing doesn't evict the caches of the CPU
+ *
+ * Return true if a page was added to the pool
+ * Return false if the pool is full or the zone is low on memory */
+bool mmu_zero_pool_refill(void);
+
+/* Print free block, split, merge and allocation failure counts
+ * and fragmentation index of each order of every zone,
+ * the hit rates of the per-CPU page caches and the zero pool
+ * and the compaction, swap and same-page merging statistics */
+void mmu_zones_print_stats(void);
+
 #endif /* __PAGE_H__ */
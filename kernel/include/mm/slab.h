@@ -5,25 +5,22 @@
 
 typedef struct mm_cache mm_cache_t;
 
-/* Initialize the SLAB cache temporarily for booting
- * Allocate 2 pages of memory from the bootmem
+/* Initialize the SLAB allocator
+ * This must be called before any cache is created
  *
  * Return 0 on success */
-int mmu_slab_preinit(void);
-
-/* Reinitialize the SLAB cache but this time for good
- * Allocate 5 pages of initial memory
- *
- * Return 0 on success
- * Return -ENOMEM if memory allocation fails */
 int mmu_slab_init(void);
 
 /* Create new cache object for objects of size "size"
+ *
+ * Objects are stored at their real size, aligned to a cache line
+ * (or to a smaller power of two if the object is small) and the slabs
+ * span 2^n pages, the order is selected so that it minimizes waste
  *
  * Return pointer to new cache on success
  * Return NULL on error and set errno to:
- *  EINVAL if the "size" is not valid
- *  ENOMEM if kmalloc fails */
+ *  EINVAL if the "size" is not valid (0 or larger than 16KB)
+ *  ENOMEM if memory allocation fails */
 mm_cache_t *mmu_cache_create(size_t size, mm_flags_t flags);
 
 /* Destroy the cache pointed to by "cache"
@@ -44,10 +41,26 @@ int mmu_cache_destroy(mm_cache_t *cache);
 void *mmu_cache_alloc_entry(mm_cache_t *c, mm_flags_t flags);
 
 /* Free entry pointed to by pointer "entry"
- * The memory will be placed into a free list
+ * The entry is placed into the magazine of this CPU and is reused
+ * by the next allocation from this cache on this CPU
  *
  * Return 0 on success
- * Return -EINVAL if either of the parameters is NULL */
+ * Return -EINVAL if either of the parameters is NULL
+ *        or "entry" doesn't belong to "cache" */
 int mmu_cache_free_entry(mm_cache_t *cache, void *entry, int flags);
 
+/* Return the empty slabs of all caches to the page allocator
+ * The objects cached in the per-CPU magazines are returned to their slabs first
+ *
+ * This is called by the page allocator when a zone runs low on memory.
+ * Caches that are locked by someone else are skipped
+ *
+ * Return the number of pages released */
+size_t mmu_caches_shrink(void);
+
+/* Print object size and alignment, slab order, objects per slab,
+ * number of slabs, empty and reclaimed slabs, objects in use and the number of bytes lost
+ * to internal fragmentation of every cache */
+void mmu_caches_print_stats(void);
+
 #endif /* __SLAB_H__ */
@@ -0,0 +1,92 @@
+#ifndef __SWAP_H__
+#define __SWAP_H__
+
+#include <mm/types.h>
+#include <stdbool.h>
+
+/* Anonymous user pages are kept on two LRU lists. New pages start on the inactive
+ * list and a page that is referenced (its accessed bit is set) while on the inactive
+ * list gets a second chance on the active list. Pages that age off the inactive
+ * list without being referenced are written to the swap area on the disk */
+
+#define SWAP_SLOT_SECTORS (PAGE_SIZE / 512) /* disk sectors per swap slot */
+
+enum MM_RECLAIM_STATUS {
+    MM_RECLAIM_GONE       = 0, /* page is not mapped where the LRU thinks it is */
+    MM_RECLAIM_BUSY       = 1, /* page is shared and can't be aged or swapped right now */
+    MM_RECLAIM_REFERENCED = 2, /* page was referenced, the accessed bit was cleared */
+    MM_RECLAIM_IDLE       = 3, /* page was not referenced */
+    MM_RECLAIM_EVICTED    = 4, /* page was swapped out and its mapping is gone */
+};
+
+/* One page given to mmu_reclaim() */
+typedef struct mm_reclaim_req {
+    unsigned long page;  /* physical address of the page */
+    struct task *task;   /* address space that maps the page */
+    unsigned long vaddr; /* address of the mapping */
+    bool evict;          /* swap the page out if it's not referenced */
+    int status;          /* what was done to the page (see MM_RECLAIM_STATUS) */
+} mm_reclaim_req_t;
+
+/* Find the swap disk and start the reclaim thread
+ *
+ * The whole AHCI disk is used as the swap area. This must be called
+ * after the scheduler has been initialized
+ *
+ * Return 0 on success
+ * Return -ENODEV if there is no disk
+ * Return -ENOMEM if the swap map can't be allocated */
+int mmu_swap_init(void);
+
+/* Put user page "address" mapped at "vaddr" of "task" on the LRU lists
+ *
+ * The page is marked MM_PU_USER. If the page is already on the lists,
+ * only the owner of the mapping is updated */
+void mmu_lru_add(unsigned long address, struct task *task, unsigned long vaddr);
+
+/* Take user page "page" off the LRU lists
+ * This must be called before the page is released or its list entry is reused */
+void mmu_lru_del(page_t *page);
+
+/* Allocate a swap slot with one reference and store its number to "slot"
+ *
+ * Return 0 on success
+ * Return -ENODEV if there is no swap area
+ * Return -ENOSPC if all slots are in use */
+int mmu_swap_alloc(unsigned long *slot);
+
+/* Take one more reference to swap slot "slot" */
+void mmu_swap_dup(unsigned long slot);
+
+/* Drop a reference to swap slot "slot", the slot is released with the last reference */
+void mmu_swap_free(unsigned long slot);
+
+/* Read the contents of swap slot "slot" to page "address"
+ *
+ * Return 0 on success
+ * Return -EIO if the disk returned an error */
+int mmu_swap_read(unsigned long slot, unsigned long address);
+
+/* Write the contents of page "address" to swap slot "slot"
+ *
+ * Return 0 on success
+ * Return -EIO if the disk returned an error */
+int mmu_swap_write(unsigned long slot, unsigned long address);
+
+/* Age the LRU lists and swap out up to "npages" inactive pages
+ *
+ * If "flags" has MM_TRY, the function gives up instead of waiting for
+ * the page tables. This is used by allocations that may hold the MMU lock.
+ * Nothing is done if another reclaim is running
+ *
+ * Return the number of pages that were swapped out */
+size_t mmu_swap_reclaim(size_t npages, int flags);
+
+/* Wake up the reclaim thread, this can be called while holding locks */
+void mmu_swap_kick(void);
+
+/* Print the sizes of the LRU lists, the number of swapped out and in pages
+ * and the usage of the swap area */
+void mmu_swap_print_stats(void);
+
+#endif /* __SWAP_H__ */
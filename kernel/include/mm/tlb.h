@@ -0,0 +1,94 @@
+#ifndef __TLB_H__
+#define __TLB_H__
+
+#include <lib/list.h>
+#include <mm/types.h>
+#include <stdbool.h>
+
+#define TLB_BATCH_MAX       16 /* number of distinct ranges a batch can hold */
+#define TLB_FLUSH_THRESHOLD 32 /* flush the whole TLB if more pages than this are invalidated */
+
+/* TLB batch gathers the invalidations of one operation so that
+ * the TLB is flushed once and other CPUs are interrupted at most once
+ * no matter how many mappings the operation changed */
+typedef struct task task_t;
+
+typedef struct mm_tlb_batch {
+    size_t nranges;      /* number of valid entries in "ranges" */
+    size_t npages;       /* total number of pages gathered */
+    bool flush_all;      /* flush the whole TLB instead of the ranges */
+    bool kernel;         /* batch contains kernel mappings which are shared by all CPUs */
+    list_head_t pages;   /* pages to release after the TLB has been flushed */
+
+    struct {
+        unsigned long start;
+        size_t npages;
+    } ranges[TLB_BATCH_MAX];
+} mm_tlb_batch_t;
+
+/* Install the TLB shootdown IPI handler */
+void mmu_tlb_init(void);
+
+/* Enable global pages and PCIDs on this CPU if they're supported
+ *
+ * If the BSP supports PCIDs, they're used unless an AP doesn't support them */
+void mmu_tlb_init_cpu(void);
+
+/* Return the CR3 value for switching to the address space of "task" on this CPU
+ *
+ * This CPU is added to the CPU mask of the address space and if PCIDs are
+ * enabled, the task is assigned a PCID and the value doesn't flush its TLB entries */
+unsigned long mmu_tlb_prepare_ctx(task_t *task);
+
+/* Initialize an empty batch */
+void mmu_tlb_batch_init(mm_tlb_batch_t *batch);
+
+/* Add "npages" pages starting at "vaddr" to "batch"
+ *
+ * Adjacent ranges are merged and if the batch grows past TLB_FLUSH_THRESHOLD
+ * pages or TLB_BATCH_MAX ranges, it's converted to a full flush */
+void mmu_tlb_batch_add(mm_tlb_batch_t *batch, unsigned long vaddr, size_t npages);
+
+/* Flush the whole address space when "batch" is flushed
+ * This is needed when upper-level page table entries are changed */
+void mmu_tlb_batch_add_all(mm_tlb_batch_t *batch);
+
+/* Release allocated page "page" when "batch" has been flushed
+ *
+ * The page may still be in the TLB of some CPU until then,
+ * so it must not be reused before that */
+void mmu_tlb_batch_add_page(mm_tlb_batch_t *batch, page_t *page);
+
+/* Invalidate the gathered ranges on this CPU and on every other CPU
+ * that may have them in its TLB and release the gathered pages
+ *
+ * User mappings are invalidated on the CPUs that have run the current
+ * address space and kernel mappings on all online CPUs.
+ * The function returns when all CPUs have flushed their TLBs
+ *
+ * The batch is empty after this call and it can be reused
+ *
+ * This must not be called while holding a spinlock
+ * that another CPU may spin on with interrupts disabled */
+void mmu_tlb_batch_flush(mm_tlb_batch_t *batch);
+
+/* Invalidate the TLB entry of "vaddr" on all CPUs that may have it */
+void mmu_tlb_flush_page(unsigned long vaddr);
+
+/* Flush all TLB entries of the address space of "task" on every CPU
+ *
+ * Unlike mmu_tlb_batch_flush(), "task" doesn't have to be the running task.
+ * This must not be called while holding a spinlock
+ * that another CPU may spin on with interrupts disabled */
+void mmu_tlb_flush_task(task_t *task);
+
+/* Handle the shootdown requests sent to this CPU
+ *
+ * Code that waits for another CPU with interrupts disabled must call this
+ * while waiting because the other CPU may be waiting for this CPU's TLB flush */
+void mmu_tlb_poll(void);
+
+/* Print the number of local flushes and sent and received shootdown IPIs of each CPU */
+void mmu_tlb_print_stats(void);
+
+#endif /* __TLB_H__ */
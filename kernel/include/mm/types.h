@@ -9,6 +9,9 @@
 #define BUDDY_MAX_ORDER 16
 #define PAGE_SHIFT      12
 
+#define HUGE_PAGE_ORDER 9 /* order of the block mapped by one 2MB page */
+#define HUGE_PAGE_SIZE  (PAGE_SIZE << HUGE_PAGE_ORDER)
+
 #define MM_SET_FLAG(value, flag)   (value |= flag)
 #define MM_UNSET_FLAG(value, flag) (value &= ~flag)
 #define MM_TEST_FLAG(value, flag)  (value & flag)
@@ -23,7 +26,8 @@ enum MM_PAGE_FLAGS {
     MM_ACCESSED   = 1 << 5,
     MM_SIZE_4MB   = 1 << 6,
 #ifdef __amd64__
-    MM_2MB        = 1 << 7, // TODO
+    MM_2MB        = 1 << 7,
+    MM_GLOBAL     = 1 << 8, /* mapping is not flushed on address space switch */
 #endif
     MM_COW        = 1 << 9,
 };
@@ -31,35 +35,67 @@ enum MM_PAGE_FLAGS {
 typedef enum MM_ALLOC_FLAGS {
     MM_NO_FLAGS  = 0 << 0, /* no allocation flags */
     MM_ZERO      = 1 << 0, /* zero the memory before returning it */
-    MM_HIGH_PRIO = 1 << 1  /* tap into high-priority pools */
+    MM_HIGH_PRIO = 1 << 1, /* tap into high-priority pools */
+    MM_TRY       = 1 << 2  /* fail instead of panicking if there's no free memory */
 } mm_flags_t;
 
+/* All zones are mapped to the kernel address space. Normal zone is
+ * the memory that devices with 32-bit DMA addresses can access.
+ * Allocations from high zone fall back to normal zone */
 enum MM_ZONES {
     MM_ZONE_DMA,     /* 0MB  - 16MB */
-    MM_ZONE_NORMAL,  /* 16MB - 2GB */
-    MM_ZONE_HIGH,    /* 2GB  -  */
+    MM_ZONE_NORMAL,  /* 16MB - 4GB */
+    MM_ZONE_HIGH,    /* 4GB  -  */
 };
 
 enum MM_ZONE_RANGES {
     MM_ZONE_DMA_START    = 0x0000000000000000,
     MM_ZONE_DMA_END      = 0x0000000001000000,
     MM_ZONE_NORMAL_START = 0x0000000001000000,
-    MM_ZONE_NORMAL_END   = 0xffffffffffffffff,
-    MM_ZONE_HIGH_START   = 0xffffffffffffffff,
+    MM_ZONE_NORMAL_END   = 0x0000000100000000,
+    MM_ZONE_HIGH_START   = 0x0000000100000000,
     MM_ZONE_HIGH_END     = 0xffffffffffffffff,
 };
 
+#define MM_PHYS_MAX (512UL << 30) /* physical memory above this is not managed */
+
 enum MM_PAGE_TYPES {
     MM_PT_INVALID = 0 << 0,
     MM_PT_FREE    = 1 << 0,
     MM_PT_IN_USE  = 1 << 1,
 };
 
+enum MM_PAGE_USAGE {
+    MM_PU_NONE     = 0,      /* page is free or its user doesn't track it */
+    MM_PU_SLAB     = 1 << 0, /* page belongs to a slab of a cache */
+    MM_PU_KMALLOC  = 1 << 1, /* page belongs to a large kmalloc() allocation */
+    MM_PU_VMALLOC  = 1 << 2, /* page is the first page of a vmalloc() allocation */
+    MM_PU_USER     = 1 << 3, /* anonymous page of a user address space, can be migrated */
+    MM_PU_ISOLATED = 1 << 4, /* page is held by compaction (see mmu_block_isolate()) */
+};
+
+enum MM_PAGE_LRU {
+    MM_LRU_NONE     = 0, /* page is not on an LRU list */
+    MM_LRU_ACTIVE   = 1, /* page has been referenced recently */
+    MM_LRU_INACTIVE = 2, /* page is a candidate for swapping out */
+    MM_LRU_RECLAIM  = 3, /* page has been taken off the lists by reclaim */
+};
+
 typedef struct page {
-    list_head_t list;
+    union {
+        list_head_t list;       /* free list entry (only valid for first page of free block)
+                                 * or LRU list entry (only valid for MM_PU_USER) */
+        struct mm_cache *cache; /* cache that owns the page (only valid for MM_PU_SLAB) */
+        size_t size;            /* size of the allocation (only valid for MM_PU_KMALLOC/VMALLOC) */
+    };
+    struct task *task;   /* address space that maps the page (only valid for MM_PU_USER) */
+    unsigned long vaddr; /* where "task" maps the page (only valid for MM_PU_USER) */
     uint8_t type:2;   /* type of memory (see MM_PAGE_TYPES) */
     uint8_t order:5;  /* order of block (0 - BUDDY_MAX_ORDER - 1) */
     uint8_t first:1;  /* is this the first block of a range? */
+    uint8_t usage:5;  /* what an allocated page is used for (see MM_PAGE_USAGE) */
+    uint8_t lru:2;    /* LRU list of a user page (see MM_PAGE_LRU) */
+    uint32_t ref;     /* reference count of an allocated block (only valid for first page) */
 } page_t;
 
 #endif /* __MMU_TYPES_H__ */
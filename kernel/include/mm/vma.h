@@ -0,0 +1,120 @@
+#ifndef __VMA_H__
+#define __VMA_H__
+
+#include <lib/list.h>
+#include <mm/types.h>
+#include <sys/types.h>
+
+#define USER_SPACE_END 0x0000800000000000
+#define USER_MMAP_BASE 0x0000200000000000 /* mmap() places areas above this if no address is given */
+#define USER_STACK_MAX (8 * 1024 * 1024) /* stack can grow at most to 8MB */
+
+typedef struct task task_t;
+typedef struct file file_t;
+
+enum MM_VMA_FLAGS {
+    VM_READ      = 1 << 0,
+    VM_WRITE     = 1 << 1,
+    VM_EXEC      = 1 << 2,
+    VM_GROWSDOWN = 1 << 3, /* area is a stack and grows down on page faults below it */
+    VM_SHARED    = 1 << 4, /* writes to a file-backed area are visible to the file */
+};
+
+/* Virtual memory area is a range of user address space
+ * that has been reserved for some purpose
+ *
+ * The pages of an area are allocated when they're first touched
+ * and the page fault handler uses the areas to decide whether the fault is valid
+ *
+ * Pages of file-backed areas are the pages of the file (see file_get_page()).
+ * Private areas map them copy-on-write and shared areas map them directly */
+typedef struct mm_vma {
+    unsigned long start; /* first address of the area (page-aligned) */
+    unsigned long end;   /* first address after the area (page-aligned) */
+    unsigned flags;      /* see MM_VMA_FLAGS */
+    file_t *file;        /* backing file or NULL for anonymous memory */
+    off_t offset;        /* file offset of "start" (page-aligned) */
+    list_head_t list;    /* entry in task's list of areas (sorted by start address) */
+} mm_vma_t;
+
+/* Initialize the cache for virtual memory areas */
+int mmu_vma_init(void);
+
+/* Create new area [start, end) for task "t"
+ *
+ * Return pointer to the area on success
+ * Return NULL on error and set errno to:
+ *   EINVAL if the range is not page-aligned or not in user space
+ *   EEXIST if the range overlaps with an existing area
+ *   ENOMEM if allocation failed */
+mm_vma_t *mmu_vma_create(task_t *t, unsigned long start, unsigned long end, unsigned flags);
+
+/* Create new area of "len" bytes for task "t" backed by "file" starting at "offset"
+ * or anonymous memory if "file" is NULL. The area takes a reference to "file"
+ *
+ * If "addr" is not 0 and the range starting at it is free, the area is placed there.
+ * Otherwise the area is placed to the first free range above USER_MMAP_BASE
+ *
+ * Return the start address of the area on success
+ * Return INVALID_ADDRESS on error and set errno to:
+ *   EINVAL if "addr" or "offset" is not page-aligned or "len" is 0
+ *   ENOMEM if there is no free range or allocation failed */
+unsigned long mmu_vma_map(task_t *t, unsigned long addr, size_t len, unsigned flags,
+                          file_t *file, off_t offset);
+
+/* Remove range [start, start + len) from the areas of task "t"
+ *
+ * Areas that are partially inside the range are shrunk or split.
+ * The pages of the range are unmapped, "t" must be current task
+ *
+ * Return 0 on success
+ * Return -EINVAL if "start" is not page-aligned or the range is not in user space
+ * Return -ENOMEM if an area had to be split and allocation failed */
+int mmu_vma_unmap(task_t *t, unsigned long start, size_t len);
+
+/* Write the present pages of range [start, start + len) back to the files
+ * of the shared writable areas of task "t". "t" must be current task
+ *
+ * Return 0 on success
+ * Return -EINVAL if "start" is not page-aligned
+ * Return -ENOMEM if some part of the range is not mapped
+ * Return -EIO if writing to a file failed */
+int mmu_vma_sync(task_t *t, unsigned long start, size_t len);
+
+/* Return the area of task "t" that contains "addr" or NULL if there is no such area */
+mm_vma_t *mmu_vma_find(task_t *t, unsigned long addr);
+
+/* Copy all areas of "src" to "dst" (used when forking)
+ *
+ * Return 0 on success
+ * Return -ENOMEM if allocation failed */
+int mmu_vma_copy(task_t *dst, task_t *src);
+
+/* Release all areas of task "t" and their references to files
+ * This doesn't touch the page tables of "t" */
+void mmu_vma_destroy(task_t *t);
+
+/* Unmap and release all areas of current task "t" (used when executing a new image)
+ *
+ * Unlike mmu_vma_destroy(), the pages of the areas are unmapped
+ * and released too so nothing of the old image stays mapped */
+void mmu_vma_unmap_all(task_t *t);
+
+/* Handle page fault at "addr" of current task using its areas
+ *
+ * If "addr" is not inside any area but right below a stack area,
+ * the stack is grown to cover "addr"
+ *
+ * Not present pages are allocated, zeroed and mapped using
+ * the protection of the area. When all pages of an aligned 2MB
+ * region of the area are present, the region is promoted to a 2MB page
+ *
+ * Pages of file-backed areas are taken from the file. Private areas copy
+ * the page on write and shared areas write to the page of the file
+ *
+ * Return 0 if the fault was handled
+ * Return -EFAULT if the access is not allowed
+ * Return -ENOMEM if there's no memory for the page */
+int mmu_vma_fault(task_t *t, unsigned long addr, bool write);
+
+#endif /* __VMA_H__ */
@@ -0,0 +1,34 @@
+#ifndef __VMALLOC_H__
+#define __VMALLOC_H__
+
+#include <mm/types.h>
+
+/* Kernel virtual region for vmalloc() (1GB)
+ *
+ * The region is mapped in the kernel half of the address space
+ * so the mappings are shared by all address spaces */
+#define VMALLOC_START 0xffffffc000000000
+#define VMALLOC_SIZE  0x0000000040000000
+#define VMALLOC_END   (VMALLOC_START + VMALLOC_SIZE)
+
+/* Initialize the virtual region allocator */
+int mmu_vmalloc_init(void);
+
+/* Allocate "size" bytes of virtually contiguous memory
+ *
+ * The memory is backed by individual pages which are not physically
+ * contiguous so it must not be used for DMA
+ *
+ * Return pointer to memory on success
+ * Return NULL on error and set errno to:
+ *  EINVAL if "size" is 0
+ *  ENOMEM if there's not enough physical memory or virtual address space */
+void *vmalloc(size_t size);
+
+/* Release memory allocated by vmalloc()
+ *
+ * The pages are unmapped and released after the TLBs of all CPUs
+ * have been flushed once for the whole allocation */
+void vfree(void *addr);
+
+#endif /* __VMALLOC_H__ */
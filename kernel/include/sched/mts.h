@@ -3,6 +3,7 @@
 
 #include <sched/task.h>
 #include <errno.h>
+#include <stdbool.h>
 
 enum SCHED_STATUS {
     ST_OK      = 0,
@@ -13,6 +14,14 @@ enum SCHED_STATUS {
     ST_ENOENT  = -ENOENT
 };
 
+typedef struct mts_stats {
+    size_t nready;        /* tasks waiting in the run queue */
+    size_t nexec;         /* task switches */
+    size_t nmigrated_in;  /* tasks moved to the CPU by the load balancer */
+    size_t nmigrated_out; /* tasks moved away from the CPU by the load balancer */
+    size_t nstolen;       /* tasks pulled while the CPU had nothing to run */
+} mts_stats_t;
+
 /* Initialize MTS and allocate space for run queueus
  * mts_init() shoul be called only once!
  *
@@ -24,8 +33,7 @@ int mts_init(void);
  * as an initialization method before it starts the scheduler
  * to initialize the per-cpu related structures
  *
- * Return ST_OK on success
- * Return ST_ENOMEM if allocating the priority queue failed */
+ * Return ST_OK on success */
 int mts_init_cpu(task_t *idle);
 
 /* mts_tick() is the driving force of MTS. It should be called periodically
@@ -128,4 +136,21 @@ task_t *mts_get_next(void);
  * Return NULL if MTS has not been started */
 task_t *mts_get_active(void);
 
+/* Return true if this CPU needs the periodic scheduler tick, ie. if there
+ * are tasks waiting for the CPU. The running task alone or the idle task
+ * can run without the tick until another task is queued to the CPU
+ *
+ * When the tick of a CPU is stopped, tasks queued to it kick the CPU
+ * and so does a busy CPU for one idle CPU so that it can steal work */
+bool mts_need_tick(void);
+
+/* Store the run queue and load balancing statistics of CPU "cpu" to "stats"
+ *
+ * Return ST_OK on success
+ * Return ST_EINVAL if "cpu" is not running MTS or "stats" is NULL */
+int mts_get_stats(unsigned cpu, mts_stats_t *stats);
+
+/* Print the run queue and load balancing statistics of every CPU */
+void mts_print_stats(void);
+
 #endif /* __MTS_H__ */
@@ -108,14 +108,21 @@ typedef struct task {
     list_head_t list;            /* list for scheduler's run/wait queues */
     list_head_t children;        /* list for this tasks's children */
     list_head_t zombies;         /* list of children that have zombified */
+    list_head_t tasks;           /* entry in the list of all tasks */
 
     wait_queue_t wq;             /* wait queue object used for blocking the task execution */
     wait_queue_head_t wqh_child; /* wait queue head to wait for wait() to finish */
 
     void *dir;                   /* virtual  address of the page directory  */
     unsigned long cr3;           /* physical address of the page directory */
+    unsigned long cpu_mask;      /* CPUs that may have TLB entries of the address space */
+    unsigned long asid;          /* PCID of the address space and its generation */
+
+    list_head_t vmas;            /* virtual memory areas of the task (sorted by address) */
+    spinlock_t vma_lock;         /* protects "vmas" */
 
     unsigned cpu;                /* on which cpu is this task waiting/executing */
+    void *sched;                 /* scheduler's entry of the task, NULL if not scheduled */
 } task_t;
 
 int sched_task_add_thread(task_t *parent, thread_t *child);
@@ -132,6 +139,13 @@ void sched_free_threads(task_t *t);
  * NOTE: this function should be called be sched_init and no one else */
 int sched_task_init(void);
 
+/* Call "func" for every task that has an address space
+ *
+ * The list of tasks is locked during the iteration so "func" must not create
+ * or destroy tasks. A task is guaranteed to have a valid page directory
+ * until "func" returns */
+void sched_task_for_each(void (*func)(task_t *, void *), void *arg);
+
 /* Release all memory used by the task "t"
  *
  * Return 0 on success
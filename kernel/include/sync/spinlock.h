@@ -14,6 +14,19 @@ static inline void spin_acquire(spinlock_t *s)
     } while (tmp);
 }
 
+/* Try to acquire the lock without spinning
+ *
+ * Return 1 if the lock was acquired
+ * Return 0 if the lock is held by someone else */
+static inline int spin_try_acquire(spinlock_t *s)
+{
+    spinlock_t tmp = 1;
+
+    asm volatile ("xchgb %0, %1" : "+r" (tmp), "+m" (*s));
+
+    return tmp == 0;
+}
+
 static inline void spin_release(spinlock_t *s)
 {
     spinlock_t tmp = 0;
@@ -0,0 +1,25 @@
+#ifndef __SYS_MMAN_H__
+#define __SYS_MMAN_H__
+
+#define MAP_FAILED ((void *)-1)
+
+enum {
+    PROT_NONE  = 0,
+    PROT_READ  = 1 << 0,
+    PROT_WRITE = 1 << 1,
+    PROT_EXEC  = 1 << 2
+};
+
+enum {
+    MAP_SHARED    = 1 << 0,
+    MAP_PRIVATE   = 1 << 1,
+    MAP_FIXED     = 1 << 4,
+    MAP_ANONYMOUS = 1 << 5
+};
+
+enum {
+    MS_ASYNC = 1 << 0,
+    MS_SYNC  = 1 << 2
+};
+
+#endif /* __SYS_MMAN_H__ */
@@ -0,0 +1,23 @@
+#ifndef __SYS_TIME_H__
+#define __SYS_TIME_H__
+
+#include <sys/types.h>
+
+#define NSEC_PER_SEC  1000000000UL
+#define NSEC_PER_MSEC 1000000UL
+#define NSEC_PER_USEC 1000UL
+
+typedef int64_t time_t;
+typedef int     clockid_t;
+
+struct timespec {
+    time_t tv_sec;  /* seconds */
+    long   tv_nsec; /* nanoseconds [0, 999999999] */
+};
+
+enum {
+    CLOCK_REALTIME  = 0,
+    CLOCK_MONOTONIC = 1,
+};
+
+#endif /* __SYS_TIME_H__ */
@@ -8,6 +8,7 @@
 #include <kernel/kprint.h>
 #include <kernel/util.h>
 #include <mm/mmu.h>
+#include <mm/numa.h>
 #include <sys/types.h>
 #include <errno.h>
 #include <stdbool.h>
@@ -146,21 +147,24 @@ static int __acpica_init(void)
     return 0;
 }
 
-/* return pointer to the start or RSD Descriptor if found, NULL otherwise */
+/* return pointer to the start or RSD Descriptor if found, NULL otherwise
+ *
+ * The areas are accessed through the direct map so that the descriptor
+ * can be found before the page allocator has been initialized */
 static unsigned long *__find_rspd_start(unsigned long start, unsigned long end)
 {
     const char *needle = "RSD PTR ";
     const size_t nlen  = kstrlen(needle);
 
     for (size_t i = start; i < end; i += nlen) {
-        uint8_t *ptr = (uint8_t *)i;
+        uint8_t *ptr = mmu_p_to_v(i);
 
         for (size_t k = 0; k < nlen; ++k) {
             if (ptr[k] != needle[k])
                 goto end;
         }
 
-        return (unsigned long *)i;
+        return (unsigned long *)ptr;
 end:;
     }
 
@@ -188,37 +192,168 @@ static bool __validate_rspd_description(struct rspd_desc *desc)
     return ((total_size & 0xff) == 0);
 }
 
-int acpi_init(void)
+/* Find and validate the RSD Descriptor
+ * The descriptor is searched only once and then cached
+ *
+ * Return pointer to the descriptor on success
+ * Return NULL on error and set errno to:
+ *   ENXIO  if the descriptor was not found
+ *   EINVAL if the descriptor is not valid */
+static struct rspd_desc *__get_rspd_desc(void)
 {
-    if ((rspd_start = __find_rspd_start(0x00080000, 0x0009FFFF)) == NULL) {
+    if (rspd_start != NULL)
+        return rspd_start;
+
+    unsigned long *start = NULL;
+
+    if ((start = __find_rspd_start(0x00080000, 0x0009FFFF)) == NULL) {
         kdebug("RSDP start not found from Extended BIOS Data Area!");
 
-        if ((rspd_start = __find_rspd_start(0x000E0000, 0x000FFFFF)) == NULL) {
+        if ((start = __find_rspd_start(0x000E0000, 0x000FFFFF)) == NULL) {
             kdebug("RSDP start not Upper memory (0x%x - 0x%x", 0x000E0000, 0x000FFFFF);
-            return -ENXIO;
+            errno = ENXIO;
+            return NULL;
         }
     }
 
-    /* RSDP start has been found, now validate the structure and initialize ACPI */
-    struct rspd_desc *desc = (struct rspd_desc *)rspd_start;
-
-    if (!__validate_rspd_description(desc)) {
-        kdebug("RSDP Descriptor from address 0x%x is not valid!", rspd_start);
-        return -EINVAL;
+    if (!__validate_rspd_description((struct rspd_desc *)start)) {
+        kdebug("RSDP Descriptor from address 0x%x is not valid!", start);
+        errno = EINVAL;
+        return NULL;
     }
 
-    struct rspd_table *table = (struct rspd_table *)(unsigned long)desc->rstd_addr;
+    return rspd_start = start;
+}
+
+/* Return pointer to the table with signature "sig" or NULL if it's not listed in RSDT
+ *
+ * The tables may be anywhere in physical memory so they're accessed through the direct map */
+static void *__find_table(struct rspd_desc *desc, const char *sig)
+{
+    struct rspd_table *table = mmu_p_to_v(desc->rstd_addr);
     size_t num_entries       = (table->hdr.length - 36) / 4;
 
     for (uint32_t i = 0; i < num_entries; ++i) {
-        struct desc_header *desc_hdr =
-            (struct desc_header *)(unsigned long)table->entry_address[i];
+        struct desc_header *desc_hdr = mmu_p_to_v(table->entry_address[i]);
 
-        if (kstrncmp((char *)desc_hdr->hdr.signature, "APIC", 3) == 0)
-            mapic = mmu_p_to_v((unsigned long)desc_hdr);
+        if (kstrncmp((char *)desc_hdr->hdr.signature, sig, 4) == 0)
+            return desc_hdr;
     }
 
-    if (mapic == NULL) {
+    return NULL;
+}
+
+/* Processor Local APIC affinity */
+static void __srat_cpu_affinity(ACPI_TABLE_SRAT *srat, ACPI_SRAT_CPU_AFFINITY *cpu)
+{
+    uint32_t pxm = cpu->ProximityDomainLo;
+
+    if (!(cpu->Flags & ACPI_SRAT_CPU_USE_AFFINITY))
+        return;
+
+    /* the upper bytes of the proximity domain are reserved before revision 2 */
+    if (srat->Header.Revision >= 2) {
+        pxm |= (uint32_t)cpu->ProximityDomainHi[0] << 8;
+        pxm |= (uint32_t)cpu->ProximityDomainHi[1] << 16;
+        pxm |= (uint32_t)cpu->ProximityDomainHi[2] << 24;
+    }
+
+    (void)mmu_numa_add_cpu(cpu->ApicId, pxm);
+}
+
+/* Processor Local x2APIC affinity */
+static void __srat_x2apic_affinity(ACPI_SRAT_X2APIC_CPU_AFFINITY *cpu)
+{
+    if (cpu->Flags & ACPI_SRAT_CPU_ENABLED)
+        (void)mmu_numa_add_cpu(cpu->ApicId, cpu->ProximityDomain);
+}
+
+/* Memory affinity */
+static void __srat_mem_affinity(ACPI_SRAT_MEM_AFFINITY *mem)
+{
+    if (!(mem->Flags & ACPI_SRAT_MEM_ENABLED))
+        return;
+
+    if (mmu_numa_add_memory(mem->ProximityDomain, mem->BaseAddress, mem->Length) < 0)
+        kdebug("ignoring memory 0x%x - 0x%x of proximity domain %u",
+                mem->BaseAddress, mem->BaseAddress + mem->Length, mem->ProximityDomain);
+}
+
+static void __parse_srat(ACPI_TABLE_SRAT *srat)
+{
+    uint8_t *ptr = (uint8_t *)(srat + 1);
+    uint8_t *end = (uint8_t *)srat + srat->Header.Length;
+
+    while (ptr + sizeof(ACPI_SUBTABLE_HEADER) <= end) {
+        ACPI_SUBTABLE_HEADER *hdr = (ACPI_SUBTABLE_HEADER *)ptr;
+
+        if (hdr->Length == 0 || ptr + hdr->Length > end)
+            break;
+
+        switch (hdr->Type) {
+            case ACPI_SRAT_TYPE_CPU_AFFINITY:
+                __srat_cpu_affinity(srat, (ACPI_SRAT_CPU_AFFINITY *)ptr);
+                break;
+
+            case ACPI_SRAT_TYPE_MEMORY_AFFINITY:
+                __srat_mem_affinity((ACPI_SRAT_MEM_AFFINITY *)ptr);
+                break;
+
+            case ACPI_SRAT_TYPE_X2APIC_CPU_AFFINITY:
+                __srat_x2apic_affinity((ACPI_SRAT_X2APIC_CPU_AFFINITY *)ptr);
+                break;
+        }
+
+        ptr += hdr->Length;
+    }
+}
+
+/* SLIT is a matrix of distances between localities (proximity domains) */
+static void __parse_slit(ACPI_TABLE_SLIT *slit)
+{
+    uint64_t count = slit->LocalityCount;
+
+    if (sizeof(ACPI_TABLE_HEADER) + sizeof(uint64_t) + count * count > slit->Header.Length) {
+        kdebug("SLIT is truncated, ignoring it");
+        return;
+    }
+
+    for (uint64_t i = 0; i < count; ++i) {
+        for (uint64_t k = 0; k < count; ++k)
+            mmu_numa_set_distance(i, k, slit->Entry[i * count + k]);
+    }
+}
+
+int acpi_numa_init(void)
+{
+    struct rspd_desc *desc = NULL;
+    ACPI_TABLE_SRAT *srat  = NULL;
+    ACPI_TABLE_SLIT *slit  = NULL;
+
+    if ((desc = __get_rspd_desc()) == NULL)
+        return -errno;
+
+    if ((srat = __find_table(desc, ACPI_SIG_SRAT)) == NULL) {
+        kdebug("SRAT not found, all memory belongs to one node");
+        return -ENXIO;
+    }
+
+    __parse_srat(srat);
+
+    if ((slit = __find_table(desc, ACPI_SIG_SLIT)) != NULL)
+        __parse_slit(slit);
+
+    return 0;
+}
+
+int acpi_init(void)
+{
+    struct rspd_desc *desc = NULL;
+
+    if ((desc = __get_rspd_desc()) == NULL)
+        return -errno;
+
+    if ((mapic = __find_table(desc, "APIC")) == NULL) {
         kdebug("Multiple APIC not found!");
         return -EINVAL;
     }
@@ -0,0 +1,230 @@
+#include <kernel/clock.h>
+#include <kernel/common.h>
+#include <kernel/compiler.h>
+#include <kernel/cpu.h>
+#include <kernel/kassert.h>
+#include <kernel/kprint.h>
+#include <kernel/percpu.h>
+#include <kernel/tick.h>
+#include <sched/sched.h>
+#include <sched/task.h>
+#include <sys/time.h>
+#include <errno.h>
+#include <stdbool.h>
+
+#define CLOCK_SYNC_ROUNDS 16
+
+#define CPUID_ADV_PM      0x80000007 /* advanced power management leaf */
+#define CPUID_INV_TSC     (1 << 8)   /* the TSC runs at a constant rate in all states */
+
+enum {
+    SYNC_IDLE    = 0,
+    SYNC_REQUEST = 1,
+    SYNC_REPLY   = 2,
+};
+
+/* The counter is converted to nanoseconds with a multiplication and
+ * a shift: ns = (tsc * mult) >> 32, where mult = (10^9 << 32) / tsc_hz */
+static struct {
+    uint64_t base; /* counter of the BSP when the clock was started */
+    uint64_t mult;
+    bool ready;
+} clock;
+
+/* Mailbox used by the APs to read the counter of the BSP */
+static struct {
+    uint64_t bsp_tsc;
+    int state;
+} sync;
+
+/* what must be added to the counter of this CPU to get the counter of the BSP */
+__percpu static int64_t tsc_offset = 0;
+
+void clock_init(uint64_t tsc_hz)
+{
+    uint32_t eax, ebx, ecx, edx;
+
+    /* the APs calibrate their timers too but the BSP's measurement is used */
+    if (clock.ready || !tsc_hz)
+        return;
+
+    cpuid(CPUID_ADV_PM, 0, &eax, &ebx, &ecx, &edx);
+
+    if (!(edx & CPUID_INV_TSC))
+        kdebug("TSC is not invariant, the monotonic clock may drift");
+
+    clock.mult = (uint64_t)(((__uint128_t)NSEC_PER_SEC << 32) / tsc_hz);
+    clock.base = rdtsc();
+
+    WRITE_ONCE(clock.ready, true);
+}
+
+uint64_t clock_monotonic_ns(void)
+{
+    uint64_t flags = 0;
+    uint64_t tsc   = 0;
+
+    if (!READ_ONCE(clock.ready))
+        return 0;
+
+    /* the offset and the counter must be read on the same CPU */
+    flags = irq_save();
+    tsc   = rdtsc() + get_thiscpu_var(tsc_offset);
+    irq_restore(flags);
+
+    if (tsc < clock.base)
+        return 0;
+
+    return (uint64_t)(((__uint128_t)(tsc - clock.base) * clock.mult) >> 32);
+}
+
+/* The AP asks the BSP for its counter several times and
+ * the round with the shortest round trip gives the offset. The BSP's
+ * counter was read somewhere within the round trip so it's assumed
+ * to have been read in the middle of it */
+void clock_sync_ap(void)
+{
+    uint64_t best  = ~0ULL;
+    int64_t offset = 0;
+
+    if (!READ_ONCE(clock.ready))
+        return;
+
+    for (size_t i = 0; i < CLOCK_SYNC_ROUNDS; ++i) {
+        uint64_t start, end, bsp;
+
+        start = rdtsc();
+        WRITE_ONCE(sync.state, SYNC_REQUEST);
+
+        while (READ_ONCE(sync.state) != SYNC_REPLY)
+            cpu_relax();
+
+        end = rdtsc();
+        bsp = READ_ONCE(sync.bsp_tsc);
+        WRITE_ONCE(sync.state, SYNC_IDLE);
+
+        if (end - start < best) {
+            best   = end - start;
+            offset = (int64_t)(bsp - (start + best / 2));
+        }
+    }
+
+    /* the counters were reset at the same time and the difference is just noise */
+    if ((uint64_t)(offset < 0 ? -offset : offset) < best)
+        offset = 0;
+
+    get_thiscpu_var(tsc_offset) = offset;
+}
+
+void clock_sync_serve(void)
+{
+    if (READ_ONCE(sync.state) != SYNC_REQUEST)
+        return;
+
+    WRITE_ONCE(sync.bsp_tsc, rdtsc());
+    __sync_synchronize();
+    WRITE_ONCE(sync.state, SYNC_REPLY);
+}
+
+/* Called by either of the timers of the waiter. Only the first one wakes up the task
+ *
+ * The waiter of clock_sleep() is on the stack of the task so it must
+ * not be touched once the task may run again */
+static void __wait_expired(void *ctx)
+{
+    clock_waiter_t *waiter = ctx;
+    task_t *task           = NULL;
+
+    spin_acquire(&waiter->lock);
+
+    if (waiter->sleeping) {
+        waiter->sleeping = false;
+        task             = waiter->task;
+    }
+
+    spin_release(&waiter->lock);
+
+    if (task)
+        sched_task_set_state(task, T_READY);
+}
+
+int clock_wait(clock_waiter_t *waiter, uint64_t ns)
+{
+    kassert(waiter != NULL);
+
+    task_t *current = sched_get_active();
+    uint64_t now    = clock_monotonic_ns();
+    uint64_t flags  = 0;
+    int ret         = 0;
+
+    kassert(current != NULL);
+
+    /* The timeout is installed on this CPU and the lock is held until
+     * the task has been blocked so neither of the timers can wake up the task
+     * before it's asleep. Interrupts stay disabled until the task is switched out */
+    flags = irq_save();
+    spin_acquire(&waiter->lock);
+
+    if (READ_ONCE(waiter->woken))
+        goto end;
+
+    waiter->task             = current;
+    waiter->timeout.expires  = (ns > ~0ULL - now) ? ~0ULL : now + ns;
+    waiter->timeout.callback = __wait_expired;
+    waiter->timeout.ctx      = waiter;
+
+    if ((ret = tick_install_hrtimer(&waiter->timeout)) < 0)
+        goto end;
+
+    /* If clock_wakeup() was called after the check above, it either saw
+     * the timeout pending and installed its own timer, which then waits for
+     * the lock, or it didn't and the sleep is skipped here */
+    if (READ_ONCE(waiter->woken)) {
+        (void)tick_cancel_hrtimer(&waiter->timeout);
+        goto end;
+    }
+
+    waiter->sleeping = true;
+    sched_task_set_state(current, T_BLOCKED);
+    spin_release(&waiter->lock);
+
+    sched_switch();
+
+    (void)tick_cancel_hrtimer(&waiter->timeout);
+    spin_acquire(&waiter->lock);
+
+end:
+    /* the wakeup has been noticed, the next one installs the timer again */
+    (void)tick_cancel_hrtimer(&waiter->wakeup);
+    WRITE_ONCE(waiter->woken, false);
+
+    spin_release(&waiter->lock);
+    irq_restore(flags);
+
+    return ret;
+}
+
+void clock_wakeup(clock_waiter_t *waiter)
+{
+    kassert(waiter != NULL);
+
+    /* only the first call after clock_wait() has noticed the previous one does anything */
+    if (__sync_lock_test_and_set(&waiter->woken, true))
+        return;
+
+    /* The timer expires immediately and its callback runs in the timer interrupt of
+     * this CPU. If this CPU's timers are not ready, the task wakes up on time */
+    waiter->wakeup.expires  = 0;
+    waiter->wakeup.callback = __wait_expired;
+    waiter->wakeup.ctx      = waiter;
+
+    (void)tick_install_hrtimer(&waiter->wakeup);
+}
+
+int clock_sleep(uint64_t ns)
+{
+    clock_waiter_t waiter = { 0 };
+
+    /* nobody else knows about the waiter so only the timeout can end the sleep */
+    return clock_wait(&waiter, ns);
+}
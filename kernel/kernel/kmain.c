@@ -5,6 +5,7 @@
 #include <drivers/bus/pci.h>
 #include <drivers/device.h>
 #include <kernel/acpi/acpi.h>
+#include <kernel/clock.h>
 #include <kernel/gdt.h>
 #include <kernel/idt.h>
 #include <kernel/irq.h>
@@ -15,8 +16,13 @@
 #include <kernel/percpu.h>
 #include <kernel/tick.h>
 #include <kernel/util.h>
+#include <mm/compact.h>
 #include <mm/heap.h>
+#include <mm/ksm.h>
 #include <mm/mmu.h>
+#include <mm/page.h>
+#include <mm/swap.h>
+#include <mm/tlb.h>
 #include <fs/binfmt.h>
 #include <fs/fs.h>
 #include <sched/task.h>
@@ -28,7 +34,6 @@
 
 /* defined by the linker */
 extern uint8_t _percpu_start, _percpu_end;
-extern uint8_t _kernel_physical_end;
 extern uint8_t _trampoline_start;
 extern uint8_t _trampoline_end;
 
@@ -54,6 +59,10 @@ void init_bsp(void *arg)
     acpi_init();
     ioapic_initialize_all();
     lapic_initialize();
+    tick_init_timer();
+
+    /* TLB shootdowns are sent to other CPUs using IPIs */
+    mmu_tlb_init();
 
     /* initialize the vfs subsystem so that new devices can be registered to devfs */
     vfs_init();
@@ -71,24 +80,24 @@ void init_bsp(void *arg)
     size_t trmp_size = (size_t)&_trampoline_end - (size_t)&_trampoline_start;
     kmemcpy((uint8_t *)0x55000, &_trampoline_start, trmp_size);
 
-    /* initialize the percpu areas for all processors */
-    unsigned long kernel_end = (unsigned long)&_kernel_physical_end;
-    unsigned long pcpu_start = ROUND_UP(kernel_end, PAGE_SIZE);
-    size_t pcpu_size         = (unsigned long)&_percpu_end - (unsigned long)&_percpu_start;
+    /* The percpu areas of the APs are reserved right after the area of the BSP
+     * by the linker script. All percpu variables start out zeroed and the BSP's
+     * area is already in use so the areas of the APs are cleared, not copied */
+    size_t pcpu_size = (unsigned long)&_percpu_end - (unsigned long)&_percpu_start;
 
-    for (size_t i = 0; i < lapic_get_cpu_count(); ++i) {
-        kmemcpy(
-            (uint8_t *)pcpu_start + i * pcpu_size,
-            (uint8_t *)&_percpu_start,
-            pcpu_size
-        );
-    }
+    if (lapic_get_cpu_count() > MAX_CPU)
+        kpanic("not enough percpu areas for all CPUs!");
+
+    kmemset(&_percpu_end, 0, (lapic_get_cpu_count() - 1) * pcpu_size);
 
     /* initialize global percpu state and GS base for BSP
      * TSS can be initialized after percpu */
     percpu_init(0);
     tss_init();
 
+    /* single-page allocations can be served from the percpu caches now */
+    mmu_pcp_init();
+
     /* enable Local APIC timer so tick_wait() works */
     enable_irq();
 
@@ -102,6 +111,16 @@ void init_bsp(void *arg)
 
     /* create init and idle tasks and start the scheduler */
     sched_init();
+
+    /* compact memory in the background for high-order allocations */
+    mmu_compact_init();
+
+    /* swap anonymous pages out to the disk when memory runs low */
+    (void)mmu_swap_init();
+
+    /* merge identical anonymous pages of the tasks */
+    mmu_ksm_init();
+
     sched_start();
 
     for (;;);
@@ -114,9 +133,11 @@ void init_ap(void *arg)
     gdt_init();
     idt_init();
     lapic_initialize();
+    mmu_tlb_init_cpu();
     percpu_init(lapic_get_init_cpu_count() - 1);
     tss_init();
     tick_init_timer();
+    clock_sync_ap();
 
     /* Initialize the idle task for this CPU and start it.
      *
@@ -20,6 +20,13 @@ static const char *errors[EMAX] = {
     "Funcion not implemented",
     "Not a directory",
     "Operation not supported",
+    "No such device or address",
+    "Try again",
+    "Bad address",
+    "Bad file descriptor",
+    "Permission denied",
+    "No such device",
+    "I/O error",
 };
 
 const char *kstrerror(int error)
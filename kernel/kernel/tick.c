@@ -1,47 +1,326 @@
+#include <drivers/lapic.h>
+#include <kernel/clock.h>
+#include <kernel/common.h>
 #include <kernel/compiler.h>
 #include <kernel/cpu.h>
+#include <kernel/irq.h>
+#include <kernel/kassert.h>
 #include <kernel/kprint.h>
 #include <kernel/percpu.h>
 #include <kernel/tick.h>
 #include <lib/list.h>
 #include <sync/spinlock.h>
+#include <sys/time.h>
+#include <errno.h>
 
-__percpu static list_head_t timers;
-__percpu static unsigned long __pcpu_tick = 0;
+#define TICK_MAX_COUNT 0xffffffffUL /* the timer counter is 32 bits wide */
+
+#define WHEEL_LEVELS    4
+#define WHEEL_SLOT_BITS 6
+#define WHEEL_SLOTS     (1UL << WHEEL_SLOT_BITS)
+#define WHEEL_SLOT_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_RANGE     (1UL << (WHEEL_LEVELS * WHEEL_SLOT_BITS)) /* ~4.6 hours */
+#define WHEEL_NEVER     (~0UL)
+
+/* slots that are not part of the wheel itself */
+#define SLOT_EXPIRED    (WHEEL_LEVELS * WHEEL_SLOTS)
+#define SLOT_INCOMING   (WHEEL_LEVELS * WHEEL_SLOTS + 1)
+
+/* Each slot of level "n" of the wheel covers 64^n milliseconds
+ *
+ * Timers that expire within 64ms are kept in exact slots of level 0 and
+ * the rest in the coarser slots of the higher levels. When level 0 wraps
+ * around, the next slot of level 1 is cascaded down to the lower levels,
+ * when level 1 wraps around, the next slot of level 2 and so on.
+ *
+ * Installing and cancelling a timer are O(1) and advancing the wheel
+ * by a millisecond touches only one slot (and the cascaded slots) */
+typedef struct tick_wheel {
+    list_head_t slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    list_head_t expired;             /* expired timers whose callbacks have not been called */
+    list_head_t incoming;            /* timers installed by other CPUs */
+    list_head_t hrtimers;            /* high-resolution timers sorted by expiry */
+    uint64_t pending[WHEEL_LEVELS];  /* slots of each level that have timers */
+    size_t ntimers;                  /* timers in the slots of the wheel */
+    unsigned long now;               /* the next millisecond to process */
+    unsigned long deadline;          /* the millisecond when the armed timer fires */
+    bool ready;
+    spinlock_t lock;
+} tick_wheel_t;
+
+__percpu static tick_wheel_t wheel;
+__percpu static unsigned long __pcpu_tick = 0; /* tick count when the timer was last armed, see tick_get() */
+__percpu static bool stopped              = false;
 static unsigned long scale = 0; /* how many ticks is 1ms */
-static spinlock_t tick_spin;
 
 void tick_init(unsigned long ticks, unsigned long ms)
 {
     scale = ticks / ms;
 }
 
-void tick_inc(void)
+unsigned long tick_get(void)
+{
+    uint64_t now_ns     = clock_monotonic_ns();
+    uint64_t flags      = 0;
+    unsigned long ticks = 0;
+
+    /* The count of the one-shot timer stops at zero when the timer fires
+     * so it only tells the time until the clock has been started */
+    if (now_ns)
+        return tick_ns_to_ticks(now_ns);
+
+    flags = irq_save();
+    ticks = get_thiscpu_var(__pcpu_tick) + lapic_timer_elapsed();
+
+    irq_restore(flags);
+    return ticks;
+}
+
+static inline unsigned long __now_ms(void)
+{
+    return scale ? tick_get() / scale : 0;
+}
+
+/* w->lock must be held by the caller */
+static void __wheel_insert(tick_wheel_t *w, timer_t *tmr)
 {
-    get_thiscpu_var(__pcpu_tick) += scale;
+    unsigned long expr = MAX(tmr->expr, w->now);
+    unsigned level     = 0;
+    unsigned idx       = 0;
+
+    if (expr - w->now >= WHEEL_RANGE)
+        expr = w->now + WHEEL_RANGE - 1;
 
-    unsigned long ticks = get_thiscpu_var(__pcpu_tick);
-    list_head_t list    = get_thiscpu_var(timers);
-    list_head_t *iter   = &list;
+    while (level < WHEEL_LEVELS - 1 && expr - w->now >= (1UL << (WHEEL_SLOT_BITS * (level + 1))))
+        level++;
+
+    idx       = (expr >> (WHEEL_SLOT_BITS * level)) & WHEEL_SLOT_MASK;
+    tmr->slot = level * WHEEL_SLOTS + idx;
+
+    list_append(w->slots[level][idx].prev, &tmr->list);
+    w->pending[level] |= (1ULL << idx);
+    w->ntimers++;
+}
 
-    if (!iter->next)
+/* w->lock must be held by the caller */
+static void __wheel_remove(tick_wheel_t *w, timer_t *tmr)
+{
+    list_remove(&tmr->list);
+    list_init(&tmr->list);
+
+    if (tmr->slot < SLOT_EXPIRED) {
+        unsigned level = tmr->slot / WHEEL_SLOTS;
+        unsigned idx   = tmr->slot % WHEEL_SLOTS;
+
+        if (LIST_EMPTY(w->slots[level][idx]))
+            w->pending[level] &= ~(1ULL << idx);
+
+        w->ntimers--;
+    }
+}
+
+/* Move the timers of slot "idx" of "level" either to
+ * the lower levels or, if they have expired, to the expired list */
+static void __wheel_cascade(tick_wheel_t *w, unsigned level, unsigned idx)
+{
+    list_head_t *slot = &w->slots[level][idx];
+
+    while (!LIST_EMPTY(*slot)) {
+        timer_t *tmr = container_of(slot->next, timer_t, list);
+
+        __wheel_remove(w, tmr);
+
+        if (level > 0 && tmr->expr > w->now) {
+            __wheel_insert(w, tmr);
+        } else {
+            tmr->slot = SLOT_EXPIRED;
+            list_append(w->expired.prev, &tmr->list);
+        }
+    }
+}
+
+/* Process every millisecond up to and including "target" */
+static void __wheel_advance(tick_wheel_t *w, unsigned long target)
+{
+    while (w->now <= target) {
+        unsigned idx = w->now & WHEEL_SLOT_MASK;
+
+        if (!w->ntimers) {
+            w->now = target + 1;
+            break;
+        }
+
+        if (idx == 0) {
+            for (unsigned level = 1; level < WHEEL_LEVELS; ++level) {
+                unsigned i = (w->now >> (WHEEL_SLOT_BITS * level)) & WHEEL_SLOT_MASK;
+
+                __wheel_cascade(w, level, i);
+
+                if (i != 0)
+                    break;
+            }
+        }
+
+        __wheel_cascade(w, 0, idx);
+        w->now++;
+
+        /* nothing happens before the next cascade if level 0 is empty */
+        if (!w->pending[0])
+            w->now = MIN(ROUND_UP(w->now, WHEEL_SLOTS), target + 1);
+    }
+}
+
+/* Return the millisecond of the next event of the wheel
+ * Timers of the higher levels are waited for until their slot is cascaded
+ *
+ * Return WHEEL_NEVER if the wheel has no timers */
+static unsigned long __wheel_next(tick_wheel_t *w)
+{
+    unsigned long next = WHEEL_NEVER;
+    unsigned idx       = w->now & WHEEL_SLOT_MASK;
+
+    if (!LIST_EMPTY(w->expired) || !LIST_EMPTY(w->incoming))
+        return w->now;
+
+    if (w->pending[0]) {
+        uint64_t rot = (w->pending[0] >> idx) | (idx ? w->pending[0] << (64 - idx) : 0);
+
+        next = w->now + __builtin_ctzll(rot);
+    }
+
+    for (unsigned level = 1; level < WHEEL_LEVELS; ++level) {
+        if (w->pending[level])
+            next = MIN(next, ROUND_UP(w->now, 1UL << (WHEEL_SLOT_BITS * level)));
+    }
+
+    return next;
+}
+
+/* Call the callbacks of the expired high-resolution timers of "w"
+ * Like the timers of the wheel, the callbacks run without the lock held */
+static void __run_hrtimers(tick_wheel_t *w)
+{
+    for (;;) {
+        hrtimer_t *tmr = NULL;
+
+        spin_acquire(&w->lock);
+
+        if (LIST_EMPTY(w->hrtimers) ||
+            (tmr = container_of(w->hrtimers.next, hrtimer_t, list))->expires > clock_monotonic_ns())
+        {
+            spin_release(&w->lock);
+            break;
+        }
+
+        list_remove(&tmr->list);
+        list_init(&tmr->list);
+        tmr->pending = false;
+
+        spin_release(&w->lock);
+
+        tmr->callback(tmr->ctx);
+    }
+}
+
+void tick_update(void)
+{
+    tick_wheel_t *w   = get_thiscpu_ptr(wheel);
+    unsigned long now = __now_ms();
+
+    if (!w->ready)
         return;
 
-    while ((iter = iter->next)) {
-        timer_t *tmr = container_of(iter, timer_t, list);
+    spin_acquire(&w->lock);
+
+    /* timers installed by other CPUs wait from the moment they're picked up */
+    while (!LIST_EMPTY(w->incoming)) {
+        timer_t *tmr = container_of(w->incoming.next, timer_t, list);
+
+        list_remove(&tmr->list);
+        tmr->expr = now + tmr->wait;
+        __wheel_insert(w, tmr);
+    }
+
+    __wheel_advance(w, now);
+    spin_release(&w->lock);
 
-        if (ticks >= tmr->expr) {
-            tmr->callback(tmr->ctx);
-            list_remove(&tmr->list);
+    /* The lock is not held while a callback runs so that the callback
+     * can install timers and other CPUs can cancel the timers that
+     * are still waiting for their callback */
+    for (;;) {
+        timer_t *tmr = NULL;
+
+        spin_acquire(&w->lock);
+
+        if (LIST_EMPTY(w->expired)) {
+            spin_release(&w->lock);
+            break;
         }
+
+        tmr = container_of(w->expired.next, timer_t, list);
+        __wheel_remove(w, tmr);
+        tmr->pending = false;
+
+        spin_release(&w->lock);
+
+        tmr->callback(tmr->ctx);
+    }
+
+    __run_hrtimers(w);
+}
+
+void tick_program(bool periodic)
+{
+    tick_wheel_t *w     = get_thiscpu_ptr(wheel);
+    unsigned long now   = tick_get();
+    unsigned long delta = periodic ? scale : TICK_MAX_COUNT;
+    unsigned long next  = WHEEL_NEVER;
+    uint64_t hr_next    = WHEEL_NEVER;
+
+    if (w->ready) {
+        spin_acquire(&w->lock);
+        next = __wheel_next(w);
+
+        if (!LIST_EMPTY(w->hrtimers))
+            hr_next = container_of(w->hrtimers.next, hrtimer_t, list)->expires;
+        spin_release(&w->lock);
+    }
+
+    if (next != WHEEL_NEVER)
+        delta = MIN(delta, (next * scale > now) ? next * scale - now : 1);
+
+    if (hr_next != WHEEL_NEVER) {
+        uint64_t now_ns = clock_monotonic_ns();
+
+        delta = MIN(delta, (hr_next > now_ns) ? tick_ns_to_ticks(hr_next - now_ns) : 1);
     }
+
+    delta = MAX(delta, 1);
+
+    get_thiscpu_var(__pcpu_tick) = now;
+    WRITE_ONCE(w->deadline, scale ? (now + delta) / scale : 0);
+    WRITE_ONCE(get_thiscpu_var(stopped), !periodic);
+
+    lapic_timer_arm(delta);
+}
+
+void tick_stop(void)
+{
+    WRITE_ONCE(get_thiscpu_var(stopped), true);
+    __sync_synchronize();
+}
+
+void tick_kick(unsigned cpu)
+{
+    if (READ_ONCE(get_percpu_var(stopped, cpu)))
+        lapic_send_fixed_ipi(cpu, VECNUM_TIMER);
 }
 
 void tick_wait(unsigned long ticks)
 {
-    unsigned long start = get_thiscpu_var(__pcpu_tick);
+    unsigned long start = tick_get();
 
-    while (start + ticks > get_thiscpu_var(__pcpu_tick))
+    while (start + ticks > tick_get())
         cpu_relax();
 }
 
@@ -52,22 +331,235 @@ unsigned long tick_ms_to_ticks(unsigned long ms)
 
 unsigned long tick_us_to_ticks(unsigned long us)
 {
-    return (us / 1000) * scale;
+    return (unsigned long)(((__uint128_t)us * scale) / (NSEC_PER_MSEC / NSEC_PER_USEC));
 }
 
 unsigned long tick_ns_to_ticks(unsigned long ns)
 {
-    return (ns / 1000 / 1000) * scale;
+    return (unsigned long)(((__uint128_t)ns * scale) / NSEC_PER_MSEC);
 }
 
 void tick_init_timer(void)
 {
-    (get_thiscpu_var(timers)).next = NULL;
-    (get_thiscpu_var(timers)).prev = NULL;
+    tick_wheel_t *w = get_thiscpu_ptr(wheel);
+
+    for (size_t level = 0; level < WHEEL_LEVELS; ++level) {
+        for (size_t i = 0; i < WHEEL_SLOTS; ++i)
+            list_init(&w->slots[level][i]);
+
+        w->pending[level] = 0;
+    }
+
+    list_init(&w->expired);
+    list_init(&w->incoming);
+    list_init(&w->hrtimers);
+
+    w->ntimers  = 0;
+    w->now      = __now_ms();
+    w->deadline = WHEEL_NEVER;
+    w->lock     = 0;
+
+    WRITE_ONCE(w->ready, true);
 }
 
-void tick_install_timer(timer_t *tmr)
+int tick_install_timer(timer_t *tmr)
 {
-    tmr->expr = get_thiscpu_var(__pcpu_tick) + scale * tmr->wait;
-    list_append(get_thiscpu_ptr(timers), &tmr->list);
+    kassert(tmr != NULL && tmr->callback != NULL);
+
+    uint64_t flags  = irq_save();
+    tick_wheel_t *w = get_thiscpu_ptr(wheel);
+    int ret         = 0;
+
+    if (!w->ready) {
+        ret = -ENXIO;
+        goto end;
+    }
+
+    spin_acquire(&w->lock);
+
+    if (tmr->pending) {
+        spin_release(&w->lock);
+        ret = -EBUSY;
+        goto end;
+    }
+
+    tmr->cpu     = get_thiscpu_id();
+    tmr->expr    = __now_ms() + tmr->wait;
+    tmr->pending = true;
+    __wheel_insert(w, tmr);
+
+    spin_release(&w->lock);
+
+    /* a stopped tick may be armed past the expiry of the new timer */
+    if (get_thiscpu_var(stopped) && tmr->expr < w->deadline)
+        tick_program(false);
+
+end:
+    irq_restore(flags);
+    return ret;
+}
+
+int tick_install_timer_on(timer_t *tmr, unsigned cpu)
+{
+    kassert(tmr != NULL && tmr->callback != NULL);
+
+    tick_wheel_t *w = NULL;
+    uint64_t flags  = 0;
+    int ret         = 0;
+
+    if (cpu >= MAX_CPU)
+        return -ENXIO;
+
+    flags = irq_save();
+
+    /* the timer can be added to the wheel of this CPU directly */
+    if (cpu == get_thiscpu_id()) {
+        ret = tick_install_timer(tmr);
+        irq_restore(flags);
+        return ret;
+    }
+
+    if (!READ_ONCE((w = get_percpu_ptr(wheel, cpu))->ready)) {
+        irq_restore(flags);
+        return -ENXIO;
+    }
+
+    spin_acquire(&w->lock);
+
+    if (tmr->pending) {
+        spin_release(&w->lock);
+        irq_restore(flags);
+        return -EBUSY;
+    }
+
+    tmr->cpu     = cpu;
+    tmr->slot    = SLOT_INCOMING;
+    tmr->pending = true;
+    list_append(w->incoming.prev, &tmr->list);
+
+    spin_release(&w->lock);
+    irq_restore(flags);
+
+    tick_kick(cpu);
+
+    return 0;
+}
+
+int tick_cancel_timer(timer_t *tmr)
+{
+    kassert(tmr != NULL);
+
+    tick_wheel_t *w = NULL;
+    uint64_t flags  = 0;
+    int ret         = 0;
+
+    /* the timer may be installed on another wheel while the lock is taken */
+    for (;;) {
+        unsigned cpu = READ_ONCE(tmr->cpu);
+
+        w     = get_percpu_ptr(wheel, cpu);
+        flags = irq_save();
+        spin_acquire(&w->lock);
+
+        if (READ_ONCE(tmr->cpu) == cpu)
+            break;
+
+        spin_release(&w->lock);
+        irq_restore(flags);
+    }
+
+    if (!tmr->pending) {
+        ret = -ENOENT;
+    } else {
+        __wheel_remove(w, tmr);
+        tmr->pending = false;
+    }
+
+    spin_release(&w->lock);
+    irq_restore(flags);
+
+    return ret;
+}
+
+int tick_install_hrtimer(hrtimer_t *tmr)
+{
+    kassert(tmr != NULL && tmr->callback != NULL);
+
+    uint64_t flags    = irq_save();
+    tick_wheel_t *w   = get_thiscpu_ptr(wheel);
+    list_head_t *prev = NULL;
+    int ret           = 0;
+
+    if (!w->ready) {
+        ret = -ENXIO;
+        goto end;
+    }
+
+    spin_acquire(&w->lock);
+
+    if (tmr->pending) {
+        spin_release(&w->lock);
+        ret = -EBUSY;
+        goto end;
+    }
+
+    /* timers with the same expiry are called in the order they were installed */
+    prev = &w->hrtimers;
+
+    FOREACH(w->hrtimers, iter) {
+        if (container_of(iter, hrtimer_t, list)->expires > tmr->expires)
+            break;
+        prev = iter;
+    }
+
+    tmr->cpu     = get_thiscpu_id();
+    tmr->pending = true;
+    list_append(prev, &tmr->list);
+
+    spin_release(&w->lock);
+
+    /* the timer is armed past the expiry of the new first timer */
+    if (prev == &w->hrtimers)
+        tick_program(!get_thiscpu_var(stopped));
+
+end:
+    irq_restore(flags);
+    return ret;
+}
+
+int tick_cancel_hrtimer(hrtimer_t *tmr)
+{
+    kassert(tmr != NULL);
+
+    tick_wheel_t *w = NULL;
+    uint64_t flags  = 0;
+    int ret         = 0;
+
+    /* the timer may be installed on another CPU while the lock is taken */
+    for (;;) {
+        unsigned cpu = READ_ONCE(tmr->cpu);
+
+        w     = get_percpu_ptr(wheel, cpu);
+        flags = irq_save();
+        spin_acquire(&w->lock);
+
+        if (READ_ONCE(tmr->cpu) == cpu)
+            break;
+
+        spin_release(&w->lock);
+        irq_restore(flags);
+    }
+
+    if (!tmr->pending) {
+        ret = -ENOENT;
+    } else {
+        list_remove(&tmr->list);
+        list_init(&tmr->list);
+        tmr->pending = false;
+    }
+
+    spin_release(&w->lock);
+    irq_restore(flags);
+
+    return ret;
 }
@@ -3,6 +3,7 @@
 #include <mm/heap.h>
 #include <mm/mmu.h>
 #include <mm/page.h>
+#include <mm/vmalloc.h>
 #include <errno.h>
 #include <limits.h>
 
@@ -77,7 +78,7 @@ bheap_t *bh_init(size_t items)
 
     heap->size     = 0;
     heap->capacity = npages * EPP;
-    heap->elems    = mmu_p_to_v(mmu_block_alloc(MM_ZONE_NORMAL, npages, 0));
+    heap->elems    = vmalloc(npages * PAGE_SIZE);
 
     return heap;
 }
@@ -0,0 +1,179 @@
+#include <kernel/clock.h>
+#include <kernel/common.h>
+#include <kernel/kpanic.h>
+#include <kernel/kprint.h>
+#include <mm/compact.h>
+#include <mm/mmu.h>
+#include <mm/numa.h>
+#include <mm/page.h>
+#include <sched/mts.h>
+#include <sched/task.h>
+#include <sys/time.h>
+#include <errno.h>
+#include <stdbool.h>
+
+#define NZONES                 (MM_ZONE_HIGH + 1)
+#define ORDER_SIZE(o)          ((1UL << (o)) * PAGE_SIZE)
+
+#define COMPACT_SCAN_MAX       64   /* blocks scanned per zone by one call */
+#define COMPACT_INTERVAL_MS    1000 /* how often the compaction thread wakes up */
+#define COMPACT_BG_ORDER       HUGE_PAGE_ORDER
+#define COMPACT_FRAG_THRESHOLD 80   /* fragmentation index that wakes up the thread */
+
+typedef struct mm_compact_stats {
+    size_t nmoved;   /* user pages moved */
+    size_t nfailed;  /* user pages of isolated blocks that couldn't be moved */
+    size_t nsuccess; /* blocks freed */
+    size_t nfail;    /* isolated blocks that couldn't be freed */
+    size_t nkicks;   /* failed allocations that woke up the compaction thread */
+} mm_compact_stats_t;
+
+static mm_compact_stats_t stats;
+
+/* Only one compaction runs at a time. It owns "stats" and "cursor" */
+static bool compacting = false;
+
+/* orders that the compaction thread has been asked to create blocks of */
+static unsigned kicked = 0;
+
+static clock_waiter_t waiter;
+
+/* Blocks are scanned in address order and the next call
+ * continues where the previous one left off */
+static unsigned long cursor[MAX_NUMNODES][NZONES];
+
+/* Try to free one block of "order" in zone "memzone" of "node"
+ *
+ * Return 0 if a block was freed
+ * Return -EAGAIN if no block was freed */
+static int __compact_zone(unsigned node, unsigned memzone, unsigned order)
+{
+    unsigned long start = 0;
+    unsigned long end   = 0;
+    unsigned long size  = ORDER_SIZE(order);
+
+    if (mmu_zone_span(node, memzone, &start, &end) < 0)
+        return -EAGAIN;
+
+    start = ROUND_UP(start, size);
+    end   = ROUND_DOWN(end, size);
+
+    if (start >= end)
+        return -EAGAIN;
+
+    for (size_t i = 0; i < COMPACT_SCAN_MAX; ++i) {
+        unsigned long block = ROUND_DOWN(cursor[node][memzone], size);
+        int nuser           = 0;
+        int nmoved          = 0;
+
+        if (block < start || block >= end)
+            block = start;
+
+        cursor[node][memzone] = block + size;
+
+        /* blocks with unmovable pages are skipped cheaply */
+        if ((nuser = mmu_block_isolate(block, order)) < 0)
+            continue;
+
+        if ((nmoved = mmu_migrate_range(block, block + size)) < 0)
+            nmoved = 0;
+
+        stats.nmoved  += nmoved;
+        stats.nfailed += nuser - nmoved;
+
+        if (mmu_block_putback(block, order) == 0) {
+            stats.nsuccess++;
+            return 0;
+        }
+
+        stats.nfail++;
+    }
+
+    return -EAGAIN;
+}
+
+int mmu_compact_node(unsigned node, unsigned memzone, unsigned order)
+{
+    int ret = -EAGAIN;
+
+    if (order == 0 || order > HUGE_PAGE_ORDER)
+        return -EINVAL;
+
+    if (node >= mmu_numa_node_count() || memzone > MM_ZONE_HIGH)
+        return -EINVAL;
+
+    if (__sync_lock_test_and_set(&compacting, true))
+        return -EBUSY;
+
+    for (unsigned z = memzone; z >= MM_ZONE_NORMAL && ret < 0; --z)
+        ret = __compact_zone(node, z, order);
+
+    __sync_lock_release(&compacting);
+
+    return ret;
+}
+
+void mmu_compact_kick(unsigned order)
+{
+    if (order == 0 || order > HUGE_PAGE_ORDER)
+        return;
+
+    __sync_fetch_and_or(&kicked, 1U << order);
+    __sync_add_and_fetch(&stats.nkicks, 1);
+
+    clock_wakeup(&waiter);
+}
+
+/* The thread sleeps until an allocation kicks it. Fragmentation
+ * caused by freeing memory doesn't kick anyone so the zones
+ * are also looked at once per interval */
+static void *__kcompactd(void *arg)
+{
+    (void)arg;
+
+    for (;;) {
+        unsigned orders = __sync_fetch_and_and(&kicked, 0);
+        unsigned order  = orders ? 31 - __builtin_clz(orders) : 0;
+
+        /* a free block of the highest requested order serves the lower ones too */
+        if (order == 0 &&
+            (mmu_zone_frag_index(MM_ZONE_HIGH,   COMPACT_BG_ORDER) >= COMPACT_FRAG_THRESHOLD ||
+             mmu_zone_frag_index(MM_ZONE_NORMAL, COMPACT_BG_ORDER) >= COMPACT_FRAG_THRESHOLD))
+            order = COMPACT_BG_ORDER;
+
+        if (order != 0) {
+            for (unsigned n = 0; n < mmu_numa_node_count(); ++n)
+                (void)mmu_compact_node(n, MM_ZONE_HIGH, order);
+        }
+
+        (void)clock_wait(&waiter, COMPACT_INTERVAL_MS * NSEC_PER_MSEC);
+    }
+
+    return NULL;
+}
+
+void mmu_compact_init(void)
+{
+    task_t   *task   = NULL;
+    thread_t *thread = NULL;
+
+    if ((task = sched_task_create("kcompactd")) == NULL)
+        kpanic("Failed to create compaction task");
+
+    if ((thread = sched_thread_create(__kcompactd, NULL)) == NULL)
+        kpanic("Failed to create thread for compaction task");
+
+    sched_task_add_thread(task, thread);
+
+    /* compaction should only use time that nobody else wants */
+    if (mts_schedule(task, -4) < 0)
+        kpanic("Failed to schedule compaction task");
+}
+
+void mmu_compact_print_stats(void)
+{
+    kprint("Compaction:\n");
+    kprint("\tpages moved %u, not moved %u\n", stats.nmoved, stats.nfailed);
+    kprint("\tblocks freed %u, not freed %u\n", stats.nsuccess, stats.nfail);
+    kprint("\tthread wakeups by failed allocations %u\n", stats.nkicks);
+}
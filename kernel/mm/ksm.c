@@ -0,0 +1,326 @@
+#include <kernel/clock.h>
+#include <kernel/common.h>
+#include <kernel/kpanic.h>
+#include <kernel/kprint.h>
+#include <kernel/util.h>
+#include <lib/list.h>
+#include <mm/ksm.h>
+#include <mm/mmu.h>
+#include <mm/page.h>
+#include <mm/vma.h>
+#include <mm/vmalloc.h>
+#include <sched/mts.h>
+#include <sched/task.h>
+#include <sync/spinlock.h>
+#include <sys/time.h>
+#include <errno.h>
+#include <stdbool.h>
+
+#define KSM_STABLE_SIZE   4096 /* shared pages that can exist at once */
+#define KSM_STABLE_PROBE  8    /* slots of the stable table searched for a hash */
+#define KSM_UNSTABLE_SIZE 8192 /* candidates remembered during one round */
+#define KSM_SCAN_PAGES    256  /* addresses visited per wakeup */
+#define KSM_MERGE_MAX     64   /* pages merged per wakeup */
+#define KSM_INTERVAL_MS   200  /* how often the merging thread wakes up */
+
+/* Shared page owned by the merging thread. The thread holds one reference
+ * to the page and each mapping of the page holds another */
+typedef struct ksm_stable {
+    unsigned long kpage;
+    uint32_t hash;
+} ksm_stable_t;
+
+/* Page that was visited during the current round and had no match yet.
+ * The page may have changed or been released since, so it's only a hint */
+typedef struct ksm_unstable {
+    task_t *task;
+    unsigned long vaddr;
+    unsigned long page;
+    uint32_t hash;
+    size_t round; /* the round that visited the page, 0 if the slot is free */
+} ksm_unstable_t;
+
+typedef struct ksm_cand {
+    task_t *task;
+    unsigned long vaddr;
+    unsigned long page;
+} ksm_cand_t;
+
+typedef struct ksm_scan {
+    bool found;      /* the task of the cursor has been reached */
+    bool stopped;    /* the visit budget ran out */
+    size_t nvisited;
+    size_t ncands;
+} ksm_scan_t;
+
+typedef struct mm_ksm_stats {
+    size_t nmerged;  /* mappings replaced with a shared page */
+    size_t nvisited; /* addresses visited */
+    size_t nrounds;  /* scans of all tasks */
+} mm_ksm_stats_t;
+
+static mm_ksm_stats_t stats;
+
+static ksm_stable_t   *stable   = NULL;
+static ksm_unstable_t *unstable = NULL;
+
+static ksm_cand_t     cands[KSM_SCAN_PAGES];
+static mm_merge_req_t reqs[KSM_MERGE_MAX];
+
+/* Each wakeup visits KSM_SCAN_PAGES addresses and the next
+ * one continues where the previous one left off. A round ends when
+ * all tasks have been visited and then the unstable table is forgotten */
+static struct {
+    task_t *task;
+    unsigned long vaddr;
+} cursor;
+
+static size_t scan_round = 1;
+
+static uint32_t __checksum(const void *data)
+{
+    const uint64_t *words = data;
+    uint64_t hash         = 0xcbf29ce484222325;
+
+    for (size_t i = 0; i < PAGE_SIZE / sizeof(uint64_t); ++i) {
+        hash ^= words[i];
+        hash *= 0x100000001b3;
+    }
+
+    return (uint32_t)(hash ^ (hash >> 32));
+}
+
+/* Return the shared page with the same contents as "data" or INVALID_ADDRESS */
+static unsigned long __stable_find(uint32_t hash, void *data)
+{
+    for (size_t i = 0; i < KSM_STABLE_PROBE; ++i) {
+        ksm_stable_t *s = &stable[(hash + i) % KSM_STABLE_SIZE];
+
+        if (s->kpage && s->hash == hash && !kmemcmp(mmu_p_to_v(s->kpage), data, PAGE_SIZE))
+            return s->kpage;
+    }
+
+    return INVALID_ADDRESS;
+}
+
+/* Allocate a shared page with the contents of "data"
+ *
+ * Return INVALID_ADDRESS if there is no free slot or no free memory */
+static unsigned long __stable_insert(uint32_t hash, void *data)
+{
+    for (size_t i = 0; i < KSM_STABLE_PROBE; ++i) {
+        ksm_stable_t *s = &stable[(hash + i) % KSM_STABLE_SIZE];
+
+        if (s->kpage)
+            continue;
+
+        if ((s->kpage = mmu_page_alloc(MM_ZONE_HIGH, MM_TRY)) == INVALID_ADDRESS) {
+            s->kpage = 0;
+            return INVALID_ADDRESS;
+        }
+
+        kmemcpy(mmu_p_to_v(s->kpage), data, PAGE_SIZE);
+        s->hash = hash;
+
+        return s->kpage;
+    }
+
+    return INVALID_ADDRESS;
+}
+
+/* Release the shared pages that are no longer mapped by anyone
+ * Only the merging thread can map them so the reference count can't grow */
+static void __stable_prune(void)
+{
+    for (size_t i = 0; i < KSM_STABLE_SIZE; ++i) {
+        if (stable[i].kpage && mmu_page_refcount(stable[i].kpage) == 1) {
+            (void)mmu_page_unref(stable[i].kpage);
+            stable[i].kpage = 0;
+        }
+    }
+}
+
+/* Collect the mergeable pages of the private anonymous areas of "task" */
+static void __scan_task(task_t *task, void *arg)
+{
+    ksm_scan_t *scan    = arg;
+    unsigned long start = 0;
+
+    if (scan->stopped)
+        return;
+
+    if (!scan->found) {
+        if (cursor.task && task != cursor.task)
+            return;
+
+        scan->found = true;
+        start       = cursor.task ? cursor.vaddr : 0;
+    }
+
+    spin_acquire(&task->vma_lock);
+
+    FOREACH(task->vmas, iter) {
+        mm_vma_t *vma = container_of(iter, mm_vma_t, list);
+
+        if (vma->file || (vma->flags & VM_SHARED))
+            continue;
+
+        for (unsigned long v = MAX(vma->start, start); v < vma->end; v += PAGE_SIZE) {
+            unsigned long page = INVALID_ADDRESS;
+
+            if (scan->nvisited == KSM_SCAN_PAGES) {
+                scan->stopped = true;
+                cursor.task   = task;
+                cursor.vaddr  = v;
+                goto end;
+            }
+
+            scan->nvisited++;
+
+            if ((page = mmu_task_page(task, v)) == INVALID_ADDRESS)
+                continue;
+
+            cands[scan->ncands].task  = task;
+            cands[scan->ncands].vaddr = v;
+            cands[scan->ncands].page  = page;
+            scan->ncands++;
+        }
+    }
+
+end:
+    spin_release(&task->vma_lock);
+}
+
+static void __add_req(size_t *nreqs, task_t *task, unsigned long vaddr, unsigned long page, unsigned long kpage)
+{
+    reqs[*nreqs].task  = task;
+    reqs[*nreqs].vaddr = vaddr;
+    reqs[*nreqs].page  = page;
+    reqs[*nreqs].kpage = kpage;
+    (*nreqs)++;
+}
+
+/* Find the shared pages of the collected pages and merge them
+ *
+ * Pages are hashed without any locks so the pages may change under
+ * the thread. That only causes missed matches because mmu_merge()
+ * compares the contents again once the pages can't be written */
+static void __merge_cands(size_t ncands)
+{
+    size_t nreqs = 0;
+    int nmerged  = 0;
+
+    for (size_t i = 0; i < ncands && nreqs + 2 <= KSM_MERGE_MAX; ++i) {
+        void *data          = mmu_p_to_v(cands[i].page);
+        uint32_t hash       = __checksum(data);
+        unsigned long kpage = __stable_find(hash, data);
+        ksm_unstable_t *u   = &unstable[hash % KSM_UNSTABLE_SIZE];
+
+        if (kpage != INVALID_ADDRESS) {
+            __add_req(&nreqs, cands[i].task, cands[i].vaddr, cands[i].page, kpage);
+            continue;
+        }
+
+        /* two pages with equal contents, the second one creates the shared page */
+        if (u->round == scan_round && u->hash == hash && u->page != cands[i].page &&
+            !kmemcmp(mmu_p_to_v(u->page), data, PAGE_SIZE) &&
+            (kpage = __stable_insert(hash, data)) != INVALID_ADDRESS)
+        {
+            __add_req(&nreqs, u->task, u->vaddr, u->page, kpage);
+            __add_req(&nreqs, cands[i].task, cands[i].vaddr, cands[i].page, kpage);
+            u->round = 0;
+            continue;
+        }
+
+        u->task  = cands[i].task;
+        u->vaddr = cands[i].vaddr;
+        u->page  = cands[i].page;
+        u->hash  = hash;
+        u->round = scan_round;
+    }
+
+    if (nreqs > 0 && (nmerged = mmu_merge(reqs, nreqs)) > 0)
+        stats.nmerged += nmerged;
+}
+
+/* Nothing tells the thread that pages have changed so it visits a bounded
+ * number of pages and then sleeps for the interval, which bounds the CPU
+ * time of merging to KSM_SCAN_PAGES pages per KSM_INTERVAL_MS */
+static void *__ksmd(void *arg)
+{
+    (void)arg;
+
+    for (;;) {
+        ksm_scan_t scan = { false, false, 0, 0 };
+
+        sched_task_for_each(__scan_task, &scan);
+
+        /* all tasks have been visited or the task of the cursor is gone */
+        if (!scan.stopped) {
+            cursor.task = NULL;
+            stats.nrounds++;
+
+            /* 0 marks free slots of the unstable table */
+            if (++scan_round == 0)
+                scan_round = 1;
+        }
+
+        stats.nvisited += scan.nvisited;
+
+        __merge_cands(scan.ncands);
+        __stable_prune();
+
+        (void)clock_sleep(KSM_INTERVAL_MS * NSEC_PER_MSEC);
+    }
+
+    return NULL;
+}
+
+void mmu_ksm_init(void)
+{
+    task_t   *task   = NULL;
+    thread_t *thread = NULL;
+
+    if ((stable   = vmalloc(KSM_STABLE_SIZE   * sizeof(ksm_stable_t)))   == NULL ||
+        (unstable = vmalloc(KSM_UNSTABLE_SIZE * sizeof(ksm_unstable_t))) == NULL)
+        kpanic("Failed to allocate tables for same-page merging");
+
+    kmemset(stable,   0, KSM_STABLE_SIZE   * sizeof(ksm_stable_t));
+    kmemset(unstable, 0, KSM_UNSTABLE_SIZE * sizeof(ksm_unstable_t));
+
+    if ((task = sched_task_create("ksmd")) == NULL)
+        kpanic("Failed to create merging task");
+
+    if ((thread = sched_thread_create(__ksmd, NULL)) == NULL)
+        kpanic("Failed to create thread for merging task");
+
+    sched_task_add_thread(task, thread);
+
+    /* merging should only use time that nobody else wants */
+    if (mts_schedule(task, -4) < 0)
+        kpanic("Failed to schedule merging task");
+}
+
+void mmu_ksm_print_stats(void)
+{
+    size_t nshared  = 0;
+    size_t nsharing = 0;
+
+    if (!stable)
+        return;
+
+    for (size_t i = 0; i < KSM_STABLE_SIZE; ++i) {
+        unsigned ref = 0;
+
+        if (stable[i].kpage && (ref = mmu_page_refcount(stable[i].kpage)) > 1) {
+            nshared++;
+            nsharing += ref - 1;
+        }
+    }
+
+    kprint("Same-page merging:\n");
+    kprint("\tshared pages %u, mappings of them %u, saved %uKB\n",
+            nshared, nsharing, ((nsharing - nshared) * PAGE_SIZE) >> 10);
+    kprint("\tpages merged %u, addresses visited %u, full scans %u\n",
+            stats.nmerged, stats.nvisited, stats.nrounds);
+}
@@ -1,12 +1,15 @@
 #include <arch/amd64/mm/mmu.h>
 #include <arch/i386/mm/mmu.h>
+#include <kernel/acpi/acpi.h>
 #include <kernel/kprint.h>
 #include <kernel/kpanic.h>
-#include <mm/bootmem.h>
 #include <mm/heap.h>
 #include <mm/mmu.h>
+#include <mm/numa.h>
 #include <mm/page.h>
 #include <mm/slab.h>
+#include <mm/vma.h>
+#include <mm/vmalloc.h>
 
 int mmu_init(void *arg)
 {
@@ -18,26 +21,31 @@ int mmu_init(void *arg)
      * these functions don't return any status codes because it is assumed that
      * they succeed and if not, the condition is fatal enough to cause kernel panic */
 
-    /* switch from boot page directory to properly initialized directory 
-     * and map all of the address space to the new page directory */
-    mmu_native_init();
+    /* switch from boot page directory to properly initialized directory
+     * and map all of the physical memory to the new page directory */
+    mmu_native_init(arg);
 
-    /* Page frame allocator needs access slab cache to work and slab in turn 
-     * requires kernel heap to work. Preinitialize heap and slab using 
-     * the boot memory allocator which holds a simple bitmap of free pages 
-     *
-     * When the page frame allocator has been initialized, bootmem is no longer used
-     * and heap and slab will be reinitialized, this time using page frame allocator */
-    (void)mmu_bootmem_init(arg);
-    (void)mmu_heap_preinit();
-    (void)mmu_slab_preinit();
+    /* Record the NUMA topology from ACPI before the zones are built so
+     * that every node gets zones of its own. Without SRAT there's only one node */
+    (void)acpi_numa_init();
+    mmu_numa_init();
 
-    /* initialize page frame allocator and build the memory map */
+    /* Initialize page frame allocator and build the memory map
+     *
+     * The free lists of page frame allocator are threaded through the page array
+     * so it doesn't depend on heap or slab and they can be initialized using it */
     mmu_zones_init(arg);
 
-    /* Reinitialize kernel heap and slab allocator using PFA */
-    mmu_heap_init();
+    /* Initialize slab allocator and kernel heap using PFA
+     * Slab must be initialized first because kmalloc() is built on top of caches */
     mmu_slab_init();
+    mmu_heap_init();
+
+    /* initialize the virtual region allocator for large buffers */
+    mmu_vmalloc_init();
+
+    /* create the cache for virtual memory areas of user tasks */
+    mmu_vma_init();
 
     kdebug("MMU initialized!");
 
@@ -66,6 +74,11 @@ int mmu_map_page(unsigned long paddr, unsigned long vaddr, int flags)
     return mmu_native_map_page(paddr, vaddr, flags);
 }
 
+int mmu_try_map_page(unsigned long paddr, unsigned long vaddr, int flags)
+{
+    return mmu_native_try_map_page(paddr, vaddr, flags);
+}
+
 int mmu_unmap_page(unsigned long vaddr)
 {
     return mmu_native_unmap_page(vaddr);
@@ -78,16 +91,52 @@ int mmu_map_range(unsigned long pstart, unsigned long vstart, size_t n, int flag
 
 int mmu_unmap_range(unsigned long start, size_t n)
 {
-    int ret = 0;
+    return mmu_native_unmap_range(start, n);
+}
 
-    for (size_t i = 0; i < n; ++i) {
-        if ((ret = mmu_native_unmap_page(start + i * PAGE_SIZE)) != 0) {
-            kdebug("failed to unmap page at address 0x%x", start + i * PAGE_SIZE);
-            return ret;
-        }
-    }
+int mmu_map_huge_page(unsigned long paddr, unsigned long vaddr, int flags)
+{
+    return mmu_native_map_huge_page(paddr, vaddr, flags);
+}
 
-    return ret;
+int mmu_promote_huge_page(unsigned long vaddr)
+{
+    return mmu_native_promote_huge_page(vaddr);
+}
+
+int mmu_migrate_range(unsigned long start, unsigned long end)
+{
+    return mmu_native_migrate_range(start, end);
+}
+
+int mmu_reclaim(mm_reclaim_req_t *reqs, size_t n, int flags)
+{
+    return mmu_native_reclaim(reqs, n, flags);
+}
+
+unsigned long mmu_task_page(task_t *task, unsigned long vaddr)
+{
+    return mmu_native_task_page(task, vaddr);
+}
+
+int mmu_merge(mm_merge_req_t *reqs, size_t n)
+{
+    return mmu_native_merge(reqs, n);
+}
+
+unsigned long mmu_translate(unsigned long vaddr)
+{
+    return mmu_native_translate(vaddr);
+}
+
+unsigned long mmu_phys_limit(void)
+{
+    return mmu_native_phys_limit();
+}
+
+void mmu_zero_page(unsigned long paddr)
+{
+    mmu_native_zero_page(paddr);
 }
 
 unsigned long mmu_v_to_p(void *vaddr)
@@ -120,6 +169,11 @@ void mmu_walk_addr(void *addr)
     return mmu_native_walk_addr(addr);
 }
 
+unsigned long mmu_get_ctx(task_t *task)
+{
+    return mmu_native_get_ctx(task);
+}
+
 void mmu_switch_ctx(task_t *task)
 {
     return mmu_native_switch_ctx(task);
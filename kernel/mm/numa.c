@@ -0,0 +1,209 @@
+#include <drivers/lapic.h>
+#include <kernel/common.h>
+#include <kernel/cpu.h>
+#include <kernel/kassert.h>
+#include <kernel/kprint.h>
+#include <kernel/percpu.h>
+#include <mm/numa.h>
+#include <mm/types.h>
+#include <errno.h>
+
+#define NUMA_MAX_RANGES 32
+
+/* The topology is recorded from ACPI SRAT and SLIT before the page allocator
+ * is initialized so everything here is statically allocated */
+typedef struct mm_numa_range {
+    unsigned long start;
+    unsigned long end;
+    unsigned node;
+} mm_numa_range_t;
+
+static mm_numa_range_t ranges[NUMA_MAX_RANGES];
+static size_t          nranges;
+
+static struct {
+    uint32_t lapic_id;
+    unsigned node;
+} cpus[MAX_CPU];
+static size_t ncpus;
+
+static uint32_t node_pxm[MAX_NUMNODES];   /* proximity domain of each node */
+static uint8_t  distance[MAX_NUMNODES][MAX_NUMNODES];
+static uint8_t  fallback[MAX_NUMNODES][MAX_NUMNODES];
+static unsigned nnodes;
+
+/* Return the node of proximity domain "pxm" or -ENXIO if it's not known */
+static int __pxm_to_node(uint32_t pxm)
+{
+    for (unsigned i = 0; i < nnodes; ++i) {
+        if (node_pxm[i] == pxm)
+            return i;
+    }
+
+    return -ENXIO;
+}
+
+/* Return the node of proximity domain "pxm", allocate new node if necessary
+ * Return -ENOSPC if all nodes are in use */
+static int __get_node(uint32_t pxm)
+{
+    int node = __pxm_to_node(pxm);
+
+    if (node >= 0)
+        return node;
+
+    if (nnodes == MAX_NUMNODES) {
+        kdebug("too many proximity domains, ignoring domain %u", pxm);
+        return -ENOSPC;
+    }
+
+    node_pxm[nnodes] = pxm;
+    return nnodes++;
+}
+
+int mmu_numa_add_memory(uint32_t pxm, unsigned long start, size_t len)
+{
+    unsigned long end = ROUND_DOWN(start + len, PAGE_SIZE);
+    int node          = 0;
+
+    start = ROUND_DOWN(start, PAGE_SIZE);
+
+    if (start >= end)
+        return 0;
+
+    if (nranges == NUMA_MAX_RANGES || (node = __get_node(pxm)) < 0)
+        return -ENOSPC;
+
+    ranges[nranges].start = start;
+    ranges[nranges].end   = end;
+    ranges[nranges].node  = node;
+    nranges++;
+
+    return 0;
+}
+
+int mmu_numa_add_cpu(uint32_t lapic_id, uint32_t pxm)
+{
+    int node = 0;
+
+    if (ncpus == MAX_CPU || (node = __get_node(pxm)) < 0)
+        return -ENOSPC;
+
+    cpus[ncpus].lapic_id = lapic_id;
+    cpus[ncpus].node     = node;
+    ncpus++;
+
+    return 0;
+}
+
+void mmu_numa_set_distance(uint32_t from, uint32_t to, uint8_t dist)
+{
+    int nfrom = __pxm_to_node(from);
+    int nto   = __pxm_to_node(to);
+
+    if (nfrom >= 0 && nto >= 0)
+        distance[nfrom][nto] = dist;
+}
+
+void mmu_numa_init(void)
+{
+    if (nnodes == 0) {
+        node_pxm[0] = 0;
+        nnodes      = 1;
+    }
+
+    /* SLIT is optional, nodes without a distance are at the default remote distance */
+    for (unsigned i = 0; i < nnodes; ++i) {
+        for (unsigned k = 0; k < nnodes; ++k) {
+            if (distance[i][k] == 0)
+                distance[i][k] = (i == k) ? NUMA_LOCAL_DISTANCE : NUMA_REMOTE_DISTANCE;
+        }
+    }
+
+    /* Sort the nodes of each fallback list by distance. The node itself is always
+     * first, ties are broken by node number so that the order is stable */
+    for (unsigned i = 0; i < nnodes; ++i) {
+        uint8_t *list = fallback[i];
+
+        list[0] = i;
+
+        for (unsigned k = 0, n = 1; k < nnodes; ++k) {
+            if (k == i)
+                continue;
+
+            unsigned pos = n++;
+
+            while (pos > 1 && distance[i][list[pos - 1]] > distance[i][k]) {
+                list[pos] = list[pos - 1];
+                pos--;
+            }
+
+            list[pos] = k;
+        }
+    }
+
+    kdebug("%u NUMA node(s), %u memory range(s), %u CPU(s) with affinity",
+            nnodes, nranges, ncpus);
+}
+
+unsigned mmu_numa_node_count(void)
+{
+    return nnodes;
+}
+
+unsigned mmu_numa_addr_node(unsigned long paddr)
+{
+    for (size_t i = 0; i < nranges; ++i) {
+        if (paddr >= ranges[i].start && paddr < ranges[i].end)
+            return ranges[i].node;
+    }
+
+    return 0;
+}
+
+unsigned long mmu_numa_range_end(unsigned long paddr)
+{
+    unsigned long end = ~0UL;
+
+    for (size_t i = 0; i < nranges; ++i) {
+        if (paddr >= ranges[i].start && paddr < ranges[i].end)
+            return ranges[i].end;
+
+        if (ranges[i].start > paddr)
+            end = MIN(end, ranges[i].start);
+    }
+
+    return end;
+}
+
+unsigned mmu_numa_lapic_node(uint32_t lapic_id)
+{
+    for (size_t i = 0; i < ncpus; ++i) {
+        if (cpus[i].lapic_id == lapic_id)
+            return cpus[i].node;
+    }
+
+    return 0;
+}
+
+unsigned mmu_numa_this_node(void)
+{
+    /* CPUs are registered when ACPI is initialized, until then everything runs on node 0 */
+    int node = lapic_get_node(get_thiscpu_id());
+
+    return (node < 0) ? 0 : node;
+}
+
+unsigned mmu_numa_distance(unsigned from, unsigned to)
+{
+    kassert(from < nnodes && to < nnodes);
+
+    return distance[from][to];
+}
+
+const uint8_t *mmu_numa_fallback(unsigned node)
+{
+    kassert(node < nnodes);
+
+    return fallback[node];
+}
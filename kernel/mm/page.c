@@ -1,379 +1,821 @@
+#include <drivers/lapic.h>
 #include <fs/multiboot2.h>
 #include <kernel/common.h>
+#include <kernel/compiler.h>
 #include <kernel/kpanic.h>
 #include <kernel/kassert.h>
+#include <kernel/kprint.h>
+#include <kernel/percpu.h>
 #include <kernel/util.h>
 #include <lib/bitmap.h>
 #include <lib/list.h>
-#include <mm/bootmem.h>
+#include <mm/compact.h>
 #include <mm/heap.h>
+#include <mm/ksm.h>
 #include <mm/mmu.h>
+#include <mm/numa.h>
 #include <mm/page.h>
 #include <mm/slab.h>
+#include <mm/swap.h>
 #include <sync/spinlock.h>
 #include <errno.h>
 #include <stdbool.h>
 
-#define ORDER_EMPTY(o) (o.list.next == NULL)
+#define ORDER_SIZE(o)    ((1UL << (o)) * PAGE_SIZE)
+#define NZONES           (MM_ZONE_HIGH + 1)
 
-typedef int (*add_block_t)(void *, unsigned long, unsigned);
+/* The page array is split into sections of 128MB. Only the sections that
+ * contain memory have a section map so holes in the physical address space
+ * don't consume memory. A section is as large as the largest buddy block
+ * so the pages of a block are always contiguous in a section map */
+#define SECTION_SHIFT    (PAGE_SHIFT + BUDDY_MAX_ORDER - 1)
+#define SECTION_PAGES    (1UL << (SECTION_SHIFT - PAGE_SHIFT))
+#define SECTION_MAP_SIZE ROUND_UP(SECTION_PAGES * sizeof(page_t), PAGE_SIZE)
+#define MAX_SECTIONS     (MM_PHYS_MAX >> SECTION_SHIFT)
 
-typedef struct mm_block {
-    unsigned long start;
-    unsigned long end;
-    list_head_t list;
-} mm_block_t;
+#define PCP_HIGH  64 /* drain the per-CPU cache when it holds more pages than this */
+#define PCP_BATCH 16 /* number of pages moved between a per-CPU cache and the zone at once */
 
-/* first item of every block order list is "dummy" entry
- * which tells if this order has any blocks and if so,
- * points to the first block of the order */
+#define WMARK_LOW_SHIFT 6 /* low watermark of a zone is 1/64 of its pages */
+
+#define ZERO_POOL_HIGH 256 /* number of zeroed pages idle CPUs keep in the pool */
+
+typedef int (*add_block_t)(void *, unsigned long, unsigned);
+
+/* per-order counters of a zone, used to track fragmentation */
+typedef struct mm_order_stats {
+    size_t nfree;  /* number of free blocks of this order */
+    size_t nsplit; /* how many times a block of this order has been split */
+    size_t nmerge; /* how many times two buddies of this order have been merged */
+    size_t nfail;  /* how many allocations of this order have failed */
+} mm_order_stats_t;
+
+/* The free lists are threaded through the page array:
+ * the first page of every free block is linked to the list of its order
+ * using page_t's list entry so allocating or freeing a block never
+ * needs to allocate memory */
 typedef struct mm_zone {
     const char *name;
-    size_t page_count;
+    unsigned node;       /* NUMA node of the zone */
+    unsigned type;       /* MM_ZONE_DMA, MM_ZONE_NORMAL or MM_ZONE_HIGH */
+    unsigned long start; /* first physical address of the zone */
+    unsigned long end;   /* end of the physical address range of the zone */
+    unsigned long mem_start; /* first address of memory claimed for the zone */
+    unsigned long mem_end;   /* end of memory claimed for the zone */
+    size_t page_count; /* total number of pages claimed for this zone */
+    size_t free_count; /* number of pages currently free */
+    size_t wmark_low;  /* caches are shrunk when free_count drops below this */
     spinlock_t lock;
-    mm_block_t blocks[BUDDY_MAX_ORDER];
+    list_head_t free_list[BUDDY_MAX_ORDER];
+    mm_order_stats_t stats[BUDDY_MAX_ORDER];
 } mm_zone_t;
 
-static mm_zone_t  zone_dma;
-static mm_zone_t  zone_normal;
-static mm_zone_t  zone_high;
-static mm_cache_t *mm_block_cache;
-static page_t     *page_array;
+/* Per-CPU cache of order-0 pages of the normal or high zone of the CPU's home node
+ *
+ * Single-page allocations and frees are served from the cache of the CPU
+ * so that they don't have to take the zone lock. The cache is refilled from
+ * and drained to the zone PCP_BATCH pages at a time. Pages of other nodes
+ * are never cached so the cache only ever holds node-local memory
+ *
+ * Freed pages are added to the head of the list and allocations are served
+ * from the head too so the most recently freed (cache-hot) page is reused first.
+ * Drain releases the pages at the tail of the list which are the coldest
+ *
+ * The lock is only contended if the task is preempted while it holds the lock
+ * or migrated between get_thiscpu_ptr() and spin_acquire() */
+typedef struct mm_pcp {
+    spinlock_t lock;
+    size_t count;
+    list_head_t list;
+
+    size_t nhit;   /* allocations served from the cache */
+    size_t nmiss;  /* allocations that required a refill */
+    size_t nfree;  /* frees that went to the cache */
+    size_t ndrain; /* how many times the cache was drained */
+} mm_pcp_t;
+
+/* Pool of zeroed order-0 pages of the normal zone of a node
+ *
+ * Idle CPUs fill the pool of their home node so that MM_ZERO allocations
+ * don't have to zero the page on the allocating CPU. The pages are allocated from the zone
+ * and they're returned to it if the zone runs low on memory.
+ * Freed pages are not zeroed, they're zeroed again when a CPU is idle */
+typedef struct mm_zero_pool {
+    spinlock_t lock;
+    size_t count;
+    list_head_t list;
+
+    size_t nhit;    /* MM_ZERO allocations served from the pool */
+    size_t nmiss;   /* MM_ZERO allocations that zeroed the page themselves */
+    size_t nzeroed; /* pages zeroed by idle CPUs */
+} mm_zero_pool_t;
+
+/* caches of the normal (0) and high (1) zones of the CPU's home node */
+static __percpu mm_pcp_t pcp[2];
+static mm_zero_pool_t zero_pool[MAX_NUMNODES];
+static bool pcp_enabled = false;
+static int  shrinking   = 0;
+
+/* zones of each node, indexed using MM_ZONES */
+static mm_zone_t     zones[MAX_NUMNODES][NZONES];
+static page_t        *page_array;     /* section maps of all present sections */
+static size_t        page_array_len;  /* number of page frames covered, holes included */
+static size_t        page_array_size; /* size of the section maps in bytes */
+static unsigned long page_array_mem = INVALID_ADDRESS;
+
+static page_t   *section_map[MAX_SECTIONS];   /* page_t of the first page of each section */
+static uint16_t section_nr[MAX_SECTIONS];     /* section number of the Nth section map */
+static uint64_t section_bits[MAX_SECTIONS / 64];
+static size_t   nsections;
+
+static const struct {
+    const char *name;
+    unsigned long start;
+    unsigned long end;
+} zone_info[NZONES] = {
+    [MM_ZONE_DMA]    = { "MM_ZONE_DMA",    MM_ZONE_DMA_START,    MM_ZONE_DMA_END    },
+    [MM_ZONE_NORMAL] = { "MM_ZONE_NORMAL", MM_ZONE_NORMAL_START, MM_ZONE_NORMAL_END },
+    [MM_ZONE_HIGH]   = { "MM_ZONE_HIGH",   MM_ZONE_HIGH_START,   MM_ZONE_HIGH_END   },
+};
 
 static inline mm_zone_t *__get_zone(unsigned long start, unsigned long end)
 {
-    if (end < MM_ZONE_DMA_END)
-        return &zone_dma;
+    unsigned node = mmu_numa_addr_node(start);
 
-    if (start >= MM_ZONE_NORMAL_START && end < MM_ZONE_NORMAL_END)
-        return &zone_normal;
+    /* memory of two nodes is never part of the same block */
+    if (mmu_numa_addr_node(end - 1) != node)
+        return NULL;
 
-    if (start >= MM_ZONE_HIGH_START && end < MM_ZONE_HIGH_END)
-        return &zone_high;
+    for (size_t i = 0; i < NZONES; ++i) {
+        if (start >= zones[node][i].start && end <= zones[node][i].end)
+            return &zones[node][i];
+    }
 
     return NULL;
 }
 
-static int __zone_add_block(void *param, unsigned long start, unsigned order)
+/* return the page array entry of page frame "pfn"
+ * or NULL if "pfn" is out of page array's range or in a memory hole */
+static inline page_t *__get_page(unsigned long pfn)
 {
-    mm_zone_t *zone   = (mm_zone_t *)param;
-    mm_block_t *block = mmu_cache_alloc_entry(mm_block_cache, MM_ZERO);
+    page_t *map = NULL;
 
-    if (block == NULL)
-        return -errno;
+    if (pfn >= page_array_len)
+        return NULL;
 
-    spin_acquire(&zone->lock);
+    if ((map = section_map[pfn >> (SECTION_SHIFT - PAGE_SHIFT)]) == NULL)
+        return NULL;
 
-    block->start = start;
-    block->end   = start + PAGE_SIZE * (1 << order) - 1;
+    return &map[pfn & (SECTION_PAGES - 1)];
+}
 
-    list_init_null(&block->list);
-    list_append(&zone->blocks[order].list, &block->list);
-    zone->page_count += (1 << order);
+/* return the page frame number of page array entry "page" */
+static inline unsigned long __page_pfn(page_t *page)
+{
+    size_t nth         = ((uint8_t *)page - (uint8_t *)page_array) / SECTION_MAP_SIZE;
+    unsigned long sect = section_nr[nth];
 
-    spin_release(&zone->lock);
-    return 0;
+    return (sect << (SECTION_SHIFT - PAGE_SHIFT)) + (page - section_map[sect]);
 }
 
-static int __page_array_add_block(void *param, unsigned long start, unsigned order)
-{
-    kassert(param != NULL);
+/* page array entry of memory that is reserved and never freed */
+static const page_t page_in_use = {
+    .type  = MM_PT_IN_USE,
+    .first = 1,
+    .ref   = 1,
+};
 
-    unsigned type = *(unsigned *)param;
-    unsigned pfn  = start >> PAGE_SHIFT;
+/* Initialize the page array entries of "npages" pages starting at "pfn" using "tmpl"
+ *
+ * Pages in memory holes are skipped */
+static void __fill_pages(unsigned long pfn, size_t npages, const page_t *tmpl)
+{
+    while (npages > 0) {
+        size_t n     = MIN(npages, SECTION_PAGES - (pfn & (SECTION_PAGES - 1)));
+        page_t *page = __get_page(pfn);
 
-    page_array[pfn].type  = type;
-    page_array[pfn].order = order;
-    page_array[pfn].first = 1;
+        for (size_t i = 0; page && i < n; ++i)
+            page[i] = *tmpl;
 
-    for (int i = 1; i < (1 << order); ++i) {
-        page_array[pfn + i].type  = type;
-        page_array[pfn + i].order = order;
-        page_array[pfn + i].first = 0;
+        pfn    += n;
+        npages -= n;
     }
+}
+
+static void __mark_block(unsigned long pfn, unsigned order, unsigned type)
+{
+    page_t tmpl = {
+        .type  = type,
+        .order = order,
+        .first = 0,
+        .usage = MM_PU_NONE,
+        .ref   = (type == MM_PT_IN_USE),
+    };
+    page_t *page = NULL;
+
+    if ((page = __get_page(pfn)) == NULL)
+        return;
+
+    __fill_pages(pfn, 1UL << order, &tmpl);
+    page->first = 1;
+}
+
+/* Insert free block starting at page frame "pfn" to the free list of "order"
+ *
+ * zone->lock must be held by the caller */
+static void __insert_block(mm_zone_t *zone, unsigned long pfn, unsigned order)
+{
+    page_t *page = __get_page(pfn);
+
+    page->type  = MM_PT_FREE;
+    page->order = order;
+    page->first = 1;
+
+    list_append(&zone->free_list[order], &page->list);
+
+    zone->stats[order].nfree++;
+    zone->free_count += (1 << order);
+}
+
+/* zone->lock must be held by the caller */
+static void __remove_block(mm_zone_t *zone, page_t *page)
+{
+    list_remove(&page->list);
+    list_init_null(&page->list);
+
+    zone->stats[page->order].nfree--;
+    zone->free_count -= (1 << page->order);
+}
+
+static int __zone_add_block(void *param, unsigned long start, unsigned order)
+{
+    mm_zone_t *zone   = (mm_zone_t *)param;
+    unsigned long pfn = start >> PAGE_SHIFT;
+
+    spin_acquire(&zone->lock);
 
+    if (zone->page_count == 0 || start < zone->mem_start)
+        zone->mem_start = start;
+
+    zone->mem_end     = MAX(zone->mem_end, start + ORDER_SIZE(order));
+    zone->page_count += (1 << order);
+    __mark_block(pfn, order, MM_PT_FREE);
+    __insert_block(zone, pfn, order);
+
+    spin_release(&zone->lock);
     return 0;
 }
 
+/* Split the range [start, end) into naturally aligned blocks,
+ * ie. every block of order N starts at an address that is a multiple
+ * of its size. The buddy of a block can then be computed from its address */
 static void __claim_range(unsigned long start, unsigned long end, add_block_t callback, void *cb_param)
 {
     kassert(callback != NULL);
     kassert(cb_param != NULL);
 
-    unsigned long range_len = end - start;
+    while (start < end && end - start >= PAGE_SIZE) {
+        unsigned order = BUDDY_MAX_ORDER - 1;
 
-    if (range_len < PAGE_SIZE)
-        return;
+        while (order > 0 && ((start & (ORDER_SIZE(order) - 1)) || end - start < ORDER_SIZE(order)))
+            order--;
 
-    for (int order = BUDDY_MAX_ORDER - 1; order >= 0; --order) {
-        size_t BLOCK_SIZE = (1 << order) * PAGE_SIZE;
-        size_t num_blocks = range_len / BLOCK_SIZE;
-        size_t rem_bytes  = range_len % BLOCK_SIZE;
+        (void)callback(cb_param, start, order);
+        start += ORDER_SIZE(order);
+    }
+}
 
-        if (num_blocks > 0) {
-            for (size_t b = 0; b < num_blocks; ++b) {
-                (void)callback(cb_param, start, order);
-                start = start + (b + 1) * BLOCK_SIZE;
-            }
+/* Remove block of "order" from the free lists of "zone"
+ *
+ * If there's no free block of "order", a larger block is split into halves until
+ * we've reached a half that satisfies the request. The upper halves are inserted
+ * back to the free lists
+ *
+ * zone->lock must be held by the caller
+ *
+ * Return the page frame number of the block on success
+ * Return INVALID_ADDRESS if there's no free block large enough */
+static unsigned long __get_block(mm_zone_t *zone, unsigned order)
+{
+    unsigned long pfn = INVALID_ADDRESS;
 
-            range_len = rem_bytes;
+    for (unsigned o = order; o < BUDDY_MAX_ORDER; ++o) {
+        if (LIST_EMPTY(zone->free_list[o]))
+            continue;
+
+        page_t *page = container_of(zone->free_list[o].next, page_t, list);
+
+        __remove_block(zone, page);
+        pfn = __page_pfn(page);
+
+        while (o != order) {
+            zone->stats[o--].nsplit++;
+            __insert_block(zone, pfn + (1UL << o), o);
         }
+
+        /* The block must be marked as used before the lock is released,
+         * otherwise a concurrent free of its buddy could try to merge with it */
+        __mark_block(pfn, order, MM_PT_IN_USE);
+        return pfn;
     }
+
+    zone->stats[order].nfail++;
+    return INVALID_ADDRESS;
 }
 
-/* get next free entry from "zone" of "order" and remove it from the free list */
-static mm_block_t *__get_free_entry(mm_zone_t *zone, unsigned order)
+static unsigned long __alloc_block(mm_zone_t *zone, unsigned order)
 {
-    kassert(zone != NULL);
-    kassert(order < BUDDY_MAX_ORDER);
+    spin_acquire(&zone->lock);
+    unsigned long pfn = __get_block(zone, order);
+    spin_release(&zone->lock);
+
+    return pfn;
+}
 
-    mm_block_t *b = container_of(zone->blocks[order].list.next, mm_block_t, list);
-    list_remove(&b->list);
-    list_init_null(&b->list);
+/* Release block to "zone" and merge it with its buddy for as long as the buddy
+ * is free. The buddy of a block of order N starting at page frame "pfn" is
+ * the block starting at "pfn ^ (1 << N)" so the merge is O(1) per order */
+static void __put_block(mm_zone_t *zone, unsigned long pfn, unsigned order)
+{
+    __mark_block(pfn, order, MM_PT_FREE);
+
+    while (order < BUDDY_MAX_ORDER - 1) {
+        unsigned long bpfn   = pfn ^ (1UL << order);
+        unsigned long bstart = bpfn << PAGE_SHIFT;
+        page_t *buddy        = __get_page(bpfn);
+
+        if (!buddy || buddy->type != MM_PT_FREE || !buddy->first || buddy->order != order)
+            break;
+
+        if (__get_zone(bstart, bstart + ORDER_SIZE(order)) != zone)
+            break;
 
-    return b;
+        __remove_block(zone, buddy);
+
+        /* the upper half is now part of the merged block */
+        __get_page(pfn | (1UL << order))->first = 0;
+
+        zone->stats[order].nmerge++;
+        pfn &= ~(1UL << order);
+        order++;
+    }
+
+    __insert_block(zone, pfn, order);
+}
+
+static void __free_block(mm_zone_t *zone, unsigned long pfn, unsigned order)
+{
+    spin_acquire(&zone->lock);
+    __put_block(zone, pfn, order);
+    spin_release(&zone->lock);
 }
 
-/* Split the block of order "split_order" into smaller blocks and keep splitting until
- * we've reached a half of a block that satisfies the request "req_order" */
-static unsigned long __split_block(mm_zone_t *zone, unsigned req_order, unsigned split_order)
+/* Move PCP_BATCH pages from "zone" to the cache
+ *
+ * cache->lock must be held by the caller */
+static void __pcp_refill(mm_pcp_t *cache, mm_zone_t *zone)
 {
-    kassert(split_order != 0 && req_order < BUDDY_MAX_ORDER);
+    unsigned long pfn = INVALID_ADDRESS;
 
     spin_acquire(&zone->lock);
 
-    mm_block_t *b = __get_free_entry(zone, split_order);
+    for (size_t i = 0; i < PCP_BATCH; ++i) {
+        if ((pfn = __get_block(zone, 0)) == INVALID_ADDRESS)
+            break;
+
+        /* Pages in the cache are marked as free but they're not first pages
+         * of any block so the buddy allocator won't merge them and
+         * freeing a cached page again is detected by mmu_block_free() */
+        page_t *page = __get_page(pfn);
 
-    unsigned long split_size  = (1 << (split_order - 1)) * PAGE_SIZE;
-    unsigned long split_start = b->start + split_size;
+        page->type  = MM_PT_FREE;
+        page->first = 0;
 
-    /* modify the end of the original block to create "new" smaller block */
-    b->end -= split_size;
-    list_append(&zone->blocks[--split_order].list, &b->list);
+        list_append(&cache->list, &page->list);
+        cache->count++;
+    }
+
+    spin_release(&zone->lock);
+}
 
-    while (req_order != split_order) {
-        mm_block_t *tmp = mmu_cache_alloc_entry(mm_block_cache, MM_ZERO);
+/* Release "count" coldest pages from the cache back to "zone"
+ *
+ * cache->lock must be held by the caller */
+static void __pcp_drain(mm_pcp_t *cache, mm_zone_t *zone, size_t count)
+{
+    spin_acquire(&zone->lock);
 
-        tmp->start  = split_start;
-        split_size  = (1 << (split_order - 1)) * PAGE_SIZE;
-        split_start = tmp->start + split_size;
+    for (size_t i = 0; i < count && cache->count > 0; ++i) {
+        page_t *page = container_of(cache->list.prev, page_t, list);
 
-        tmp->end -= split_size;
-        tmp->end = tmp->start + split_size - 1;
-        list_append(&zone->blocks[--split_order].list, &tmp->list);
+        list_remove(&page->list);
+        cache->count--;
+
+        __put_block(zone, __page_pfn(page), 0);
     }
 
     spin_release(&zone->lock);
-    return split_start;
+
+    cache->ndrain++;
 }
 
-/* Allocate block of memory from requested zone
+/* Return the cache of this CPU for zones of type "type" and store the zone
+ * the cache is filled from to "zone", ie. the zone of the CPU's home node
  *
- * This function can fail and it return INVALID_ADDRESS on error
- * and pointer to valid block of memory on succes */
-static unsigned long __alloc_mem(unsigned memzone, unsigned order, int flags)
+ * The zone is looked up using the CPU that owns the cache so a task that
+ * migrates to a CPU of another node never mixes pages of two nodes in one cache */
+static inline mm_pcp_t *__pcp_get(unsigned type, mm_zone_t **zone)
 {
-    /* TODO: this is temporary, pfa and bootmem need better cooperation but
-     * right now I'll focus my attention to finalizing x86_64 support */
-    kassert(memzone == MM_ZONE_NORMAL);
+    unsigned long cpu = get_thiscpu_id();
+    int node          = lapic_get_node(cpu);
 
-    if (order > BUDDY_MAX_ORDER ||
-        (memzone & ~(MM_ZONE_DMA | MM_ZONE_NORMAL | MM_ZONE_HIGH)) != 0)
-    {
-        errno = EINVAL;
-        return INVALID_ADDRESS;
+    *zone = &zones[(node < 0) ? 0 : node][type];
+    return &(*get_percpu_ptr(pcp, cpu))[type == MM_ZONE_HIGH];
+}
+
+static unsigned long __pcp_alloc(mm_zone_t *zone)
+{
+    mm_zone_t *local  = NULL;
+    mm_pcp_t *cache   = __pcp_get(zone->type, &local);
+    unsigned long pfn = INVALID_ADDRESS;
+
+    /* pages of remote nodes are not cached */
+    if (local != zone)
+        return __alloc_block(zone, 0);
+
+    spin_acquire(&cache->lock);
+
+    if (cache->list.next == NULL)
+        list_init(&cache->list);
+
+    if (cache->count > 0) {
+        cache->nhit++;
+    } else {
+        cache->nmiss++;
+        __pcp_refill(cache, zone);
     }
 
-    /* Usually either MM_ZONE_DMA or MM_ZONE_NORMAL is requested, so try to
-     * satisfy the request using MM_ZONE_NORMAL and save the DMA for when it's actually needed.
-     *
-     * If the MM_ZONE_NORMAL does not contain a block large enough, MM_ZONE_DMA can be used
-     * though MM_ZONE_NORMAL should be prioritized above all else */
-    mm_zone_t *zone = NULL;
+    if (cache->count > 0) {
+        page_t *page = container_of(cache->list.next, page_t, list);
 
-    if (memzone & MM_ZONE_NORMAL)
-        zone = &zone_normal;
+        list_remove(&page->list);
+        cache->count--;
 
-    else if (memzone & MM_ZONE_DMA)
-        zone = &zone_dma;
+        pfn = __page_pfn(page);
+        __mark_block(pfn, 0, MM_PT_IN_USE);
+    }
 
-    else if (memzone & MM_ZONE_HIGH)
-        zone = &zone_high;
+    spin_release(&cache->lock);
+    put_thiscpu_ptr(cache);
 
-    spin_acquire(&zone->lock);
+    return pfn;
+}
 
-    for (unsigned o = order; o < BUDDY_MAX_ORDER; ++o) {
-        if (ORDER_EMPTY(zone->blocks[o]))
-            continue;
+static void __pcp_free(mm_zone_t *zone, unsigned long pfn)
+{
+    mm_zone_t *local = NULL;
+    mm_pcp_t *cache  = __pcp_get(zone->type, &local);
+    page_t *page     = __get_page(pfn);
+
+    if (local != zone) {
+        __free_block(zone, pfn, 0);
+        return;
+    }
 
-        /* There's a free block available in the order's list caller requested
-         * Hanle this as a special case because it's cleaner */
-        if (o == order) {
-            mm_block_t *b = __get_free_entry(zone, o);
+    spin_acquire(&cache->lock);
 
-            unsigned long start = b->start;
-            (void)mmu_cache_free_entry(mm_block_cache, b, flags);
+    if (cache->list.next == NULL)
+        list_init(&cache->list);
 
-            spin_release(&zone->lock);
-            return start;
+    page->type  = MM_PT_FREE;
+    page->first = 0;
+    page->usage = MM_PU_NONE;
+
+    list_append(&cache->list, &page->list);
+    cache->count++;
+    cache->nfree++;
+
+    if (cache->count > PCP_HIGH)
+        __pcp_drain(cache, zone, PCP_BATCH);
+
+    spin_release(&cache->lock);
+    put_thiscpu_ptr(cache);
+}
+
+static unsigned long __alloc_pages(mm_zone_t *zone, unsigned order)
+{
+    if (order == 0 && zone->type != MM_ZONE_DMA && pcp_enabled)
+        return __pcp_alloc(zone);
+
+    return __alloc_block(zone, order);
+}
+
+/* Return the pages of the zero pools back to the normal zones */
+static void __zero_pool_drain(void)
+{
+    list_head_t pages;
+
+    list_init(&pages);
+
+    for (unsigned n = 0; n < mmu_numa_node_count(); ++n) {
+        mm_zero_pool_t *pool = &zero_pool[n];
+
+        spin_acquire(&pool->lock);
+
+        while (pool->count > 0) {
+            page_t *page = container_of(pool->list.next, page_t, list);
+
+            list_remove(&page->list);
+            list_append(&pages, &page->list);
+            pool->count--;
         }
 
-        spin_release(&zone->lock);
-        return __split_block(zone, order, o);
+        spin_release(&pool->lock);
     }
 
-    spin_release(&zone->lock);
-    errno = ENOMEM;
-    return INVALID_ADDRESS;
+    while (!LIST_EMPTY(pages)) {
+        page_t *page = container_of(pages.next, page_t, list);
+
+        list_remove(&page->list);
+        (void)mmu_block_free(mmu_page_addr(page), 0);
+    }
 }
 
-/* claim only available/reclaimable memory for zones */
-static void __claim_range_preinit(unsigned type, unsigned long address, size_t len)
+/* Release the empty slabs of all caches and the pages of the zero pool back to the zones
+ *
+ * Only one CPU shrinks the caches at a time, others just continue with
+ * their allocation. zone->lock must not be held by the caller */
+static void __shrink_caches(void)
 {
-    if (type != MULTIBOOT_MEMORY_AVAILABLE &&
-        type != MULTIBOOT_MEMORY_ACPI_RECLAIMABLE)
+    if (__sync_lock_test_and_set(&shrinking, 1))
         return;
 
-    return mmu_claim_range(address, len);
+    (void)mmu_caches_shrink();
+    __zero_pool_drain();
+
+    __sync_lock_release(&shrinking);
 }
 
-/* claim all memory but update only the page array */
-static void __claim_range_postinit(unsigned type, unsigned long address, size_t len)
+/* Allocate block of "order" from the nodes in the fallback order of "node"
+ *
+ * Memory of the nearest node is preferred over the zone type: on each node,
+ * high zone requests fall back to the normal zone before the next node is tried.
+ * The zone that served the allocation is stored to "zone"
+ *
+ * Return the page frame number of the block on success
+ * Return INVALID_ADDRESS if none of the zones has a free block large enough */
+static unsigned long __alloc_nodes(unsigned node, unsigned memzone, unsigned order, mm_zone_t **zone)
 {
-    unsigned mm_type = MM_PT_INVALID;
+    const uint8_t *nodes = mmu_numa_fallback(node);
+    unsigned long pfn    = INVALID_ADDRESS;
 
-    switch (type) {
-        case MULTIBOOT_MEMORY_AVAILABLE:
-        case MULTIBOOT_MEMORY_ACPI_RECLAIMABLE:
-            mm_type = MM_PT_FREE;
-            break;
+    for (unsigned i = 0; i < mmu_numa_node_count(); ++i) {
+        for (unsigned z = memzone; z >= MM_ZONE_NORMAL; --z) {
+            *zone = &zones[nodes[i]][z];
 
-        case MULTIBOOT_MEMORY_RESERVED:
-        case MULTIBOOT_MEMORY_NVS:
-        case MULTIBOOT_MEMORY_BADRAM:
-            mm_type = MM_PT_IN_USE;
-            break;
+            if ((*zone)->page_count == 0)
+                continue;
+
+            if ((pfn = __alloc_pages(*zone, order)) != INVALID_ADDRESS)
+                return pfn;
+        }
     }
 
-    __claim_range(
-        ROUND_UP(address, PAGE_SIZE),
-        ROUND_DOWN(address + len, PAGE_SIZE),
-        __page_array_add_block,
-        &mm_type
-    );
+    return INVALID_ADDRESS;
 }
 
-void mmu_zones_init(void *arg)
+/* Allocate block of memory from requested zone, preferring the memory of "node"
+ *
+ * Single pages of the normal and high zones are allocated from the per-CPU cache
+ * if "node" is the home node of this CPU
+ *
+ * This function can fail and it return INVALID_ADDRESS on error
+ * and pointer to valid block of memory on succes */
+static unsigned long __alloc_mem(unsigned node, unsigned memzone, unsigned order, int flags)
+{
+    if (order >= BUDDY_MAX_ORDER || memzone > MM_ZONE_HIGH || node >= mmu_numa_node_count()) {
+        errno = EINVAL;
+        return INVALID_ADDRESS;
+    }
+
+    /* TODO: this is temporary, pfa and bootmem need better cooperation but
+     * right now I'll focus my attention to finalizing x86_64 support
+     *
+     * The kernel image is in the DMA zone so nothing can be allocated from it */
+    kassert(memzone != MM_ZONE_DMA);
+
+    /* High zone is requested for memory that doesn't have to be accessible
+     * to 32-bit devices, such as user pages and page tables. If high zone
+     * doesn't exist or it's exhausted, the request is served from the normal zone */
+    mm_zone_t *zone   = NULL;
+    unsigned long pfn = INVALID_ADDRESS;
+
+    /* If the zone runs low on memory, return the empty slabs of the caches
+     * back to the zones. If the allocation failed, try again after shrinking */
+    if ((pfn = __alloc_nodes(node, memzone, order, &zone)) == INVALID_ADDRESS) {
+        __shrink_caches();
+        pfn = __alloc_nodes(node, memzone, order, &zone);
+    } else if (zone->free_count < zone->wmark_low) {
+        __shrink_caches();
+        mmu_swap_kick();
+    }
+
+    /* There may be enough free memory but it's too fragmented for the request.
+     * Allocations that can fail may be made while holding the MMU lock
+     * so they only wake up the compaction thread. Others are about to panic
+     * so the free memory is compacted before giving up */
+    if (pfn == INVALID_ADDRESS && order > 0) {
+        if (flags & MM_TRY)
+            mmu_compact_kick(order);
+        else if (mmu_compact_node(node, memzone, order) == 0)
+            pfn = __alloc_nodes(node, memzone, order, &zone);
+    }
+
+    /* The last resort is to swap out user pages. The reclaim doesn't wait for
+     * someone else who is reclaiming or moving pages, that would deadlock
+     * if it's the thread that is waiting for this allocation */
+    if (pfn == INVALID_ADDRESS) {
+        if (flags & MM_TRY)
+            mmu_swap_kick();
+        else if (mmu_swap_reclaim(1UL << order, MM_TRY) > 0)
+            pfn = __alloc_nodes(node, memzone, order, &zone);
+    }
+
+    if (pfn == INVALID_ADDRESS) {
+        errno = ENOMEM;
+        return INVALID_ADDRESS;
+    }
+
+    return pfn << PAGE_SHIFT;
+}
+
+/* Mark the sections that contain memory listed in the memory map */
+static void __find_sections(unsigned type, unsigned long address, size_t len)
 {
-    zone_dma.name    = "MM_ZONE_DMA";
-    zone_normal.name = "MM_ZONE_NORMAL";
-    zone_high.name   = "MM_ZONE_HIGH";
+    (void)type;
 
-    zone_dma.page_count    = 0;
-    zone_normal.page_count = 0;
-    zone_high.page_count   = 0;
+    unsigned long end = MIN(address + len, mmu_phys_limit());
 
-    for (size_t i = 0; i < BUDDY_MAX_ORDER; ++i) {
-        zone_dma.blocks[i].start    = 0;
-        zone_dma.blocks[i].end      = 0;
+    if (address >= end)
+        return;
 
-        zone_normal.blocks[i].start = 0;
-        zone_normal.blocks[i].end   = 0;
+    for (unsigned long s = address >> SECTION_SHIFT; s <= (end - 1) >> SECTION_SHIFT; ++s)
+        section_bits[s / 64] |= 1UL << (s % 64);
 
-        zone_high.blocks[i].start   = 0;
-        zone_high.blocks[i].end     = 0;
+    page_array_len = MAX(page_array_len, end >> PAGE_SHIFT);
+}
+
+/* Find a range of available memory from normal or high zone for the page array */
+static void __find_page_array(unsigned type, unsigned long address, size_t len)
+{
+    if (page_array_mem != INVALID_ADDRESS || type != MULTIBOOT_MEMORY_AVAILABLE)
+        return;
+
+    unsigned long start = ROUND_UP(MAX(address, MM_ZONE_NORMAL_START), PAGE_SIZE);
+
+    if (start + page_array_size <= MIN(address + len, mmu_phys_limit()))
+        page_array_mem = start;
+}
+
+/* Memory that is not available is marked as used in the page array, available
+ * memory is initialized when it's claimed for the zones */
+static void __claim_range_page_array(unsigned type, unsigned long address, size_t len)
+{
+    if (type == MULTIBOOT_MEMORY_AVAILABLE ||
+        type == MULTIBOOT_MEMORY_ACPI_RECLAIMABLE)
+        return;
+
+    unsigned long start = ROUND_UP(address, PAGE_SIZE);
+    unsigned long end   = MIN(ROUND_DOWN(address + len, PAGE_SIZE), page_array_len << PAGE_SHIFT);
+
+    if (start < end)
+        __fill_pages(start >> PAGE_SHIFT, (end - start) >> PAGE_SHIFT, &page_in_use);
+}
 
-        list_init_null(&zone_dma.blocks[i].list);
-        list_init_null(&zone_normal.blocks[i].list);
-        list_init_null(&zone_high.blocks[i].list);
+/* claim only available/reclaimable memory for zones and skip the page array */
+static void __claim_range_zones(unsigned type, unsigned long address, size_t len)
+{
+    if (type != MULTIBOOT_MEMORY_AVAILABLE &&
+        type != MULTIBOOT_MEMORY_ACPI_RECLAIMABLE)
+        return;
+
+    unsigned long start    = address;
+    unsigned long end      = address + len;
+    unsigned long pa_start = page_array_mem;
+    unsigned long pa_end   = page_array_mem + page_array_size;
+
+    if (pa_start < end && pa_end > start) {
+        if (start < pa_start)
+            mmu_claim_range(start, pa_start - start);
+
+        if (pa_end < end)
+            mmu_claim_range(pa_end, end - pa_end);
+
+        return;
     }
 
-    if ((mm_block_cache = mmu_cache_create(sizeof(mm_block_t), MM_NO_FLAGS)) == NULL)
-        kpanic("Failed to allocate mm_block_cache for PFA");
+    mmu_claim_range(address, len);
+}
 
-    /* Memory is claimed twice: on the first run we're only interested in free memory
-     * because we're initializing the zones. When zones and the page array have been initialized
-     * we reclaim all memory but this time we're only updating the page array */
-    multiboot2_map_memory(arg, __claim_range_preinit);
+void mmu_zones_init(void *arg)
+{
+    /* every node has all zones, zones of a node contain only the memory of that node */
+    for (unsigned n = 0; n < MAX_NUMNODES; ++n) {
+        for (unsigned i = 0; i < NZONES; ++i) {
+            mm_zone_t *zone = &zones[n][i];
+
+            zone->name       = zone_info[i].name;
+            zone->node       = n;
+            zone->type       = i;
+            zone->start      = zone_info[i].start;
+            zone->end        = zone_info[i].end;
+            zone->mem_start  = 0;
+            zone->mem_end    = 0;
+            zone->page_count = 0;
+            zone->free_count = 0;
+            zone->wmark_low  = 0;
+            zone->lock       = 0;
+
+            for (size_t k = 0; k < BUDDY_MAX_ORDER; ++k)
+                list_init(&zone->free_list[k]);
+
+            kmemset(zone->stats, 0, sizeof(zone->stats));
+        }
+    }
 
-    /* We have now mapped all memory for the PFA but during boot
-     * we allocated memory pages from boot memory manager.
+    /* Create the page array for all physical memory
      *
-     * We must now "claim" these pages and set them as occupied
-     * to prevent reallocation. The boot process is very straightforward right now:
-     *  - alloc page for heap
-     *  - alloc 2 pages for slab
-     *  - alloc slab cache for pfa
-     *  -> done
+     * The page array has an entry for each page of every section that contains
+     * memory listed in the memory map. The section maps are allocated as one
+     * range, in the order of the sections, directly from the memory map.
      *
-     * This means that we must mark the these three pages (found at the start of DMA zone)
-     * as occupied in the zone (and if they're part of a larger block, split the block) */
-    /* TODO: i need to rethink this.. */
-    int entries = 0;
-    struct bootmem_mmap **map = mmu_bootmem_release(&entries);
+     * The free lists of the zones are threaded through the page array so it must
+     * exist before any memory can be claimed and the range is left out
+     * when the zones are initialized */
+    multiboot2_map_memory(arg, __find_sections);
 
-    /* Create page array for all physical memory (current max: 2GB bytes)
-     *
-     * Each page maps 4096 bytes of memory so we need 2GB / 4096 == 0x800000
-     * entries to hold the entire page array in memory and each entry is sizeof(page_t)
-     * bytes of memory so in total we need 0x800000 * sizeof(page_t) which is 10MB of memory
-     * but due to lack of granularity we need to allocate a much larger block
-     *
-     * Use the internal allocation function to allocate the block because currently
-     * the page_array points to NULL */
-    unsigned long pa_mem = __alloc_mem(MM_ZONE_NORMAL, 12, 0);
+    for (size_t i = 0; i < MAX_SECTIONS / 64; ++i)
+        nsections += __builtin_popcountl(section_bits[i]);
 
-    if (pa_mem == INVALID_ADDRESS)
+    page_array_size = nsections * SECTION_MAP_SIZE;
+
+    multiboot2_map_memory(arg, __find_page_array);
+
+    if (page_array_mem == INVALID_ADDRESS)
         kpanic("failed to allocate memory for page array");
 
-    page_array = mmu_p_to_v(pa_mem);
+    page_array = mmu_p_to_v(page_array_mem);
+
+    for (size_t s = 0, n = 0; s < MAX_SECTIONS; ++s) {
+        if (!(section_bits[s / 64] & (1UL << (s % 64))))
+            continue;
+
+        section_nr[n]  = s;
+        section_map[s] = (page_t *)((uint8_t *)page_array + n++ * SECTION_MAP_SIZE);
+    }
 
-    /* initially mark all memory as invalid
-     * (even the parts that multiboot2 memory doesn't contain) */
-    kmemset(page_array, MM_PT_INVALID, (1 << 12) * PAGE_SIZE);
+    /* Initially all memory is invalid (even the parts multiboot2 memory doesn't contain).
+     * Unavailable memory and the page array are then marked as used and the free
+     * memory is claimed for the zones which marks it free. Every page is written
+     * at most twice and a whole range at a time */
+    kmemset(page_array, 0, page_array_size);
 
-    /* Mark areas of page array to free/occupied using multiboot2 memory map */
-    multiboot2_map_memory(arg, __claim_range_postinit);
+    multiboot2_map_memory(arg, __claim_range_page_array);
+    __fill_pages(page_array_mem >> PAGE_SHIFT, page_array_size >> PAGE_SHIFT, &page_in_use);
+    multiboot2_map_memory(arg, __claim_range_zones);
 
-    /* set the memory consumed by the page array as in use separately
-     * because multiboot2_map_memory() has marked it as free */
-    (void)__page_array_add_block(&(unsigned){ MM_PT_IN_USE }, pa_mem, 12);
+    for (unsigned n = 0; n < MAX_NUMNODES; ++n) {
+        for (unsigned i = 0; i < NZONES; ++i)
+            zones[n][i].wmark_low = zones[n][i].page_count >> WMARK_LOW_SHIFT;
+    }
+
+    kdebug("page array: %u sections, %u KB",
+            nsections, page_array_size >> 10);
 }
 
 void mmu_claim_range(unsigned long address, size_t len)
 {
-    mm_zone_t *zone = __get_zone(address, address + len);
+    kassert(page_array != NULL);
 
-    if (zone != NULL) {
-        /* round up and down to get usable boundaries */
-        __claim_range(
-            ROUND_UP(address, PAGE_SIZE),
-            ROUND_DOWN(address + len, PAGE_SIZE),
-            __zone_add_block,
-            zone
-        );
-    }
+    unsigned long start = ROUND_UP(address, PAGE_SIZE);
+    unsigned long end   = ROUND_DOWN(address + len, PAGE_SIZE);
 
-    /* There are two possibilities for the range to be NULL:
-     * - the address range given was invalid (rarely the case)
-     * - the address range given overlaps two (or more) zones
-     *
-     * We must check here which is the case and if it's the overlapping case,
-     * deal with the error by splitting the range into two smaller ranges */
-    if (address < MM_ZONE_NORMAL_START && address + len > MM_ZONE_DMA_END) {
-        __claim_range(
-            ROUND_UP(address, PAGE_SIZE),
-            MM_ZONE_DMA_END,
-            __zone_add_block,
-            &zone_dma
-        );
+    /* only memory that is covered by the page array can be managed */
+    end = MIN(end, page_array_len << PAGE_SHIFT);
+
+    /* The range may overlap several zones and nodes, claim the part of each zone
+     * separately and split it further at node boundaries */
+    for (size_t i = 0; i < NZONES; ++i) {
+        unsigned long zstart = MAX(start, zone_info[i].start);
+        unsigned long zend   = MIN(end,   zone_info[i].end);
 
-        __claim_range(
-            MM_ZONE_NORMAL_START,
-            ROUND_DOWN(address + len, PAGE_SIZE),
-            __zone_add_block,
-            &zone_normal
-        );
+        while (zstart < zend) {
+            unsigned long nend = MIN(zend, mmu_numa_range_end(zstart));
+            unsigned node      = mmu_numa_addr_node(zstart);
+
+            __claim_range(zstart, nend, __zone_add_block, &zones[node][i]);
+            zstart = nend;
+        }
     }
 }
 
@@ -387,36 +829,421 @@ unsigned long mmu_page_alloc(unsigned memzone, int flags)
     return mmu_block_alloc(memzone, 0, flags);
 }
 
-unsigned long mmu_block_alloc(unsigned memzone, unsigned order, int flags)
+/* Take a zeroed page from the zero pool of "node"
+ *
+ * Return INVALID_ADDRESS if the pool is empty */
+static unsigned long __zero_pool_get(unsigned node)
 {
-    unsigned long address = __alloc_mem(memzone, order, flags);
+    mm_zero_pool_t *pool = &zero_pool[node];
+    page_t *page         = NULL;
+
+    spin_acquire(&pool->lock);
+
+    if (pool->count > 0) {
+        page = container_of(pool->list.next, page_t, list);
+
+        list_remove(&page->list);
+        pool->count--;
+        pool->nhit++;
+    } else {
+        pool->nmiss++;
+    }
+
+    spin_release(&pool->lock);
+
+    return page ? mmu_page_addr(page) : INVALID_ADDRESS;
+}
 
-    if (address == INVALID_ADDRESS) {
+unsigned long mmu_block_alloc_node(unsigned node, unsigned memzone, unsigned order, int flags)
+{
+    unsigned long address = INVALID_ADDRESS;
+
+    if ((flags & MM_ZERO) && order == 0 && memzone != MM_ZONE_DMA &&
+        node < mmu_numa_node_count() && pcp_enabled)
+    {
+        if ((address = __zero_pool_get(node)) != INVALID_ADDRESS)
+            return address;
+    }
+
+    address = __alloc_mem(node, memzone, order, flags);
+
+    if (address == INVALID_ADDRESS && !(flags & MM_TRY)) {
         kpanic("out of memory");
         return INVALID_ADDRESS;
     }
 
-    (void)__page_array_add_block(&(unsigned){ MM_PT_IN_USE }, address, order);
+    if (address != INVALID_ADDRESS && (flags & MM_ZERO))
+        kmemset(mmu_p_to_v(address), 0, ORDER_SIZE(order));
 
     return address;
 }
 
+unsigned long mmu_block_alloc(unsigned memzone, unsigned order, int flags)
+{
+    return mmu_block_alloc_node(mmu_numa_this_node(), memzone, order, flags);
+}
+
+bool mmu_zero_pool_refill(void)
+{
+    unsigned node        = mmu_numa_this_node();
+    mm_zone_t *zone      = &zones[node][MM_ZONE_NORMAL];
+    mm_zero_pool_t *pool = &zero_pool[node];
+    unsigned long pfn    = INVALID_ADDRESS;
+
+    if (!pcp_enabled || READ_ONCE(pool->count) >= ZERO_POOL_HIGH)
+        return false;
+
+    /* the pool must not take memory that is needed elsewhere */
+    if (READ_ONCE(zone->free_count) < 2 * zone->wmark_low)
+        return false;
+
+    /* only the memory of the node is used so that the pool stays node-local */
+    if (zone->page_count == 0 || (pfn = __alloc_pages(zone, 0)) == INVALID_ADDRESS)
+        return false;
+
+    mmu_zero_page(pfn << PAGE_SHIFT);
+
+    spin_acquire(&pool->lock);
+
+    list_append(&pool->list, &__get_page(pfn)->list);
+    pool->count++;
+    pool->nzeroed++;
+
+    spin_release(&pool->lock);
+
+    return true;
+}
+
 int mmu_block_free(unsigned long address, unsigned order)
 {
-    if (!PAGE_ALIGNED(address))
+    if (!PAGE_ALIGNED(address) || order >= BUDDY_MAX_ORDER)
         return -EINVAL;
 
-    mm_zone_t *zone = __get_zone(address, address + (1 << order) * PAGE_SIZE);
+    mm_zone_t *zone = __get_zone(address, address + ORDER_SIZE(order));
+    page_t *page    = __get_page(address >> PAGE_SHIFT);
 
     if (zone == NULL)
         return -ENXIO;
 
-    (void)__page_array_add_block(&(unsigned){ MM_PT_FREE }, address, order);
+    if (page && (page->type != MM_PT_IN_USE || !page->first || page->order != order)) {
+        kdebug("invalid free: 0x%x, order %u (type %u, order %u)",
+                address, order, page->type, page->order);
+        return -EINVAL;
+    }
+
+    /* the list entry of a user page is reused by the free lists */
+    if (page && page->usage == MM_PU_USER)
+        mmu_lru_del(page);
+
+    if (order == 0 && zone->type != MM_ZONE_DMA && pcp_enabled)
+        __pcp_free(zone, address >> PAGE_SHIFT);
+    else
+        __free_block(zone, address >> PAGE_SHIFT, order);
 
-    return __zone_add_block(zone, address, order);
+    return 0;
 }
 
 int mmu_page_free(unsigned long address)
 {
     return mmu_block_free(address, 0);
 }
+
+page_t *mmu_page_get(unsigned long address)
+{
+    return __get_page(address >> PAGE_SHIFT);
+}
+
+unsigned long mmu_page_addr(page_t *page)
+{
+    kassert((uint8_t *)page >= (uint8_t *)page_array &&
+            (uint8_t *)page <  (uint8_t *)page_array + page_array_size);
+
+    return __page_pfn(page) << PAGE_SHIFT;
+}
+
+void mmu_page_ref(unsigned long address)
+{
+    page_t *page = __get_page(address >> PAGE_SHIFT);
+
+    kassert(page != NULL && page->type == MM_PT_IN_USE && page->first);
+    kassert(page->ref != 0);
+
+    __sync_add_and_fetch(&page->ref, 1);
+}
+
+unsigned mmu_page_unref(unsigned long address)
+{
+    page_t *page = __get_page(address >> PAGE_SHIFT);
+    unsigned ref = 0;
+
+    kassert(page != NULL && page->type == MM_PT_IN_USE && page->first);
+    kassert(page->ref != 0);
+
+    if ((ref = __sync_sub_and_fetch(&page->ref, 1)) == 0)
+        (void)mmu_block_free(address, page->order);
+
+    return ref;
+}
+
+unsigned mmu_page_refcount(unsigned long address)
+{
+    page_t *page = __get_page(address >> PAGE_SHIFT);
+
+    if (!page || page->type != MM_PT_IN_USE)
+        return 0;
+
+    return page->ref;
+}
+
+size_t mmu_zones_shortage(void)
+{
+    size_t npages = 0;
+
+    for (unsigned n = 0; n < mmu_numa_node_count(); ++n) {
+        for (unsigned z = MM_ZONE_NORMAL; z <= MM_ZONE_HIGH; ++z) {
+            mm_zone_t *zone = &zones[n][z];
+            size_t nfree    = READ_ONCE(zone->free_count);
+
+            if (zone->page_count != 0 && nfree < 2 * zone->wmark_low)
+                npages += 2 * zone->wmark_low - nfree;
+        }
+    }
+
+    return npages;
+}
+
+int mmu_zone_span(unsigned node, unsigned memzone, unsigned long *start, unsigned long *end)
+{
+    if (node >= mmu_numa_node_count() || memzone > MM_ZONE_HIGH || !start || !end)
+        return -EINVAL;
+
+    if (zones[node][memzone].page_count == 0)
+        return -ENXIO;
+
+    *start = zones[node][memzone].mem_start;
+    *end   = zones[node][memzone].mem_end;
+
+    return 0;
+}
+
+int mmu_block_isolate(unsigned long address, unsigned order)
+{
+    mm_zone_t *zone    = __get_zone(address, address + ORDER_SIZE(order));
+    unsigned long pfn  = address >> PAGE_SHIFT;
+    unsigned long end  = pfn + (1UL << order);
+    page_t *page       = NULL;
+    int nmovable       = 0;
+
+    if (!PAGE_ALIGNED(address) || (address & (ORDER_SIZE(order) - 1)) || !zone)
+        return -EINVAL;
+
+    spin_acquire(&zone->lock);
+
+    /* check the whole block first so that nothing has to be undone.
+     * Free blocks are naturally aligned so each one is either
+     * inside the block or contains the whole block */
+    for (unsigned long i = pfn; i < end; ) {
+        if (!(page = __get_page(i)) || !page->first)
+            goto busy;
+
+        if (page->type == MM_PT_FREE) {
+            if (page->order >= order)
+                goto busy;
+
+            i += 1UL << page->order;
+            continue;
+        }
+
+        /* pages shared after fork are not moved */
+        if (page->type != MM_PT_IN_USE || page->order != 0 || page->usage != MM_PU_USER || page->ref != 1)
+            goto busy;
+
+        nmovable++;
+        i++;
+    }
+
+    /* the free parts are marked as used so that they're not allocated
+     * or merged with their buddies while the user pages are migrated */
+    for (unsigned long i = pfn; i < end; ) {
+        page = __get_page(i);
+
+        if (page->type != MM_PT_FREE) {
+            i++;
+            continue;
+        }
+
+        unsigned o = page->order;
+
+        __remove_block(zone, page);
+        __mark_block(i, o, MM_PT_IN_USE);
+        page->usage = MM_PU_ISOLATED;
+
+        i += 1UL << o;
+    }
+
+    spin_release(&zone->lock);
+    return nmovable;
+
+busy:
+    spin_release(&zone->lock);
+    return -EBUSY;
+}
+
+int mmu_block_putback(unsigned long address, unsigned order)
+{
+    mm_zone_t *zone    = __get_zone(address, address + ORDER_SIZE(order));
+    unsigned long pfn  = address >> PAGE_SHIFT;
+    unsigned long end  = pfn + (1UL << order);
+    page_t *page       = NULL;
+    bool complete      = true;
+
+    kassert(zone != NULL);
+
+    spin_acquire(&zone->lock);
+
+    for (unsigned long i = pfn; i < end && complete; ) {
+        page = __get_page(i);
+
+        if (page->type != MM_PT_IN_USE || !page->first || page->usage != MM_PU_ISOLATED)
+            complete = false;
+
+        i += 1UL << page->order;
+    }
+
+    if (complete) {
+        __put_block(zone, pfn, order);
+        spin_release(&zone->lock);
+        return 0;
+    }
+
+    /* Some page couldn't be migrated, release the isolated parts one by one.
+     * Pages that were freed by their users while isolated are already free */
+    for (unsigned long i = pfn; i < end; ) {
+        page = __get_page(i);
+
+        if (page->type != MM_PT_IN_USE || !page->first || page->usage != MM_PU_ISOLATED) {
+            i++;
+            continue;
+        }
+
+        unsigned o = page->order;
+
+        __put_block(zone, i, o);
+        i += 1UL << o;
+    }
+
+    spin_release(&zone->lock);
+    return -EAGAIN;
+}
+
+/* Return the number of free pages of "zone" and store the number
+ * of pages in free blocks of at least "order" to "usable" */
+static size_t __zone_free_pages(mm_zone_t *zone, unsigned order, size_t *usable)
+{
+    size_t nfree = 0;
+
+    spin_acquire(&zone->lock);
+
+    for (unsigned o = order; o < BUDDY_MAX_ORDER; ++o)
+        *usable += zone->stats[o].nfree << o;
+
+    nfree = zone->free_count;
+
+    spin_release(&zone->lock);
+
+    return nfree;
+}
+
+static int __zone_frag_index(mm_zone_t *zone, unsigned order)
+{
+    size_t usable = 0;
+    size_t nfree  = __zone_free_pages(zone, order, &usable);
+
+    if (nfree == 0)
+        return 0;
+
+    return ((nfree - usable) * 100) / nfree;
+}
+
+int mmu_zone_frag_index(unsigned memzone, unsigned order)
+{
+    if (memzone > MM_ZONE_HIGH || order >= BUDDY_MAX_ORDER)
+        return -EINVAL;
+
+    size_t usable = 0;
+    size_t nfree  = 0;
+
+    /* the zone of every node is counted */
+    for (unsigned n = 0; n < mmu_numa_node_count(); ++n)
+        nfree += __zone_free_pages(&zones[n][memzone], order, &usable);
+
+    if (nfree == 0)
+        return 0;
+
+    return ((nfree - usable) * 100) / nfree;
+}
+
+void mmu_pcp_init(void)
+{
+    for (unsigned n = 0; n < MAX_NUMNODES; ++n)
+        list_init(&zero_pool[n].list);
+
+    pcp_enabled = true;
+}
+
+void mmu_zones_print_stats(void)
+{
+    for (unsigned n = 0; n < mmu_numa_node_count(); ++n) {
+        for (size_t i = 0; i < NZONES; ++i) {
+            mm_zone_t *zone = &zones[n][i];
+
+            if (zone->page_count == 0)
+                continue;
+
+            kprint("node %u %s: %u pages, %u free, low watermark %u\n", n,
+                    zone->name, zone->page_count, zone->free_count, zone->wmark_low);
+            kprint("\torder     free    split    merge     fail  frag\n");
+
+            for (unsigned o = 0; o < BUDDY_MAX_ORDER; ++o) {
+                kprint("\t%5u %8u %8u %8u %8u  %3d%%\n", o,
+                        zone->stats[o].nfree,  zone->stats[o].nsplit,
+                        zone->stats[o].nmerge, zone->stats[o].nfail,
+                        (long)__zone_frag_index(zone, o));
+            }
+        }
+    }
+
+    if (!pcp_enabled)
+        return;
+
+    kprint("per-CPU page caches:\n");
+    kprint("\t  cpu node zone    count      hit     miss     free    drain  hit%%\n");
+
+    for (size_t i = 0; i < lapic_get_cpu_count(); ++i) {
+        for (size_t z = 0; z < 2; ++z) {
+            mm_pcp_t *cache = &(*get_percpu_ptr(pcp, i))[z];
+            size_t nalloc   = cache->nhit + cache->nmiss;
+
+            kprint("\t%5u %4d %4s %8u %8u %8u %8u %8u  %3d%%\n", i,
+                    (long)lapic_get_node(i), z ? "high" : "norm",
+                    cache->count, cache->nhit,  cache->nmiss,
+                    cache->nfree, cache->ndrain,
+                    nalloc ? (long)((cache->nhit * 100) / nalloc) : 0L);
+
+            put_percpu_ptr(cache, i);
+        }
+    }
+
+    for (unsigned n = 0; n < mmu_numa_node_count(); ++n) {
+        mm_zero_pool_t *pool = &zero_pool[n];
+        size_t nzalloc       = pool->nhit + pool->nmiss;
+
+        kprint("node %u zero pool: %u pages, %u zeroed, %u hit, %u miss, %d%% hit\n", n,
+                pool->count, pool->nzeroed, pool->nhit, pool->nmiss,
+                nzalloc ? (long)((pool->nhit * 100) / nzalloc) : 0L);
+    }
+
+    mmu_compact_print_stats();
+    mmu_swap_print_stats();
+    mmu_ksm_print_stats();
+}
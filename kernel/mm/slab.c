@@ -2,164 +2,404 @@
 #include <kernel/kassert.h>
 #include <kernel/kpanic.h>
 #include <kernel/kprint.h>
+#include <kernel/percpu.h>
 #include <kernel/util.h>
 #include <lib/list.h>
-#include <mm/bootmem.h>
-#include <mm/heap.h>
 #include <mm/mmu.h>
+#include <mm/numa.h>
 #include <mm/page.h>
 #include <mm/slab.h>
 #include <sync/spinlock.h>
 #include <errno.h>
+#include <stdbool.h>
+
+#define SLAB_SIZE(o)   ((1UL << (o)) * PAGE_SIZE)
+#define SLAB_MAX_ORDER 3  /* largest slab is 32KB */
+#define SLAB_MAX_WASTE 8  /* accept a slab order if at most 1/8 of the slab is wasted */
+#define CACHE_LINE     64
+#define MAG_SIZE       14 /* number of objects in a magazine (makes mm_magazine_t 128 bytes) */
+#define MAG_BATCH      (MAG_SIZE / 2)
+
+/* Slab is a naturally aligned block of 2^order pages which holds
+ * the objects of one cache. The slab header is stored at the beginning
+ * of the block so the slab of an object is found by rounding the address
+ * of the object down to the slab size
+ *
+ * Free objects of a slab are linked through their first word so
+ * freeing an object never allocates memory */
+typedef struct mm_slab {
+    list_head_t list;       /* entry in cache's full/partial/free list */
+    struct mm_cache *cache; /* cache that owns this slab */
+    void *free;             /* first free object of the slab */
+    size_t inuse;           /* number of objects allocated from the slab */
+    unsigned node;          /* node whose lists the slab is on */
+} mm_slab_t;
+
+/* Slabs of a cache are kept on per-node lists and the slabs of a node are
+ * allocated from the memory of that node. CPUs allocate objects only from
+ * the slabs of their home node so the objects are always node-local */
+typedef struct mm_cache_node {
+    list_head_t full;
+    list_head_t partial;
+    list_head_t free;
+} mm_cache_node_t;
+
+/* Per-CPU stack of objects, refilled from and drained to the slabs MAG_BATCH
+ * objects at a time. Locked like the per-CPU page cache, see mm_pcp_t */
+typedef struct mm_magazine {
+    spinlock_t lock;
+    size_t count;
+    void *objs[MAG_SIZE];
+} mm_magazine_t;
+
+struct mm_cache {
+    size_t size;      /* size of the object requested by the user */
+    size_t item_size; /* size of the object aligned to its alignment */
+    size_t align;     /* alignment of the objects */
+    size_t capacity;  /* number of objects in one slab */
+    size_t offset;    /* offset of the first object from the start of the slab */
+    size_t nslabs;    /* number of slabs allocated for the cache */
+    size_t nfree;     /* number of empty slabs */
+    size_t nreclaim;  /* number of empty slabs returned to the page allocator */
+    unsigned order;   /* each slab is 2^order pages */
+    bool magazines;   /* internal caches don't use magazines */
+    mm_flags_t flags;
 
-#define C_FORCE_SPATIAL 0
+    spinlock_t lock;
+    mm_cache_node_t nodes[MAX_NUMNODES];
+    list_head_t list; /* entry in the list of all caches */
 
-struct cache_free_chunk {
-    void *mem;
-    list_head_t list;
+    mm_magazine_t *mags[MAX_CPU];
 };
 
-typedef struct cache_fixed_entry {
-    /* TODO: what is numfree?? */
-    size_t num_free;
-
-    void *next_free; /* pointer to next free slot in mem */
-    void *mem;       /* pointer to memory block */
+/* cache for cache descriptors and cache for magazines
+ * These are used by the slab allocator itself so they can't have magazines */
+static mm_cache_t cache_cache;
+static mm_cache_t mag_cache;
 
-    list_head_t list;
-} cfe_t;
+static list_head_t caches;
+static spinlock_t  caches_lock = 0;
 
-struct mm_cache {
-    size_t item_size;
-    size_t capacity; /* number of total items (# of pages * (PAGE_SIZE / item_size)) */
+/* Objects are aligned to the cache line if they're larger than half a cache line.
+ * Smaller objects are aligned to the smallest power of two not less than their size
+ * so an object never straddles two cache lines but small objects are still packed tightly */
+static size_t __get_align(size_t size)
+{
+    size_t align = CACHE_LINE;
 
-    spinlock_t lock;
+    while (align > sizeof(void *) && size <= align / 2)
+        align /= 2;
 
-    /* TODO:  */
-    struct cache_fixed_entry *free_list;
+    return align;
+}
 
-    /* list of cache entries, each entry is work of 4KB of memory  */
-    struct cache_fixed_entry *used_list;
+/* Return the number of bytes in a slab of "order" that are not used for objects */
+static size_t __slab_waste(mm_cache_t *c, unsigned order)
+{
+    size_t capacity = (SLAB_SIZE(order) - c->offset) / c->item_size;
 
-    /* TODO:  */
-    struct cache_free_chunk *free_chunks;
-};
+    return SLAB_SIZE(order) - capacity * c->size;
+}
 
-/* list of free pages that can be allocated for any cache
- * If this list is empty, alloc_fixed_entry will be used to
- * allocate space for cache.
+/* Find the slab order that wastes the least amount of memory
  *
- * When a cache is destroyed, the pages are place here */
-static list_head_t free_list;
+ * Smaller orders are preferred: the first order that wastes at most 1/SLAB_MAX_WASTE
+ * of the slab is selected and if no such order exists, the order with smallest
+ * relative waste is selected */
+static int __get_order(mm_cache_t *c)
+{
+    int best = -1;
+
+    for (unsigned o = 0; o <= SLAB_MAX_ORDER; ++o) {
+        if (c->offset + c->item_size > SLAB_SIZE(o))
+            continue;
+
+        if (__slab_waste(c, o) * SLAB_MAX_WASTE <= SLAB_SIZE(o))
+            return o;
+
+        /* compare waste / size of the slabs without dividing */
+        if (best < 0 || __slab_waste(c, o) * SLAB_SIZE(best) < __slab_waste(c, best) * SLAB_SIZE(o))
+            best = o;
+    }
+
+    return best;
+}
+
+static int __cache_init(mm_cache_t *c, size_t size, mm_flags_t flags)
+{
+    int order = 0;
+
+    c->size      = size;
+    c->align     = __get_align(size);
+    c->item_size = ROUND_UP(MAX(size, sizeof(void *)), c->align);
+    c->offset    = ROUND_UP(sizeof(mm_slab_t), CACHE_LINE);
+    c->nslabs    = 0;
+    c->nfree     = 0;
+    c->nreclaim  = 0;
+    c->magazines = true;
+    c->flags     = flags;
+    c->lock      = 0;
+
+    if ((order = __get_order(c)) < 0)
+        return -EINVAL;
+
+    c->order    = order;
+    c->capacity = (SLAB_SIZE(c->order) - c->offset) / c->item_size;
+
+    for (size_t i = 0; i < MAX_NUMNODES; ++i) {
+        list_init(&c->nodes[i].full);
+        list_init(&c->nodes[i].partial);
+        list_init(&c->nodes[i].free);
+    }
+
+    kmemset(c->mags, 0, sizeof(c->mags));
 
-int initialized = 0;
+    spin_acquire(&caches_lock);
+    list_append(&caches, &c->list);
+    spin_release(&caches_lock);
 
-static struct cache_fixed_entry *alloc_fixed_entry(size_t item_size)
+    return 0;
+}
+
+/* Allocate new slab for "node" of the cache and link all of its objects into the free list */
+static mm_slab_t *__slab_alloc(mm_cache_t *c, unsigned node)
 {
-    static spinlock_t fe_lock = 0;
+    unsigned long mem = mmu_block_alloc_node(node, MM_ZONE_NORMAL, c->order, 0);
+
+    if (mem == INVALID_ADDRESS)
+        return NULL;
 
-    spin_acquire(&fe_lock);
+    mm_slab_t *slab = mmu_p_to_v(mem);
+    uint8_t *obj    = (uint8_t *)slab + c->offset;
 
-    if (free_list.next != NULL) {
-        cfe_t *e = container_of(free_list.next, struct cache_fixed_entry, list);
-        /* kdebug("hererererere"); */
-        list_remove(&e->list);
-        e->num_free = (PAGE_SIZE / item_size) - 1;
-        spin_release(&fe_lock);
-        return e;
+    slab->cache = c;
+    slab->inuse = 0;
+    slab->free  = obj;
+    slab->node  = node;
+
+    /* record the owner of the pages so that kfree() can find the cache of an object */
+    for (size_t i = 0; i < (1UL << c->order); ++i) {
+        page_t *page = mmu_page_get(mem + i * PAGE_SIZE);
+
+        page->usage = MM_PU_SLAB;
+        page->cache = c;
     }
 
-    unsigned long mem = mmu_page_alloc(MM_ZONE_NORMAL, 0);
-    kassert(mem != INVALID_ADDRESS);
+    for (size_t i = 0; i < c->capacity - 1; ++i, obj += c->item_size)
+        *(void **)obj = obj + c->item_size;
 
-    void *mem_v = mmu_p_to_v(mem);
-    cfe_t *e    = kzalloc(sizeof(cfe_t));
+    *(void **)obj = NULL;
 
-    e->mem       = mem_v;
-    e->next_free = mem_v;
-    e->num_free  = (PAGE_SIZE / item_size) - 1;
+    list_append(&c->nodes[node].free, &slab->list);
+    c->nslabs++;
+    c->nfree++;
 
-    spin_release(&fe_lock);
-    return e;
+    return slab;
 }
 
-int mmu_slab_preinit(void)
+static inline mm_slab_t *__slab_of(mm_cache_t *c, void *obj)
 {
-    list_init_null(&free_list);
+    return (mm_slab_t *)ROUND_DOWN((unsigned long)obj, SLAB_SIZE(c->order));
+}
 
-    /* alloc two pages for booting */
-    for (int i = 0; i < 2; ++i) {
-        unsigned long mem = mmu_bootmem_alloc_page();
-        void *mem_v       = mmu_p_to_v(mem);
+/* Take one object from the slabs of "node"
+ * Partially used slabs are preferred over empty ones to keep the number of slabs low
+ *
+ * cache->lock must be held by the caller */
+static void *__get_obj(mm_cache_t *c, unsigned node)
+{
+    mm_cache_node_t *n = &c->nodes[node];
+    mm_slab_t *slab    = NULL;
+
+    if (!LIST_EMPTY(n->partial))
+        slab = container_of(n->partial.next, mm_slab_t, list);
+    else if (!LIST_EMPTY(n->free))
+        slab = container_of(n->free.next, mm_slab_t, list);
+    else if ((slab = __slab_alloc(c, node)) == NULL)
+        return NULL;
 
-        cfe_t *e = kzalloc(sizeof(cfe_t));
+    void *obj  = slab->free;
+    slab->free = *(void **)obj;
 
-        e->mem       = mem_v;
-        e->next_free = mem_v;
-        e->num_free  = PAGE_SIZE;
+    if (slab->inuse == 0)
+        c->nfree--;
 
-        list_init_null(&e->list);
-        list_append(&free_list, &e->list);
+    if (slab->inuse++ == 0 || slab->free == NULL) {
+        list_remove(&slab->list);
+        list_append(slab->free ? &n->partial : &n->full, &slab->list);
     }
 
-    kdebug("SLAB initialized for booting!");
+    return obj;
+}
 
-    return 0;
+/* Return object to its slab
+ *
+ * cache->lock must be held by the caller */
+static void __put_obj(mm_cache_t *c, void *obj)
+{
+    mm_slab_t *slab    = __slab_of(c, obj);
+    mm_cache_node_t *n = &c->nodes[slab->node];
+    bool full          = (slab->free == NULL);
+
+    *(void **)obj = slab->free;
+    slab->free    = obj;
+
+    if (--slab->inuse == 0)
+        c->nfree++;
+
+    if (slab->inuse == 0 || full) {
+        list_remove(&slab->list);
+        list_append(slab->inuse ? &n->partial : &n->free, &slab->list);
+    }
 }
 
-int mmu_slab_init(void)
+/* Return all empty slabs of the cache to the page allocator
+ *
+ * cache->lock must be held by the caller
+ *
+ * Return the number of pages released */
+static size_t __cache_shrink(mm_cache_t *c)
 {
-    list_init_null(&free_list);
+    size_t npages = 0;
+
+    for (size_t i = 0; i < MAX_NUMNODES; ++i) {
+        while (!LIST_EMPTY(c->nodes[i].free)) {
+            mm_slab_t *slab = container_of(c->nodes[i].free.next, mm_slab_t, list);
 
-    /* allocate 5 pages of initial memory for SLAB */
-    unsigned long mem;
-    void *mem_v;
-    cfe_t *e;
+            list_remove(&slab->list);
+            c->nslabs--;
+            c->nfree--;
+            c->nreclaim++;
 
-    for (int i = 0; i < 20; ++i) {
-        if ((mem = mmu_page_alloc(MM_ZONE_NORMAL, 0)) == INVALID_ADDRESS) {
-            kdebug("Failed to allocate memory");
-            return -errno;
+            (void)mmu_block_free(mmu_v_to_p(slab), c->order);
+            npages += (1 << c->order);
         }
+    }
 
-        mem_v = mmu_p_to_v(mem);
-        e     = kzalloc(sizeof(cfe_t));
+    return npages;
+}
 
-        e->mem       = mem_v;
-        e->next_free = mem_v;
-        e->num_free  = PAGE_SIZE;
+static void *__cache_alloc(mm_cache_t *c)
+{
+    unsigned node = mmu_numa_this_node();
+
+    spin_acquire(&c->lock);
+    void *obj = __get_obj(c, node);
+    spin_release(&c->lock);
+
+    return obj;
+}
+
+static void __cache_free(mm_cache_t *c, void *obj)
+{
+    spin_acquire(&c->lock);
+    __put_obj(c, obj);
+    spin_release(&c->lock);
+}
 
-        list_init_null(&e->list);
-        list_append(&free_list, &e->list);
+/* Return the magazine of this CPU for cache "c"
+ * The magazine is allocated when the cache is first used on this CPU
+ *
+ * Return NULL if the cache doesn't use magazines or allocation failed */
+static mm_magazine_t *__get_magazine(mm_cache_t *c)
+{
+    if (!c->magazines)
+        return NULL;
+
+    unsigned long cpu = get_thiscpu_id();
+    mm_magazine_t *m  = c->mags[cpu];
+
+    if (m != NULL)
+        return m;
+
+    if ((m = __cache_alloc(&mag_cache)) == NULL)
+        return NULL;
+
+    m->lock  = 0;
+    m->count = 0;
+
+    /* someone else on this CPU may have allocated the magazine before us */
+    if (!__sync_bool_compare_and_swap(&c->mags[cpu], NULL, m)) {
+        __cache_free(&mag_cache, m);
+        m = c->mags[cpu];
     }
 
-    initialized = 1;
+    return m;
+}
+
+/* Move MAG_BATCH objects from the slabs of this CPU's node to the magazine
+ *
+ * m->lock must be held by the caller */
+static void __magazine_refill(mm_cache_t *c, mm_magazine_t *m)
+{
+    unsigned node = mmu_numa_this_node();
+    void *obj     = NULL;
+
+    spin_acquire(&c->lock);
+
+    while (m->count < MAG_BATCH && (obj = __get_obj(c, node)) != NULL)
+        m->objs[m->count++] = obj;
+
+    spin_release(&c->lock);
+}
+
+/* Move "count" least recently freed objects from the magazine back to the slabs
+ *
+ * Both m->lock and cache->lock must be held by the caller */
+static void __magazine_put(mm_cache_t *c, mm_magazine_t *m, size_t count)
+{
+    count = MIN(count, m->count);
+
+    for (size_t i = 0; i < count; ++i)
+        __put_obj(c, m->objs[i]);
+
+    kmemmove(&m->objs[0], &m->objs[count], (m->count - count) * sizeof(void *));
+    m->count -= count;
+}
+
+/* m->lock must be held by the caller */
+static void __magazine_flush(mm_cache_t *c, mm_magazine_t *m, size_t count)
+{
+    spin_acquire(&c->lock);
+    __magazine_put(c, m, count);
+    spin_release(&c->lock);
+}
+
+int mmu_slab_init(void)
+{
+    list_init(&caches);
+
+    if (__cache_init(&mag_cache, sizeof(mm_magazine_t), MM_NO_FLAGS) ||
+        __cache_init(&cache_cache, sizeof(mm_cache_t), MM_NO_FLAGS))
+    {
+        kpanic("failed to initialize internal slab caches");
+    }
+
+    mag_cache.magazines   = false;
+    cache_cache.magazines = false;
+
     return 0;
 }
 
 mm_cache_t *mmu_cache_create(size_t size, mm_flags_t flags)
 {
-    (void)flags;
-
     mm_cache_t *c = NULL;
 
-    if (size > PAGE_SIZE || size == 0) {
+    if (size > SLAB_SIZE(SLAB_MAX_ORDER) / 2 || size == 0) {
         errno = EINVAL;
         return NULL;
     }
 
-    if ((c = kzalloc(sizeof(mm_cache_t))) == NULL)
+    if ((c = __cache_alloc(&cache_cache)) == NULL) {
+        errno = ENOMEM;
         return NULL;
+    }
 
-    c->item_size = MULTIPLE_OF_2(size);
-    c->capacity  = PAGE_SIZE / c->item_size;
-
-    c->free_list = alloc_fixed_entry(c->item_size);
-    c->used_list = NULL;
-
-    /* kdebug("allocated 0x%x", c->free_list->mem); */
-    /* kdebug("one page holds %u items of size %u (%u)", */
-    /*         c->capacity, c->item_size, MULTIPLE_OF_2(c->item_size)); */
+    if (__cache_init(c, size, flags) < 0) {
+        __cache_free(&cache_cache, c);
+        errno = EINVAL;
+        return NULL;
+    }
 
     return c;
 }
@@ -169,17 +409,42 @@ int mmu_cache_destroy(mm_cache_t *cache)
     if (!cache)
         return -EINVAL;
 
-    if (cache->used_list != NULL) {
-        kdebug("cache still in use, unable to destroy it!");
-        return -EBUSY;
+    /* return the objects cached in magazines to the slabs
+     * so that the slab lists tell whether the cache is still in use */
+    for (size_t i = 0; i < MAX_CPU; ++i) {
+        mm_magazine_t *m = cache->mags[i];
+
+        if (m == NULL)
+            continue;
+
+        spin_acquire(&m->lock);
+        __magazine_flush(cache, m, m->count);
+        spin_release(&m->lock);
+    }
+
+    spin_acquire(&cache->lock);
+
+    for (size_t i = 0; i < MAX_NUMNODES; ++i) {
+        if (!LIST_EMPTY(cache->nodes[i].full) || !LIST_EMPTY(cache->nodes[i].partial)) {
+            spin_release(&cache->lock);
+            kdebug("cache still in use, unable to destroy it!");
+            return -EBUSY;
+        }
     }
 
-    if (cache->free_list != NULL) {
-        /* TODO: free pages */
+    (void)__cache_shrink(cache);
+    spin_release(&cache->lock);
+
+    spin_acquire(&caches_lock);
+    list_remove(&cache->list);
+    spin_release(&caches_lock);
 
+    for (size_t i = 0; i < MAX_CPU; ++i) {
+        if (cache->mags[i])
+            __cache_free(&mag_cache, cache->mags[i]);
     }
 
-    kfree(cache);
+    __cache_free(&cache_cache, cache);
     return 0;
 }
 
@@ -190,83 +455,133 @@ void *mmu_cache_alloc_entry(mm_cache_t *c, mm_flags_t flags)
         return NULL;
     }
 
-    spin_acquire(&c->lock);
+    mm_magazine_t *m = __get_magazine(c);
+    void *ret        = NULL;
 
-    /* if there are any free chunks left, try to use them first and return early */
-    if (c->free_chunks != NULL && (flags & C_FORCE_SPATIAL) == 0) {
-        void *ret = c->free_chunks->mem;
-
-        /* is there only one free chunk? */
-        if (c->free_chunks->list.next == NULL) {
-            /* kdebug("only one free: 0x%x", ret); */
-            c->free_chunks = NULL;
-        } else {
-            list_head_t *next_chunk = c->free_chunks->list.next;
-            list_remove(&c->free_chunks->list);
-            c->free_chunks = container_of(next_chunk, struct cache_free_chunk, list);
-            /* kdebug("ret 0x%x | next 0x%x", ret, c->free_chunks->mem); */
-        }
+    if (m == NULL) {
+        ret = __cache_alloc(c);
+    } else {
+        spin_acquire(&m->lock);
 
-        spin_release(&c->lock);
-        return ret;
-    }
+        if (m->count == 0)
+            __magazine_refill(c, m);
 
-    void *ret = NULL;
+        if (m->count > 0)
+            ret = m->objs[--m->count];
 
-    if (c->free_list == NULL) {
-        c->free_list = alloc_fixed_entry(c->item_size);
-        c->capacity += PAGE_SIZE / c->item_size;
+        spin_release(&m->lock);
     }
 
-    ret = c->free_list->next_free;
-
-    /* if last element, set free_list to NULL and append cache_entry to used list
-     * else set next_free to point to next free element in c->free_list->mem */
-    if (c->free_list->num_free-- == 0) {
-        /* kdebug("allocated last element from free list"); */
-
-        if (c->used_list == NULL)
-            c->used_list = c->free_list;
-        else
-            list_append(&c->used_list->list, &c->free_list->list);
-
-        c->free_list = NULL;
-    } else {
-        /* kdebug("old free 0x%x | new free 0x%x (item size %u)", */
-        /*         c->free_list->next_free, */
-        /*         (uint8_t *)c->free_list->next_free + c->item_size, */
-        /*         c->item_size); */
-
-        c->free_list->next_free = (uint8_t *)c->free_list->next_free + c->item_size;
+    if (ret == NULL) {
+        errno = ENOMEM;
+        return NULL;
     }
 
-    if (flags & MM_ZERO)
+    if ((flags | c->flags) & MM_ZERO)
         kmemset(ret, 0, c->item_size);
 
-    spin_release(&c->lock);
     return ret;
 }
 
 int mmu_cache_free_entry(mm_cache_t *cache, void *entry, int flags)
 {
+    (void)flags;
+
     if (cache == NULL || entry == NULL)
         return -EINVAL;
 
-    /* kprint("freeing entry 0x%x - 0x%x\n", entry, (uint8_t *)entry + cache->item_size); */
-    spin_release(&cache->lock);
+    mm_slab_t *slab = __slab_of(cache, entry);
 
-    struct cache_free_chunk *cfc = kmalloc(sizeof(struct cache_free_chunk), flags);
+    if (slab->cache != cache) {
+        kdebug("0x%x doesn't belong to cache 0x%x", entry, cache);
+        return -EINVAL;
+    }
 
-    list_init_null(&cfc->list);
-    cfc->mem = entry;
+    mm_magazine_t *m = __get_magazine(cache);
 
-    /* kdebug("freeing memory at address 0x%x", cfc->mem); */
+    /* objects of other nodes go straight back to their slab so that
+     * the magazine only ever holds objects of this CPU's node */
+    if (m == NULL || slab->node != mmu_numa_this_node()) {
+        __cache_free(cache, entry);
+        return 0;
+    }
 
-    if (cache->free_chunks == NULL)
-        cache->free_chunks = cfc;
-    else
-        list_append(&cache->free_chunks->list, &cfc->list);
+    spin_acquire(&m->lock);
 
-    spin_release(&cache->lock);
+    if (m->count == MAG_SIZE)
+        __magazine_flush(cache, m, MAG_BATCH);
+
+    m->objs[m->count++] = entry;
+
+    spin_release(&m->lock);
     return 0;
 }
+
+size_t mmu_caches_shrink(void)
+{
+    size_t npages = 0;
+
+    /* The shrinker is called by the page allocator which may in turn have been
+     * called by a cache that is holding its own lock so only try to acquire
+     * the locks and skip the caches that are currently in use */
+    if (!spin_try_acquire(&caches_lock))
+        return 0;
+
+    FOREACH(caches, iter) {
+        mm_cache_t *c = container_of(iter, mm_cache_t, list);
+
+        if (!spin_try_acquire(&c->lock))
+            continue;
+
+        /* objects cached in magazines keep otherwise empty slabs alive */
+        for (size_t i = 0; i < MAX_CPU; ++i) {
+            mm_magazine_t *m = c->mags[i];
+
+            if (m == NULL || !spin_try_acquire(&m->lock))
+                continue;
+
+            __magazine_put(c, m, m->count);
+            spin_release(&m->lock);
+        }
+
+        npages += __cache_shrink(c);
+        spin_release(&c->lock);
+    }
+
+    spin_release(&caches_lock);
+    return npages;
+}
+
+void mmu_caches_print_stats(void)
+{
+    kprint("\t    size    align  order     objs    slabs     free  reclaim    inuse   waste/slab   total waste\n");
+
+    spin_acquire(&caches_lock);
+
+    FOREACH(caches, iter) {
+        mm_cache_t *c = container_of(iter, mm_cache_t, list);
+        size_t inuse  = 0;
+
+        spin_acquire(&c->lock);
+
+        for (size_t i = 0; i < MAX_NUMNODES; ++i) {
+            FOREACH(c->nodes[i].full, siter)
+                inuse += container_of(siter, mm_slab_t, list)->inuse;
+
+            FOREACH(c->nodes[i].partial, siter)
+                inuse += container_of(siter, mm_slab_t, list)->inuse;
+        }
+
+        /* Internal fragmentation is everything in a slab that is not used for
+         * objects of the requested size: slab header, padding of the objects
+         * and the unused tail of the slab */
+        kprint("\t%8u %8u %6u %8u %8u %8u %8u %8u %12u %13u\n",
+                c->size, c->align, c->order, c->capacity, c->nslabs,
+                c->nfree, c->nreclaim, inuse,
+                __slab_waste(c, c->order), __slab_waste(c, c->order) * c->nslabs);
+
+        spin_release(&c->lock);
+    }
+
+    spin_release(&caches_lock);
+}
@@ -0,0 +1,398 @@
+#include <drivers/disk/ahci.h>
+#include <kernel/clock.h>
+#include <kernel/common.h>
+#include <kernel/compiler.h>
+#include <kernel/kassert.h>
+#include <kernel/kpanic.h>
+#include <kernel/kprint.h>
+#include <kernel/util.h>
+#include <lib/list.h>
+#include <mm/mmu.h>
+#include <mm/page.h>
+#include <mm/swap.h>
+#include <mm/vmalloc.h>
+#include <sched/mts.h>
+#include <sched/task.h>
+#include <sync/spinlock.h>
+#include <sys/time.h>
+#include <errno.h>
+
+#define SWAP_MAX_SLOTS     (1UL << 22) /* 16GB of swap */
+#define SWAP_MAX_REFS      0xffff
+
+#define RECLAIM_BATCH      32  /* pages aged or swapped out at once */
+#define RECLAIM_MAX_PASSES 16  /* batches one call to mmu_swap_reclaim() may take */
+#define KSWAPD_INTERVAL_MS 100 /* how often the reclaim thread checks the free memory */
+
+static struct {
+    list_head_t active;   /* most recently used pages first */
+    list_head_t inactive; /* most recently deactivated pages first */
+    size_t nactive;
+    size_t ninactive;
+    spinlock_t lock;
+} lru;
+
+/* Each slot of the swap area holds one page and it has a reference
+ * for each swap entry that points to it. Slots are allocated next-fit */
+static struct {
+    uint16_t *map;  /* reference count of each slot */
+    size_t nslots;
+    size_t nused;
+    size_t next;    /* where the search for a free slot starts */
+    spinlock_t lock;
+} swap;
+
+static struct {
+    size_t nswapout;   /* pages written to the swap area */
+    size_t nswapin;    /* pages read from the swap area */
+    size_t nactivated; /* inactive pages that were referenced and given a second chance */
+    size_t ndeactivated;
+    size_t nerrors;    /* failed reads and writes */
+} stats;
+
+/* Only one reclaim runs at a time. It owns "reqs" */
+static bool reclaiming = false;
+static mm_reclaim_req_t reqs[RECLAIM_BATCH];
+
+static bool kicked = false;
+static clock_waiter_t waiter;
+
+/* lru.lock must be held by the caller */
+static void __lru_insert(page_t *page, unsigned list)
+{
+    if (list == MM_LRU_ACTIVE) {
+        list_append(&lru.active, &page->list);
+        lru.nactive++;
+    } else {
+        list_append(&lru.inactive, &page->list);
+        lru.ninactive++;
+    }
+
+    page->lru = list;
+}
+
+/* lru.lock must be held by the caller */
+static void __lru_unlink(page_t *page)
+{
+    list_remove(&page->list);
+
+    if (page->lru == MM_LRU_ACTIVE)
+        lru.nactive--;
+    else
+        lru.ninactive--;
+
+    page->lru = MM_LRU_NONE;
+}
+
+void mmu_lru_add(unsigned long address, struct task *task, unsigned long vaddr)
+{
+    page_t *page = mmu_page_get(address);
+
+    kassert(page != NULL && page->type == MM_PT_IN_USE && page->order == 0);
+
+    spin_acquire(&lru.lock);
+
+    page->usage = MM_PU_USER;
+    page->task  = task;
+    page->vaddr = ROUND_DOWN(vaddr, PAGE_SIZE);
+
+    if (page->lru == MM_LRU_NONE)
+        __lru_insert(page, MM_LRU_INACTIVE);
+
+    spin_release(&lru.lock);
+}
+
+void mmu_lru_del(page_t *page)
+{
+    kassert(page != NULL);
+
+    spin_acquire(&lru.lock);
+
+    if (page->lru == MM_LRU_ACTIVE || page->lru == MM_LRU_INACTIVE)
+        __lru_unlink(page);
+
+    /* a page held by reclaim is not put back on the lists */
+    page->lru = MM_LRU_NONE;
+
+    spin_release(&lru.lock);
+}
+
+/* Take a reference to "page" unless it's being released
+ * The reference keeps the page around while reclaim looks at it */
+static bool __pin(page_t *page)
+{
+    uint32_t ref = 0;
+
+    do {
+        if ((ref = READ_ONCE(page->ref)) == 0)
+            return false;
+    } while (!__sync_bool_compare_and_swap(&page->ref, ref, ref + 1));
+
+    return true;
+}
+
+/* Take up to "n" of the oldest pages of "list" off the lists
+ *
+ * Return the number of pages stored to "reqs" */
+static size_t __lru_take(list_head_t *list, size_t n, bool evict)
+{
+    size_t count = 0;
+
+    spin_acquire(&lru.lock);
+
+    for (list_head_t *iter = list->prev; iter != list && count < n; ) {
+        page_t *page = container_of(iter, page_t, list);
+
+        iter = iter->prev;
+
+        /* the page is released right now and taken off the lists by mmu_lru_del() */
+        if (!__pin(page))
+            continue;
+
+        __lru_unlink(page);
+        page->lru = MM_LRU_RECLAIM;
+
+        reqs[count].page   = mmu_page_addr(page);
+        reqs[count].task   = page->task;
+        reqs[count].vaddr  = page->vaddr;
+        reqs[count].evict  = evict;
+        reqs[count].status = MM_RECLAIM_BUSY;
+        count++;
+    }
+
+    spin_release(&lru.lock);
+
+    return count;
+}
+
+/* Put the pages taken by __lru_take() back on the lists according to their status
+ *
+ * Referenced pages go to the active list, pages that were not referenced
+ * to the inactive list and pages that can't be looked at right now back to
+ * where they came from. Pages that were swapped out or are not mapped
+ * where the LRU expects them are left out */
+static void __lru_put_back(size_t n, bool from_active)
+{
+    for (size_t i = 0; i < n; ++i) {
+        page_t *page = mmu_page_get(reqs[i].page);
+
+        spin_acquire(&lru.lock);
+
+        if (page->lru == MM_LRU_RECLAIM) {
+            page->lru = MM_LRU_NONE;
+
+            switch (reqs[i].status) {
+                case MM_RECLAIM_REFERENCED:
+                    if (!from_active)
+                        stats.nactivated++;
+                    __lru_insert(page, MM_LRU_ACTIVE);
+                    break;
+
+                case MM_RECLAIM_BUSY:
+                    __lru_insert(page, from_active ? MM_LRU_ACTIVE : MM_LRU_INACTIVE);
+                    break;
+
+                case MM_RECLAIM_IDLE:
+                    if (from_active)
+                        stats.ndeactivated++;
+                    __lru_insert(page, MM_LRU_INACTIVE);
+                    break;
+
+                case MM_RECLAIM_EVICTED:
+                    stats.nswapout++;
+                    break;
+            }
+        }
+
+        spin_release(&lru.lock);
+
+        /* an evicted page is released here */
+        (void)mmu_page_unref(reqs[i].page);
+    }
+}
+
+size_t mmu_swap_reclaim(size_t npages, int flags)
+{
+    size_t nfreed = 0;
+    size_t n      = 0;
+    int ret       = 0;
+
+    if (!swap.map || __sync_lock_test_and_set(&reclaiming, true))
+        return 0;
+
+    for (size_t pass = 0; pass < RECLAIM_MAX_PASSES && nfreed < npages; ++pass) {
+        /* The inactive list is kept at least as long as the active list
+         * so that its pages have time to be referenced before they're evicted */
+        if (READ_ONCE(lru.ninactive) < READ_ONCE(lru.nactive)) {
+            n   = __lru_take(&lru.active, RECLAIM_BATCH, false);
+            ret = mmu_reclaim(reqs, n, flags);
+            __lru_put_back(n, true);
+
+            if (ret < 0)
+                break;
+        }
+
+        if ((n = __lru_take(&lru.inactive, RECLAIM_BATCH, true)) == 0)
+            continue;
+
+        ret = mmu_reclaim(reqs, n, flags);
+        __lru_put_back(n, false);
+
+        if (ret < 0)
+            break;
+
+        nfreed += ret;
+    }
+
+    __sync_lock_release(&reclaiming);
+
+    return nfreed;
+}
+
+void mmu_swap_kick(void)
+{
+    WRITE_ONCE(kicked, true);
+    clock_wakeup(&waiter);
+}
+
+int mmu_swap_alloc(unsigned long *slot)
+{
+    kassert(slot != NULL);
+
+    if (!swap.map)
+        return -ENODEV;
+
+    spin_acquire(&swap.lock);
+
+    if (swap.nused == swap.nslots) {
+        spin_release(&swap.lock);
+        return -ENOSPC;
+    }
+
+    while (swap.map[swap.next] != 0)
+        swap.next = (swap.next + 1) % swap.nslots;
+
+    *slot = swap.next;
+    swap.map[swap.next] = 1;
+    swap.nused++;
+
+    spin_release(&swap.lock);
+
+    return 0;
+}
+
+void mmu_swap_dup(unsigned long slot)
+{
+    spin_acquire(&swap.lock);
+
+    kassert(slot < swap.nslots && swap.map[slot] != 0);
+    kassert(swap.map[slot] != SWAP_MAX_REFS);
+
+    swap.map[slot]++;
+
+    spin_release(&swap.lock);
+}
+
+void mmu_swap_free(unsigned long slot)
+{
+    spin_acquire(&swap.lock);
+
+    kassert(slot < swap.nslots && swap.map[slot] != 0);
+
+    if (--swap.map[slot] == 0)
+        swap.nused--;
+
+    spin_release(&swap.lock);
+}
+
+int mmu_swap_read(unsigned long slot, unsigned long address)
+{
+    kassert(slot < swap.nslots);
+
+    if (ahci_disk_read(slot * SWAP_SLOT_SECTORS, mmu_p_to_v(address), SWAP_SLOT_SECTORS) < 0) {
+        __sync_add_and_fetch(&stats.nerrors, 1);
+        return -EIO;
+    }
+
+    __sync_add_and_fetch(&stats.nswapin, 1);
+    return 0;
+}
+
+int mmu_swap_write(unsigned long slot, unsigned long address)
+{
+    kassert(slot < swap.nslots);
+
+    if (ahci_disk_write(slot * SWAP_SLOT_SECTORS, mmu_p_to_v(address), SWAP_SLOT_SECTORS) < 0) {
+        __sync_add_and_fetch(&stats.nerrors, 1);
+        return -EIO;
+    }
+
+    return 0;
+}
+
+/* The thread sleeps until an allocation finds a zone below its low watermark
+ * or fails. It reclaims up to twice the low watermark and zones between
+ * the two don't kick anyone, so the zones are also looked at once per interval */
+static void *__kswapd(void *arg)
+{
+    (void)arg;
+
+    for (;;) {
+        size_t npages = mmu_zones_shortage();
+
+        if (__sync_lock_test_and_set(&kicked, false))
+            npages = MAX(npages, RECLAIM_BATCH);
+
+        if (npages > 0)
+            (void)mmu_swap_reclaim(npages, MM_NO_FLAGS);
+
+        (void)clock_wait(&waiter, KSWAPD_INTERVAL_MS * NSEC_PER_MSEC);
+    }
+
+    return NULL;
+}
+
+int mmu_swap_init(void)
+{
+    task_t   *task   = NULL;
+    thread_t *thread = NULL;
+    size_t nslots    = MIN(ahci_disk_size() / SWAP_SLOT_SECTORS, SWAP_MAX_SLOTS);
+
+    list_init(&lru.active);
+    list_init(&lru.inactive);
+
+    if (nslots == 0) {
+        kprint("swap: no disk, swapping disabled\n");
+        return -ENODEV;
+    }
+
+    if ((swap.map = vmalloc(nslots * sizeof(uint16_t))) == NULL)
+        return -ENOMEM;
+
+    kmemset(swap.map, 0, nslots * sizeof(uint16_t));
+    swap.nslots = nslots;
+
+    if ((task = sched_task_create("kswapd")) == NULL)
+        kpanic("Failed to create reclaim task");
+
+    if ((thread = sched_thread_create(__kswapd, NULL)) == NULL)
+        kpanic("Failed to create thread for reclaim task");
+
+    sched_task_add_thread(task, thread);
+
+    /* reclaim is needed when memory runs low, not only when nothing else runs */
+    if (mts_schedule(task, 0) < 0)
+        kpanic("Failed to schedule reclaim task");
+
+    kprint("swap: %uMB of swap\n", (nslots * PAGE_SIZE) >> 20);
+
+    return 0;
+}
+
+void mmu_swap_print_stats(void)
+{
+    kprint("LRU: %u active, %u inactive pages, %u activated, %u deactivated\n",
+            lru.nactive, lru.ninactive, stats.nactivated, stats.ndeactivated);
+    kprint("Swap: %u of %u slots used, %u pages out, %u pages in, %u errors\n",
+            swap.nused, swap.nslots, stats.nswapout, stats.nswapin, stats.nerrors);
+}
@@ -0,0 +1,596 @@
+#include <kernel/common.h>
+#include <kernel/kassert.h>
+#include <kernel/kpanic.h>
+#include <kernel/kprint.h>
+#include <fs/file.h>
+#include <fs/dentry.h>
+#include <fs/inode.h>
+#include <kernel/util.h>
+#include <lib/list.h>
+#include <mm/mmu.h>
+#include <mm/page.h>
+#include <mm/slab.h>
+#include <mm/swap.h>
+#include <mm/vma.h>
+#include <sched/sched.h>
+#include <sched/task.h>
+#include <sync/spinlock.h>
+#include <errno.h>
+
+static mm_cache_t *vma_cache = NULL;
+
+static int __get_flags(mm_vma_t *vma)
+{
+    int flags = MM_PRESENT | MM_USER;
+
+    if (vma->flags & VM_WRITE)
+        flags |= MM_READWRITE;
+
+    return flags;
+}
+
+/* Insert "vma" to the sorted area list of "t"
+ *
+ * t->vma_lock must be held by the caller
+ *
+ * Return 0 on success
+ * Return -EEXIST if "vma" overlaps with an existing area */
+static int __insert(task_t *t, mm_vma_t *vma)
+{
+    list_head_t *prev = &t->vmas;
+
+    FOREACH(t->vmas, iter) {
+        mm_vma_t *cur = container_of(iter, mm_vma_t, list);
+
+        if (cur->start >= vma->end)
+            break;
+
+        if (cur->end > vma->start)
+            return -EEXIST;
+
+        prev = iter;
+    }
+
+    list_append(prev, &vma->list);
+    return 0;
+}
+
+/* Return the first address at or above "start" where "len" bytes are free
+ *
+ * t->vma_lock must be held by the caller
+ *
+ * Return INVALID_ADDRESS if there is no such range in user space */
+static unsigned long __find_free(task_t *t, unsigned long start, size_t len)
+{
+    FOREACH(t->vmas, iter) {
+        mm_vma_t *cur = container_of(iter, mm_vma_t, list);
+
+        if (cur->end <= start)
+            continue;
+
+        if (cur->start >= start + len)
+            break;
+
+        start = cur->end;
+    }
+
+    return (start + len <= USER_SPACE_END) ? start : INVALID_ADDRESS;
+}
+
+/* Release "vma" and its reference to the backing file
+ * "vma" must already be removed from the area list */
+static void __free_vma(mm_vma_t *vma)
+{
+    if (vma->file)
+        (void)file_fput(vma->file);
+
+    mmu_cache_free_entry(vma_cache, vma, 0);
+}
+
+/* Try to grow a stack area of "t" down so that it covers "addr"
+ *
+ * t->vma_lock must be held by the caller
+ *
+ * Return pointer to the grown area on success and NULL on error */
+static mm_vma_t *__grow_stack(task_t *t, unsigned long addr)
+{
+    mm_vma_t *prev = NULL;
+
+    FOREACH(t->vmas, iter) {
+        mm_vma_t *cur = container_of(iter, mm_vma_t, list);
+
+        if (cur->start <= addr) {
+            prev = cur;
+            continue;
+        }
+
+        if (!(cur->flags & VM_GROWSDOWN) || cur->end - ROUND_DOWN(addr, PAGE_SIZE) > USER_STACK_MAX)
+            return NULL;
+
+        /* stack must not grow into the area below it */
+        if (prev && prev->end > ROUND_DOWN(addr, PAGE_SIZE))
+            return NULL;
+
+        cur->start = ROUND_DOWN(addr, PAGE_SIZE);
+        return cur;
+    }
+
+    return NULL;
+}
+
+int mmu_vma_init(void)
+{
+    if ((vma_cache = mmu_cache_create(sizeof(mm_vma_t), MM_NO_FLAGS)) == NULL)
+        kpanic("failed to create cache for virtual memory areas");
+
+    return 0;
+}
+
+mm_vma_t *mmu_vma_create(task_t *t, unsigned long start, unsigned long end, unsigned flags)
+{
+    mm_vma_t *vma = NULL;
+    int ret       = 0;
+
+    if (!t || !PAGE_ALIGNED(start) || !PAGE_ALIGNED(end) || start >= end || end > USER_SPACE_END) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if ((vma = mmu_cache_alloc_entry(vma_cache, MM_NO_FLAGS)) == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    vma->start  = start;
+    vma->end    = end;
+    vma->flags  = flags;
+    vma->file   = NULL;
+    vma->offset = 0;
+
+    spin_acquire(&t->vma_lock);
+    ret = __insert(t, vma);
+    spin_release(&t->vma_lock);
+
+    if (ret < 0) {
+        mmu_cache_free_entry(vma_cache, vma, 0);
+        errno = -ret;
+        return NULL;
+    }
+
+    return vma;
+}
+
+unsigned long mmu_vma_map(task_t *t, unsigned long addr, size_t len, unsigned flags,
+                          file_t *file, off_t offset)
+{
+    unsigned long start = INVALID_ADDRESS;
+    mm_vma_t *vma       = NULL;
+
+    if (!t || len == 0 || !PAGE_ALIGNED(addr) || offset < 0 || !PAGE_ALIGNED(offset)) {
+        errno = EINVAL;
+        return INVALID_ADDRESS;
+    }
+
+    if (len > USER_SPACE_END - USER_MMAP_BASE) {
+        errno = ENOMEM;
+        return INVALID_ADDRESS;
+    }
+
+    if ((vma = mmu_cache_alloc_entry(vma_cache, MM_NO_FLAGS)) == NULL) {
+        errno = ENOMEM;
+        return INVALID_ADDRESS;
+    }
+
+    len = ROUND_UP(len, PAGE_SIZE);
+
+    vma->flags  = flags;
+    vma->file   = file;
+    vma->offset = offset;
+
+    if (file)
+        __sync_add_and_fetch(&file->f_count, 1);
+
+    spin_acquire(&t->vma_lock);
+
+    if (addr && addr <= USER_SPACE_END - len && __find_free(t, addr, len) == addr)
+        start = addr;
+    else
+        start = __find_free(t, USER_MMAP_BASE, len);
+
+    if (start != INVALID_ADDRESS) {
+        vma->start = start;
+        vma->end   = start + len;
+
+        /* the range was just found free */
+        (void)__insert(t, vma);
+    }
+
+    spin_release(&t->vma_lock);
+
+    if (start == INVALID_ADDRESS) {
+        __free_vma(vma);
+        errno = ENOMEM;
+    }
+
+    return start;
+}
+
+int mmu_vma_unmap(task_t *t, unsigned long start, size_t len)
+{
+    unsigned long end = start + ROUND_UP(len, PAGE_SIZE);
+    mm_vma_t *split   = NULL;
+    list_head_t removed;
+
+    if (!t || !PAGE_ALIGNED(start) || len == 0 || len > USER_SPACE_END || end > USER_SPACE_END)
+        return -EINVAL;
+
+    /* splitting an area in two needs a new area and it
+     * must be allocated before the area list is locked */
+    if ((split = mmu_cache_alloc_entry(vma_cache, MM_NO_FLAGS)) == NULL)
+        return -ENOMEM;
+
+    list_init(&removed);
+    spin_acquire(&t->vma_lock);
+
+    for (list_head_t *iter = t->vmas.next, *next = NULL; iter != &t->vmas; iter = next) {
+        mm_vma_t *cur = container_of(iter, mm_vma_t, list);
+        next          = iter->next;
+
+        if (cur->start >= end)
+            break;
+
+        if (cur->end <= start)
+            continue;
+
+        if (cur->start < start && cur->end > end) {
+            *split        = *cur;
+            split->start  = end;
+            split->offset = cur->offset + (end - cur->start);
+            cur->end      = start;
+
+            if (split->file)
+                __sync_add_and_fetch(&split->file->f_count, 1);
+
+            list_append(&cur->list, &split->list);
+            split = NULL;
+            break;
+        }
+
+        if (cur->start < start) {
+            cur->end = start;
+            continue;
+        }
+
+        if (cur->end > end) {
+            cur->offset += end - cur->start;
+            cur->start   = end;
+            break;
+        }
+
+        list_remove(&cur->list);
+        list_append(&removed, &cur->list);
+    }
+
+    spin_release(&t->vma_lock);
+
+    (void)mmu_unmap_range(start, (end - start) / PAGE_SIZE);
+
+    /* the pages are unmapped so the files can be released */
+    while (!LIST_EMPTY(removed)) {
+        mm_vma_t *vma = container_of(removed.next, mm_vma_t, list);
+
+        list_remove(&vma->list);
+        __free_vma(vma);
+    }
+
+    if (split)
+        mmu_cache_free_entry(vma_cache, split, 0);
+
+    return 0;
+}
+
+/* Write the present pages of [start, end) of shared area "vma" back to its file */
+static int __write_back(mm_vma_t *vma, unsigned long start, unsigned long end)
+{
+    off_t size = vma->file->f_dentry->d_inode->i_size;
+
+    for (unsigned long addr = start; addr < end; addr += PAGE_SIZE) {
+        off_t offset        = vma->offset + (addr - vma->start);
+        unsigned long paddr = mmu_translate(addr);
+
+        if (paddr == INVALID_ADDRESS || offset >= size)
+            continue;
+
+        if (file_pwrite(vma->file, offset, MIN(PAGE_SIZE, size - offset), mmu_p_to_v(paddr)) < 0)
+            return -EIO;
+    }
+
+    return 0;
+}
+
+int mmu_vma_sync(task_t *t, unsigned long start, size_t len)
+{
+    unsigned long end  = start + ROUND_UP(len, PAGE_SIZE);
+    unsigned long addr = start;
+    int ret            = 0;
+
+    if (!t || !PAGE_ALIGNED(start) || len > USER_SPACE_END || end > USER_SPACE_END)
+        return -EINVAL;
+
+    /* the areas are written one at a time and the lock is not held while
+     * writing so a copy of the area is used. The copy holds a reference
+     * to the file in case the area is unmapped during the write */
+    while (addr < end && ret == 0) {
+        mm_vma_t *vma = NULL;
+        mm_vma_t copy;
+
+        spin_acquire(&t->vma_lock);
+
+        FOREACH(t->vmas, iter) {
+            mm_vma_t *cur = container_of(iter, mm_vma_t, list);
+
+            if (cur->end > addr) {
+                vma = cur;
+                break;
+            }
+        }
+
+        if (!vma || vma->start > addr) {
+            spin_release(&t->vma_lock);
+            return -ENOMEM;
+        }
+
+        copy      = *vma;
+        copy.file = ((vma->flags & (VM_SHARED | VM_WRITE)) == (VM_SHARED | VM_WRITE)) ? vma->file : NULL;
+
+        if (copy.file)
+            __sync_add_and_fetch(&copy.file->f_count, 1);
+
+        spin_release(&t->vma_lock);
+
+        if (copy.file) {
+            ret = __write_back(&copy, addr, MIN(end, copy.end));
+            (void)file_fput(copy.file);
+        }
+
+        addr = MIN(end, copy.end);
+    }
+
+    return ret;
+}
+
+mm_vma_t *mmu_vma_find(task_t *t, unsigned long addr)
+{
+    mm_vma_t *ret = NULL;
+
+    spin_acquire(&t->vma_lock);
+
+    FOREACH(t->vmas, iter) {
+        mm_vma_t *cur = container_of(iter, mm_vma_t, list);
+
+        if (cur->start > addr)
+            break;
+
+        if (addr < cur->end) {
+            ret = cur;
+            break;
+        }
+    }
+
+    spin_release(&t->vma_lock);
+    return ret;
+}
+
+int mmu_vma_copy(task_t *dst, task_t *src)
+{
+    int ret = 0;
+
+    spin_acquire(&src->vma_lock);
+
+    FOREACH(src->vmas, iter) {
+        mm_vma_t *cur = container_of(iter, mm_vma_t, list);
+        mm_vma_t *vma = mmu_cache_alloc_entry(vma_cache, MM_NO_FLAGS);
+
+        if (!vma) {
+            ret = -ENOMEM;
+            break;
+        }
+
+        vma->start  = cur->start;
+        vma->end    = cur->end;
+        vma->flags  = cur->flags;
+        vma->file   = cur->file;
+        vma->offset = cur->offset;
+
+        if (vma->file)
+            __sync_add_and_fetch(&vma->file->f_count, 1);
+
+        /* the source list is sorted so the copy can be built by appending to the tail */
+        list_append(dst->vmas.prev, &vma->list);
+    }
+
+    spin_release(&src->vma_lock);
+    return ret;
+}
+
+void mmu_vma_destroy(task_t *t)
+{
+    spin_acquire(&t->vma_lock);
+
+    while (!LIST_EMPTY(t->vmas)) {
+        mm_vma_t *vma = container_of(t->vmas.next, mm_vma_t, list);
+
+        list_remove(&vma->list);
+        __free_vma(vma);
+    }
+
+    list_init(&t->vmas);
+    spin_release(&t->vma_lock);
+}
+
+void mmu_vma_unmap_all(task_t *t)
+{
+    list_head_t removed;
+
+    /* the pages are unmapped from the page tables of current address space */
+    kassert(t == sched_get_active());
+
+    list_init(&removed);
+    spin_acquire(&t->vma_lock);
+
+    while (!LIST_EMPTY(t->vmas)) {
+        mm_vma_t *vma = container_of(t->vmas.next, mm_vma_t, list);
+
+        list_remove(&vma->list);
+        list_append(removed.prev, &vma->list);
+    }
+
+    list_init(&t->vmas);
+    spin_release(&t->vma_lock);
+
+    while (!LIST_EMPTY(removed)) {
+        mm_vma_t *vma = container_of(removed.next, mm_vma_t, list);
+
+        (void)mmu_unmap_range(vma->start, (vma->end - vma->start) / PAGE_SIZE);
+
+        list_remove(&vma->list);
+        __free_vma(vma);
+    }
+}
+
+/* Allocate a page for a user mapping
+ *
+ * No locks are held by the fault paths so pages can be swapped out
+ * here if there's no free memory, the fault fails if that doesn't help */
+static unsigned long __alloc_page(int flags)
+{
+    unsigned long page = mmu_page_alloc(MM_ZONE_HIGH, flags | MM_TRY);
+
+    if (page == INVALID_ADDRESS && mmu_swap_reclaim(1, MM_TRY) > 0)
+        page = mmu_page_alloc(MM_ZONE_HIGH, flags | MM_TRY);
+
+    return page;
+}
+
+/* Map the page of "file" at "offset" to "vaddr" of current address space
+ *
+ * Private areas get their own copy of the page when they first write to it.
+ * Until then, the page of the file is mapped copy-on-write
+ *
+ * If another thread mapped "vaddr" first, its mapping is kept
+ *
+ * Return 0 on success
+ * Return -EFAULT if the page cannot be read
+ * Return -ENOMEM if there's no memory for the copy of the page */
+static int __fault_file(file_t *file, off_t offset, unsigned long vaddr, int flags, bool shared, bool write)
+{
+    unsigned long page = file_get_page(file, offset);
+    bool ref           = false;
+
+    if (page == INVALID_ADDRESS)
+        return -EFAULT;
+
+    if (!shared && write) {
+        unsigned long copy = __alloc_page(MM_NO_FLAGS);
+
+        if (copy == INVALID_ADDRESS)
+            return -ENOMEM;
+
+        kmemcpy(mmu_p_to_v(copy), mmu_p_to_v(page), PAGE_SIZE);
+
+        if (mmu_try_map_page(copy, vaddr, flags) < 0) {
+            (void)mmu_page_unref(copy);
+            return 0;
+        }
+
+        mmu_lru_add(copy, sched_get_active(), vaddr);
+        return 0;
+    }
+
+    if (!shared && (flags & MM_READWRITE))
+        flags = (flags & ~MM_READWRITE) | MM_COW;
+
+    /* the mapping owns a reference to the page unless the page
+     * was not allocated by the page allocator (see __share_entry()) */
+    if ((ref = !!mmu_page_refcount(page)))
+        mmu_page_ref(page);
+
+    if (mmu_try_map_page(page, vaddr, flags) < 0 && ref)
+        (void)mmu_page_unref(page);
+
+    return 0;
+}
+
+int mmu_vma_fault(task_t *t, unsigned long addr, bool write)
+{
+    mm_vma_t *vma = NULL;
+    file_t *file  = NULL;
+    off_t offset  = 0;
+    int flags     = 0;
+    int ret       = 0;
+    bool shared   = false;
+    bool huge     = false;
+
+    if (!t || addr >= USER_SPACE_END)
+        return -EFAULT;
+
+    spin_acquire(&t->vma_lock);
+
+    FOREACH(t->vmas, iter) {
+        mm_vma_t *cur = container_of(iter, mm_vma_t, list);
+
+        if (cur->start <= addr && addr < cur->end) {
+            vma = cur;
+            break;
+        }
+    }
+
+    if (!vma)
+        vma = __grow_stack(t, addr);
+
+    if (!vma || (write && !(vma->flags & VM_WRITE))) {
+        spin_release(&t->vma_lock);
+        return -EFAULT;
+    }
+
+    flags  = __get_flags(vma);
+    file   = vma->file;
+    offset = vma->offset + (ROUND_DOWN(addr, PAGE_SIZE) - vma->start);
+    shared = !!(vma->flags & VM_SHARED);
+    huge   = !file && vma->start <= ROUND_DOWN(addr, HUGE_PAGE_SIZE) &&
+             ROUND_DOWN(addr, HUGE_PAGE_SIZE) + HUGE_PAGE_SIZE <= vma->end;
+
+    /* the area may be unmapped while the page is read */
+    if (file)
+        __sync_add_and_fetch(&file->f_count, 1);
+
+    spin_release(&t->vma_lock);
+
+    if (file) {
+        ret = __fault_file(file, offset, ROUND_DOWN(addr, PAGE_SIZE), flags, shared, write);
+        (void)file_fput(file);
+
+        return ret;
+    }
+
+    /* anonymous memory: zero-fill on demand */
+    unsigned long page = __alloc_page(MM_ZERO);
+
+    if (page == INVALID_ADDRESS)
+        return -ENOMEM;
+
+    /* another thread faulted the page in first and may have written to it already */
+    if (mmu_try_map_page(page, ROUND_DOWN(addr, PAGE_SIZE), flags) < 0) {
+        (void)mmu_page_unref(page);
+        return 0;
+    }
+
+    /* private pages can be moved by compaction and swapped out */
+    mmu_lru_add(page, t, addr);
+
+    /* once the area has populated a whole 2MB region, map it using one large page */
+    if (huge)
+        (void)mmu_promote_huge_page(addr);
+
+    return 0;
+}
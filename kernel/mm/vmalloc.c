@@ -0,0 +1,143 @@
+#include <kernel/common.h>
+#include <kernel/kassert.h>
+#include <kernel/kpanic.h>
+#include <kernel/kprint.h>
+#include <lib/bitmap.h>
+#include <lib/list.h>
+#include <mm/mmu.h>
+#include <mm/page.h>
+#include <mm/swap.h>
+#include <mm/vmalloc.h>
+#include <sync/spinlock.h>
+#include <errno.h>
+
+#define VMALLOC_NPAGES (VMALLOC_SIZE / PAGE_SIZE)
+
+/* each bit of the bitmap tells whether the corresponding page
+ * of the vmalloc region has been allocated for someone */
+static bitmap_t  *vm_bitmap;
+static spinlock_t vm_lock = 0;
+
+static void __unmap_range(unsigned long vaddr, size_t npages)
+{
+    list_head_t pages;
+    page_t *page = NULL;
+
+    list_init(&pages);
+
+    /* collect the backing pages before the mappings are gone */
+    for (size_t i = 0; i < npages; ++i) {
+        unsigned long paddr = mmu_translate(vaddr + i * PAGE_SIZE);
+
+        if (paddr != INVALID_ADDRESS && (page = mmu_page_get(paddr)) != NULL)
+            list_append(&pages, &page->list);
+    }
+
+    /* the TLBs of all CPUs are flushed once for the whole range
+     * and the pages can be released only after that */
+    (void)mmu_unmap_range(vaddr, npages);
+
+    while (!LIST_EMPTY(pages)) {
+        page = container_of(pages.next, page_t, list);
+
+        list_remove(&page->list);
+        (void)mmu_page_free(mmu_page_addr(page));
+    }
+}
+
+static void __release_range(unsigned long vaddr, size_t npages)
+{
+    uint32_t start = (vaddr - VMALLOC_START) / PAGE_SIZE;
+
+    spin_acquire(&vm_lock);
+    (void)bm_unset_range(vm_bitmap, start, start + npages);
+    spin_release(&vm_lock);
+}
+
+int mmu_vmalloc_init(void)
+{
+    if ((vm_bitmap = bm_alloc_bitmap(VMALLOC_NPAGES)) == NULL)
+        kpanic("failed to allocate bitmap for vmalloc region");
+
+    return 0;
+}
+
+void *vmalloc(size_t size)
+{
+    if (size == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    size_t npages = ROUND_UP(size, PAGE_SIZE) / PAGE_SIZE;
+    int start     = 0;
+
+    /* every allocation is followed by an unmapped guard page
+     * so that overflowing the buffer causes a page fault */
+    spin_acquire(&vm_lock);
+
+    if ((start = bm_find_first_unset_range(vm_bitmap, 0, VMALLOC_NPAGES - 1, npages + 1)) < 0) {
+        spin_release(&vm_lock);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    (void)bm_set_range(vm_bitmap, start, start + npages);
+    spin_release(&vm_lock);
+
+    unsigned long vaddr = VMALLOC_START + (unsigned long)start * PAGE_SIZE;
+
+    for (size_t i = 0; i < npages; ++i) {
+        unsigned long paddr = mmu_page_alloc(MM_ZONE_HIGH, MM_TRY);
+
+        /* MM_TRY only wakes up kswapd so the pages are swapped out here */
+        if (paddr == INVALID_ADDRESS && mmu_swap_reclaim(1, MM_TRY) > 0)
+            paddr = mmu_page_alloc(MM_ZONE_HIGH, MM_TRY);
+
+        if (paddr == INVALID_ADDRESS ||
+            mmu_map_page(paddr, vaddr + i * PAGE_SIZE, MM_PRESENT | MM_READWRITE) < 0)
+        {
+            if (paddr != INVALID_ADDRESS)
+                (void)mmu_page_free(paddr);
+
+            __unmap_range(vaddr, i);
+            __release_range(vaddr, npages);
+
+            errno = ENOMEM;
+            return NULL;
+        }
+
+        /* the size of the allocation is stored to the first page so vfree() knows it */
+        if (i == 0) {
+            page_t *page = mmu_page_get(paddr);
+
+            page->usage = MM_PU_VMALLOC;
+            page->size  = npages;
+        }
+    }
+
+    return (void *)vaddr;
+}
+
+void vfree(void *addr)
+{
+    unsigned long vaddr = (unsigned long)addr;
+    unsigned long paddr = INVALID_ADDRESS;
+    page_t *page        = NULL;
+
+    if (!addr)
+        return;
+
+    if (vaddr < VMALLOC_START || vaddr >= VMALLOC_END || !PAGE_ALIGNED(vaddr) ||
+        (paddr = mmu_translate(vaddr)) == INVALID_ADDRESS ||
+        (page = mmu_page_get(paddr)) == NULL || page->usage != MM_PU_VMALLOC)
+    {
+        kdebug("0x%x was not allocated by vmalloc()", addr);
+        return;
+    }
+
+    size_t npages = page->size;
+
+    __unmap_range(vaddr, npages);
+    __release_range(vaddr, npages);
+}
@@ -2,9 +2,10 @@
 #include <kernel/cpu.h>
 #include <kernel/kassert.h>
 #include <kernel/kpanic.h>
+#include <kernel/kprint.h>
 #include <kernel/percpu.h>
+#include <kernel/tick.h>
 #include <kernel/util.h>
-#include <lib/bheap.h>
 #include <lib/list.h>
 #include <mm/heap.h>
 #include <mm/slab.h>
@@ -15,6 +16,14 @@
 
 #define ST_ERROR(err) ((errno = -(err)) ? NULL : NULL);
 
+#define MTS_BALANCE_TICKS  8 /* how often a busy CPU compares its load to other CPUs */
+#define MTS_BALANCE_MAX    4 /* tasks moved by one balancing pass */
+#define MTS_CACHE_HOT      3 /* ticks after running during which a task is not migrated */
+
+#define MTS_NPRIO     64    /* priority levels of a run queue */
+#define MTS_PRIO_MIN  (-32) /* lower priorities share the lowest level */
+#define MTS_PRIO_MAX  (MTS_PRIO_MIN + MTS_NPRIO - 1)
+
 typedef struct sched_task    sched_task_t;
 typedef struct run_queue     run_queue_t;
 typedef struct mts_scheduler mts_scheduler_t;
@@ -66,6 +75,7 @@ struct heur {
     tick_t total_alloc;    /* total amount of ticks allocated for this task */
     tick_t tick;           /* tick counter used to measure time (active/blocked state) */
     tick_t birth;          /* tick count value when this task was created */
+    tick_t last_ran;       /* tick count value when this task last stopped running */
 
     size_t unfair;         /* how many reschedules has gone by with unfair execution times */
     size_t nexec;          /* how many times this task has been selected for execution */
@@ -84,13 +94,22 @@ struct sched_task {
     size_t exec_rt;      /* how many ticks have been consumed out of "timeslice" ticks */
 
     struct heur rt_heur; /* various run time heuristics for dynamic priority adjustment */
-    list_head_t list;    /* list used for the wait queue */
+    list_head_t list;    /* list used for the priority queue and the wait queue */
+    int level;           /* level of the priority queue the task was queued to */
 
     int pid;             /* pid of the task */
 };
 
+/* Ready tasks are kept in a FIFO list for each priority level and
+ * a bitmap tells which levels have tasks so that finding the highest
+ * priority task, adding a task and removing a task are all O(1) */
+struct prio_queue {
+    uint64_t bitmap;                /* levels that have ready tasks */
+    list_head_t levels[MTS_NPRIO];  /* ready tasks of each level */
+};
+
 struct run_queue {
-    bheap_t *pqueue;       /* priority queue for tasks */
+    struct prio_queue pqueue; /* priority queue for tasks */
     list_head_t wait_list; /* list of blocked tasks */
     sched_task_t *active;  /* currently running task */
     task_t *idle;          /* idle task for this run queue, chosen if pqueue is empty */
@@ -105,6 +124,10 @@ struct run_queue {
     int lowest;            /* current lowest value of scheduling priority */
     bool iactive;          /* set to true when idle task is running */
 
+    size_t nmigrated_in;   /* tasks moved to this run queue from other CPUs */
+    size_t nmigrated_out;  /* tasks moved from this run queue to other CPUs */
+    size_t nstolen;        /* tasks pulled while this CPU had nothing to run */
+
     spinlock_t lock;       /* lock for this run queueu */
 };
 
@@ -118,15 +141,225 @@ struct mts_scheduler {
 static __percpu run_queue_t rq;
 static mts_scheduler_t mts;
 
-static bool __cmp_pld(void *a1, void *a2)
+/* Scheduling priorities are not bounded (penalized tasks keep getting
+ * lower priorities) so the priorities outside the levels are clamped */
+static inline int __prio(int sprio)
+{
+    return MAX(MIN(sprio, MTS_PRIO_MAX), MTS_PRIO_MIN);
+}
+
+static void __pq_init(struct prio_queue *pq)
+{
+    pq->bitmap = 0;
+
+    for (size_t i = 0; i < MTS_NPRIO; ++i)
+        list_init(&pq->levels[i]);
+}
+
+/* Add "t" to the end of the list of its priority level */
+static void __pq_insert(struct prio_queue *pq, sched_task_t *t)
+{
+    list_head_t *level = NULL;
+
+    t->level = __prio(t->sprio) - MTS_PRIO_MIN;
+    level    = &pq->levels[t->level];
+
+    list_append(level->prev, &t->list);
+    pq->bitmap |= (1ULL << t->level);
+}
+
+static void __pq_remove(struct prio_queue *pq, sched_task_t *t)
+{
+    list_remove(&t->list);
+    list_init(&t->list);
+
+    if (LIST_EMPTY(pq->levels[t->level]))
+        pq->bitmap &= ~(1ULL << t->level);
+}
+
+/* Return the highest priority that has ready tasks
+ * Return INT_MIN if there are no ready tasks */
+static inline int __pq_peek(struct prio_queue *pq)
+{
+    if (!pq->bitmap)
+        return INT_MIN;
+
+    return (63 - __builtin_clzll(pq->bitmap)) + MTS_PRIO_MIN;
+}
+
+/* Remove the task that has waited longest on the highest priority level
+ * Return NULL if there are no ready tasks */
+static sched_task_t *__pq_pop(struct prio_queue *pq)
+{
+    sched_task_t *t = NULL;
+
+    if (!pq->bitmap)
+        return NULL;
+
+    t = container_of(pq->levels[63 - __builtin_clzll(pq->bitmap)].next, sched_task_t, list);
+    __pq_remove(pq, t);
+
+    return t;
+}
+
+/* A task that stopped running only a moment ago still has its working set
+ * in the caches of its CPU. It may also still be in the middle of being
+ * switched out, so such tasks are never migrated
+ *
+ * Return NULL if all ready tasks of "src" are cache-hot */
+static sched_task_t *__find_migratable(run_queue_t *src)
+{
+    for (uint64_t bitmap = src->pqueue.bitmap; bitmap; bitmap &= ~(1ULL << (63 - __builtin_clzll(bitmap)))) {
+        list_head_t *level = &src->pqueue.levels[63 - __builtin_clzll(bitmap)];
+
+        FOREACH((*level), iter) {
+            sched_task_t *st = container_of(iter, sched_task_t, list);
+
+            if (src->tick - st->rt_heur.last_ran >= MTS_CACHE_HOT)
+                return st;
+        }
+    }
+
+    return NULL;
+}
+
+/* Load of a run queue: the ready tasks and the running task if there is one */
+static inline size_t __load(run_queue_t *q)
+{
+    return READ_ONCE(q->nready) + !!READ_ONCE(q->active);
+}
+
+/* Find the run queue with the highest load, ties are broken by
+ * the combined priority of the ready tasks. The queues are not locked
+ * so the result is only a hint and must be checked again under the lock
+ *
+ * Return NULL if there is only one CPU */
+static run_queue_t *__find_busiest(run_queue_t *self)
+{
+    run_queue_t *busiest = NULL;
+
+    for (size_t i = 0; i < READ_ONCE(mts.ncpu); ++i) {
+        run_queue_t *q = mts.rq[i];
+
+        if (q == self)
+            continue;
+
+        if (!busiest || __load(q) > __load(busiest) ||
+            (__load(q) == __load(busiest) && READ_ONCE(q->rprio) > READ_ONCE(busiest->rprio)))
+            busiest = q;
+    }
+
+    return busiest;
+}
+
+/* Move at most "n" ready tasks that are not cache-hot from "src" to "dst"
+ * "dst" must be locked by the caller. "src" is only tried so that two CPUs
+ * pulling from each other can't deadlock
+ *
+ * Return the number of tasks moved */
+static size_t __pull_tasks(run_queue_t *dst, unsigned cpu, run_queue_t *src, size_t n)
+{
+    size_t count = 0;
+
+    if (!spin_try_acquire(&src->lock))
+        return 0;
+
+    while (count < n && src->nready > 0) {
+        sched_task_t *st = __find_migratable(src);
+
+        if (!st)
+            break;
+
+        __pq_remove(&src->pqueue, st);
+
+        src->ntasks -= 1;
+        src->nready -= 1;
+        src->rprio  -= st->prio;
+
+        /* the heuristics are measured in ticks of the run queue */
+        st->rt_heur.birth    += dst->tick - src->tick;
+        st->rt_heur.tick     += dst->tick - src->tick;
+        st->rt_heur.last_ran += dst->tick - src->tick;
+        st->task->cpu         = cpu;
+
+        if (dst->lowest > st->sprio)
+            dst->lowest = st->sprio;
+
+        dst->ntasks += 1;
+        dst->nready += 1;
+        dst->rprio  += st->prio;
+
+        __pq_insert(&dst->pqueue, st);
+        count++;
+    }
+
+    src->nmigrated_out += count;
+    dst->nmigrated_in  += count;
+
+    spin_release(&src->lock);
+
+    return count;
+}
+
+/* Pull one task from the busiest CPU to "q" which has nothing to run
+ * "q" must be locked by the caller
+ *
+ * Return the number of tasks moved */
+static size_t __steal_task(run_queue_t *q)
+{
+    run_queue_t *busiest = __find_busiest(q);
+    size_t count         = 0;
+
+    if (!busiest || READ_ONCE(busiest->nready) == 0)
+        return 0;
+
+    count       = __pull_tasks(q, get_thiscpu_id(), busiest, 1);
+    q->nstolen += count;
+
+    return count;
+}
+
+/* A CPU whose tick is stopped doesn't notice tasks queued to it by other CPUs
+ *
+ * Kick "cpu" after a task was queued to it and if "cpu" is busy, kick
+ * also an idle CPU so that it can steal the task. The caller must have
+ * released the lock of the run queue so that the new task is visible */
+static void __kick(unsigned cpu)
+{
+    tick_kick(cpu);
+
+    if (!READ_ONCE(mts.rq[cpu]->active))
+        return;
+
+    for (unsigned i = 0; i < READ_ONCE(mts.ncpu); ++i) {
+        run_queue_t *q = mts.rq[i];
+
+        if (i != cpu && READ_ONCE(q->iactive) && READ_ONCE(q->nready) == 0) {
+            tick_kick(i);
+            return;
+        }
+    }
+}
+
+/* Move half of the difference in load between the busiest CPU and "q" to "q"
+ * The queue of this CPU is tried because the timer interrupt may have
+ * interrupted a holder of the lock on this very CPU */
+static void __balance(run_queue_t *q)
 {
-    if (!a1 || !a2)
-        return false;
+    run_queue_t *busiest = __find_busiest(q);
+    size_t load          = 0;
+    size_t bload         = 0;
 
-    task_t *t1 = (task_t *)a1;
-    task_t *t2 = (task_t *)((sched_task_t *)a2)->task;
+    if (!busiest || !spin_try_acquire(&q->lock))
+        return;
 
-    return (t1->pid == t2->pid);
+    load  = __load(q);
+    bload = __load(busiest);
+
+    if (bload > load + 1)
+        (void)__pull_tasks(q, get_thiscpu_id(), busiest, MIN((bload - load) / 2, MTS_BALANCE_MAX));
+
+    spin_release(&q->lock);
 }
 
 static inline run_queue_t *__get_rq(unsigned cpu)
@@ -144,6 +377,23 @@ static inline void __put_rq(run_queue_t *q)
     spin_release(&q->lock);
 }
 
+/* Lock the run queue of "task"
+ *
+ * The task may be pulled to another CPU by __pull_tasks() before
+ * the lock is taken so the CPU of the task is checked again once it's held */
+static run_queue_t *__get_task_rq(task_t *task)
+{
+    for (;;) {
+        unsigned cpu   = READ_ONCE(task->cpu);
+        run_queue_t *q = __get_rq(cpu);
+
+        if (READ_ONCE(task->cpu) == cpu)
+            return q;
+
+        __put_rq(q);
+    }
+}
+
 static int __update_blocked(sched_task_t *t, bool start)
 {
     kassert(t != NULL);
@@ -312,7 +562,7 @@ static int __schedule_task(sched_task_t *t, bool switch_task)
 
     if (switch_task) {
         q->nready++;
-        (void)bh_insert(q->pqueue, t->sprio, t);
+        __pq_insert(&q->pqueue, t);
         return ST_SWITCH;
     }
 
@@ -337,11 +587,7 @@ int mts_init_cpu(task_t *idle)
 
     run_queue_t *q = get_thiscpu_ptr(rq);
 
-    if ((q->pqueue = bh_init(256)) == NULL) {
-        spin_release(&mts.lock);
-        return ST_ENOMEM;
-    }
-
+    __pq_init(&q->pqueue);
     list_init(&q->wait_list);
 
     q->active   = NULL;
@@ -352,6 +598,10 @@ int mts_init_cpu(task_t *idle)
     q->nblocked = 0;
     q->nexec    = 0;
     q->lowest   = INT_MAX;
+
+    q->nmigrated_in  = 0;
+    q->nmigrated_out = 0;
+    q->nstolen       = 0;
     q->idle     = idle;
     q->lock     = 0;
 
@@ -399,7 +649,7 @@ int mts_schedule(task_t *task, int nice)
     st->prio      = SP_BASE + SPB_BIRTH + nice;
     st->sprio     = SP_BASE + SPB_BIRTH + nice;
     st->type      = SCHED_BATCH;
-    st->state     = ST_ACTIVE;
+    st->state     = ST_READY;
     st->timeslice = STS_BASE;
     st->exec_rt   = 0;
     st->pid       = task->pid;
@@ -416,16 +666,17 @@ int mts_schedule(task_t *task, int nice)
     q->nready += 1;
     q->rprio  += st->prio;
 
-    if ((ret = bh_insert(q->pqueue, st->sprio, st)) < 0)
-        goto end;
+    task->sched = st;
+    __pq_insert(&q->pqueue, st);
 
     if (q->active && q->active->sprio < st->sprio && task->cpu != get_thiscpu_id())
         ret = ST_SWITCH;
 
-end:
     spin_release(&mts.lock);
     spin_release(&q->lock);
 
+    __kick(task->cpu);
+
     return ret;
 }
 
@@ -439,7 +690,7 @@ task_t *mts_get_next(void)
     spin_acquire(&q->lock);
 
     sched_task_t *st = NULL;
-    int prio         = bh_peek_max(q->pqueue);
+    int prio         = __pq_peek(&q->pqueue);
 
     /* MTS has not been started or idle task is being
      * run, pop the first task from queue
@@ -453,6 +704,7 @@ task_t *mts_get_next(void)
         /* TODO: move spinlock to SLAB! */
         spin_acquire(&mts.lock);
         list_remove(&q->active->list);
+        q->active->task->sched = NULL;
         mmu_cache_free_entry(mts.st_cache, q->active, 0);
         spin_release(&mts.lock);
         q->active = NULL;
@@ -471,7 +723,7 @@ task_t *mts_get_next(void)
      *         -> reschedule current task and switch to new task
      *
      * Get the task with highest priority from queue, reschedule active and return */
-    if (prio > (int)q->active->sprio) {
+    if (prio > __prio(q->active->sprio)) {
         q->active->state |= ST_PREEMPTED;
         goto setup_active;
     }
@@ -498,7 +750,7 @@ task_t *mts_get_next(void)
          * If __schedule_task() returns ST_OK, we can keep executing this task. If, however,
          * ST_SWITCH is returned, we must switch the active task even if the current task
          * has the highest priority [it might have changed in __adjust_priority()]*/
-        if (prio < (int)q->active->sprio) {
+        if (prio < __prio(q->active->sprio)) {
             if (__schedule_task(q->active, false) == ST_OK) {
                 spin_release(&q->lock);
                 return q->active->task;
@@ -509,18 +761,26 @@ task_t *mts_get_next(void)
     }
 
 setup_active:
-    /* If the priority queue is empty, we need to select idle task */
-    if (prio == INT_MIN)
-        goto setup_idle;
+    /* If the priority queue is empty, try to take work from
+     * the busiest CPU before selecting the idle task */
+    if (prio == INT_MIN) {
+        if (__steal_task(q) > 0)
+            prio = __pq_peek(&q->pqueue);
+
+        if (prio == INT_MIN)
+            goto setup_idle;
+    }
 
     /* Here the actual task switch is done, first we pop the highest
      * priority task from queue, schedule active task (if we have one),
      * set the popped task as active task and updated its runtime heuristics */
-    st = bh_remove_max(q->pqueue);
+    st = __pq_pop(&q->pqueue);
     kassert(st != NULL);
 
-    if (q->active)
+    if (q->active) {
+        q->active->rt_heur.last_ran = q->tick;
         __schedule_task(q->active, true);
+    }
 
     q->active  = st;
     q->iactive = false;
@@ -579,8 +839,18 @@ int mts_tick(void)
             return ST_SWITCH;
 
         /* If the priority queue is not empty, switch task.
-         * Otherwise keep executing idle task */
-        return (bh_peek_max(q->pqueue) > INT_MIN) ? ST_SWITCH : ST_OK;
+         * Otherwise try to steal a task from the busiest CPU */
+        if (__pq_peek(&q->pqueue) > INT_MIN)
+            return ST_SWITCH;
+
+        if (spin_try_acquire(&q->lock)) {
+            int ret = (__steal_task(q) > 0) ? ST_SWITCH : ST_OK;
+
+            spin_release(&q->lock);
+            return ret;
+        }
+
+        return ST_OK;
     }
 
     /* each run queue has a tick counter which is updated
@@ -589,6 +859,9 @@ int mts_tick(void)
     q->tick++;
     q->active->exec_rt++;
 
+    if (q->tick % MTS_BALANCE_TICKS == 0)
+        __balance(q);
+
     /* There are three different scenarios:
      *
      * 1) there is a higher-priority task waiting
@@ -602,9 +875,9 @@ int mts_tick(void)
      * 3) active task has time left and there are no higher priority tasks waiting
      *      -> continue execution normally
      */
-    int prio = bh_peek_max(q->pqueue);
+    int prio = __pq_peek(&q->pqueue);
 
-    if (prio > (int)q->active->sprio) {
+    if (prio > __prio(q->active->sprio)) {
         /* kdebug("preempt %s", q->active->task->name); */
         q->active->state |= ST_PREEMPTED;
         return ST_SWITCH;
@@ -624,39 +897,52 @@ int mts_tick(void)
 
 int mts_unschedule(task_t *task)
 {
-    run_queue_t *q = get_percpu_ptr(rq, task->cpu);
-
     if (!task)
         return ST_EINVAL;
 
+    run_queue_t *q  = __get_task_rq(task);
+    sched_task_t *t = task->sched;
+    int ret         = ST_OK;
+
     /* MTS has not been started */
     if (!q->active && !q->iactive)
-        return ST_OK;
+        goto out;
+
+    if (!t) {
+        ret = ST_ENOENT;
+        goto out;
+    }
 
     /* Task to be deleted is active task, release memory and
      * return ST_SWITCH to caller indicating that task must be switched */
-    if (q->active->task == task) {
+    if (q->active == t) {
         q->active->state = ST_UNSCHEDULED;
         q->ntasks--;
-        return ST_SWITCH;
+        ret = ST_SWITCH;
+        goto out;
     }
 
-    spin_acquire(&q->lock);
-
-    /* the task that needs to be blocked is not active task
-     * and we must thus find it from the queue */
-    sched_task_t *t = bh_remove_pld(q->pqueue, task, __cmp_pld);
+    /* the task is either waiting in the priority queue or in the wait queue */
+    if (t->state == ST_READY) {
+        __pq_remove(&q->pqueue, t);
+        q->nready--;
+        q->rprio -= t->prio;
+    } else {
+        q->nblocked--;
+    }
 
     q->ntasks--;
-    q->nready--;
+    task->sched = NULL;
 
     spin_acquire(&mts.lock);
     list_remove(&t->list);
     mmu_cache_free_entry(mts.st_cache, t, 0);
     spin_release(&mts.lock);
-    spin_release(&q->lock);
 
-    return ST_OK;
+out:
+    __put_rq(q);
+
+    return ret;
 }
 
 int mts_block(task_t *task)
@@ -666,31 +952,49 @@ int mts_block(task_t *task)
 
     int ret         = ST_OK;
     run_queue_t *bq = __get_rq(0);
-    run_queue_t  *q = task->cpu ? __get_rq(task->cpu) : bq;
-    sched_task_t *t = NULL;
+    run_queue_t  *q = bq;
+    sched_task_t *t = task->sched;
 
-    if (q->active && (t = q->active)->task == task) {
-        ret = ST_SWITCH;
-        goto end;
-    }
+    /* the wait queue is locked first, see __get_task_rq() */
+    for (;;) {
+        unsigned cpu = READ_ONCE(task->cpu);
 
-    /* the task that needs to be blocked is not active task
-     * and we must thus find it from the queue */
-    t = bh_remove_pld(q->pqueue, task, __cmp_pld);
+        if (!cpu)
+            break;
+
+        q = __get_rq(cpu);
+
+        if (READ_ONCE(task->cpu) == cpu)
+            break;
+
+        __put_rq(q);
+        q = bq;
+    }
 
     if (!t) {
         ret = ST_ENOENT;
-        goto end;
+        goto out;
+    }
+
+    /* The active task is not in the priority queue and its
+     * priority is not part of the ready tasks' combined priority */
+    if (q->active == t) {
+        t->rt_heur.last_ran = q->tick;
+        ret = ST_SWITCH;
+    } else if (t->state == ST_READY) {
+        __pq_remove(&q->pqueue, t);
+        q->nready -= 1;
+        q->rprio  -= t->prio;
+    } else {
+        ret = ST_ENOENT;
+        goto out;
     }
 
-end:
     /* Move task from run queue to wait queue
      *
      * The default waiting queue is on CPU 0 because
      * interrupt forwarding does not work at the moment */
     bq->nblocked += 1;
-    q->nready    -= 1;
-    q->rprio     -= t->prio;
     t->state      = ST_BLOCKED;
     task->cpu     = 0;
 
@@ -700,6 +1004,7 @@ end:
 
     kassert(t->task != NULL);
 
+out:
     if (q != bq)
         __put_rq(bq);
     __put_rq(q);
@@ -712,8 +1017,11 @@ int mts_unblock(task_t *task)
     if (!task)
         return ST_EINVAL;
 
-    run_queue_t *q = __get_rq(task->cpu);
-    int ret        = ST_ENOENT;
+    unsigned cpu    = task->cpu;
+    run_queue_t *q  = __get_rq(cpu);
+    sched_task_t *t = task->sched;
+    int ret         = ST_ENOENT;
+    bool queued     = false;
 
     /* MTS has not been started */
     if (!q->active && !q->iactive) {
@@ -721,20 +1029,63 @@ int mts_unblock(task_t *task)
         goto end;
     }
 
-    FOREACH(q->wait_list, iter) {
-        sched_task_t *t = container_of(iter, sched_task_t, list);
+    if (t && t->state == ST_BLOCKED) {
+        list_remove(&t->list);
+        list_init(&t->list);
+        (void)__update_blocked(t, false);
+        (void)__schedule_task(t, true);
 
-        if (t->task->pid == task->pid) {
-            list_remove(&t->list);
-            (void)__update_blocked(t, false);
-            (void)__schedule_task(t, true);
-
-            ret = (q->active) ? ((t->sprio > q->active->sprio) ? ST_SWITCH : ST_OK) : ST_OK;
-            goto end;
-        }
+        queued = true;
+        ret    = (q->active) ? ((t->sprio > q->active->sprio) ? ST_SWITCH : ST_OK) : ST_OK;
     }
 
 end:
     __put_rq(q);
+
+    if (queued)
+        __kick(cpu);
+
     return ret;
 }
+
+bool mts_need_tick(void)
+{
+    run_queue_t *q = get_thiscpu_ptr(rq);
+
+    /* MTS has not been started */
+    if (!q->active && !q->iactive)
+        return true;
+
+    return READ_ONCE(q->nready) > 0;
+}
+
+int mts_get_stats(unsigned cpu, mts_stats_t *stats)
+{
+    run_queue_t *q = NULL;
+
+    if (!stats || cpu >= mts.ncpu)
+        return ST_EINVAL;
+
+    q = mts.rq[cpu];
+
+    stats->nready        = READ_ONCE(q->nready);
+    stats->nexec         = READ_ONCE(q->nexec);
+    stats->nmigrated_in  = READ_ONCE(q->nmigrated_in);
+    stats->nmigrated_out = READ_ONCE(q->nmigrated_out);
+    stats->nstolen       = READ_ONCE(q->nstolen);
+
+    return ST_OK;
+}
+
+void mts_print_stats(void)
+{
+    mts_stats_t stats;
+
+    for (unsigned i = 0; i < mts.ncpu; ++i) {
+        if (mts_get_stats(i, &stats) < 0)
+            continue;
+
+        kprint("CPU %u: %u ready, %u switches, %u migrated in, %u migrated out, %u stolen\n",
+                i, stats.nready, stats.nexec, stats.nmigrated_in, stats.nmigrated_out, stats.nstolen);
+    }
+}
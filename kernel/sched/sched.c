@@ -2,6 +2,7 @@
 #include <drivers/pit.h>
 #include <fs/binfmt.h>
 #include <fs/file.h>
+#include <kernel/clock.h>
 #include <kernel/common.h>
 #include <kernel/gdt.h>
 #include <kernel/kassert.h>
@@ -12,6 +13,7 @@
 #include <kernel/tick.h>
 #include <kernel/util.h>
 #include <mm/heap.h>
+#include <mm/page.h>
 #include <sched/mts.h>
 #include <sched/sched.h>
 #include <errno.h>
@@ -29,8 +31,11 @@ static void *idle_task_func(void *arg)
 
     ap_initialized++;
 
+    /* use the idle time to zero pages for MM_ZERO allocations
+     * and when there's nothing to zero, sleep until an interrupt */
     for (;;) {
-        cpu_relax();
+        if (!mmu_zero_pool_refill())
+            cpu_halt();
     }
 
     return NULL;
@@ -57,8 +62,11 @@ static void *init_task_func(void *arg)
 
         kdebug("Waiting for CPU %u to register itself...", i);
 
-        while (READ_ONCE(ap_initialized) != i)
+        /* the AP synchronizes its clock with ours before it registers itself */
+        while (READ_ONCE(ap_initialized) != i) {
+            clock_sync_serve();
             cpu_relax();
+        }
     }
 #endif
     sched_initialized = true;
@@ -123,7 +131,7 @@ void sched_enter_userland(void *eip, void *esp)
     /* update TSS and load the context from 
      * threads->exec_state essentially switching the task */
     tss_update_rsp((unsigned long)cur->threads->kstack_top + KSTACK_SIZE);
-    native_context_load(cur->cr3, &cur->threads->bootstrap);
+    native_context_load(mmu_get_ctx(cur), &cur->threads->bootstrap);
 
     kpanic("native_context_load() returned!");
 }
@@ -247,7 +255,7 @@ __noreturn void sched_start()
 
     /* native_context_load() loads a new context from cr3/exec_state discarding
      * the current context entirely. Used only for task bootstrapping */
-    native_context_load(next->cr3, next->threads->exec_state);
+    native_context_load(mmu_get_ctx(next), next->threads->exec_state);
 
     kpanic("native_context_load() returned!");
 }
@@ -267,9 +275,24 @@ task_t *sched_get_init(void)
 
 void sched_tick(isr_regs_t *cpu)
 {
-    if (!READ_ONCE(sched_initialized))
+    int ret = ST_OK;
+
+    if (!READ_ONCE(sched_initialized)) {
+        tick_program(true);
         return;
+    }
+
+    ret = mts_tick();
+
+    /* The tick is marked stopped before the run queue is looked at so that
+     * a task queued at the same time either sees the mark and kicks this CPU
+     * or is seen by mts_need_tick()
+     *
+     * The timer is armed before the task switch because the switch
+     * returns only when the interrupted task is run again */
+    tick_stop();
+    tick_program(mts_need_tick());
 
-    if (mts_tick() != ST_OK)
+    if (ret != ST_OK)
         __prepare_switch(cpu);
 }
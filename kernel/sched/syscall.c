@@ -2,6 +2,7 @@
 #include <fs/binfmt.h>
 #include <fs/fs.h>
 #include <fs/file.h>
+#include <kernel/clock.h>
 #include <kernel/irq.h>
 #include <kernel/kassert.h>
 #include <kernel/kprint.h>
@@ -9,16 +10,19 @@
 #include <kernel/util.h>
 #include <mm/mmu.h>
 #include <mm/heap.h>
+#include <mm/vma.h>
 #include <net/socket.h>
 #include <sched/sched.h>
 #include <sched/syscall.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 
-#define MAX_SYSCALLS 17
+#define MAX_SYSCALLS 22
 
-typedef int32_t (*syscall_t)(isr_regs_t *cpu);
+typedef int64_t (*syscall_t)(isr_regs_t *cpu);
 
-int32_t sys_read(isr_regs_t *cpu)
+int64_t sys_read(isr_regs_t *cpu)
 {
     int fd          = (int)cpu->rdx;
     void *buf       = (void *)cpu->rbx;
@@ -44,7 +48,7 @@ int32_t sys_read(isr_regs_t *cpu)
     return nread;
 }
 
-int32_t sys_write(isr_regs_t *cpu)
+int64_t sys_write(isr_regs_t *cpu)
 {
     int fd          = (int)cpu->rdx;
     void *buf       = (void *)cpu->rbx;
@@ -67,7 +71,7 @@ int32_t sys_write(isr_regs_t *cpu)
     return file_write(current->file_ctx->fd[fd], 0, len, buf);
 }
 
-int32_t sys_fork(isr_regs_t *cpu)
+int64_t sys_fork(isr_regs_t *cpu)
 {
     (void)cpu;
 
@@ -88,7 +92,7 @@ int32_t sys_fork(isr_regs_t *cpu)
     return t->pid;
 }
 
-int32_t sys_execv(isr_regs_t *cpu)
+int64_t sys_execv(isr_regs_t *cpu)
 {
     char *p      = (char *)cpu->rbx;
     file_t *file = NULL;
@@ -107,11 +111,8 @@ int32_t sys_execv(isr_regs_t *cpu)
 
     vfs_path_release(path);
 
-    /* clear page tables of current process:
-     * mark all user page tables as not present and try to free
-     * as many page frames as possible (all pages not marked as CoW) */
-    /* TODO:  */
-    /* mmu_unmap_pages(0, KSTART - 1); */
+    /* the loader unmaps and releases the pages of the current image
+     * once it has read the new one, see mmu_vma_unmap_all() */
 
     /* binfmt_load either jumps to user land and starts to execute
      * the new process or it fails (and returns) and we must return -1 to caller */
@@ -122,7 +123,7 @@ error:
     return -1;
 }
 
-int32_t sys_exit(isr_regs_t *cpu)
+int64_t sys_exit(isr_regs_t *cpu)
 {
     int status      = cpu->rax;
     task_t *current = sched_get_active();
@@ -154,7 +155,7 @@ int32_t sys_exit(isr_regs_t *cpu)
     __builtin_unreachable();
 }
 
-int32_t sys_wait(isr_regs_t *cpu)
+int64_t sys_wait(isr_regs_t *cpu)
 {
     (void)cpu;
 
@@ -191,7 +192,7 @@ int32_t sys_wait(isr_regs_t *cpu)
     return 0;
 }
 
-int32_t sys_socket(isr_regs_t *cpu)
+int64_t sys_socket(isr_regs_t *cpu)
 {
     int domain      = (int)cpu->rdx;
     int type        = (int)cpu->rbx;
@@ -201,7 +202,7 @@ int32_t sys_socket(isr_regs_t *cpu)
     return socket_alloc(current->file_ctx, domain, type, proto);
 }
 
-int32_t sys_bind(isr_regs_t *cpu)
+int64_t sys_bind(isr_regs_t *cpu)
 {
     int sockfd       = cpu->rdi;
     saddr_in_t *addr = (saddr_in_t *)cpu->rsi;
@@ -211,7 +212,7 @@ int32_t sys_bind(isr_regs_t *cpu)
     return socket_bind(current->file_ctx, sockfd, addr, slen);
 }
 
-int32_t sys_send(isr_regs_t *cpu)
+int64_t sys_send(isr_regs_t *cpu)
 {
     int sockfd       = cpu->rdi;
     void *buf        = (void *)cpu->rsi;
@@ -222,7 +223,7 @@ int32_t sys_send(isr_regs_t *cpu)
     return socket_send(current->file_ctx, sockfd, buf, len, flags, NULL, 0);
 }
 
-int32_t sys_sendto(isr_regs_t *cpu)
+int64_t sys_sendto(isr_regs_t *cpu)
 {
     int sockfd       = cpu->rdi;
     void *buf        = (void *)cpu->rsi;
@@ -235,7 +236,7 @@ int32_t sys_sendto(isr_regs_t *cpu)
     return socket_send(current->file_ctx, sockfd, buf, len, flags, addr, slen);
 }
 
-int32_t sys_recv(isr_regs_t *cpu)
+int64_t sys_recv(isr_regs_t *cpu)
 {
     int sockfd       = cpu->rdi;
     void *buf        = (void *)cpu->rsi;
@@ -246,7 +247,7 @@ int32_t sys_recv(isr_regs_t *cpu)
     return socket_recv(current->file_ctx, sockfd, buf, len, flags, NULL, NULL);
 }
 
-int32_t sys_recvfrom(isr_regs_t *cpu)
+int64_t sys_recvfrom(isr_regs_t *cpu)
 {
     int sockfd       = cpu->rdi;
     void *buf        = (void *)cpu->rsi;
@@ -259,7 +260,7 @@ int32_t sys_recvfrom(isr_regs_t *cpu)
     return socket_recv(current->file_ctx, sockfd, buf, len, flags, addr, slen);
 }
 
-int32_t sys_connect(isr_regs_t *cpu)
+int64_t sys_connect(isr_regs_t *cpu)
 {
     int sockfd       = cpu->rdi;
     saddr_in_t *addr = (saddr_in_t *)cpu->rsi;
@@ -269,7 +270,7 @@ int32_t sys_connect(isr_regs_t *cpu)
     return socket_connect(current->file_ctx, sockfd, addr, slen);
 }
 
-int32_t sys_listen(isr_regs_t *cpu)
+int64_t sys_listen(isr_regs_t *cpu)
 {
     int sockfd      = cpu->rdi;
     int backlog     = cpu->rsi;
@@ -278,7 +279,7 @@ int32_t sys_listen(isr_regs_t *cpu)
     return socket_listen(current->file_ctx, sockfd, backlog);
 }
 
-int32_t sys_accept(isr_regs_t *cpu)
+int64_t sys_accept(isr_regs_t *cpu)
 {
     int sockfd       = cpu->rdi;
     saddr_in_t *addr = (saddr_in_t *)cpu->rsi;
@@ -288,6 +289,186 @@ int32_t sys_accept(isr_regs_t *cpu)
     return socket_accept(current->file_ctx, sockfd, addr, slen);
 }
 
+/* Map "len" bytes of file "fd" starting at "offset" or anonymous
+ * memory if "flags" has MAP_ANONYMOUS to the address space of current task
+ *
+ * The pages are not touched until the task accesses them, see mmu_vma_fault() */
+int64_t sys_mmap(isr_regs_t *cpu)
+{
+    unsigned long addr = cpu->rdi;
+    size_t len         = cpu->rsi;
+    int prot           = cpu->rdx;
+    int flags          = cpu->rcx;
+    int fd             = cpu->r8;
+    off_t offset       = cpu->r9;
+    task_t *current    = sched_get_active();
+    file_t *file       = NULL;
+    unsigned vm_flags  = 0;
+    int type           = flags & (MAP_SHARED | MAP_PRIVATE);
+
+    if (len == 0 || offset < 0 || !PAGE_ALIGNED(offset) ||
+        (type != MAP_SHARED && type != MAP_PRIVATE) ||
+        ((flags & MAP_FIXED) && (addr == 0 || !PAGE_ALIGNED(addr))))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* shared anonymous memory would need a backing object shared by forked tasks */
+    if ((flags & MAP_ANONYMOUS) && type == MAP_SHARED) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    vm_flags |= (prot & PROT_READ)  ? VM_READ   : 0;
+    vm_flags |= (prot & PROT_WRITE) ? VM_WRITE  : 0;
+    vm_flags |= (prot & PROT_EXEC)  ? VM_EXEC   : 0;
+    vm_flags |= (type == MAP_SHARED) ? VM_SHARED : 0;
+
+    if (!(flags & MAP_ANONYMOUS)) {
+        if ((file = file_fget(fd)) == NULL)
+            return -1;
+
+        if (!file->f_dentry || !file->f_dentry->d_inode ||
+            !(file->f_dentry->d_inode->i_flags & T_IFREG))
+        {
+            (void)file_fput(file);
+            errno = ENODEV;
+            return -1;
+        }
+
+        if (type == MAP_SHARED && (prot & PROT_WRITE) && !(file->f_mode & O_RDWR)) {
+            (void)file_fput(file);
+            errno = EACCES;
+            return -1;
+        }
+    }
+
+    /* a fixed mapping replaces whatever was mapped to the range */
+    if (flags & MAP_FIXED)
+        (void)mmu_vma_unmap(current, addr, len);
+
+    unsigned long ret = mmu_vma_map(current, ROUND_DOWN(addr, PAGE_SIZE), len, vm_flags, file, offset);
+
+    /* the area took its own reference to the file */
+    if (file)
+        (void)file_fput(file);
+
+    if (ret == INVALID_ADDRESS)
+        return -1;
+
+    if ((flags & MAP_FIXED) && ret != addr) {
+        (void)mmu_vma_unmap(current, ret, len);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    return ret;
+}
+
+int64_t sys_munmap(isr_regs_t *cpu)
+{
+    unsigned long addr = cpu->rdi;
+    size_t len         = cpu->rsi;
+    int ret            = mmu_vma_unmap(sched_get_active(), addr, len);
+
+    if (ret < 0) {
+        errno = -ret;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Pages of shared mappings are the pages of the file so they only have
+ * to be written to the file. The write back is always synchronous */
+int64_t sys_msync(isr_regs_t *cpu)
+{
+    unsigned long addr = cpu->rdi;
+    size_t len         = cpu->rsi;
+    int flags          = cpu->rdx;
+    int ret            = 0;
+
+    if ((flags & MS_ASYNC) && (flags & MS_SYNC)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if ((ret = mmu_vma_sync(sched_get_active(), addr, len)) < 0) {
+        errno = -ret;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Return true if the "size" bytes at "ptr" are in user space */
+static bool __is_user_range(const void *ptr, size_t size)
+{
+    unsigned long addr = (unsigned long)ptr;
+
+    return ptr != NULL && addr < USER_SPACE_END && size <= USER_SPACE_END - addr;
+}
+
+/* Only the monotonic clock is supported, there's no real-time clock to read the wall time from */
+int64_t sys_clock_gettime(isr_regs_t *cpu)
+{
+    clockid_t clk_id    = (clockid_t)cpu->rdi;
+    struct timespec *tp = (struct timespec *)cpu->rsi;
+    uint64_t now        = 0;
+
+    if (clk_id != CLOCK_MONOTONIC) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (!__is_user_range(tp, sizeof(*tp))) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    now         = clock_monotonic_ns();
+    tp->tv_sec  = now / NSEC_PER_SEC;
+    tp->tv_nsec = now % NSEC_PER_SEC;
+
+    return 0;
+}
+
+/* The sleep can't be interrupted so the remaining time is always zero */
+int64_t sys_nanosleep(isr_regs_t *cpu)
+{
+    const struct timespec *req = (const struct timespec *)cpu->rdi;
+    struct timespec *rem       = (struct timespec *)cpu->rsi;
+    uint64_t ns                = ~0ULL;
+    int ret                    = 0;
+
+    if (!__is_user_range(req, sizeof(*req)) || (rem && !__is_user_range(rem, sizeof(*rem)))) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    if (req->tv_sec < 0 || req->tv_nsec < 0 || req->tv_nsec >= (long)NSEC_PER_SEC) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* a sleep too long to be counted in nanoseconds never ends */
+    if ((uint64_t)req->tv_sec <= (~0ULL - req->tv_nsec) / NSEC_PER_SEC)
+        ns = (uint64_t)req->tv_sec * NSEC_PER_SEC + req->tv_nsec;
+
+    if ((ret = clock_sleep(ns)) < 0) {
+        errno = -ret;
+        return -1;
+    }
+
+    if (rem) {
+        rem->tv_sec  = 0;
+        rem->tv_nsec = 0;
+    }
+
+    return 0;
+}
+
 static syscall_t syscalls[MAX_SYSCALLS] = {
     [0] = sys_read,
     [1] = sys_write,
@@ -302,7 +483,12 @@ static syscall_t syscalls[MAX_SYSCALLS] = {
     [12] = sys_recv,
     [13] = sys_recvfrom,
     [14] = sys_connect,
-    [15] = sys_listen
+    [15] = sys_listen,
+    [17] = sys_mmap,
+    [18] = sys_munmap,
+    [19] = sys_msync,
+    [20] = sys_clock_gettime,
+    [21] = sys_nanosleep
 };
 
 uint32_t syscall_handler(void *ctx)
@@ -313,7 +499,7 @@ uint32_t syscall_handler(void *ctx)
         kpanic("unsupported system call");
     } else {
         task_t *current = sched_get_active();
-        int32_t ret     = syscalls[cpu->rax](cpu);
+        int64_t ret     = syscalls[cpu->rax](cpu);
 
         /* return value is transferred in rax */
         current->threads->exec_state->rax = ret;
@@ -6,6 +6,7 @@
 #include <mm/mmu.h>
 #include <mm/page.h>
 #include <mm/slab.h>
+#include <mm/vma.h>
 #include <sched/task.h>
 #include <sync/wait.h>
 #include <errno.h>
@@ -13,6 +14,10 @@
 static mm_cache_t *task_cache = NULL;
 static mm_cache_t *thread_cache = NULL;
 
+/* all tasks that have an address space, see sched_task_for_each() */
+static list_head_t tasks;
+static spinlock_t  tasks_lock = 0;
+
 static pid_t sched_get_pid(void)
 {
     static spinlock_t lock = 0;
@@ -35,6 +40,8 @@ int sched_task_init(void)
     if ((thread_cache = mmu_cache_create(sizeof(thread_t), MM_NO_FLAGS)) == NULL)
         return -errno;
 
+    list_init(&tasks);
+
     return 0;
 }
 
@@ -113,10 +120,15 @@ task_t *sched_task_create(const char *name)
     list_init(&t->children);
     list_init(&t->zombies);
     list_init(&t->list);
+    list_init(&t->vmas);
 
     t->dir = mmu_build_dir();
     t->cr3 = (unsigned long)mmu_v_to_p(t->dir);
 
+    spin_acquire(&tasks_lock);
+    list_append(&tasks, &t->tasks);
+    spin_release(&tasks_lock);
+
     wq_init(&t->wq, t);
     wq_init_head(&t->wqh_child);
 
@@ -153,8 +165,16 @@ int sched_task_destroy(task_t *task)
 
     kassert(task->nthreads == 1);
 
+    /* sched_task_for_each() must not see the page directory after it's released */
+    spin_acquire(&tasks_lock);
+    list_remove(&task->tasks);
+    spin_release(&tasks_lock);
+
+    mmu_vma_destroy(task);
     mmu_destroy_dir(task->dir);
     sched_thread_destroy(task->threads);
+
+    return 0;
 }
 
 task_t *sched_task_fork(task_t *parent)
@@ -195,6 +215,11 @@ task_t *sched_task_fork(task_t *parent)
     list_init(&child->list);
     list_append(&parent->children, &child->list);
 
+    list_init(&child->vmas);
+
+    if (mmu_vma_copy(child, parent) < 0)
+        kpanic("failed to copy virtual memory areas of parent");
+
     child->dir = mmu_duplicate_dir();
     child->cr3 = (unsigned long)mmu_v_to_p(child->dir);
 
@@ -206,9 +231,26 @@ task_t *sched_task_fork(task_t *parent)
     child->file_ctx = parent->file_ctx;
     parent->file_ctx->count++;
 
+    spin_acquire(&tasks_lock);
+    list_append(&tasks, &child->tasks);
+    spin_release(&tasks_lock);
+
     return child;
 }
 
+void sched_task_for_each(void (*func)(task_t *, void *), void *arg)
+{
+    kassert(func != NULL);
+
+    spin_acquire(&tasks_lock);
+
+    FOREACH(tasks, iter) {
+        func(container_of(iter, task_t, tasks), arg);
+    }
+
+    spin_release(&tasks_lock);
+}
+
 void sched_free_threads(task_t *t)
 {
     if (t->nthreads == 1)